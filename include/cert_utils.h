@@ -9,6 +9,15 @@
 #define CERT_UTILS_H
 
 #include "tls_proxy.h"
+#include "work_queue.h"
+
+/* cert_cache_start() and cert_job_poll() results */
+#define CERT_READY 1
+#define CERT_PENDING 0
+#define CERT_FAILED -1
+
+/* A certificate being generated, shared by every connection waiting for the host */
+typedef struct cert_job cert_job_t;
 
 /* Function prototypes */
 int init_openssl(void);
@@ -17,10 +26,38 @@ int load_or_generate_ca_cert(void);
 int generate_cert_for_host(const char *hostname, X509 **cert, EVP_PKEY **key);
 void print_openssl_error(void);
 
+/* Shared server contexts, cached per hostname */
+int init_cert_cache(void);
+void cleanup_cert_cache(void);
+void clear_cert_cache(void);
+SSL_CTX *get_server_template_ctx(void);
+SSL_CTX *get_ssl_ctx_for_host(const char *hostname);
+int cert_cache_start(const char *hostname, SSL_CTX **ctx, cert_job_t **job, work_waiter_t *waiter);
+int cert_job_poll(cert_job_t *job, SSL_CTX **ctx);
+void cert_job_release(cert_job_t *job, work_waiter_t *waiter);
+void get_cert_cache_counters(cert_cache_stats_t *stats);
+
+/* Background leaf key pool */
+int init_key_pool(void);
+void cleanup_key_pool(void);
+int start_key_pool(void);
+void stop_key_pool(void);
+void resize_key_pool(int depth);
+void change_leaf_key_algorithm(leaf_key_algorithm_t algorithm);
+void get_key_pool_counters(key_pool_stats_t *stats);
+
 /* SSL Context creation */
 SSL_CTX *create_server_ssl_context(void);
 SSL_CTX *create_client_ssl_context(void);
 
+/* Shared upstream client context with per host:port session resumption */
+int init_upstream_sessions(void);
+void cleanup_upstream_sessions(void);
+SSL_CTX *get_client_ssl_ctx(void);
+void attach_upstream_session(SSL *ssl, const char *host, int port);
+void record_upstream_handshake(SSL *ssl);
+void get_upstream_session_counters(upstream_session_stats_t *stats);
+
 /* File utility functions */
 char* read_file_to_memory(const char* filename, long* file_size);
 int write_memory_to_file(const char* filename, const char* data, size_t data_size);
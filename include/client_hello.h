@@ -0,0 +1,30 @@
+/*
+ * TLS MITM Proxy - ClientHello Parser
+ *
+ * Reads the first TLS record a client sends, as peeked from the socket,
+ * without OpenSSL's handshake machinery and without allocating, so the
+ * proxy can decide what to do with a connection before any handshake
+ * starts. The server name, ALPN offer, cipher suites, extensions, versions,
+ * groups and signature algorithms are extracted into a client_hello_info_t
+ * and the JA3 and JA4 fingerprints computed from them. A ClientHello
+ * longer than its first record is parsed as far as that record goes.
+ */
+
+#ifndef CLIENT_HELLO_H
+#define CLIENT_HELLO_H
+
+#include "tls_proxy.h"
+
+#define CLIENT_HELLO_RECORD_HEADER 5
+#define CLIENT_HELLO_MAX_RECORD (16384 + 2048)  /* Largest record length accepted */
+#define CLIENT_HELLO_PEEK_SIZE (CLIENT_HELLO_RECORD_HEADER + CLIENT_HELLO_MAX_RECORD)
+
+/* client_hello_parse() results */
+#define CLIENT_HELLO_OK 1
+#define CLIENT_HELLO_INCOMPLETE 0       /* The record is not all there yet */
+#define CLIENT_HELLO_INVALID (-1)       /* Not a ClientHello */
+
+/* Function prototypes */
+int client_hello_parse(const unsigned char *data, int len, client_hello_info_t *hello);
+
+#endif /* CLIENT_HELLO_H */
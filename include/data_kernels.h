@@ -0,0 +1,52 @@
+/*
+ * TLS MITM Proxy - Data Formatting Kernels
+ *
+ * Text/binary classification and hex dump encoding used when formatting
+ * intercepted data for the log callback and log file, and the byte set
+ * scan that prefilters keyword tagging (keyword_tags.h). Vectorized versions
+ * are picked at runtime from what the CPU supports, with a portable scalar
+ * fallback. This header has no other project dependencies so the kernels
+ * can be benchmarked on their own (see test/bench_data_kernels.c).
+ */
+
+#ifndef DATA_KERNELS_H
+#define DATA_KERNELS_H
+
+#include <stddef.h>
+
+/* Byte set for data_find_byteset(), filled by data_byteset_init() */
+typedef struct {
+    unsigned char member[256];      /* Nonzero for bytes in the set */
+    unsigned char lo_mask[16];      /* Nibble tables: a byte can only be in the set */
+    unsigned char hi_mask[16];      /* if lo_mask[low] & hi_mask[high] is nonzero */
+    unsigned char few[4];           /* The members when there are at most four */
+    int count;
+} data_byteset_t;
+
+/* Kernel implementations */
+typedef enum {
+    DATA_KERNEL_AUTO = 0,           /* Best kernel the CPU supports */
+    DATA_KERNEL_SCALAR = 1,         /* Portable fallback */
+    DATA_KERNEL_SSE2 = 2,           /* x86-64 baseline */
+    DATA_KERNEL_AVX2 = 3,           /* x86-64 with AVX2 */
+    DATA_KERNEL_NEON = 4            /* arm64 */
+} data_kernel_t;
+
+/* Function prototypes */
+int select_data_kernel(data_kernel_t kernel);
+const char *data_kernel_name(void);
+
+/* Nonzero if every byte is printable ASCII, NUL, CR, LF or tab */
+int data_is_text(const unsigned char *data, size_t len);
+
+/* Hex dump as "xx " per byte with a line break every 16 bytes; no terminator.
+ * Returns the number of characters written, always hex_dump_length(len). */
+size_t hex_dump_encode(const unsigned char *data, size_t len, char *out);
+size_t hex_dump_length(size_t len);
+
+/* Build a byte set from a list of bytes (duplicates are fine) */
+void data_byteset_init(data_byteset_t *set, const unsigned char *bytes, size_t count);
+/* Offset of the first byte that is in the set, len if there is none */
+size_t data_find_byteset(const unsigned char *data, size_t len, const data_byteset_t *set);
+
+#endif /* DATA_KERNELS_H */
@@ -0,0 +1,35 @@
+/*
+ * TLS MITM Proxy - DNS Cache
+ *
+ * Resolves upstream host names with getaddrinfo() and keeps the answers,
+ * successful or not, for a configurable time so connections to hosts
+ * already seen go straight to connect(). Concurrent lookups of the same
+ * name share one resolver call. The threaded engine resolves inline; the
+ * event loop hands a lookup to a fixed pool of resolver threads and is
+ * notified when it is done.
+ */
+
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+
+#include "tls_proxy.h"
+#include "work_queue.h"
+
+/* dns_cache_resolve() and dns_lookup_poll() results */
+#define DNS_RESOLVED 1
+#define DNS_PENDING 0
+#define DNS_FAILED -1
+
+/* A resolver call in progress, shared by every connection waiting for the name */
+typedef struct dns_lookup dns_lookup_t;
+
+/* Function prototypes */
+int init_dns_cache(void);
+int dns_cache_resolve(const char *host, struct in_addr *addr, int *error);
+int dns_cache_start(const char *host, struct in_addr *addr, int *error, dns_lookup_t **lookup, work_waiter_t *waiter);
+int dns_lookup_poll(dns_lookup_t *lookup, struct in_addr *addr, int *error);
+void dns_lookup_release(dns_lookup_t *lookup, work_waiter_t *waiter);
+void get_dns_cache_counters(dns_cache_stats_t *stats);
+void cleanup_dns_cache(void);
+
+#endif /* DNS_CACHE_H */
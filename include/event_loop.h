@@ -0,0 +1,24 @@
+/*
+ * TLS MITM Proxy - Event Loop Engine
+ *
+ * Optional connection engine for Linux: a small fixed set of epoll reactor
+ * threads drive the SOCKS5 handshake, upstream connect, TLS handshakes and
+ * relay of many connections as non-blocking state machines.
+ */
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "tls_proxy.h"
+
+/* Upper bound for reactor threads */
+#define EVENT_LOOP_MAX_REACTORS 64
+
+/* Function prototypes */
+int event_loop_supported(void);
+int event_loop_start(int reactor_threads);
+void event_loop_stop(void);
+int event_loop_is_running(void);
+int event_loop_dispatch(socket_t client_sock, const struct sockaddr_in *client_addr);
+
+#endif /* EVENT_LOOP_H */
@@ -0,0 +1,70 @@
+/*
+ * TLS MITM Proxy - Event Queue
+ *
+ * Bounded lock-free multi-producer queue that decouples forwarding threads
+ * from the log callback and log file. Producers push event records, a
+ * dedicated dispatcher thread drains them.
+ */
+
+#ifndef EVENT_QUEUE_H
+#define EVENT_QUEUE_H
+
+#include "tls_proxy.h"
+
+#include "keyword_tags.h"
+
+#include "http_stream.h"
+
+/* Event kinds carried by the queue */
+typedef enum {
+    EVENT_LOG_ENTRY = 0,            /* Intercepted data chunk for the log callbacks/file */
+    EVENT_HTTP_MESSAGE,             /* Reassembled HTTP/1.x message or HTTP/2 header block for the message callback */
+    EVENT_HTTP2_DATA                /* Chunk with HTTP/2 DATA payload pieces for the data callback */
+} event_kind_t;
+
+/* An HTTP/2 DATA payload piece within a queued chunk */
+typedef struct {
+    int stream_id;
+    int offset;                     /* Into the record data */
+    int length;
+    int end_stream;
+    int packet_id;
+    int tags[KEYWORD_TAGS_MAX_PER_EVENT]; /* Keywords in the piece, when it is logged on its own */
+    int tag_count;
+} http2_span_t;
+
+/* One queued event; the payload copy is owned by the record */
+typedef struct {
+    event_kind_t kind;
+    time_t timestamp;
+    int connection_id;
+    int packet_id;
+    char direction[32];
+    char src_ip[MAX_IP_ADDR_LEN];
+    char dst_ip[MAX_IP_ADDR_LEN];
+    int dst_port;
+    unsigned char *data;            /* Raw payload, formatted only when a consumer needs text */
+    int data_length;
+    int tags[KEYWORD_TAGS_MAX_PER_EVENT]; /* Ids of the keywords found in the chunk */
+    int tag_count;
+    http_message_t *http;           /* EVENT_HTTP_MESSAGE: layout of data (which is the message buffer) */
+    http2_span_t *spans;            /* EVENT_HTTP2_DATA: payload pieces in data */
+    int span_count;
+    int as_log_entry;               /* Also deliver the whole record as a log entry (otherwise: each span) */
+} event_record_t;
+
+/* Function prototypes */
+int event_queue_start(void);
+void event_queue_stop(void);
+void event_queue_cleanup(void);
+void event_queue_push_log(const char *direction, const char *src_ip, const char *dst_ip, int dst_port,
+    const unsigned char *data, int data_length, int connection_id, int packet_id,
+    const int *tags, int tag_count);
+void event_queue_push_http(const char *direction, const char *src_ip, const char *dst_ip, int dst_port,
+    http_message_t *message, int connection_id, int packet_id, int as_log_entry);
+void event_queue_push_http2_data(const char *direction, const char *src_ip, const char *dst_ip, int dst_port,
+    const unsigned char *data, int data_length, int connection_id, int packet_id,
+    const int *tags, int tag_count, http2_span_t *spans, int span_count, int as_log_entry);
+void event_queue_get_stats(event_queue_stats_t *stats);
+
+#endif /* EVENT_QUEUE_H */
@@ -0,0 +1,24 @@
+/*
+ * TLS MITM Proxy - ClientHello Index
+ *
+ * The parsed ClientHello of every open TLS connection, indexed by
+ * connection_id in an open-addressing hash map. Entries are added when the
+ * ClientHello is read and removed when the connection closes, so the
+ * index only ever holds live connections. Lookups by fingerprint walk the
+ * table under the same lock.
+ */
+
+#ifndef FINGERPRINT_INDEX_H
+#define FINGERPRINT_INDEX_H
+
+#include "tls_proxy.h"
+
+/* Function prototypes */
+int init_fingerprint_index(void);
+int fingerprint_index_add(int connection_id, const client_hello_info_t *hello);
+void fingerprint_index_remove(int connection_id);
+int fingerprint_index_get(int connection_id, client_hello_info_t *hello);
+int fingerprint_index_find(const char *fingerprint, int *connection_ids, int max_ids);
+void cleanup_fingerprint_index(void);
+
+#endif /* FINGERPRINT_INDEX_H */
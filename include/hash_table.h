@@ -0,0 +1,41 @@
+/*
+ * TLS MITM Proxy - Hash Table
+ *
+ * An open-addressing table of entry pointers with linear probing, shared
+ * by the intercept registry and the ClientHello index. The table only
+ * stores pointers; the owner allocates the entries, hashes their keys and
+ * compares them. It grows to keep the load factor at or below one half,
+ * and deletion shifts later entries back instead of leaving tombstones,
+ * so lookups never degrade.
+ *
+ * Not thread-safe; callers hold their own lock.
+ */
+
+#ifndef HASH_TABLE_H
+#define HASH_TABLE_H
+
+#include "tls_proxy.h"
+
+#include <stdint.h>
+
+/* Hash of the key of a stored entry, consistent with the hash used for lookups */
+typedef size_t (*hash_entry_fn_t)(const void *entry);
+
+/* Whether a stored entry has the looked-up key */
+typedef int (*hash_match_fn_t)(const void *entry, const void *key);
+
+typedef struct {
+    void **slots;
+    size_t capacity;                /* Power of two, 0 until the first insert */
+    size_t count;
+    hash_entry_fn_t hash;
+} hash_table_t;
+
+/* Function prototypes */
+size_t hash_table_mix(uint64_t key);
+long hash_table_find(const hash_table_t *table, size_t hash, hash_match_fn_t match, const void *key);
+int hash_table_insert(hash_table_t *table, void *entry);
+void hash_table_remove_at(hash_table_t *table, size_t index);
+void hash_table_free(hash_table_t *table);
+
+#endif /* HASH_TABLE_H */
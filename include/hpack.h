@@ -0,0 +1,40 @@
+/*
+ * TLS MITM Proxy - HPACK Header Decoder
+ *
+ * Decodes HTTP/2 header blocks (RFC 7541) into the same text-plus-offsets
+ * layout as HTTP/1.x messages ("name: value" lines). A decoder holds the
+ * dynamic table of one direction of a connection, so the blocks of that
+ * direction have to be decoded in the order they were sent, all of them,
+ * for the table to stay in step with the sender's encoder.
+ */
+
+#ifndef HPACK_H
+#define HPACK_H
+
+#include "http_stream.h"
+
+#define HPACK_DEFAULT_TABLE_SIZE 4096
+#define HPACK_MAX_TABLE_SIZE (1024 * 1024)  /* Largest dynamic table an encoder may ask for */
+
+/* Dynamic table entry; data holds the name followed by the value */
+typedef struct {
+    unsigned char *data;
+    int name_length;
+    int value_length;
+} hpack_entry_t;
+
+typedef struct {
+    hpack_entry_t *entries;         /* Ring buffer, newest entry at head */
+    int slots;
+    int head;
+    int count;
+    int size;                       /* Entry sizes as defined by RFC 7541 (length + 32) */
+    int max_size;                   /* Set by dynamic table size updates */
+} hpack_decoder_t;
+
+/* Function prototypes */
+void hpack_decoder_init(hpack_decoder_t *decoder);
+int hpack_decode(hpack_decoder_t *decoder, const unsigned char *block, int len, http_message_t *message);
+void hpack_decoder_free(hpack_decoder_t *decoder);
+
+#endif /* HPACK_H */
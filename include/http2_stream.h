@@ -0,0 +1,64 @@
+/*
+ * TLS MITM Proxy - HTTP/2 Frame Decoder
+ *
+ * Incremental decoder fed with the chunks of one relay direction. A
+ * direction is taken to be HTTP/2 if it starts with the client connection
+ * preface or, for the server side, with a SETTINGS frame. Frames are then
+ * split out of the byte stream wherever the reads cut them: header blocks
+ * (HEADERS or PUSH_PROMISE plus CONTINUATION) are collected and decoded
+ * with the direction's HPACK table into one message per block, and DATA
+ * payloads are handed on as pointers into the chunk, tagged with their
+ * stream id, so multiplexed streams come out separated without copying
+ * the body. Flow control, SETTINGS, PING and the other frames are skipped.
+ */
+
+#ifndef HTTP2_STREAM_H
+#define HTTP2_STREAM_H
+
+#include "hpack.h"
+
+#define HTTP2_FRAME_HEADER_SIZE 9
+#define HTTP2_STREAM_MAX_BLOCK (256 * 1024)  /* Longest header block kept */
+
+typedef enum {
+    HTTP2_STREAM_DETECT = 0,        /* Matching the connection preface */
+    HTTP2_STREAM_FRAME_HEADER,
+    HTTP2_STREAM_PAD_LENGTH,        /* Padded DATA frame: the pad length byte */
+    HTTP2_STREAM_DATA,
+    HTTP2_STREAM_BLOCK,             /* Payload of a frame carrying a header block fragment */
+    HTTP2_STREAM_SKIP,              /* Frames without events, and DATA padding */
+    HTTP2_STREAM_OFF                /* Not (or no longer) decodable HTTP/2 */
+} http2_stream_state_t;
+
+/* Decoder state of one relay direction; zeroed means "start of stream" */
+typedef struct {
+    http2_stream_state_t state;
+    int is_client;                  /* Sent the preface, so its header blocks are requests */
+    int settings_expected;          /* Server side: the first frame must be SETTINGS */
+    unsigned char header[HTTP2_FRAME_HEADER_SIZE];
+    int header_len;                 /* DETECT: preface bytes matched */
+    int type;                       /* Current frame */
+    int flags;
+    int stream_id;
+    int remaining;                  /* Payload bytes of the current frame still to come */
+    int padding;                    /* Trailing pad bytes of the current DATA frame */
+    unsigned char *block;           /* Header block being collected */
+    int block_len;
+    int block_cap;
+    int fragment_start;             /* Where the current frame's payload starts in block */
+    int block_stream_id;            /* Stream of the header block in progress, 0 if none */
+    int message_stream_id;          /* Stream it is reported on (the promised one for PUSH_PROMISE) */
+    int block_flags;                /* HTTP_MESSAGE_* flags for the decoded message */
+    hpack_decoder_t hpack;
+} http2_stream_t;
+
+/* Receives a piece of a DATA frame payload; data points into the fed chunk */
+typedef void( * http2_data_sink_t)(void *context, int stream_id, const unsigned char *data, int length,
+                                   int end_stream);
+
+/* Function prototypes */
+int http2_stream_feed(http2_stream_t *stream, const unsigned char *data, int len,
+                      http_message_sink_t headers, http2_data_sink_t body, void *context);
+void http2_stream_stop(http2_stream_t *stream);
+
+#endif /* HTTP2_STREAM_H */
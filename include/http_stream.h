@@ -0,0 +1,81 @@
+/*
+ * TLS MITM Proxy - HTTP/1.x Message Reassembly
+ *
+ * Incremental parser fed with the chunks of one relay direction. It
+ * follows request and status lines, headers, Content-Length and chunked
+ * bodies, responses without a body (HEAD, 1xx, 204, 304) and bodies that
+ * run until the connection closes, and hands each finished message to a
+ * sink as one buffer: the head as received followed by the (de-chunked)
+ * body, with the offsets of the start line fields and every header so
+ * consumers never parse it again. A direction whose traffic does not look
+ * like HTTP/1.x, or that switches protocols (101), is left alone from
+ * then on.
+ *
+ * The parser keeps no copy of the chunks other than the message being
+ * assembled, and the sink takes ownership of that buffer.
+ */
+
+#ifndef HTTP_STREAM_H
+#define HTTP_STREAM_H
+
+#include "tls_proxy.h"
+
+#include "keyword_tags.h"
+
+#define HTTP_STREAM_MAX_HEAD (64 * 1024)    /* Longest start line plus headers */
+#define HTTP_STREAM_MAX_LINE 256            /* Longest chunk size or trailer line kept */
+
+/* A reassembled message; data holds the head followed by the stored body */
+typedef struct {
+    http_message_info_t info;       /* Offsets into data; info.headers points at headers */
+    unsigned char *data;
+    int len;
+    int cap;
+    http_header_field_t *headers;
+    int header_cap;
+    int tags[KEYWORD_TAGS_MAX_PER_EVENT]; /* Keyword ids of the chunks the message spans */
+    int tag_count;
+} http_message_t;
+
+typedef enum {
+    HTTP_STREAM_START = 0,          /* Between messages */
+    HTTP_STREAM_HEAD,               /* Start line and headers */
+    HTTP_STREAM_BODY,               /* Content-Length body */
+    HTTP_STREAM_CHUNK_SIZE,         /* Chunked body: size line */
+    HTTP_STREAM_CHUNK_DATA,
+    HTTP_STREAM_CHUNK_END,          /* CRLF after the chunk data */
+    HTTP_STREAM_TRAILERS,
+    HTTP_STREAM_UNTIL_CLOSE,        /* Response body delimited by the connection close */
+    HTTP_STREAM_OFF                 /* Not (or no longer) HTTP/1.x */
+} http_stream_state_t;
+
+/* Parser state of one relay direction; zeroed means "start of stream" */
+typedef struct http_stream {
+    http_stream_state_t state;
+    struct http_stream *peer;       /* Other direction of the connection, may be NULL */
+    http_message_t *message;        /* Message being assembled */
+    int line_start;                 /* HEAD: offset of the current header line in message data */
+    long long remaining;            /* Body or chunk bytes still to come */
+    char line[HTTP_STREAM_MAX_LINE];
+    int line_len;
+    int line_overflow;              /* The current line did not fit in line */
+    unsigned long long head_requests; /* Response side: bit i set if outstanding request i is HEAD */
+    int pending_requests;
+} http_stream_t;
+
+/* Receives a finished message and owns it from then on */
+typedef void( * http_message_sink_t)(void *context, http_message_t *message);
+
+/* Function prototypes */
+void http_stream_pair(http_stream_t *requests, http_stream_t *responses);
+int http_stream_feed(http_stream_t *stream, const unsigned char *data, int len,
+                     const int *tags, int tag_count, http_message_sink_t sink, void *context);
+void http_stream_finish(http_stream_t *stream, http_message_sink_t sink, void *context);
+void http_stream_stop(http_stream_t *stream);
+void http_message_free(http_message_t *message);
+int http_message_reserve(http_message_t *message, int len);
+int http_message_append(http_message_t *message, const void *data, int len);
+int http_message_add_header(http_message_t *message, int name_offset, int name_length,
+                            int value_offset, int value_length);
+
+#endif /* HTTP_STREAM_H */
@@ -0,0 +1,51 @@
+/*
+ * TLS MITM Proxy - Intercept Filters
+ *
+ * Decides which chunks are held for interception. Rules are compiled once
+ * when set_intercept_filter() is called and published with a single
+ * pointer swap, so the forwarding threads evaluate them without taking a
+ * lock. Without a filter every chunk in an enabled direction is held.
+ *
+ * Rule syntax: rules are separated by ';' or newlines and a chunk is held
+ * if any rule matches. A rule is a list of key=value terms that must all
+ * match; values may be double-quoted (with \", \\ and \xNN escapes).
+ *   host=<glob>        Target host requested by the client (* and ?, case-insensitive)
+ *   sni=<glob>         Server name sent in the TLS ClientHello
+ *   ja3=<glob>         JA3 fingerprint of the TLS ClientHello (32 hex digits)
+ *   ja4=<glob>         JA4 fingerprint of the TLS ClientHello
+ *   client=<ip[/bits]> Client address or IPv4 network
+ *   port=<n[-m],...>   Target port or port ranges
+ *   dir=c2s|s2c        Only one direction
+ *   contains=<bytes>   Payload contains the bytes; hex:<digits> for binary
+ *   regex=<pattern>    Payload matches: . [] [^] \d \w \s \xNN * + ? ^ $
+ * Example: host=*.example.com port=443,8000-8999 contains="POST /api"
+ */
+
+#ifndef INTERCEPT_FILTER_H
+#define INTERCEPT_FILTER_H
+
+#include "tls_proxy.h"
+
+/* Connection attributes the rules are matched against; the strings are
+ * owned by the connection and may be NULL when unknown */
+typedef struct {
+    const char *host;               /* Target host from the SOCKS5 request */
+    const char *sni;                /* TLS server name, NULL for plain TCP */
+    const char *ja3;                /* ClientHello fingerprints, NULL for plain TCP */
+    const char *ja4;
+    const char *client_ip;
+    int port;                       /* Target port */
+    unsigned long prepared_for;     /* Generation of the filter set the candidate mask was computed for */
+    unsigned long long candidates;  /* Rules whose connection terms match this target */
+    unsigned long rewrite_prepared_for; /* Generation of the rewrite rule set (rewrite_rules.h) it was computed for */
+    unsigned long long rewrite_candidates;
+} intercept_target_t;
+
+/* Function prototypes */
+int intercept_filter_set(const char *rules);
+int intercept_filter_match(int direction, intercept_target_t *target,
+                           const unsigned char *data, int len);
+int intercept_filter_active(int direction, intercept_target_t *target);
+void cleanup_intercept_filters(void);
+
+#endif /* INTERCEPT_FILTER_H */
@@ -0,0 +1,25 @@
+/*
+ * TLS MITM Proxy - Intercept Registry
+ *
+ * Messages held for interception, indexed by (connection_id, packet_id)
+ * in an open-addressing hash map, plus a per-connection list so the
+ * oldest held message of a connection can still be found in O(1). Grows
+ * as needed; there is no fixed limit on pending messages.
+ *
+ * All functions must be called with g_intercept_config.intercept_cs held.
+ */
+
+#ifndef INTERCEPT_REGISTRY_H
+#define INTERCEPT_REGISTRY_H
+
+#include "tls_proxy.h"
+
+/* Function prototypes */
+int intercept_registry_add(intercept_data_t *intercept);
+void intercept_registry_remove(intercept_data_t *intercept);
+intercept_data_t *intercept_registry_find(int connection_id, int packet_id);
+intercept_data_t *intercept_registry_find_waiting(int connection_id);
+int intercept_registry_count(void);
+void cleanup_intercept_registry(void);
+
+#endif /* INTERCEPT_REGISTRY_H */
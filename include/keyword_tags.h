@@ -0,0 +1,39 @@
+/*
+ * TLS MITM Proxy - Keyword Tags
+ *
+ * Flags logged chunks that contain any of a configured set of keywords.
+ * The keywords are compiled once into an Aho-Corasick automaton, so each
+ * chunk is scanned in a single pass however many keywords there are, and
+ * the scan state is kept per relay direction so a keyword split across
+ * two reads is still found (it is reported with the chunk it ends in).
+ * The ids of the keywords found travel with the log event to the tag
+ * callback and the log file.
+ *
+ * Keyword text uses the rule format of the intercept filter (see
+ * intercept_filter.h), one keyword per rule:
+ *   match=<bytes>      Keyword; hex:<digits> for binary
+ *   id=<n>             Id reported for it (default: position in the list)
+ * Example: match=password; match="api_key" id=7; match=hex:deadbeef
+ */
+
+#ifndef KEYWORD_TAGS_H
+#define KEYWORD_TAGS_H
+
+#include "tls_proxy.h"
+
+#define KEYWORD_TAGS_MAX_PER_EVENT 16   /* Ids reported with one log event */
+#define KEYWORD_TAGS_MAX_PATTERNS 4096
+
+/* Scan position of one relay direction; zeroed means "start of stream" */
+typedef struct {
+    unsigned long set;              /* Generation of the keyword set the state belongs to */
+    unsigned int state;
+} keyword_tag_stream_t;
+
+/* Function prototypes */
+int keyword_tags_set(const char *keywords, int ignore_case);
+int keyword_tags_scan(keyword_tag_stream_t *stream, const unsigned char *data, int len,
+                      int *ids, int max_ids);
+void cleanup_keyword_tags(void);
+
+#endif /* KEYWORD_TAGS_H */
@@ -0,0 +1,23 @@
+/*
+ * TLS MITM Proxy - Log File Writer
+ *
+ * Records for the log file are appended to an in-memory buffer and written
+ * in batches by a dedicated thread, so forwarding and dispatcher threads
+ * never wait on write() or fflush(). Two buffers alternate: producers fill
+ * one while the writer thread writes the other.
+ */
+
+#ifndef LOG_WRITER_H
+#define LOG_WRITER_H
+
+#include "tls_proxy.h"
+
+/* Function prototypes */
+int init_log_writer(void);
+void cleanup_log_writer(void);
+int log_writer_start(void);
+void log_writer_stop(void);
+void log_writer_write(const char *text, size_t len);
+void log_writer_printf(const char *format, ...);
+
+#endif /* LOG_WRITER_H */
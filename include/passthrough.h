@@ -0,0 +1,47 @@
+/*
+ * TLS MITM Proxy - Passthrough List
+ *
+ * Connections matching a passthrough rule are tunnelled without being
+ * intercepted: no certificate is forged for them, nothing is logged,
+ * rewritten or held, and the relay takes its cheapest path (splice() on
+ * Linux). TLS connections are matched on the server name of their
+ * ClientHello, read off the socket before any handshake starts.
+ *
+ * Rule syntax is the intercept filter format (see intercept_filter.h):
+ * rules are separated by ';' or newlines, a connection passes through if
+ * any rule matches, and all terms of a rule must match.
+ *   host=<glob>        Target host requested by the client
+ *   sni=<glob>         Server name in the ClientHello; never matches
+ *                      plain TCP or a ClientHello without one
+ *   client=<ip[/bits]> Client address or IPv4 network
+ *   dest=<ip[/bits]>   Resolved server address or IPv4 network
+ *   port=<n[-m],...>   Target port or port ranges
+ *   ja3=<glob>         JA3 or JA4 fingerprint of the ClientHello; never
+ *   ja4=<glob>         match plain TCP
+ * Example: sni=*.bank.example;dest=10.0.0.0/8 port=443
+ */
+
+#ifndef PASSTHROUGH_H
+#define PASSTHROUGH_H
+
+#include "tls_proxy.h"
+
+/* Connection attributes the rules are matched against; strings may be NULL */
+typedef struct {
+    const char *host;               /* Target host from the SOCKS5 request */
+    const char *sni;                /* ClientHello server name, NULL if none */
+    const char *ja3;                /* ClientHello fingerprints, NULL if unknown */
+    const char *ja4;
+    const char *client_ip;
+    const char *server_ip;
+    int port;                       /* Target port */
+} passthrough_target_t;
+
+/* Function prototypes */
+int passthrough_rules_set(const char *rules);
+int passthrough_active(void);
+int passthrough_match(const passthrough_target_t *target);
+int passthrough_rule_hits(long long *hits, int max_rules);
+void cleanup_passthrough_rules(void);
+
+#endif /* PASSTHROUGH_H */
@@ -0,0 +1,153 @@
+/*
+ * TLS MITM Proxy - Pattern Matching
+ *
+ * Building blocks shared by the intercept filter, the rewrite rules and
+ * the passthrough list: the key=value rule text reader, case-insensitive
+ * host globs, port lists, IPv4 networks, byte patterns searched with
+ * Boyer-Moore-Horspool and a small backtracking regex engine (. [] [^] \d
+ * \w \s \xNN * + ? ^ $, no groups). Patterns are compiled once and can
+ * then be used from any thread.
+ *
+ * Compiled rule sets are immutable once active and published through a
+ * pattern_slot_t: readers take the current set without locking, and a
+ * replaced set is freed once every reader that may hold it has left.
+ * pattern_rules_set() does the compiling and publishing for every kind of
+ * key=value rule set; each kind only supplies how its terms apply to a
+ * rule and how a finished rule joins the set.
+ */
+
+#ifndef PATTERN_MATCH_H
+#define PATTERN_MATCH_H
+
+#include "tls_proxy.h"
+
+#define PATTERN_MAX_VALUE 1024          /* Longest term value in rule text */
+#define PATTERN_MAX_REGEX_ATOMS 128
+#define PATTERN_MAX_PORT_RANGES 16
+
+/* pattern_next_term() results */
+#define PATTERN_TERM 1                  /* key and value were read */
+#define PATTERN_RULE_END 0              /* ';' or newline */
+#define PATTERN_TEXT_END 2              /* End of the rule text */
+#define PATTERN_ERROR (-1)
+
+/* One regex element: the bytes it accepts and how often it repeats */
+typedef struct {
+    unsigned char accept[32];
+    int min;
+    int max;                        /* -1 = unbounded */
+} pattern_atom_t;
+
+typedef struct {
+    pattern_atom_t *atoms;
+    int count;
+    int anchor_start;
+    int anchor_end;
+    int first_byte;                 /* Byte every match starts with, -1 if not fixed */
+} pattern_regex_t;
+
+/* Port list such as 443,8000-8999 */
+typedef struct {
+    int count;                      /* 0 = no port term */
+    int lo[PATTERN_MAX_PORT_RANGES];
+    int hi[PATTERN_MAX_PORT_RANGES];
+} pattern_ports_t;
+
+/* IPv4 address or network such as 10.0.0.0/8, host byte order */
+typedef struct {
+    int is_set;
+    unsigned int net;
+    unsigned int mask;
+} pattern_net_t;
+
+typedef struct {
+    unsigned char *bytes;
+    int len;
+    int shift[256];                 /* Horspool bad-character shifts */
+} pattern_bytes_t;
+
+/* Connection terms of a rule: host, sni, ja3, ja4, client, dest and port */
+typedef struct {
+    char *host;                     /* Compiled globs, NULL when not given */
+    char *sni;
+    char *ja3;
+    char *ja4;
+    pattern_net_t client;
+    pattern_net_t dest;
+    pattern_ports_t ports;
+} pattern_conn_terms_t;
+
+/* Connection the terms are matched against; strings may be NULL when unknown */
+typedef struct {
+    const char *host;
+    const char *sni;
+    const char *ja3;
+    const char *ja4;
+    const char *client_ip;
+    const char *server_ip;
+    int port;
+} pattern_conn_t;
+
+/* Start of every rule set published through a pattern_slot_t */
+typedef struct pattern_set {
+    unsigned long generation;       /* Distinct per publication, for state cached across reads */
+    int drained;                    /* Retired: reader epochs seen empty since it was replaced */
+    struct pattern_set *retired_next;
+} pattern_set_t;
+
+typedef void (*pattern_set_free_t)(pattern_set_t *set);
+
+/* Publication point of one kind of rule set; zero-initialized */
+typedef struct {
+    pattern_set_t *volatile current;
+    volatile long readers[2];       /* Readers inside, by the epoch parity they entered in */
+    volatile long epoch;            /* Flipped by each publication */
+    unsigned long generation;       /* Last generation handed out */
+    pattern_set_t *retired;         /* Replaced sets some reader may still hold */
+} pattern_slot_t;
+
+/* One kind of rule set for pattern_rules_set(); rules are plain structures of rule_size bytes */
+typedef struct {
+    const char *name;               /* Log prefix such as "Intercept filter" */
+    size_t set_size;                /* Set structure, starting with its pattern_set_t */
+    size_t rule_size;
+    void (*init_rule)(void *rule);  /* Defaults for a zeroed rule, NULL if zero will do */
+    int (*apply_term)(void *rule, const char *key, const char *value, char *error, size_t error_size);
+    int (*push_rule)(pattern_set_t *set, void *rule, char *error, size_t error_size); /* Takes the rule over */
+    void (*free_rule)(void *rule);
+    pattern_set_free_t free_set;
+} pattern_rule_kind_t;
+
+/* Function prototypes */
+int pattern_next_term(const char **text, char *key, size_t key_size,
+                      char *value, size_t value_size, char *error, size_t error_size);
+int pattern_parse_escape(const char **p);
+
+char *pattern_glob_compile(const char *glob);
+int pattern_glob_match(const char *glob, const char *text);
+
+int pattern_ports_parse(pattern_ports_t *ports, const char *value);
+int pattern_ports_match(const pattern_ports_t *ports, int port);
+int pattern_net_parse(pattern_net_t *net, const char *value);
+int pattern_net_match(const pattern_net_t *net, const char *address);
+
+int pattern_conn_terms_parse(pattern_conn_terms_t *terms, const char *key, const char *value, int with_dest,
+                             char *error, size_t error_size);
+int pattern_conn_terms_match(const pattern_conn_terms_t *terms, const pattern_conn_t *conn);
+void pattern_conn_terms_free(pattern_conn_terms_t *terms);
+
+int pattern_bytes_compile(pattern_bytes_t *pattern, const char *value);
+int pattern_bytes_find(const pattern_bytes_t *pattern, const unsigned char *data, int len);
+void pattern_bytes_free(pattern_bytes_t *pattern);
+
+int pattern_regex_compile(pattern_regex_t *re, const char *pattern, char *error, size_t error_size);
+int pattern_regex_find(const pattern_regex_t *re, const unsigned char *data, int len, int *match_len);
+void pattern_regex_free(pattern_regex_t *re);
+
+const pattern_set_t *pattern_slot_enter(pattern_slot_t *slot, int *epoch);
+void pattern_slot_leave(pattern_slot_t *slot, int epoch);
+void pattern_slot_publish(pattern_slot_t *slot, pattern_set_t *set, pattern_set_free_t free_set);
+void pattern_slot_cleanup(pattern_slot_t *slot, pattern_set_free_t free_set);
+int pattern_rules_set(pattern_slot_t *slot, const pattern_rule_kind_t *kind, const char *text);
+
+#endif /* PATTERN_MATCH_H */
@@ -34,8 +34,12 @@
     #define DESTROY_MUTEX(m) DeleteCriticalSection(&(m))
     #define CREATE_EVENT() CreateEvent(NULL, TRUE, FALSE, NULL)
     #define SET_EVENT(e) SetEvent(e)
+    #define RESET_EVENT(e) ResetEvent(e)
     #define WAIT_EVENT(e, timeout) WaitForSingleObject((e), (timeout))
     #define CLOSE_EVENT(e) CloseHandle(e)
+    #define EVENT_WAIT_SIGNALED WAIT_OBJECT_0
+    #define EVENT_WAIT_TIMEOUT WAIT_TIMEOUT
+    #define EVENT_WAIT_FOREVER INFINITE
     #define SLEEP_MS(ms) Sleep(ms)
     #define SLEEP(ms) Sleep(ms)
     #define THREAD_RETURN return 0
@@ -43,6 +47,15 @@
     #define JOIN_THREAD(id) WaitForSingleObject(id, INFINITE)
     #define GET_SOCKET_ERROR() WSAGetLastError()
     #define GET_LAST_ERROR() GetLastError()
+    #define SOCKET_WOULD_BLOCK(err) ((err) == WSAEWOULDBLOCK)
+    #define ATOMIC_INCREMENT(v) InterlockedIncrement((volatile LONG *)&(v))
+    #define ATOMIC_DECREMENT(v) InterlockedDecrement((volatile LONG *)&(v))
+    #define ATOMIC_INCREMENT64(v) InterlockedIncrement64((volatile LONG64 *)&(v))
+    #define ATOMIC_LOAD(v) InterlockedCompareExchange((volatile LONG *)&(v), 0, 0)
+    #define ATOMIC_STORE(v, x) InterlockedExchange((volatile LONG *)&(v), (LONG)(x))
+    #define ATOMIC_CAS(v, expected, desired) (InterlockedCompareExchange((volatile LONG *)&(v), (LONG)(desired), (LONG)(expected)) == (LONG)(expected))
+    #define ATOMIC_LOAD_PTR(v) InterlockedCompareExchangePointer((PVOID volatile *)&(v), NULL, NULL)
+    #define ATOMIC_EXCHANGE_PTR(v, x) InterlockedExchangePointer((PVOID volatile *)&(v), (PVOID)(x))
 
 #else
     /* POSIX-specific includes */
@@ -65,7 +78,13 @@
     #include <stdbool.h>
     typedef int socket_t;
     typedef pthread_mutex_t mutex_t;
-    typedef int event_t;  /* Simplified event type for cross-platform compatibility */    typedef pthread_t thread_t;
+    /* Manual-reset event, same semantics as a Windows event created with CREATE_EVENT() */
+    typedef struct posix_event {
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;    /* Uses CLOCK_MONOTONIC so timed waits ignore clock changes */
+        int signaled;
+    } *event_t;
+    typedef pthread_t thread_t;
     typedef pthread_t THREAD_HANDLE;
     typedef void* THREAD_RETURN_TYPE;
     typedef bool intercept_bool_t;
@@ -73,16 +92,21 @@
     #define INVALID_THREAD_ID ((pthread_t)0)
     #define SOCKET_ERROR_VAL (-1)
     #define SD_BOTH SHUT_RDWR
+    #define SD_SEND SHUT_WR
     #define SOCKET_OPTS_ERROR (-1)
     #define CLOSE_SOCKET(s) close(s)
     #define INIT_MUTEX(m) pthread_mutex_init(&(m), NULL)
     #define LOCK_MUTEX(m) pthread_mutex_lock(&(m))
     #define UNLOCK_MUTEX(m) pthread_mutex_unlock(&(m))
     #define DESTROY_MUTEX(m) pthread_mutex_destroy(&(m))
-    #define CREATE_EVENT() 1  /* Simplified for cross-platform compatibility - returns valid event ID */
-    #define SET_EVENT(e) do { /* No-op for simplified implementation */ } while(0)
-    #define WAIT_EVENT(e, timeout_ms) 0  /* Simplified - returns success */
-    #define CLOSE_EVENT(e) do { /* No-op for simplified implementation */ } while(0)
+    #define CREATE_EVENT() posix_event_create()
+    #define SET_EVENT(e) posix_event_set(e)
+    #define RESET_EVENT(e) posix_event_reset(e)
+    #define WAIT_EVENT(e, timeout_ms) posix_event_wait((e), (timeout_ms))
+    #define CLOSE_EVENT(e) posix_event_close(e)
+    #define EVENT_WAIT_SIGNALED 0
+    #define EVENT_WAIT_TIMEOUT ETIMEDOUT
+    #define EVENT_WAIT_FOREVER (-1L)
     #define SLEEP_MS(ms) usleep((ms) * 1000)
     #define THREAD_RETURN return NULL
     #define CREATE_THREAD(id, func, arg) pthread_create(&id, NULL, func, arg)
@@ -90,6 +114,15 @@
     #define SLEEP(ms) usleep((ms) * 1000)
     #define GET_SOCKET_ERROR() errno
     #define GET_LAST_ERROR() errno
+    #define SOCKET_WOULD_BLOCK(err) ((err) == EAGAIN || (err) == EWOULDBLOCK)
+    #define ATOMIC_INCREMENT(v) __sync_add_and_fetch(&(v), 1)
+    #define ATOMIC_DECREMENT(v) __sync_sub_and_fetch(&(v), 1)
+    #define ATOMIC_INCREMENT64(v) __sync_add_and_fetch(&(v), 1)
+    #define ATOMIC_LOAD(v) __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+    #define ATOMIC_STORE(v, x) __atomic_store_n(&(v), (x), __ATOMIC_RELEASE)
+    #define ATOMIC_CAS(v, expected, desired) __sync_bool_compare_and_swap(&(v), (expected), (desired))
+    #define ATOMIC_LOAD_PTR(v) __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+    #define ATOMIC_EXCHANGE_PTR(v, x) __atomic_exchange_n(&(v), (x), __ATOMIC_ACQ_REL)
 
     typedef int BOOL;
     #define TRUE 1
@@ -113,6 +146,111 @@ static inline int close_socket(socket_t sock) {
 #endif
 }
 
+#ifndef INTERCEPT_WINDOWS
+/* POSIX event primitive behind CREATE_EVENT/SET_EVENT/RESET_EVENT/WAIT_EVENT/CLOSE_EVENT */
+static inline event_t posix_event_create(void) {
+    event_t e = (event_t)calloc(1, sizeof(*e));
+    pthread_condattr_t attr;
+
+    if (!e) {
+        return NULL;
+    }
+    if (pthread_mutex_init(&e->mutex, NULL) != 0) {
+        free(e);
+        return NULL;
+    }
+    pthread_condattr_init(&attr);
+#ifndef __APPLE__
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+    if (pthread_cond_init(&e->cond, &attr) != 0) {
+        pthread_condattr_destroy(&attr);
+        pthread_mutex_destroy(&e->mutex);
+        free(e);
+        return NULL;
+    }
+    pthread_condattr_destroy(&attr);
+    return e;
+}
+
+static inline void posix_event_set(event_t e) {
+    if (!e) {
+        return;
+    }
+    pthread_mutex_lock(&e->mutex);
+    e->signaled = 1;
+    pthread_cond_broadcast(&e->cond);
+    pthread_mutex_unlock(&e->mutex);
+}
+
+static inline void posix_event_reset(event_t e) {
+    if (!e) {
+        return;
+    }
+    pthread_mutex_lock(&e->mutex);
+    e->signaled = 0;
+    pthread_mutex_unlock(&e->mutex);
+}
+
+/* Returns EVENT_WAIT_SIGNALED, EVENT_WAIT_TIMEOUT or another errno value on failure */
+static inline int posix_event_wait(event_t e, long timeout_ms) {
+    int result = 0;
+
+    if (!e) {
+        return EINVAL;
+    }
+    if (timeout_ms < 0) {
+        /* EVENT_WAIT_FOREVER */
+        pthread_mutex_lock(&e->mutex);
+        while (!e->signaled && result == 0) {
+            result = pthread_cond_wait(&e->cond, &e->mutex);
+        }
+        if (e->signaled) {
+            result = EVENT_WAIT_SIGNALED;
+        }
+        pthread_mutex_unlock(&e->mutex);
+        return result;
+    }
+#ifdef __APPLE__
+    /* No pthread_condattr_setclock on macOS; relative waits are monotonic there */
+    struct timespec relative;
+    relative.tv_sec = timeout_ms / 1000;
+    relative.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    pthread_mutex_lock(&e->mutex);
+    while (!e->signaled && result == 0) {
+        result = pthread_cond_timedwait_relative_np(&e->cond, &e->mutex, &relative);
+    }
+#else
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&e->mutex);
+    while (!e->signaled && result == 0) {
+        result = pthread_cond_timedwait(&e->cond, &e->mutex, &deadline);
+    }
+#endif
+    if (e->signaled) {
+        result = EVENT_WAIT_SIGNALED; /* Signaled right as the wait timed out still counts */
+    }
+    pthread_mutex_unlock(&e->mutex);
+    return result;
+}
+
+static inline void posix_event_close(event_t e) {
+    if (!e) {
+        return;
+    }
+    pthread_cond_destroy(&e->cond);
+    pthread_mutex_destroy(&e->mutex);
+    free(e);
+}
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,39 @@
+/*
+ * TLS MITM Proxy - Match and Replace Rules
+ *
+ * Rewrites payloads in the forwarding path without a round trip to the
+ * intercept callback. Rules use the same text format as the intercept
+ * filter (see intercept_filter.h) and are applied in order, each to the
+ * output of the previous one:
+ *   host=<glob>        Only connections to matching target hosts
+ *   dir=c2s|s2c        Only one direction
+ *   match=<bytes>      Literal to replace; hex:<digits> for binary
+ *   regex=<pattern>    Pattern to replace (same subset as the filter)
+ *   replace=<bytes>    Replacement, may be empty or change the length
+ *   header=<name>      Limit the rule to one HTTP/1.x header: without
+ *                      match/regex the whole value is set to replace, and
+ *                      without replace the header line is removed
+ * When an HTTP/1.x message with Content-Length is rewritten and its body
+ * was complete in the chunk, Content-Length is updated to the new length.
+ * Any other chunk whose payload would change length is left alone by
+ * match/regex rules, unless the change is confined to the header block
+ * of a message starting in the chunk: the new length would break the
+ * framing of the stream (Content-Length, chunk sizes, HTTP/2 frames).
+ * Matches are found within one chunk; a match split across two reads is
+ * not rewritten.
+ */
+
+#ifndef REWRITE_RULES_H
+#define REWRITE_RULES_H
+
+#include "intercept_filter.h"
+
+/* Function prototypes */
+int rewrite_rules_set(const char *rules);
+unsigned char *rewrite_apply(int direction, intercept_target_t *target,
+                             const unsigned char *data, int len, int *out_len);
+int rewrite_rules_active(int direction, intercept_target_t *target);
+int rewrite_rules_hits(long long *hits, int max_rules);
+void cleanup_rewrite_rules(void);
+
+#endif /* REWRITE_RULES_H */
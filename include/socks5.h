@@ -41,7 +41,20 @@
 #define SOCKS5_REPLY_CMD_NOTSUP    0x07
 #define SOCKS5_REPLY_ADDR_NOTSUP   0x08
 
+/* Incremental parser results (non-blocking callers) */
+#define SOCKS5_PARSE_INCOMPLETE    0
+#define SOCKS5_PARSE_ERROR         (-1)
+#define SOCKS5_NO_REPLY            (-1)
+
 /* Function prototypes */
 int handle_socks5_handshake(socket_t client_sock, char *target_host, int *target_port);
 
+/* Incremental parsing for the event loop engine.
+ * Both return the number of bytes consumed, SOCKS5_PARSE_INCOMPLETE when more
+ * data is needed, or SOCKS5_PARSE_ERROR. */
+int socks5_parse_greeting(const unsigned char *buf, int len, int *has_no_auth);
+int socks5_parse_request(const unsigned char *buf, int len, char *target_host,
+                         int *target_port, int *reply_code);
+void socks5_build_reply(unsigned char reply[10], unsigned char reply_code);
+
 #endif /* SOCKS5_H */
@@ -30,6 +30,7 @@
 #include <openssl/pem.h>
 #include <openssl/bio.h>
 #include <openssl/rsa.h>
+#include <openssl/ec.h>
 
 /* Enable library export symbol visibility */
 #ifndef BUILDING_INTERCEPT_LIB
@@ -59,6 +60,25 @@ void **__cdecl OPENSSL_Applink(void);
 #define MAX_FILEPATH_LEN 512
 #define MAX_IP_ADDR_LEN 46  /* Max length for IPv6 addresses */
 #define CERT_EXPIRY_DAYS 365
+#define CERT_CACHE_CAPACITY 256           /* Leaf certificates kept per hostname */
+#define CERT_CACHE_MAX_AGE (60 * 60 * 24) /* Seconds, well inside CERT_EXPIRY_DAYS */
+#define CERT_CACHE_BUCKETS 512
+#define KEY_POOL_DEFAULT_DEPTH 8          /* Pre-generated leaf keys kept ready */
+#define KEY_POOL_MAX_DEPTH 256
+#define KEY_POOL_THREADS 2                /* Background key generation threads */
+#define CERT_WORKER_THREADS 2             /* Threads generating certificates for the event loop */
+#define UPSTREAM_SESSION_CAPACITY 256     /* Upstream TLS sessions kept per host:port */
+#define EVENT_QUEUE_DEFAULT_CAPACITY 4096 /* Log events buffered for the dispatcher */
+#define EVENT_QUEUE_MAX_CAPACITY (1 << 20)
+#define LOG_WRITER_BUFFER_SIZE (256 * 1024) /* Bytes per log file batch buffer (two are used) */
+#define LOG_FLUSH_DEFAULT_INTERVAL_MS 200 /* Longest a batched record waits before it is written */
+#define INTERCEPT_HOLD_DEFAULT_BUDGET (1024 * 1024) /* Bytes a direction may queue behind held intercepts */
+#define HTTP_MESSAGE_DEFAULT_MAX_BODY (1024 * 1024) /* Body bytes kept per reassembled HTTP message */
+#define DNS_CACHE_CAPACITY 512            /* Resolved upstream host names kept */
+#define DNS_RESOLVER_THREADS 4            /* Threads resolving host names for the event loop */
+#define DNS_CACHE_DEFAULT_TTL 60          /* Seconds a resolved address is reused */
+#define DNS_NEGATIVE_DEFAULT_TTL 5        /* Seconds a failed lookup is remembered */
+#define CONNECT_DEFAULT_TIMEOUT_MS 10000  /* Upstream TCP connect timeout */
 /* Certificate file paths are now managed by user_data.h functions */
 
 /* Platform-specific defines and typedefs */
@@ -98,26 +118,40 @@ typedef struct {
     int target_port;
 } connection_info;
 
-typedef struct {
-    SSL *src;
-    SSL *dst;
-    char direction[32]; /* Use a char array instead of string pointer */
-    char src_ip[MAX_IP_ADDR_LEN];
-    char dst_ip[MAX_IP_ADDR_LEN];
-    int dst_port;
-    int connection_id;
-} forward_info;
+/* Connection handling engines */
+typedef enum {
+    PROXY_ENGINE_THREADED = 0,      /* One handler thread per connection */
+    PROXY_ENGINE_EVENT_LOOP = 1     /* Fixed pool of epoll reactor threads (Linux) */
+} proxy_engine_t;
 
-/* TCP forwarding info without SSL */
-typedef struct {
-    socket_t src;
-    socket_t dst;
-    char direction[32];
-    char src_ip[MAX_IP_ADDR_LEN];
-    char dst_ip[MAX_IP_ADDR_LEN];
-    int dst_port;
-    int connection_id;
-} forward_tcp_info;
+/* Leaf certificate key algorithms */
+typedef enum {
+    LEAF_KEY_RSA_2048 = 0,
+    LEAF_KEY_RSA_3072 = 1,
+    LEAF_KEY_ECDSA_P256 = 2,        /* Default: fastest to generate and handshake */
+    LEAF_KEY_ECDSA_P384 = 3
+} leaf_key_algorithm_t;
+
+/* What producers do when the event queue is full */
+typedef enum {
+    EVENT_QUEUE_BLOCK = 0,          /* Wait for the dispatcher to make room (no loss) */
+    EVENT_QUEUE_DROP_OLDEST = 1,    /* Discard the oldest queued event */
+    EVENT_QUEUE_DROP_NEWEST = 2     /* Discard the event being queued */
+} event_queue_policy_t;
+
+/* How eagerly the log writer puts records on disk */
+typedef enum {
+    LOG_DURABILITY_BATCHED = 0,     /* Write when a buffer fills or the flush interval passes */
+    LOG_DURABILITY_FLUSHED = 1,     /* Write and flush as soon as the writer thread sees a record */
+    LOG_DURABILITY_SYNCED = 2       /* As FLUSHED, plus fsync after every batch */
+} log_durability_t;
+
+/* How HTTP/1.x and HTTP/2 traffic is reported */
+typedef enum {
+    HTTP_MESSAGES_OFF = 0,          /* Chunk log events only */
+    HTTP_MESSAGES_ALSO = 1,         /* Message events as well as chunk log events */
+    HTTP_MESSAGES_ONLY = 2          /* Message events replace the chunk log events of HTTP/1.x and HTTP/2 streams */
+} http_message_mode_t;
 
 /* Configuration structure */
 typedef struct {
@@ -126,6 +160,21 @@ typedef struct {
     char log_file[MAX_FILEPATH_LEN];/* Path to log file */
     FILE *log_fp;                   /* Log file pointer */
     int verbose;                    /* Flag for verbose output */
+    proxy_engine_t engine;          /* Connection handling engine */
+    int reactor_threads;            /* Reactor threads for the event loop engine */
+    int key_pool_depth;             /* Leaf keys to keep pre-generated, 0 disables the pool */
+    leaf_key_algorithm_t leaf_key_algorithm; /* Key type for generated leaf certificates */
+    event_queue_policy_t event_queue_policy; /* Overflow policy of the log event queue */
+    int event_queue_capacity;       /* Log event queue slots, rounded up to a power of two */
+    log_durability_t log_durability; /* Latency/safety trade-off of the log file writer */
+    int log_flush_interval_ms;      /* Flush interval for LOG_DURABILITY_BATCHED */
+    int intercept_hold_budget;      /* Bytes per direction held for interception before reading pauses */
+    http_message_mode_t http_message_mode; /* HTTP/1.x message reassembly for new connections */
+    int http_message_max_body;      /* Body bytes kept per reassembled message */
+    int ktls;                       /* Ask for kernel TLS offload on new TLS connections */
+    int dns_cache_ttl;              /* Seconds upstream addresses are cached, 0 disables */
+    int dns_negative_ttl;           /* Seconds failed lookups are cached, 0 disables */
+    int connect_timeout_ms;         /* Upstream TCP connect timeout */
 } proxy_config;
 
 /* Server thread control */
@@ -154,8 +203,9 @@ typedef enum {
 } intercept_action_t;
 
 /* Interception data structure */
-typedef struct {
+typedef struct intercept_data {
     int connection_id;
+    int packet_id;                  /* With connection_id, the intercept registry key */
     char direction[32];
     char src_ip[MAX_IP_ADDR_LEN];
     char dst_ip[MAX_IP_ADDR_LEN];
@@ -163,10 +213,13 @@ typedef struct {
     unsigned char *data;
     int data_length;
     int is_waiting_for_response;
-    event_t response_event;
+    void (*wakeup)(void *arg);      /* Wakes the relay holding the message once it is answered */
+    void *wakeup_arg;
     intercept_action_t action;
     unsigned char *modified_data;
     int modified_length;
+    struct intercept_data *conn_next; /* Registry: next held message of the same connection */
+    struct intercept_data *conn_prev; /* Registry: previous one (the tail, for the oldest) */
 } intercept_data_t;
 
 /* Global interception configuration */
@@ -189,9 +242,16 @@ extern intercept_config_t g_intercept_config;
 
 /* Global callback functions (defined in main.c) */
 extern log_callback_t g_log_callback;
+extern raw_log_callback_t g_raw_log_callback;
+extern tag_callback_t g_tag_callback;
+extern http_message_callback_t g_http_message_callback;
+extern http2_data_callback_t g_http2_data_callback;
 extern status_callback_t g_status_callback;
 extern connection_callback_t g_connection_callback;
 extern disconnect_callback_t g_disconnect_callback;
+extern protocol_callback_t g_protocol_callback;
+extern ktls_callback_t g_ktls_callback;
+extern client_hello_callback_t g_client_hello_callback;
 extern intercept_callback_t g_intercept_callback;
 
 /* Function prototypes */
@@ -48,10 +48,110 @@ extern "C" {
 typedef void (*log_callback_t)(const char* timestamp, int connection_id, int packet_id, const char* src_ip, const char* dst_ip, int dst_port, const char* message_type, const char* data);
 typedef void (*status_callback_t)(const char* message);
 
+/* Raw log callback: the unformatted payload plus metadata, timestamp in seconds since the epoch.
+ * data is only valid for the duration of the call; use format_log_data() to render it on demand. */
+typedef void (*raw_log_callback_t)(long long timestamp, int connection_id, int packet_id, const char* direction, const char* src_ip, const char* dst_ip, int dst_port, const unsigned char* data, int data_length);
+
+/* Tag callback: ids of the keywords (see set_keyword_tags()) found in a logged chunk. Called right after
+ * the log callbacks of the same connection_id/packet_id, only for chunks with at least one keyword. */
+typedef void (*tag_callback_t)(int connection_id, int packet_id, const int* keyword_ids, int count);
+
+/* One header of an HTTP message event, as offsets into the message data */
+typedef struct {
+    int name_offset;
+    int name_length;
+    int value_offset;
+    int value_length;                /* Without surrounding whitespace */
+} http_header_field_t;
+
+/* HTTP_MESSAGE_* flags in http_message_info_t */
+#define HTTP_MESSAGE_CHUNKED 0x01    /* Sent with chunked encoding; the body in data is decoded */
+#define HTTP_MESSAGE_TRUNCATED 0x02  /* Only the first body bytes are in data (see set_http_message_events()) */
+#define HTTP_MESSAGE_INCOMPLETE 0x04 /* The connection closed or the stream stopped parsing before the end */
+#define HTTP_MESSAGE_END_STREAM 0x08 /* HTTP/2: no DATA follows on this stream */
+#define HTTP_MESSAGE_PUSH_PROMISE 0x10 /* HTTP/2: request the server promised to push on stream_id */
+
+/* Layout of a reassembled HTTP/1.x message or HTTP/2 header block; all offsets are into the message data.
+ * HTTP/2 headers (pseudo-headers included) are decoded into "name: value" lines; the body follows
+ * separately through the HTTP/2 data callback. */
+typedef struct {
+    int is_request;                  /* 1 = request, 0 = response */
+    int method_offset;               /* Request method and target; 0 for responses */
+    int method_length;
+    int target_offset;
+    int target_length;
+    int status_code;                 /* Response status; 0 for requests */
+    int header_count;
+    const http_header_field_t* headers;
+    int body_offset;                 /* Where the body starts (the length of the head) */
+    int body_length;                 /* Body bytes in data */
+    long long body_total;            /* Body bytes in the message; more than body_length if truncated */
+    int flags;                       /* HTTP_MESSAGE_* */
+    int stream_id;                   /* HTTP/2 stream; 0 for HTTP/1.x */
+} http_message_info_t;
+
+/* HTTP message callback: one call per reassembled HTTP/1.x request or response. message and data are
+ * only valid for the duration of the call. */
+typedef void (*http_message_callback_t)(long long timestamp, int connection_id, int packet_id, const char* direction, const char* src_ip, const char* dst_ip, int dst_port, const http_message_info_t* message, const unsigned char* data, int data_length);
+
+/* HTTP/2 data callback: DATA frame payload of one stream, in the pieces it arrives in. end_stream is 1 on
+ * the last piece of the stream's body. data is only valid for the duration of the call. */
+typedef void (*http2_data_callback_t)(long long timestamp, int connection_id, int packet_id, const char* direction, const char* src_ip, const char* dst_ip, int dst_port, int stream_id, const unsigned char* data, int data_length, int end_stream);
+
 /* Callback function types for real-time proxy events */
 typedef void (*connection_callback_t)(const char* client_ip, int client_port, const char* target_host, int target_port, int connection_id);
 typedef void (*disconnect_callback_t)(int connection_id, const char* reason);
 
+/* Protocol callback: the application protocol (ALPN) negotiated for an intercepted TLS connection, once both
+ * handshakes are done. The client is given whatever the server picked from the client's own offer; protocol
+ * is "" when no protocol was negotiated. */
+typedef void (*protocol_callback_t)(int connection_id, const char* protocol);
+
+/* KTLS_* flags in the kTLS callback: which halves of the two TLS sessions the kernel encrypts or decrypts */
+#define KTLS_CLIENT_SEND 0x01        /* Proxy -> client records */
+#define KTLS_CLIENT_RECV 0x02        /* Client -> proxy records */
+#define KTLS_SERVER_SEND 0x04        /* Proxy -> server records */
+#define KTLS_SERVER_RECV 0x08        /* Server -> proxy records */
+
+/* kTLS callback: with set_ktls_enabled(1), called once both handshakes of an intercepted TLS connection are done.
+ * flags is 0 if the kernel or the negotiated cipher did not allow any offload. */
+typedef void (*ktls_callback_t)(int connection_id, int flags);
+
+/* Capacities of the lists in client_hello_info_t; longer lists are cut and the fingerprints cover the kept part */
+#define CLIENT_HELLO_MAX_CIPHERS 256
+#define CLIENT_HELLO_MAX_EXTENSIONS 64
+#define CLIENT_HELLO_MAX_VERSIONS 16
+#define CLIENT_HELLO_MAX_GROUPS 64
+#define CLIENT_HELLO_MAX_POINT_FORMATS 16
+#define CLIENT_HELLO_MAX_SIGNATURE_ALGORITHMS 64
+
+/* What a TLS client offered in its ClientHello. Lists are in wire order with GREASE values kept; the
+ * fingerprints leave GREASE out as their definitions require. */
+typedef struct {
+    int legacy_version;              /* client_version field, e.g. 0x0303 */
+    int truncated;                   /* The ClientHello continued past its first record or a list was cut */
+    char sni[256];                   /* Server name, "" if none */
+    char alpn[256];                  /* Offered application protocols, comma-separated, "" if none */
+    int cipher_count;
+    unsigned short ciphers[CLIENT_HELLO_MAX_CIPHERS];
+    int extension_count;
+    unsigned short extensions[CLIENT_HELLO_MAX_EXTENSIONS];
+    int version_count;               /* supported_versions extension */
+    unsigned short versions[CLIENT_HELLO_MAX_VERSIONS];
+    int group_count;                 /* supported_groups extension */
+    unsigned short groups[CLIENT_HELLO_MAX_GROUPS];
+    int point_format_count;          /* ec_point_formats extension */
+    unsigned char point_formats[CLIENT_HELLO_MAX_POINT_FORMATS];
+    int signature_algorithm_count;   /* signature_algorithms extension */
+    unsigned short signature_algorithms[CLIENT_HELLO_MAX_SIGNATURE_ALGORITHMS];
+    char ja3[33];                    /* JA3 fingerprint (MD5, hex) */
+    char ja4[37];                    /* JA4 fingerprint, e.g. t13d1516h2_8daaf6152771_e5627efa2ab1 */
+} client_hello_info_t;
+
+/* ClientHello callback: called for each TLS connection once its ClientHello is in, after the connection
+ * callback and before any handshake. hello is only valid for the duration of the call. */
+typedef void (*client_hello_callback_t)(int connection_id, const client_hello_info_t* hello);
+
 /* Callback function types for interception */
 typedef void (*intercept_callback_t)(int connection_id, const char* direction, const char* src_ip, const char* dst_ip, int dst_port, const unsigned char* data, int data_length, int packet_id);
 
@@ -66,11 +166,18 @@ INTERCEPT_API intercept_bool_t set_config(const char* bind_addr, int port, const
 
 /* Set callback functions for real-time logging */
 INTERCEPT_API void set_log_callback(log_callback_t callback);
+INTERCEPT_API void set_raw_log_callback(raw_log_callback_t callback);
+INTERCEPT_API void set_tag_callback(tag_callback_t callback);
+INTERCEPT_API void set_http_message_callback(http_message_callback_t callback);
+INTERCEPT_API void set_http2_data_callback(http2_data_callback_t callback);
 INTERCEPT_API void set_status_callback(status_callback_t callback);
 
 /* Set callback functions for real-time proxy events */
 INTERCEPT_API void set_connection_callback(connection_callback_t callback);
 INTERCEPT_API void set_disconnect_callback(disconnect_callback_t callback);
+INTERCEPT_API void set_protocol_callback(protocol_callback_t callback);
+INTERCEPT_API void set_ktls_callback(ktls_callback_t callback);
+INTERCEPT_API void set_client_hello_callback(client_hello_callback_t callback);
 
 /* Set callback functions for interception */
 INTERCEPT_API void set_intercept_callback(intercept_callback_t callback);
@@ -80,6 +187,52 @@ INTERCEPT_API void set_intercept_enabled(int enabled);
 INTERCEPT_API void set_intercept_direction(int direction);
 INTERCEPT_API void respond_to_intercept(int connection_id, int action, const unsigned char* modified_data, int modified_length);
 
+/* Respond to one specific held message, identified by the packet_id passed to the intercept callback.
+ * Returns FALSE if no such message is waiting (already answered or timed out). */
+INTERCEPT_API intercept_bool_t respond_to_intercept_packet(int connection_id, int packet_id, int action, const unsigned char* modified_data, int modified_length);
+
+/* Hold only matching traffic. Rules are separated by ';' or newlines, a chunk is held if any rule matches,
+ * and all key=value terms of a rule must match: host=<glob> sni=<glob> ja3=<glob> ja4=<glob> client=<ip[/bits]>
+ * port=<n[-m],...> dir=c2s|s2c contains=<bytes or hex:..> regex=<pattern>. NULL or "" holds everything again.
+ * Returns FALSE and keeps the current filter if the rules do not parse. */
+INTERCEPT_API intercept_bool_t set_intercept_filter(const char* rules);
+
+/* Rewrite traffic in the forwarding path without the intercept callback. Same rule text format as
+ * set_intercept_filter(): host=<glob> dir=c2s|s2c match=<bytes> or regex=<pattern>, replace=<bytes>,
+ * header=<HTTP header name>. Rules apply in order. NULL or "" removes all rules.
+ * Returns FALSE and keeps the current rules if the text does not parse. */
+INTERCEPT_API intercept_bool_t set_rewrite_rules(const char* rules);
+
+/* Copy up to max_rules per-rule hit counters (chunks each rule changed) into hits.
+ * Returns the number of active rules. */
+INTERCEPT_API int get_rewrite_rule_hits(long long* hits, int max_rules);
+
+/* Tunnel matching connections without intercepting them: no forged certificate, no logging, rewriting or
+ * holding. Same rule text format as set_intercept_filter(): host=<glob> sni=<glob> ja3=<glob> ja4=<glob>
+ * client=<ip[/bits]> dest=<ip[/bits]> port=<n[-m],...>; sni= and the fingerprints are read from the
+ * ClientHello before any handshake.
+ * NULL or "" intercepts everything again. Returns FALSE and keeps the current rules if the text does not parse. */
+INTERCEPT_API intercept_bool_t set_passthrough_rules(const char* rules);
+
+/* Copy up to max_rules per-rule hit counters (connections each rule passed through) into hits.
+ * Returns the number of active rules. */
+INTERCEPT_API int get_passthrough_rule_hits(long long* hits, int max_rules);
+
+/* Tag logged chunks that contain any of a set of keywords, reported through the tag callback and the log
+ * file. One keyword per rule in the set_intercept_filter() text format: match=<bytes or hex:..> id=<n>
+ * (id defaults to the keyword's position). Keywords split across reads are found. NULL or "" turns
+ * tagging off. Returns FALSE and keeps the current keywords if the text does not parse. */
+INTERCEPT_API intercept_bool_t set_keyword_tags(const char* keywords, int ignore_case);
+
+/* Set how many bytes per direction may wait behind held messages (default 1 MB). Traffic keeps being
+ * read and queued while messages are held; reading from that side pauses only once the budget is used up. */
+INTERCEPT_API intercept_bool_t set_intercept_hold_budget(int bytes);
+
+/* Select the connection handling engine (takes effect on the next start_proxy()):
+ * 0 = one thread per connection (default), 1 = epoll event loop (Linux only).
+ * reactor_threads <= 0 uses one reactor thread per CPU. */
+INTERCEPT_API intercept_bool_t set_proxy_engine(int engine, int reactor_threads);
+
 /* Get system network interfaces */
 INTERCEPT_API int get_system_ips(char* buffer, int buffer_size);
 
@@ -104,6 +257,124 @@ typedef struct {
 /* Get current proxy configuration with status */
 INTERCEPT_API proxy_config_t get_proxy_config(void);
 
+/* Structure to hold leaf certificate cache statistics */
+typedef struct {
+    unsigned long long hits;      /* Handshakes served from the cache */
+    unsigned long long misses;    /* Certificates generated */
+    unsigned long long evictions; /* Entries dropped to stay within capacity */
+    unsigned long long expired;   /* Entries dropped because they aged out */
+    int entries;                  /* Certificates currently cached */
+    int capacity;                 /* Maximum number of cached certificates */
+} cert_cache_stats_t;
+
+/* Get leaf certificate cache statistics */
+INTERCEPT_API cert_cache_stats_t get_cert_cache_stats(void);
+
+/* Select the key algorithm for generated leaf certificates:
+ * 0 = RSA-2048, 1 = RSA-3072, 2 = ECDSA P-256 (default), 3 = ECDSA P-384.
+ * Cached certificates and pooled keys of the previous type are discarded. */
+INTERCEPT_API intercept_bool_t set_leaf_key_algorithm(int algorithm);
+INTERCEPT_API int get_leaf_key_algorithm(void);
+
+/* Structure to hold background key pool statistics */
+typedef struct {
+    int depth;                    /* Keys currently ready in the pool */
+    int target_depth;             /* Depth the background threads refill to */
+    unsigned long long served;    /* Keys handed out from the pool */
+    unsigned long long stalls;    /* Keys generated inline because the pool was empty */
+    unsigned long long generated; /* Keys generated by the background threads */
+} key_pool_stats_t;
+
+/* Set how many leaf keys are kept pre-generated (0 disables the pool) */
+INTERCEPT_API intercept_bool_t set_key_pool_depth(int depth);
+
+/* Get background key pool statistics */
+INTERCEPT_API key_pool_stats_t get_key_pool_stats(void);
+
+/* Structure to hold upstream (proxy -> server) TLS handshake statistics */
+typedef struct {
+    unsigned long long resumed;   /* Handshakes that resumed a cached session */
+    unsigned long long full;      /* Full handshakes */
+    int cached_sessions;          /* host:port entries with a resumable session */
+} upstream_session_stats_t;
+
+/* Get upstream TLS session resumption statistics */
+INTERCEPT_API upstream_session_stats_t get_upstream_session_stats(void);
+
+/* Structure to hold upstream host name resolution statistics */
+typedef struct {
+    unsigned long long lookups;          /* Host names resolved (address literals are not counted) */
+    unsigned long long hits;             /* Answered with a cached address */
+    unsigned long long negative_hits;    /* Answered with a cached failure */
+    unsigned long long shared;           /* Waited for a lookup of the same name already in progress */
+    unsigned long long misses;           /* Sent to the system resolver */
+    unsigned long long failures;         /* Resolver lookups that failed */
+    unsigned long long resolve_us_total; /* Time spent in the system resolver, microseconds */
+    unsigned long long resolve_us_max;   /* Slowest resolver lookup, microseconds */
+    int entries;                         /* Names currently cached */
+    int capacity;                        /* Maximum number of cached names */
+} dns_cache_stats_t;
+
+/* Set how long upstream host names are cached: positive_ttl seconds for addresses (default 60), negative_ttl
+ * seconds for failed lookups (default 5). 0 turns that kind of caching off; concurrent lookups of the same
+ * name are still shared. Applies to answers cached afterwards. */
+INTERCEPT_API intercept_bool_t set_dns_cache_ttl(int positive_ttl, int negative_ttl);
+
+/* Get upstream host name resolution statistics */
+INTERCEPT_API dns_cache_stats_t get_dns_cache_stats(void);
+
+/* Set how long a connection to the upstream server may take before it is given up (default 10000 ms) */
+INTERCEPT_API intercept_bool_t set_connect_timeout(int timeout_ms);
+
+/* Configure the queue that hands log events from forwarding threads to the
+ * dispatcher thread (takes effect on the next start_proxy()).
+ * policy: 0 = block when full (default), 1 = drop oldest, 2 = drop newest.
+ * capacity <= 0 keeps the current capacity. */
+INTERCEPT_API intercept_bool_t set_event_queue_policy(int policy, int capacity);
+
+/* Structure to hold log event queue statistics */
+typedef struct {
+    unsigned long long enqueued;   /* Events accepted into the queue */
+    unsigned long long dispatched; /* Events delivered to the log callback/file */
+    unsigned long long dropped;    /* Events discarded by the overflow policy */
+    int depth;                     /* Events currently queued */
+    int capacity;                  /* Queue capacity */
+} event_queue_stats_t;
+
+/* Set how eagerly the log file is written: 0 = batched (by size or every flush_interval_ms, default 200),
+ * 1 = flushed as soon as possible, 2 = flushed and fsync'd after every batch. flush_interval_ms = 0 keeps the current interval. */
+INTERCEPT_API intercept_bool_t set_log_durability(int durability, int flush_interval_ms);
+
+/* Report HTTP/1.x traffic as whole messages and HTTP/2 traffic as per-stream header and data events
+ * (applies to connections opened afterwards):
+ * mode 0 = off (default), 1 = message events in addition to the chunk log events,
+ * 2 = message events instead of chunk log events: the log callbacks and log file get one entry per
+ *     HTTP/1.x message, HTTP/2 header block and HTTP/2 data piece.
+ * max_body caps the body bytes kept per message (default 1 MB, 0 = headers only, < 0 keeps the current cap). */
+INTERCEPT_API intercept_bool_t set_http_message_events(int mode, int max_body);
+
+/* Get log event queue statistics */
+INTERCEPT_API event_queue_stats_t get_event_queue_stats(void);
+
+/* Ask OpenSSL to hand record encryption of new TLS connections to the kernel (Linux kTLS), on both the
+ * client-facing and the upstream session. Decrypted data is still relayed and logged as usual; where
+ * nothing needs the bytes it is spliced between the sockets without entering user space. Returns FALSE
+ * if this OpenSSL build has no kTLS support. */
+INTERCEPT_API intercept_bool_t set_ktls_enabled(int enabled);
+
+/* Copy the ClientHello of an open TLS connection into hello. Returns FALSE if the connection is closed,
+ * not TLS, or its ClientHello was not parsed. */
+INTERCEPT_API intercept_bool_t get_client_hello_info(int connection_id, client_hello_info_t* hello);
+
+/* Find open TLS connections by fingerprint: fingerprint is a glob (* and ?, case-insensitive) matched
+ * against both the JA3 and the JA4 of each connection. Copies up to max_ids connection ids and returns the
+ * number of matching connections. */
+INTERCEPT_API int find_connections_by_fingerprint(const char* fingerprint, int* connection_ids, int max_ids);
+
+/* Render a raw payload the way the string log callback shows it (text, or hex dump for binary).
+ * Returns the message type ("Text", "Binary" or "Empty"). */
+INTERCEPT_API const char* format_log_data(const unsigned char* data, int data_length, char* buffer, int buffer_size);
+
 /* Certificate export function */
 /* export_type: 0 = certificate (PEM to DER), 1 = private key (PEM copy) */
 INTERCEPT_API intercept_bool_t export_certificate(const char* output_directory, int export_type);
@@ -10,46 +10,207 @@
 
 #include "tls_proxy.h"
 
+#include "intercept_filter.h"
+
+#include "rewrite_rules.h"
+
+#include "keyword_tags.h"
+
+#include "http_stream.h"
+
+#include "http2_stream.h"
+
+#include "client_hello.h"
+
+#include "passthrough.h"
+
+#include "fingerprint_index.h"
+
+#include "dns_cache.h"
+
 /* Protocol type detection */
 #define PROTOCOL_TLS 1
 #define PROTOCOL_HTTP 2
 #define PROTOCOL_PLAIN_TCP 3
 
-/* Function prototypes */
-int detect_protocol(socket_t sock);
-void forward_data(SSL * src, SSL * dst,
-  const char * direction,
-    const char * src_ip,
-      const char * dst_ip, int dst_port, int connection_id);
+/* Relay readiness flags reported by relay_pump() */
+#define RELAY_WANT_READ  0x01
+#define RELAY_WANT_WRITE 0x02
 
-void forward_tcp_data(socket_t src, socket_t dst,
-  const char * direction,
-    const char * src_ip,
-      const char * dst_ip, int dst_port, int connection_id);
+/* How long a TLS client gets to deliver its whole ClientHello before it is matched as far as it got */
+#define CLIENT_HELLO_WAIT_MS 1000
+
+/* Largest splice() step of the zero-copy relay, the default pipe capacity */
+#define RELAY_SPLICE_CHUNK (64 * 1024)
+
+/* relay_pump() results; RELAY_ERROR only reports a failed write to dst internally */
+#define RELAY_OK     0
+#define RELAY_EOF    1
+#define RELAY_ERROR  (-1)
+
+/* Relay endpoint: a TLS session when ssl is set, otherwise the raw socket */
+typedef struct {
+  socket_t fd;
+  SSL *ssl;
+} relay_endpoint_t;
 
-THREAD_RETURN_TYPE forward_data_thread(void * arg);
+/*
+ * A chunk parked in a direction's hold queue: either intercepted and
+ * waiting for the user, or read after an intercepted chunk and kept back
+ * so the stream stays in order.
+ */
+typedef struct relay_chunk {
+  struct relay_chunk *next;
+  intercept_data_t *intercept;  /* NULL if the chunk is only queued behind one */
+  time_t held_since;
+  unsigned char *data;
+  int len;
+} relay_chunk_t;
+
+/* Per-direction state of the log path, carried across reads */
+typedef struct {
+  keyword_tag_stream_t tags;   /* Keyword scan position */
+  http_stream_t http;          /* HTTP/1.x message reassembly */
+  http2_stream_t h2;           /* HTTP/2 frame and HPACK decoding */
+  http_message_mode_t http_mode; /* config.http_message_mode when the relay started */
+} log_stream_t;
+
+/*
+ * One direction of a proxied connection driven with non-blocking I/O.
+ * src_want/dst_want tell the caller which readiness to wait for on each fd.
+ */
+typedef struct {
+  relay_endpoint_t src;
+  relay_endpoint_t dst;
+  char direction[32];
+  char src_ip[MAX_IP_ADDR_LEN];
+  char dst_ip[MAX_IP_ADDR_LEN];
+  int dst_port;
+  int connection_id;
+  int packet_id;
+  unsigned char buffer[BUFFER_SIZE];
+  unsigned char *out;          /* Pending output: buffer or out_owned */
+  unsigned char *out_owned;    /* Heap copy of modified intercept data */
+  int out_len;
+  int out_off;
+  int src_want;
+  int dst_want;
+  int src_closed;              /* Source reached end of stream */
+  int eof;                     /* Source closed and everything forwarded */
+  relay_chunk_t *held;         /* Hold queue, oldest first; reading continues behind it */
+  relay_chunk_t *held_tail;
+  int held_bytes;              /* Bytes in the hold queue, bounded by config.intercept_hold_budget */
+  intercept_target_t target;   /* Connection attributes for the intercept filter */
+  log_stream_t log;            /* Keyword scan and HTTP reassembly state */
+  int opaque;                  /* Passthrough: forwarded untouched, nothing looks at the bytes */
+  void (*wakeup)(void *arg);   /* Called under intercept_cs when a held chunk is answered */
+  void *wakeup_arg;
+  #ifdef INTERCEPT_LINUX
+  int pipe_fds[2];             /* splice() pipe of the zero-copy path, -1 until first used */
+  int pipe_len;                /* Bytes in the pipe, written to dst before anything else */
+  int splice_unavailable;      /* splice() refused these sockets, always copy */
+  int splice_bypass;           /* kTLS source has a non-data record, take it with SSL_read once */
+  #endif
+} relay_dir_t;
+
+/* Longest client ALPN list passed through; longer lists are not offered upstream */
+#define ALPN_MAX_LIST 255
+
+/*
+ * SNI and ALPN callback state for the client-facing TLS handshake. A client
+ * that offers ALPN has its handshake paused after the ClientHello until the
+ * upstream handshake, offered the same list, has picked the protocol.
+ */
+typedef struct {
+  const char *original_target_host; /* From SOCKS */
+  SSL_CTX *generated_ctx_for_sni;
+  char prepared_hostname[MAX_HOSTNAME_LEN]; /* Name generated_ctx_for_sni was built for ahead of the handshake */
+  X509 *generated_cert_for_sni;     /* Owned by generated_ctx_for_sni */
+  EVP_PKEY *generated_key_for_sni;  /* Owned by generated_ctx_for_sni */
+  unsigned char client_alpn[ALPN_MAX_LIST]; /* Client's protocol list, wire format without the length */
+  int client_alpn_len;              /* 0 if the client offered no ALPN */
+  int upstream_ready;               /* Upstream handshake done, protocol below is final */
+  char protocol[ALPN_MAX_LIST + 1]; /* Negotiated protocol, "" if none */
+} client_sni_callback_args;
 
-THREAD_RETURN_TYPE forward_tcp_thread(void * arg);
+/* Function prototypes */
+int detect_protocol(socket_t sock);
+int allocate_connection_id(void);
+int set_socket_nonblocking(socket_t sock, int enabled);
+int upstream_connect_start(socket_t sock, const struct sockaddr_in *addr, int *error);
+int upstream_connect_finish(socket_t sock, int timeout_ms, int *error);
+const char *cert_hostname(const char *sni_hostname, const char *target_host);
+int sni_cert_setup_callback(SSL *s, int *ad, void *arg);
+int alpn_client_hello_callback(SSL *s, int *al, void *arg);
+int alpn_select_callback(SSL *s, const unsigned char **out, unsigned char *outlen,
+  const unsigned char *in, unsigned int inlen, void *arg);
+void alpn_offer_upstream(SSL *upstream_ssl, const client_sni_callback_args *args);
+void alpn_upstream_done(SSL *upstream_ssl, client_sni_callback_args *args);
+void alpn_report(SSL *client_side_ssl, client_sni_callback_args *args, int connection_id,
+  const char *target_host);
+void ktls_enable(SSL *ssl);
+void ktls_report(SSL *client_side_ssl, SSL *server_side_ssl, int connection_id);
+int peek_client_hello(socket_t sock, client_hello_info_t *hello);
+int wait_client_hello(socket_t sock, client_hello_info_t *hello, int timeout_ms);
+void client_hello_report(int connection_id, const client_hello_info_t *hello);
+int passthrough_connection(const char *target_host, int target_port, const char *client_ip,
+  const char *server_ip, const client_hello_info_t *hello, int connection_id);
+
+void relay_dir_init(relay_dir_t *dir, socket_t src_fd, SSL *src_ssl,
+  socket_t dst_fd, SSL *dst_ssl, const char *direction,
+    const char *src_ip, const char *dst_ip, int dst_port, int connection_id);
+void relay_dir_pair(relay_dir_t *client_to_server, relay_dir_t *server_to_client);
+void relay_dir_set_target(relay_dir_t *dir, const char *host, int port,
+  const char *client_ip, SSL *client_side_ssl, const client_hello_info_t *hello);
+void relay_dir_set_opaque(relay_dir_t *dir);
+void relay_dir_set_wakeup(relay_dir_t *dir, void (*wakeup)(void *arg), void *arg);
+int relay_pump(relay_dir_t *dir);
+void relay_dir_abort(relay_dir_t *dir);
+void relay_dir_cleanup(relay_dir_t *dir);
+void relay_bidirectional(socket_t client_fd, SSL *client_side_ssl,
+  socket_t server_fd, SSL *server_side_ssl,
+    const char *client_ip, int client_port,
+      const char *server_ip, int server_port,
+        const char *target_host, const client_hello_info_t *hello, int connection_id, int opaque);
 
 void pretty_print_data(const char * direction,
   const unsigned char * data, int len,
     const char * src_ip,
-      const char * dst_ip, int dst_port, int connection_id, int packet_id);
+      const char * dst_ip, int dst_port, int connection_id, int packet_id,
+        log_stream_t * stream);
+
+const char * format_log_message(const unsigned char * data, int len, char * message, size_t size);
 
 THREAD_RETURN_TYPE handle_client(void * arg);
 
 /* Callback helper functions - implemented in main.c */
-void send_log_entry(const char * src_ip,
+void send_log_entry(time_t timestamp, const char * src_ip,
   const char * dst_ip, int dst_port,
     const char * message_type,
       const char * data, int connection_id, int packet_id);
 
+void send_raw_log_entry(time_t timestamp, const char * direction,
+  const char * src_ip, const char * dst_ip, int dst_port,
+    const unsigned char * data, int data_length, int connection_id, int packet_id);
+
+void send_tag_entry(int connection_id, int packet_id, const int * ids, int count);
+
+void send_http_message_entry(time_t timestamp, const char * direction,
+  const char * src_ip, const char * dst_ip, int dst_port,
+    const http_message_info_t * message, const unsigned char * data, int data_length,
+      int connection_id, int packet_id);
+
+void send_http2_data_entry(time_t timestamp, const char * direction,
+  const char * src_ip, const char * dst_ip, int dst_port, int stream_id,
+    const unsigned char * data, int data_length, int end_stream, int connection_id, int packet_id);
+
 void send_status_update(const char * message);
 
 /* Interception support functions */
-int should_intercept_data(const char * direction, int connection_id);
+int relay_direction_flag(const char * direction);
+int should_intercept_data(const char * direction, intercept_target_t * target,
+  const unsigned char * data, int len);
 
-int wait_for_intercept_response(intercept_data_t * intercept_data);
 void send_intercept_data(int connection_id,
   const char * direction,
     const char * src_ip,
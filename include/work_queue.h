@@ -0,0 +1,40 @@
+/*
+ * TLS MITM Proxy - Work Queue
+ *
+ * A fixed set of worker threads running queued jobs in order. Used for
+ * slow blocking work (host name resolution, certificate generation) that
+ * must stay off the threads it was requested from.
+ *
+ * A waiter asks to be told when a job it shares with others is done,
+ * instead of polling for it. The job's owner keeps the waiter list under
+ * its own lock.
+ */
+
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+#include "tls_proxy.h"
+
+/* Upper bound for the threads of one queue */
+#define WORK_QUEUE_MAX_THREADS 16
+
+typedef void (*work_fn_t)(void *arg);
+
+typedef struct work_queue work_queue_t;
+
+/* Completion notice of a queued job; the node belongs to the waiting caller */
+typedef struct work_waiter {
+    work_fn_t notify;           /* Called once, under the job owner's lock, when the job is done */
+    void *arg;
+    struct work_waiter *next;
+} work_waiter_t;
+
+/* Function prototypes */
+work_queue_t *work_queue_create(int threads);
+int work_queue_submit(work_queue_t *queue, work_fn_t fn, void *arg);
+void work_queue_destroy(work_queue_t *queue);
+void work_waiter_add(work_waiter_t **list, work_waiter_t *waiter);
+void work_waiter_remove(work_waiter_t **list, work_waiter_t *waiter);
+void work_waiter_notify_all(work_waiter_t **list);
+
+#endif /* WORK_QUEUE_H */
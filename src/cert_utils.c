@@ -6,6 +6,9 @@ Passing Memory instead of File operations directly
  */
 
 #include "../include/cert_utils.h"
+#include "../include/tls_utils.h"
+
+#include <ctype.h>
 
 /* Helper function to read file contents into memory buffer */
 char * read_file_to_memory(const char * filename, long * file_size) {
@@ -291,6 +294,9 @@ static int save_ca_cert_to_files(void) {
 
 // Simplified main function
 int load_or_generate_ca_cert(void) {
+  // Leaf certificates signed by a previously loaded CA must not be reused
+  clear_cert_cache();
+
   // Initialize user data directory first
   if (!init_user_data_directory()) {
     log_message("Failed to initialize user data directory\n");
@@ -365,50 +371,247 @@ int load_or_generate_ca_cert(void) {
 }
 
 
-int generate_cert_for_host(const char * hostname, X509 ** cert_out, EVP_PKEY ** key_out) {
-  X509 * cert;
-  EVP_PKEY * key;
-  X509_NAME * name;
+/* Background key pool */
 
-  if (config.verbose) {
-    log_message("Generating certificate for %s\n", hostname);
-  }
+static struct {
+  mutex_t cs;
+  event_t wakeup; // Set when the pool may need refilling or the workers must stop
+  int initialized;
+  volatile int running;
+  EVP_PKEY * keys[KEY_POOL_MAX_DEPTH];
+  int count;
+  leaf_key_algorithm_t algorithm; // Type of the keys currently pooled
+  THREAD_HANDLE threads[KEY_POOL_THREADS];
+  int thread_count;
+  key_pool_stats_t stats;
+} g_key_pool;
 
-  // Generate key
-  key = EVP_PKEY_new();
-  if (!key) {
-    print_openssl_error();
-    return 0;
-  } // Generate key using modern OpenSSL 3.0 API
-  EVP_PKEY_CTX * pkey_ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+/* Generate a fresh key for a leaf certificate */
+static EVP_PKEY * generate_leaf_key(leaf_key_algorithm_t algorithm) {
+  EVP_PKEY * key = NULL;
+  int is_rsa = (algorithm == LEAF_KEY_RSA_2048 || algorithm == LEAF_KEY_RSA_3072);
+
+  EVP_PKEY_CTX * pkey_ctx = EVP_PKEY_CTX_new_id(is_rsa ? EVP_PKEY_RSA : EVP_PKEY_EC, NULL);
   if (!pkey_ctx) {
     print_openssl_error();
-    EVP_PKEY_free(key);
-    return 0;
+    return NULL;
   }
 
-  if (EVP_PKEY_keygen_init(pkey_ctx) <= 0) {
-    print_openssl_error();
-    EVP_PKEY_CTX_free(pkey_ctx);
-    EVP_PKEY_free(key);
-    return 0;
+  int ok = EVP_PKEY_keygen_init(pkey_ctx) > 0;
+  if (ok && is_rsa) {
+    ok = EVP_PKEY_CTX_set_rsa_keygen_bits(pkey_ctx, algorithm == LEAF_KEY_RSA_3072 ? 3072 : 2048) > 0;
+  } else if (ok) {
+    ok = EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pkey_ctx,
+        algorithm == LEAF_KEY_ECDSA_P384 ? NID_secp384r1 : NID_X9_62_prime256v1) > 0 &&
+      EVP_PKEY_CTX_set_ec_param_enc(pkey_ctx, OPENSSL_EC_NAMED_CURVE) > 0;
   }
 
-  if (EVP_PKEY_CTX_set_rsa_keygen_bits(pkey_ctx, 2048) <= 0) {
+  if (!ok || EVP_PKEY_keygen(pkey_ctx, & key) <= 0) {
     print_openssl_error();
     EVP_PKEY_CTX_free(pkey_ctx);
     EVP_PKEY_free(key);
+    return NULL;
+  }
+
+  EVP_PKEY_CTX_free(pkey_ctx);
+  return key;
+}
+
+/* Keep the pool filled up to config.key_pool_depth */
+static THREAD_RETURN_TYPE key_pool_worker(void * arg) {
+  (void) arg;
+
+  while (g_key_pool.running) {
+    LOCK_MUTEX(g_key_pool.cs);
+    int needed = g_key_pool.count < config.key_pool_depth;
+    if (!needed) {
+      RESET_EVENT(g_key_pool.wakeup); // Set again under the lock by whoever changes that
+    }
+    UNLOCK_MUTEX(g_key_pool.cs);
+
+    if (!needed) {
+      WAIT_EVENT(g_key_pool.wakeup, EVENT_WAIT_FOREVER);
+      continue;
+    }
+
+    leaf_key_algorithm_t algorithm = config.leaf_key_algorithm;
+    EVP_PKEY * key = generate_leaf_key(algorithm);
+    if (!key) {
+      SLEEP(1000); // Don't spin if key generation keeps failing
+      continue;
+    }
+
+    LOCK_MUTEX(g_key_pool.cs);
+    if (algorithm == g_key_pool.algorithm &&
+      g_key_pool.count < config.key_pool_depth && g_key_pool.count < KEY_POOL_MAX_DEPTH) {
+      g_key_pool.keys[g_key_pool.count++] = key;
+      g_key_pool.stats.generated++;
+      key = NULL;
+    }
+    UNLOCK_MUTEX(g_key_pool.cs);
+
+    if (key) {
+      EVP_PKEY_free(key); // Pool was shrunk, filled or switched algorithm meanwhile
+    }
+  }
+
+  THREAD_RETURN;
+}
+
+/* Take a key from the pool, or generate one inline when it is empty */
+static EVP_PKEY * take_pooled_key(void) {
+  EVP_PKEY * key = NULL;
+  leaf_key_algorithm_t algorithm = config.leaf_key_algorithm;
+
+  if (g_key_pool.initialized) {
+    LOCK_MUTEX(g_key_pool.cs);
+    if (g_key_pool.count > 0 && g_key_pool.algorithm == algorithm) {
+      key = g_key_pool.keys[--g_key_pool.count];
+      g_key_pool.keys[g_key_pool.count] = NULL;
+      g_key_pool.stats.served++;
+      SET_EVENT(g_key_pool.wakeup);
+    } else if (g_key_pool.running && config.key_pool_depth > 0) {
+      g_key_pool.stats.stalls++;
+    }
+    UNLOCK_MUTEX(g_key_pool.cs);
+  }
+
+  if (!key) {
+    key = generate_leaf_key(algorithm);
+  }
+  return key;
+}
+
+int init_key_pool(void) {
+  if (g_key_pool.initialized) {
+    return 1;
+  }
+  memset( & g_key_pool, 0, sizeof(g_key_pool));
+  g_key_pool.wakeup = CREATE_EVENT();
+  if (!g_key_pool.wakeup) {
     return 0;
   }
+  INIT_MUTEX(g_key_pool.cs);
+  g_key_pool.algorithm = config.leaf_key_algorithm;
+  g_key_pool.initialized = 1;
+  return 1;
+}
 
-  if (EVP_PKEY_keygen(pkey_ctx, & key) <= 0) {
-    print_openssl_error();
-    EVP_PKEY_CTX_free(pkey_ctx);
-    EVP_PKEY_free(key);
+void cleanup_key_pool(void) {
+  if (!g_key_pool.initialized) {
+    return;
+  }
+  stop_key_pool();
+  resize_key_pool(0);
+  CLOSE_EVENT(g_key_pool.wakeup);
+  DESTROY_MUTEX(g_key_pool.cs);
+  g_key_pool.initialized = 0;
+}
+
+int start_key_pool(void) {
+  if (!g_key_pool.initialized || g_key_pool.running) {
+    return g_key_pool.running;
+  }
+
+  g_key_pool.running = 1;
+  g_key_pool.thread_count = 0;
+  for (int i = 0; i < KEY_POOL_THREADS; i++) {
+    THREAD_HANDLE thread = INVALID_THREAD_ID;
+    if (CREATE_THREAD(thread, key_pool_worker, NULL) != 0) {
+      log_message("WARNING: Failed to start key pool thread");
+      break;
+    }
+    g_key_pool.threads[g_key_pool.thread_count++] = thread;
+  }
+
+  if (g_key_pool.thread_count == 0) {
+    g_key_pool.running = 0;
     return 0;
   }
+  return 1;
+}
 
-  EVP_PKEY_CTX_free(pkey_ctx);
+void stop_key_pool(void) {
+  if (!g_key_pool.running) {
+    return;
+  }
+
+  // Pooled keys are kept for the next start
+  LOCK_MUTEX(g_key_pool.cs);
+  g_key_pool.running = 0;
+  SET_EVENT(g_key_pool.wakeup);
+  UNLOCK_MUTEX(g_key_pool.cs);
+  for (int i = 0; i < g_key_pool.thread_count; i++) {
+    JOIN_THREAD(g_key_pool.threads[i]);
+    #ifdef INTERCEPT_WINDOWS
+    CloseHandle(g_key_pool.threads[i]);
+    #endif
+  }
+  g_key_pool.thread_count = 0;
+}
+
+/* Change the target depth, dropping keys above the new depth */
+void resize_key_pool(int depth) {
+  config.key_pool_depth = depth;
+  if (!g_key_pool.initialized) {
+    return;
+  }
+
+  LOCK_MUTEX(g_key_pool.cs);
+  while (g_key_pool.count > depth) {
+    EVP_PKEY_free(g_key_pool.keys[--g_key_pool.count]);
+    g_key_pool.keys[g_key_pool.count] = NULL;
+  }
+  SET_EVENT(g_key_pool.wakeup); // A deeper pool needs filling
+  UNLOCK_MUTEX(g_key_pool.cs);
+}
+
+/* Switch the leaf key type, discarding pooled keys and cached certificates */
+void change_leaf_key_algorithm(leaf_key_algorithm_t algorithm) {
+  if (g_key_pool.initialized) {
+    LOCK_MUTEX(g_key_pool.cs);
+    config.leaf_key_algorithm = algorithm;
+    g_key_pool.algorithm = algorithm;
+    while (g_key_pool.count > 0) {
+      EVP_PKEY_free(g_key_pool.keys[--g_key_pool.count]);
+      g_key_pool.keys[g_key_pool.count] = NULL;
+    }
+    SET_EVENT(g_key_pool.wakeup);
+    UNLOCK_MUTEX(g_key_pool.cs);
+  } else {
+    config.leaf_key_algorithm = algorithm;
+  }
+
+  clear_cert_cache();
+}
+
+void get_key_pool_counters(key_pool_stats_t * stats) {
+  memset(stats, 0, sizeof( * stats));
+  stats -> target_depth = config.key_pool_depth;
+  if (!g_key_pool.initialized) {
+    return;
+  }
+  LOCK_MUTEX(g_key_pool.cs);
+  * stats = g_key_pool.stats;
+  stats -> depth = g_key_pool.count;
+  stats -> target_depth = config.key_pool_depth;
+  UNLOCK_MUTEX(g_key_pool.cs);
+}
+
+int generate_cert_for_host(const char * hostname, X509 ** cert_out, EVP_PKEY ** key_out) {
+  X509 * cert;
+  EVP_PKEY * key;
+  X509_NAME * name;
+
+  if (config.verbose) {
+    log_message("Generating certificate for %s\n", hostname);
+  }
+
+  // Take a pre-generated key, falls back to generating one inline
+  key = take_pooled_key();
+  if (!key) {
+    return 0;
+  }
 
   // Generate cert
   cert = X509_new();
@@ -467,6 +670,428 @@ int generate_cert_for_host(const char * hostname, X509 ** cert_out, EVP_PKEY **
   return 1;
 }
 
+/* Per-hostname server context cache */
+
+typedef struct cert_cache_entry {
+  char hostname[MAX_HOSTNAME_LEN];
+  SSL_CTX * ctx; // Owns the leaf certificate and key
+  time_t expires;
+  struct cert_cache_entry * hash_next;
+  struct cert_cache_entry * lru_prev; // More recently used
+  struct cert_cache_entry * lru_next; // Less recently used
+} cert_cache_entry;
+
+struct cert_job {
+  char hostname[MAX_HOSTNAME_LEN];
+  char key_name[MAX_HOSTNAME_LEN];
+  SSL_CTX * ctx; // Result, NULL if generation failed
+  int done;
+  int refs; // Worker and waiting connections
+  work_waiter_t * waiters; // Notified once the context is built
+  struct cert_job * next;
+};
+
+static struct {
+  mutex_t cs;
+  int initialized;
+  cert_cache_entry * buckets[CERT_CACHE_BUCKETS];
+  cert_cache_entry * lru_head;
+  cert_cache_entry * lru_tail;
+  int count;
+  cert_cache_stats_t stats;
+  SSL_CTX * template_ctx; // Shared by all client-facing connections
+  cert_job_t * jobs; // Hosts being generated for cert_cache_start()
+  work_queue_t * workers;
+} g_cert_cache;
+
+static unsigned int cert_cache_hash(const char * hostname) {
+  unsigned int hash = 2166136261u; // FNV-1a
+  for (const unsigned char * p = (const unsigned char * ) hostname; * p; p++) {
+    hash ^= * p;
+    hash *= 16777619u;
+  }
+  return hash % CERT_CACHE_BUCKETS;
+}
+
+static void cert_cache_lru_unlink(cert_cache_entry * entry) {
+  if (entry -> lru_prev) entry -> lru_prev -> lru_next = entry -> lru_next;
+  else g_cert_cache.lru_head = entry -> lru_next;
+  if (entry -> lru_next) entry -> lru_next -> lru_prev = entry -> lru_prev;
+  else g_cert_cache.lru_tail = entry -> lru_prev;
+  entry -> lru_prev = NULL;
+  entry -> lru_next = NULL;
+}
+
+static void cert_cache_lru_push_front(cert_cache_entry * entry) {
+  entry -> lru_prev = NULL;
+  entry -> lru_next = g_cert_cache.lru_head;
+  if (g_cert_cache.lru_head) g_cert_cache.lru_head -> lru_prev = entry;
+  g_cert_cache.lru_head = entry;
+  if (!g_cert_cache.lru_tail) g_cert_cache.lru_tail = entry;
+}
+
+/* Unlink an entry from both lists and free it. Caller holds the lock. */
+static void cert_cache_remove(cert_cache_entry * entry) {
+  cert_cache_entry ** link = & g_cert_cache.buckets[cert_cache_hash(entry -> hostname)];
+  while ( * link && * link != entry) {
+    link = & ( * link) -> hash_next;
+  }
+  if ( * link) {
+    * link = entry -> hash_next;
+  }
+  cert_cache_lru_unlink(entry);
+
+  // Connections still using the context keep their own reference
+  SSL_CTX_free(entry -> ctx);
+  free(entry);
+  g_cert_cache.count--;
+}
+
+static cert_cache_entry * cert_cache_find(const char * hostname) {
+  cert_cache_entry * entry = g_cert_cache.buckets[cert_cache_hash(hostname)];
+  while (entry && strcmp(entry -> hostname, hostname) != 0) {
+    entry = entry -> hash_next;
+  }
+  return entry;
+}
+
+int init_cert_cache(void) {
+  if (g_cert_cache.initialized) {
+    return 1;
+  }
+  memset( & g_cert_cache, 0, sizeof(g_cert_cache));
+  INIT_MUTEX(g_cert_cache.cs);
+  g_cert_cache.stats.capacity = CERT_CACHE_CAPACITY;
+  // Without workers cert_cache_start() generates inline
+  g_cert_cache.workers = work_queue_create(CERT_WORKER_THREADS);
+  g_cert_cache.initialized = 1;
+  return 1;
+}
+
+void clear_cert_cache(void) {
+  if (!g_cert_cache.initialized) {
+    return;
+  }
+  LOCK_MUTEX(g_cert_cache.cs);
+  while (g_cert_cache.lru_head) {
+    cert_cache_remove(g_cert_cache.lru_head);
+  }
+  UNLOCK_MUTEX(g_cert_cache.cs);
+}
+
+void cleanup_cert_cache(void) {
+  if (!g_cert_cache.initialized) {
+    return;
+  }
+  // Jobs still queued are dropped, no connection waits on them any more
+  work_queue_destroy(g_cert_cache.workers);
+  g_cert_cache.workers = NULL;
+  while (g_cert_cache.jobs) {
+    cert_job_t * next = g_cert_cache.jobs -> next;
+    if (g_cert_cache.jobs -> ctx) {
+      SSL_CTX_free(g_cert_cache.jobs -> ctx);
+    }
+    free(g_cert_cache.jobs);
+    g_cert_cache.jobs = next;
+  }
+  clear_cert_cache();
+  if (g_cert_cache.template_ctx) {
+    SSL_CTX_free(g_cert_cache.template_ctx);
+    g_cert_cache.template_ctx = NULL;
+  }
+  DESTROY_MUTEX(g_cert_cache.cs);
+  g_cert_cache.initialized = 0;
+}
+
+/*
+ * Return the long-lived template context used to accept client
+ * connections. Its SNI callback swaps in the per-host context, and its
+ * session cache is what makes server-side resumption work. The caller
+ * receives its own reference and must release it with SSL_CTX_free.
+ */
+SSL_CTX * get_server_template_ctx(void) {
+  SSL_CTX * ctx = NULL;
+
+  if (!g_cert_cache.initialized) {
+    return NULL;
+  }
+
+  LOCK_MUTEX(g_cert_cache.cs);
+  if (!g_cert_cache.template_ctx) {
+    g_cert_cache.template_ctx = create_server_ssl_context();
+    if (g_cert_cache.template_ctx) {
+      SSL_CTX_set_tlsext_servername_callback(g_cert_cache.template_ctx, sni_cert_setup_callback);
+    }
+  }
+  if (g_cert_cache.template_ctx) {
+    SSL_CTX_up_ref(g_cert_cache.template_ctx);
+    ctx = g_cert_cache.template_ctx;
+  }
+  UNLOCK_MUTEX(g_cert_cache.cs);
+
+  return ctx;
+}
+
+/* Build a server context presenting the given leaf certificate */
+static SSL_CTX * create_host_ssl_context(const char * hostname, X509 * cert, EVP_PKEY * key) {
+  SSL_CTX * ctx = create_server_ssl_context();
+  if (!ctx) {
+    return NULL;
+  }
+
+  if (SSL_CTX_use_certificate(ctx, cert) != 1 ||
+    SSL_CTX_use_PrivateKey(ctx, key) != 1 ||
+    !SSL_CTX_check_private_key(ctx)) {
+    log_message("SNI: Failed to use generated cert/key for %s", hostname);
+    print_openssl_error();
+    SSL_CTX_free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+/* Host names are case-insensitive, so the cache is keyed by the lowercase name */
+static void cert_cache_key(const char * hostname, char * key_name) {
+  size_t i;
+  for (i = 0; hostname[i] && i < MAX_HOSTNAME_LEN - 1; i++) {
+    key_name[i] = (char) tolower((unsigned char) hostname[i]);
+  }
+  key_name[i] = '\0';
+}
+
+/* Cached context for a host, with a reference for the caller. Caller holds the lock. */
+static SSL_CTX * cert_cache_get(const char * key_name) {
+  cert_cache_entry * entry = cert_cache_find(key_name);
+  if (entry && entry -> expires <= time(NULL)) {
+    cert_cache_remove(entry);
+    g_cert_cache.stats.expired++;
+    entry = NULL;
+  }
+  if (!entry) {
+    g_cert_cache.stats.misses++;
+    return NULL;
+  }
+
+  cert_cache_lru_unlink(entry);
+  cert_cache_lru_push_front(entry);
+  SSL_CTX_up_ref(entry -> ctx);
+  g_cert_cache.stats.hits++;
+  return entry -> ctx;
+}
+
+/* Generate a host's certificate and cache its context; the slow part runs unlocked */
+static SSL_CTX * cert_cache_build(const char * hostname, const char * key_name) {
+  X509 * cert = NULL;
+  EVP_PKEY * key = NULL;
+  log_message("SNI: Generating certificate for: %s", hostname);
+  if (!generate_cert_for_host(hostname, & cert, & key)) {
+    return NULL;
+  }
+
+  SSL_CTX * ctx = create_host_ssl_context(hostname, cert, key);
+  // The context holds its own references
+  X509_free(cert);
+  EVP_PKEY_free(key);
+  if (!ctx) {
+    return NULL;
+  }
+
+  LOCK_MUTEX(g_cert_cache.cs);
+  cert_cache_entry * entry = cert_cache_find(key_name);
+  if (!entry) {
+    entry = (cert_cache_entry * ) calloc(1, sizeof(cert_cache_entry));
+    if (entry) {
+      while (g_cert_cache.count >= CERT_CACHE_CAPACITY && g_cert_cache.lru_tail) {
+        cert_cache_remove(g_cert_cache.lru_tail);
+        g_cert_cache.stats.evictions++;
+      }
+      strcpy(entry -> hostname, key_name);
+      SSL_CTX_up_ref(ctx);
+      entry -> ctx = ctx;
+      entry -> expires = time(NULL) + CERT_CACHE_MAX_AGE;
+
+      unsigned int bucket = cert_cache_hash(key_name);
+      entry -> hash_next = g_cert_cache.buckets[bucket];
+      g_cert_cache.buckets[bucket] = entry;
+      cert_cache_lru_push_front(entry);
+      g_cert_cache.count++;
+    }
+  }
+  // If another handshake cached this host meanwhile, keep its entry and
+  // hand out the context built here; both are equally valid.
+  UNLOCK_MUTEX(g_cert_cache.cs);
+
+  return ctx;
+}
+
+/*
+ * Return the server context for hostname, generating its certificate and
+ * caching the context on a miss. All connections to the same host share
+ * one context. The caller receives its own reference and must release it
+ * with SSL_CTX_free.
+ */
+SSL_CTX * get_ssl_ctx_for_host(const char * hostname) {
+  char key_name[MAX_HOSTNAME_LEN];
+
+  if (!hostname || !g_cert_cache.initialized) {
+    return NULL;
+  }
+  cert_cache_key(hostname, key_name);
+
+  LOCK_MUTEX(g_cert_cache.cs);
+  SSL_CTX * ctx = cert_cache_get(key_name);
+  UNLOCK_MUTEX(g_cert_cache.cs);
+
+  if (ctx) {
+    if (config.verbose) {
+      log_message("SNI: Reusing cached certificate for: %s", hostname);
+    }
+    return ctx;
+  }
+  return cert_cache_build(hostname, key_name);
+}
+
+/*
+ * Drop a reference to a job; the last one frees it. The waiter passed to
+ * cert_cache_start() is not notified once this returns.
+ */
+void cert_job_release(cert_job_t * job, work_waiter_t * waiter) {
+  if (!job) {
+    return;
+  }
+
+  LOCK_MUTEX(g_cert_cache.cs);
+  work_waiter_remove( & job -> waiters, waiter);
+  int refs = --job -> refs;
+  UNLOCK_MUTEX(g_cert_cache.cs);
+
+  if (refs == 0) {
+    if (job -> ctx) {
+      SSL_CTX_free(job -> ctx);
+    }
+    free(job);
+  }
+}
+
+/* Worker side of cert_cache_start(): build the context and publish it to the waiters */
+static void cert_job_run(void * arg) {
+  cert_job_t * job = (cert_job_t * ) arg;
+  SSL_CTX * ctx = cert_cache_build(job -> hostname, job -> key_name);
+
+  LOCK_MUTEX(g_cert_cache.cs);
+  cert_job_t ** link = & g_cert_cache.jobs;
+  while ( * link && * link != job) {
+    link = & ( * link) -> next;
+  }
+  if ( * link) {
+    * link = job -> next;
+  }
+  job -> ctx = ctx;
+  job -> done = 1;
+  work_waiter_notify_all( & job -> waiters);
+  UNLOCK_MUTEX(g_cert_cache.cs);
+
+  cert_job_release(job, NULL);
+}
+
+/*
+ * Return the server context for hostname without blocking. A cached one is
+ * returned in *ctx with CERT_READY, as from get_ssl_ctx_for_host();
+ * otherwise the certificate is generated on a worker thread and
+ * CERT_PENDING is returned with a job in *job, to be polled with
+ * cert_job_poll() and released with cert_job_release(). Connections to
+ * the same host share one job. waiter, if not NULL, is notified from the
+ * worker once a pending job is done.
+ */
+int cert_cache_start(const char * hostname, SSL_CTX ** ctx, cert_job_t ** job, work_waiter_t * waiter) {
+  char key_name[MAX_HOSTNAME_LEN];
+
+  * ctx = NULL;
+  * job = NULL;
+  if (!hostname || !g_cert_cache.initialized) {
+    return CERT_FAILED;
+  }
+  cert_cache_key(hostname, key_name);
+
+  LOCK_MUTEX(g_cert_cache.cs);
+  * ctx = cert_cache_get(key_name);
+  if ( * ctx) {
+    UNLOCK_MUTEX(g_cert_cache.cs);
+    return CERT_READY;
+  }
+
+  for (cert_job_t * pending = g_cert_cache.jobs; pending; pending = pending -> next) {
+    if (strcmp(pending -> key_name, key_name) == 0) {
+      pending -> refs++;
+      work_waiter_add( & pending -> waiters, waiter);
+      * job = pending;
+      UNLOCK_MUTEX(g_cert_cache.cs);
+      return CERT_PENDING;
+    }
+  }
+
+  cert_job_t * created = g_cert_cache.workers ? (cert_job_t * ) calloc(1, sizeof(cert_job_t)) : NULL;
+  if (created) {
+    strncpy(created -> hostname, hostname, sizeof(created -> hostname) - 1);
+    strcpy(created -> key_name, key_name);
+    created -> refs = 2; // The caller's and the worker's
+    work_waiter_add( & created -> waiters, waiter);
+    created -> next = g_cert_cache.jobs;
+    g_cert_cache.jobs = created;
+  }
+  UNLOCK_MUTEX(g_cert_cache.cs);
+
+  if (created) {
+    if (work_queue_submit(g_cert_cache.workers, cert_job_run, created)) {
+      * job = created;
+      return CERT_PENDING;
+    }
+    // Not accepted: run it here, for anyone who joined it meanwhile too
+    LOCK_MUTEX(g_cert_cache.cs);
+    work_waiter_remove( & created -> waiters, waiter);
+    UNLOCK_MUTEX(g_cert_cache.cs);
+    cert_job_run(created);
+    int ret = cert_job_poll(created, ctx);
+    cert_job_release(created, NULL);
+    return ret;
+  }
+
+  // No workers: generate on the caller's thread
+  * ctx = cert_cache_build(hostname, key_name);
+  return * ctx ? CERT_READY : CERT_FAILED;
+}
+
+/* Result of a job: CERT_PENDING until it is done, then CERT_READY with a context reference in *ctx or CERT_FAILED */
+int cert_job_poll(cert_job_t * job, SSL_CTX ** ctx) {
+  int ret = CERT_PENDING;
+
+  * ctx = NULL;
+  LOCK_MUTEX(g_cert_cache.cs);
+  if (job -> done) {
+    if (job -> ctx) {
+      SSL_CTX_up_ref(job -> ctx);
+      * ctx = job -> ctx;
+      ret = CERT_READY;
+    } else {
+      ret = CERT_FAILED;
+    }
+  }
+  UNLOCK_MUTEX(g_cert_cache.cs);
+  return ret;
+}
+
+void get_cert_cache_counters(cert_cache_stats_t * stats) {
+  memset(stats, 0, sizeof( * stats));
+  stats -> capacity = CERT_CACHE_CAPACITY;
+  if (!g_cert_cache.initialized) {
+    return;
+  }
+  LOCK_MUTEX(g_cert_cache.cs);
+  * stats = g_cert_cache.stats;
+  stats -> entries = g_cert_cache.count;
+  UNLOCK_MUTEX(g_cert_cache.cs);
+}
+
 SSL_CTX * create_server_ssl_context(void) {
   SSL_CTX * ctx;
 
@@ -505,6 +1130,10 @@ SSL_CTX * create_server_ssl_context(void) {
   // Set session cache mode
   SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
 
+  // ALPN is passed through: the client is answered with the upstream's choice from its own list
+  SSL_CTX_set_client_hello_cb(ctx, alpn_client_hello_callback, NULL);
+  SSL_CTX_set_alpn_select_cb(ctx, alpn_select_callback, NULL);
+
   return ctx;
 }
 
@@ -551,4 +1180,203 @@ SSL_CTX * create_client_ssl_context(void) {
   SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT);
 
   return ctx;
-}
\ No newline at end of file
+}
+
+/* Shared upstream client context and session cache */
+
+typedef struct {
+  char key[MAX_HOSTNAME_LEN + 8]; // host:port
+  SSL_SESSION * session;
+  time_t last_used;
+} upstream_session_entry;
+
+static struct {
+  mutex_t cs;
+  int initialized;
+  int ex_index; // SSL ex_data slot holding the connection's host:port key
+  SSL_CTX * ctx;
+  upstream_session_entry entries[UPSTREAM_SESSION_CAPACITY];
+  int count;
+  upstream_session_stats_t stats;
+} g_upstream;
+
+static void upstream_key_free(void * parent, void * ptr, CRYPTO_EX_DATA * ad, int idx, long argl, void * argp) {
+  (void) parent;
+  (void) ad;
+  (void) idx;
+  (void) argl;
+  (void) argp;
+  free(ptr);
+}
+
+static upstream_session_entry * upstream_find(const char * key) {
+  for (int i = 0; i < g_upstream.count; i++) {
+    if (strcmp(g_upstream.entries[i].key, key) == 0) {
+      return & g_upstream.entries[i];
+    }
+  }
+  return NULL;
+}
+
+static void upstream_remove(upstream_session_entry * entry) {
+  SSL_SESSION_free(entry -> session);
+  * entry = g_upstream.entries[--g_upstream.count];
+  memset( & g_upstream.entries[g_upstream.count], 0, sizeof(upstream_session_entry));
+}
+
+/*
+ * Called by OpenSSL whenever the server hands us a session (TLS 1.2 after
+ * the handshake, TLS 1.3 on each NewSessionTicket). Keeps the newest
+ * session per host:port. Returning 1 takes ownership of the reference.
+ */
+static int upstream_new_session_cb(SSL * ssl, SSL_SESSION * session) {
+  const char * key = (const char * ) SSL_get_ex_data(ssl, g_upstream.ex_index);
+  if (!key || !SSL_SESSION_is_resumable(session)) {
+    return 0;
+  }
+
+  LOCK_MUTEX(g_upstream.cs);
+  upstream_session_entry * entry = upstream_find(key);
+  if (entry) {
+    SSL_SESSION_free(entry -> session);
+  } else {
+    if (g_upstream.count >= UPSTREAM_SESSION_CAPACITY) {
+      // Evict the least recently used host
+      upstream_session_entry * oldest = & g_upstream.entries[0];
+      for (int i = 1; i < g_upstream.count; i++) {
+        if (g_upstream.entries[i].last_used < oldest -> last_used) {
+          oldest = & g_upstream.entries[i];
+        }
+      }
+      upstream_remove(oldest);
+    }
+    entry = & g_upstream.entries[g_upstream.count++];
+    strncpy(entry -> key, key, sizeof(entry -> key) - 1);
+    entry -> key[sizeof(entry -> key) - 1] = '\0';
+  }
+  entry -> session = session;
+  entry -> last_used = time(NULL);
+  UNLOCK_MUTEX(g_upstream.cs);
+
+  return 1;
+}
+
+int init_upstream_sessions(void) {
+  if (g_upstream.initialized) {
+    return 1;
+  }
+  memset( & g_upstream, 0, sizeof(g_upstream));
+  INIT_MUTEX(g_upstream.cs);
+  g_upstream.ex_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, upstream_key_free);
+  g_upstream.initialized = 1;
+  return 1;
+}
+
+void cleanup_upstream_sessions(void) {
+  if (!g_upstream.initialized) {
+    return;
+  }
+  LOCK_MUTEX(g_upstream.cs);
+  while (g_upstream.count > 0) {
+    upstream_remove( & g_upstream.entries[g_upstream.count - 1]);
+  }
+  if (g_upstream.ctx) {
+    SSL_CTX_free(g_upstream.ctx);
+    g_upstream.ctx = NULL;
+  }
+  UNLOCK_MUTEX(g_upstream.cs);
+  DESTROY_MUTEX(g_upstream.cs);
+  g_upstream.initialized = 0;
+}
+
+/*
+ * Return the process-wide client context for proxy -> server connections.
+ * The caller receives its own reference and must release it with SSL_CTX_free.
+ */
+SSL_CTX * get_client_ssl_ctx(void) {
+  SSL_CTX * ctx = NULL;
+
+  if (!g_upstream.initialized) {
+    return NULL;
+  }
+
+  LOCK_MUTEX(g_upstream.cs);
+  if (!g_upstream.ctx) {
+    g_upstream.ctx = create_client_ssl_context();
+    if (g_upstream.ctx) {
+      // Sessions are stored per host:port by the callback, not by OpenSSL
+      SSL_CTX_set_session_cache_mode(g_upstream.ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+      SSL_CTX_sess_set_new_cb(g_upstream.ctx, upstream_new_session_cb);
+    }
+  }
+  if (g_upstream.ctx) {
+    SSL_CTX_up_ref(g_upstream.ctx);
+    ctx = g_upstream.ctx;
+  }
+  UNLOCK_MUTEX(g_upstream.cs);
+
+  return ctx;
+}
+
+/*
+ * Tag an upstream SSL object with its host:port and offer the cached session
+ * for that origin, if any. Call before the handshake.
+ */
+void attach_upstream_session(SSL * ssl, const char * host, int port) {
+  char key[MAX_HOSTNAME_LEN + 8];
+
+  if (!g_upstream.initialized || !ssl || !host) {
+    return;
+  }
+
+  snprintf(key, sizeof(key), "%s:%d", host, port);
+  char * key_copy = strdup(key);
+  if (!key_copy || !SSL_set_ex_data(ssl, g_upstream.ex_index, key_copy)) {
+    free(key_copy);
+    return;
+  }
+
+  LOCK_MUTEX(g_upstream.cs);
+  upstream_session_entry * entry = upstream_find(key);
+  if (entry) {
+    time_t now = time(NULL);
+    if (now >= (time_t)(SSL_SESSION_get_time(entry -> session) + SSL_SESSION_get_timeout(entry -> session))) {
+      upstream_remove(entry); // Expired, a full handshake will store a new one
+    } else {
+      SSL_set_session(ssl, entry -> session);
+      entry -> last_used = now;
+    }
+  }
+  UNLOCK_MUTEX(g_upstream.cs);
+}
+
+/* Count a completed upstream handshake as resumed or full */
+void record_upstream_handshake(SSL * ssl) {
+  if (!g_upstream.initialized || !ssl) {
+    return;
+  }
+
+  int resumed = SSL_session_reused(ssl);
+  LOCK_MUTEX(g_upstream.cs);
+  if (resumed) {
+    g_upstream.stats.resumed++;
+  } else {
+    g_upstream.stats.full++;
+  }
+  UNLOCK_MUTEX(g_upstream.cs);
+
+  if (config.verbose) {
+    log_message("Upstream TLS handshake %s", resumed ? "resumed a cached session" : "was a full handshake");
+  }
+}
+
+void get_upstream_session_counters(upstream_session_stats_t * stats) {
+  memset(stats, 0, sizeof( * stats));
+  if (!g_upstream.initialized) {
+    return;
+  }
+  LOCK_MUTEX(g_upstream.cs);
+  * stats = g_upstream.stats;
+  stats -> cached_sessions = g_upstream.count;
+  UNLOCK_MUTEX(g_upstream.cs);
+}
@@ -0,0 +1,455 @@
+/*
+ * TLS MITM Proxy - ClientHello Parser Implementation
+ *
+ * The record is walked with a bounded cursor. Running out of bytes before
+ * the end of the record means more are on the way; running out at the end
+ * of the record means the ClientHello is malformed, or continues in the
+ * next record.
+ *
+ * JA3 is the MD5 of "version,ciphers,extensions,groups,point formats" in
+ * decimal, lists joined with '-'. JA4 is "t", the highest offered
+ * version, SNI present ('d') or not ('i'), the cipher and extension
+ * counts and the first and last character of the first ALPN protocol,
+ * followed by truncated SHA-256 hashes of the sorted cipher list and of
+ * the sorted extension list (without SNI and ALPN) plus the signature
+ * algorithms. GREASE values are left out of both.
+ */
+
+#include "../include/client_hello.h"
+
+#include <openssl/evp.h>
+
+#define TLS_CONTENT_HANDSHAKE 0x16
+#define TLS_HANDSHAKE_CLIENT_HELLO 0x01
+#define TLS_EXT_SERVER_NAME 0x0000
+#define TLS_EXT_SUPPORTED_GROUPS 0x000a
+#define TLS_EXT_EC_POINT_FORMATS 0x000b
+#define TLS_EXT_SIGNATURE_ALGORITHMS 0x000d
+#define TLS_EXT_ALPN 0x0010
+#define TLS_EXT_SUPPORTED_VERSIONS 0x002b
+#define TLS_SNI_HOST_NAME 0x00
+#define JA4_HASH_LEN 12                 // Hex digits kept of each JA4 hash
+#define FINGERPRINT_TEXT 4096           // Longest JA3 or JA4 hash input
+
+typedef struct {
+  const unsigned char * p;
+  const unsigned char * end;
+  int short_read;                       // Ran past end
+} hello_cursor_t;
+
+static int take(hello_cursor_t * c, int n, const unsigned char ** out) {
+  if (c -> short_read || c -> end - c -> p < n) {
+    c -> short_read = 1;
+    return 0;
+  }
+  if (out) {
+    * out = c -> p;
+  }
+  c -> p += n;
+  return 1;
+}
+
+static int take_int(hello_cursor_t * c, int n, int * value) {
+  const unsigned char * bytes;
+  if (!take(c, n, & bytes)) {
+    return 0;
+  }
+  * value = 0;
+  for (int i = 0; i < n; i++) {
+    * value = ( * value << 8) | bytes[i];
+  }
+  return 1;
+}
+
+/* Reserved values clients sprinkle in to keep servers tolerant (RFC 8701) */
+static int is_grease(int value) {
+  return (value & 0x0f0f) == 0x0a0a && (value >> 8) == (value & 0xff);
+}
+
+/* Read a list of 2-byte values prefixed with its length in length_size bytes */
+static void read_u16_list(const unsigned char * data, int len, int length_size,
+  unsigned short * out, int max, int * count, client_hello_info_t * hello) {
+  hello_cursor_t c = {
+    data,
+    data + len,
+    0
+  };
+  int list_len;
+  int value;
+
+  if (!take_int( & c, length_size, & list_len) || list_len > len - length_size) {
+    return;
+  }
+  c.end = c.p + list_len;
+  while (take_int( & c, 2, & value)) {
+    if ( * count == max) {
+      hello -> truncated = 1;
+      return;
+    }
+    out[( * count) ++] = (unsigned short) value;
+  }
+}
+
+/* Copy the host_name entry of a server_name extension body */
+static void parse_server_name(const unsigned char * data, int len, client_hello_info_t * hello) {
+  hello_cursor_t c = {
+    data,
+    data + len,
+    0
+  };
+  int list_len;
+  int type;
+  int name_len;
+  const unsigned char * name;
+
+  if (!take_int( & c, 2, & list_len) || list_len > len - 2) {
+    return;
+  }
+  c.end = c.p + list_len;
+  while (take_int( & c, 1, & type) && take_int( & c, 2, & name_len) && take( & c, name_len, & name)) {
+    if (type != TLS_SNI_HOST_NAME) {
+      continue;
+    }
+    if (name_len == 0 || name_len >= (int) sizeof(hello -> sni)) {
+      return;
+    }
+    for (int i = 0; i < name_len; i++) {
+      if (name[i] <= 0x20 || name[i] >= 0x7f) {
+        return; // Not a DNS name
+      }
+    }
+    memcpy(hello -> sni, name, name_len);
+    hello -> sni[name_len] = '\0';
+    return;
+  }
+}
+
+static int is_alnum(unsigned char ch) {
+  return (ch >= '0' && ch <= '9') || (ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z');
+}
+
+/*
+ * Join the offered protocols with ',' (bytes that cannot be shown become
+ * '?') and note the JA4 characters of the first one
+ */
+static void parse_alpn(const unsigned char * data, int len, client_hello_info_t * hello, char ja4_alpn[2]) {
+  static const char hex[] = "0123456789abcdef";
+  hello_cursor_t c = {
+    data,
+    data + len,
+    0
+  };
+  int list_len;
+  int name_len;
+  const unsigned char * name;
+  size_t used = 0;
+
+  if (!take_int( & c, 2, & list_len) || list_len > len - 2) {
+    return;
+  }
+  c.end = c.p + list_len;
+  while (take_int( & c, 1, & name_len) && take( & c, name_len, & name)) {
+    if (name_len == 0) {
+      continue;
+    }
+    if (used == 0) {
+      unsigned char first = name[0];
+      unsigned char last = name[name_len - 1];
+      if (is_alnum(first) && is_alnum(last)) {
+        ja4_alpn[0] = (char) first;
+        ja4_alpn[1] = (char) last;
+      } else {
+        ja4_alpn[0] = hex[first >> 4];
+        ja4_alpn[1] = hex[last & 0x0f];
+      }
+    } else if (used + 1 < sizeof(hello -> alpn)) {
+      hello -> alpn[used++] = ',';
+    }
+    for (int i = 0; i < name_len && used + 1 < sizeof(hello -> alpn); i++) {
+      hello -> alpn[used++] = (name[i] > 0x20 && name[i] < 0x7f && name[i] != ',') ? (char) name[i] : '?';
+    }
+  }
+  hello -> alpn[used] = '\0';
+}
+
+static void parse_extension(int type, const unsigned char * data, int len,
+  client_hello_info_t * hello, char ja4_alpn[2]) {
+  switch (type) {
+  case TLS_EXT_SERVER_NAME:
+    if (!hello -> sni[0]) {
+      parse_server_name(data, len, hello);
+    }
+    break;
+  case TLS_EXT_ALPN:
+    if (!hello -> alpn[0]) {
+      parse_alpn(data, len, hello, ja4_alpn);
+    }
+    break;
+  case TLS_EXT_SUPPORTED_VERSIONS:
+    read_u16_list(data, len, 1, hello -> versions, CLIENT_HELLO_MAX_VERSIONS, & hello -> version_count, hello);
+    break;
+  case TLS_EXT_SUPPORTED_GROUPS:
+    read_u16_list(data, len, 2, hello -> groups, CLIENT_HELLO_MAX_GROUPS, & hello -> group_count, hello);
+    break;
+  case TLS_EXT_SIGNATURE_ALGORITHMS:
+    read_u16_list(data, len, 2, hello -> signature_algorithms, CLIENT_HELLO_MAX_SIGNATURE_ALGORITHMS,
+      & hello -> signature_algorithm_count, hello);
+    break;
+  case TLS_EXT_EC_POINT_FORMATS:
+    if (len >= 1) {
+      int count = data[0] < len - 1 ? data[0] : len - 1;
+      for (int i = 0; i < count; i++) {
+        if (hello -> point_format_count == CLIENT_HELLO_MAX_POINT_FORMATS) {
+          hello -> truncated = 1;
+          break;
+        }
+        hello -> point_formats[hello -> point_format_count++] = data[1 + i];
+      }
+    }
+    break;
+  }
+}
+
+/* Append the non-GREASE values of a list, separated by sep, as decimal or 4-digit hex */
+static size_t append_list(char * text, size_t used, const unsigned short * values, int count,
+  char sep, int as_hex) {
+  int first = 1;
+  for (int i = 0; i < count && used < FINGERPRINT_TEXT - 8; i++) {
+    if (is_grease(values[i])) {
+      continue;
+    }
+    if (!first) {
+      text[used++] = sep;
+    }
+    used += snprintf(text + used, FINGERPRINT_TEXT - used, as_hex ? "%04x" : "%u", values[i]);
+    first = 0;
+  }
+  text[used] = '\0';
+  return used;
+}
+
+static int compare_u16(const void * a, const void * b) {
+  return (int) * (const unsigned short * ) a - (int) * (const unsigned short * ) b;
+}
+
+/* Hash text with md and write the first hex_len hex digits of the digest to out */
+static void digest_hex(const EVP_MD * md, const char * text, size_t len, char * out, int hex_len) {
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_len = 0;
+
+  out[0] = '\0';
+  if (EVP_Digest(text, len, digest, & digest_len, md, NULL) != 1) {
+    return; // Digest unavailable, e.g. MD5 under a FIPS provider
+  }
+  for (int i = 0; i < hex_len / 2 && i < (int) digest_len; i++) {
+    snprintf(out + i * 2, 3, "%02x", digest[i]);
+  }
+}
+
+/* JA4 two-character version code of the highest offered version */
+static const char * ja4_version(const client_hello_info_t * hello) {
+  int version = 0;
+  for (int i = 0; i < hello -> version_count; i++) {
+    if (!is_grease(hello -> versions[i]) && hello -> versions[i] > version) {
+      version = hello -> versions[i];
+    }
+  }
+  if (version == 0) {
+    version = hello -> legacy_version;
+  }
+  switch (version) {
+  case 0x0304:
+    return "13";
+  case 0x0303:
+    return "12";
+  case 0x0302:
+    return "11";
+  case 0x0301:
+    return "10";
+  case 0x0300:
+    return "s3";
+  case 0x0200:
+    return "s2";
+  }
+  return "00";
+}
+
+static void compute_fingerprints(client_hello_info_t * hello, const char ja4_alpn[2]) {
+  char text[FINGERPRINT_TEXT];
+  unsigned short sorted[CLIENT_HELLO_MAX_CIPHERS];
+  size_t used;
+  int ciphers = 0;
+  int extensions = 0;
+
+  // JA3
+  used = snprintf(text, sizeof(text), "%d,", hello -> legacy_version);
+  used = append_list(text, used, hello -> ciphers, hello -> cipher_count, '-', 0);
+  text[used++] = ',';
+  used = append_list(text, used, hello -> extensions, hello -> extension_count, '-', 0);
+  text[used++] = ',';
+  used = append_list(text, used, hello -> groups, hello -> group_count, '-', 0);
+  text[used++] = ',';
+  for (int i = 0; i < hello -> point_format_count; i++) {
+    used += snprintf(text + used, sizeof(text) - used, i ? "-%u" : "%u", hello -> point_formats[i]);
+  }
+  digest_hex(EVP_md5(), text, used, hello -> ja3, 32);
+
+  // JA4 counts
+  for (int i = 0; i < hello -> cipher_count; i++) {
+    if (!is_grease(hello -> ciphers[i])) {
+      sorted[ciphers++] = hello -> ciphers[i];
+    }
+  }
+  for (int i = 0; i < hello -> extension_count; i++) {
+    if (!is_grease(hello -> extensions[i])) {
+      extensions++;
+    }
+  }
+  int length = snprintf(hello -> ja4, sizeof(hello -> ja4), "t%s%c%02d%02d%c%c_", ja4_version(hello),
+    hello -> sni[0] ? 'd' : 'i', ciphers > 99 ? 99 : ciphers, extensions > 99 ? 99 : extensions,
+    ja4_alpn[0], ja4_alpn[1]);
+
+  // JA4 cipher hash
+  qsort(sorted, ciphers, sizeof(sorted[0]), compare_u16);
+  if (ciphers > 0) {
+    used = append_list(text, 0, sorted, ciphers, ',', 1);
+    digest_hex(EVP_sha256(), text, used, hello -> ja4 + length, JA4_HASH_LEN);
+  } else {
+    memset(hello -> ja4 + length, '0', JA4_HASH_LEN);
+  }
+  length += JA4_HASH_LEN;
+  hello -> ja4[length++] = '_';
+
+  // JA4 extension hash: sorted extensions without SNI and ALPN, then the signature algorithms as sent
+  extensions = 0;
+  for (int i = 0; i < hello -> extension_count; i++) {
+    int type = hello -> extensions[i];
+    if (type != TLS_EXT_SERVER_NAME && type != TLS_EXT_ALPN) {
+      sorted[extensions++] = (unsigned short) type;
+    }
+  }
+  qsort(sorted, extensions, sizeof(sorted[0]), compare_u16);
+  used = append_list(text, 0, sorted, extensions, ',', 1);
+  if (used > 0) {
+    if (hello -> signature_algorithm_count > 0) {
+      text[used++] = '_';
+      used = append_list(text, used, hello -> signature_algorithms, hello -> signature_algorithm_count, ',', 1);
+    }
+    digest_hex(EVP_sha256(), text, used, hello -> ja4 + length, JA4_HASH_LEN);
+  } else {
+    memset(hello -> ja4 + length, '0', JA4_HASH_LEN);
+  }
+  hello -> ja4[length + JA4_HASH_LEN] = '\0';
+}
+
+/*
+ * Parse the ClientHello at the start of data, len bytes peeked from the
+ * client. Returns CLIENT_HELLO_OK with the fingerprints filled in,
+ * CLIENT_HELLO_INCOMPLETE while the record is still arriving (hello holds
+ * whatever was already seen, without fingerprints), or
+ * CLIENT_HELLO_INVALID.
+ */
+int client_hello_parse(const unsigned char * data, int len, client_hello_info_t * hello) {
+  hello_cursor_t c = {
+    data,
+    data + len,
+    0
+  };
+  const unsigned char * header;
+  const unsigned char * list;
+  char ja4_alpn[2] = {
+    '0',
+    '0'
+  };
+  int record_len;
+  int type;
+  int body_len;
+  int body_complete = 0;
+  int n;
+
+  memset(hello, 0, sizeof( * hello));
+  if (!take( & c, CLIENT_HELLO_RECORD_HEADER, & header)) {
+    return (len > 0 && data[0] != TLS_CONTENT_HANDSHAKE) ? CLIENT_HELLO_INVALID : CLIENT_HELLO_INCOMPLETE;
+  }
+  record_len = (header[3] << 8) | header[4];
+  if (header[0] != TLS_CONTENT_HANDSHAKE || header[1] != 0x03 ||
+    record_len == 0 || record_len > CLIENT_HELLO_MAX_RECORD) {
+    return CLIENT_HELLO_INVALID;
+  }
+  int record_complete = len - CLIENT_HELLO_RECORD_HEADER >= record_len;
+  if (record_complete) {
+    c.end = c.p + record_len;
+  }
+
+  if (!take_int( & c, 1, & type) || !take_int( & c, 3, & body_len)) {
+    goto short_read;
+  }
+  if (type != TLS_HANDSHAKE_CLIENT_HELLO) {
+    return CLIENT_HELLO_INVALID;
+  }
+  if (body_len > c.end - c.p) {
+    if (record_complete) {
+      hello -> truncated = 1; // Continues in the next record
+    }
+  } else {
+    c.end = c.p + body_len;
+    body_complete = 1;
+  }
+
+  // client_version, random, session_id, cipher_suites, compression_methods
+  if (!take_int( & c, 2, & hello -> legacy_version) || !take( & c, 32, NULL) ||
+    !take_int( & c, 1, & n) || !take( & c, n, NULL) ||
+    !take_int( & c, 2, & n) || !take( & c, n, & list)) {
+    goto short_read;
+  }
+  for (int i = 0; i + 1 < n; i += 2) {
+    if (hello -> cipher_count == CLIENT_HELLO_MAX_CIPHERS) {
+      hello -> truncated = 1;
+      break;
+    }
+    hello -> ciphers[hello -> cipher_count++] = (unsigned short)((list[i] << 8) | list[i + 1]);
+  }
+  if (!take_int( & c, 1, & n) || !take( & c, n, NULL)) {
+    goto short_read;
+  }
+
+  if (c.p < c.end) {
+    int extensions_len;
+    if (!take_int( & c, 2, & extensions_len)) {
+      goto short_read;
+    }
+    if (extensions_len < c.end - c.p) {
+      c.end = c.p + extensions_len;
+    }
+    while (c.p < c.end) {
+      int ext_type;
+      int ext_len;
+      const unsigned char * ext;
+
+      if (!take_int( & c, 2, & ext_type) || !take_int( & c, 2, & ext_len) || !take( & c, ext_len, & ext)) {
+        goto short_read;
+      }
+      if (hello -> extension_count < CLIENT_HELLO_MAX_EXTENSIONS) {
+        hello -> extensions[hello -> extension_count++] = (unsigned short) ext_type;
+      } else {
+        hello -> truncated = 1;
+      }
+      parse_extension(ext_type, ext, ext_len, hello, ja4_alpn);
+    }
+  }
+  if (!body_complete && !record_complete) {
+    return CLIENT_HELLO_INCOMPLETE; // Data ended between two fields, more are on the way
+  }
+  compute_fingerprints(hello, ja4_alpn);
+  return CLIENT_HELLO_OK;
+
+  short_read:
+    if (!record_complete) {
+      return CLIENT_HELLO_INCOMPLETE;
+    }
+  if (!hello -> truncated) {
+    return CLIENT_HELLO_INVALID;
+  }
+  compute_fingerprints(hello, ja4_alpn);
+  return CLIENT_HELLO_OK;
+}
@@ -0,0 +1,602 @@
+/*
+ * TLS MITM Proxy - Data Formatting Kernels Implementation
+ *
+ * Each kernel handles 16 (NEON, SSE2) or 32 (AVX2) bytes per step and
+ * leaves the tail to the scalar code. The hex dump layout is 48 characters
+ * per 16 input bytes plus a line break between groups, which lines up with
+ * one vector of input per output line.
+ *
+ * The byte set scan tests up to four bytes with plain compares. Larger
+ * sets use two 16-entry nibble tables looked up with a byte shuffle; the
+ * tables can let through bytes outside the set, so each hit is confirmed
+ * against the exact membership table. SSE2 has no byte shuffle and its
+ * compares measured slower than the scalar loop, so the SSE2 kernel scans
+ * byte sets with the scalar code.
+ */
+
+#include "../include/data_kernels.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define DATA_KERNELS_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define DATA_KERNELS_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* Compile a single function for an instruction set beyond the build baseline */
+#if defined(__GNUC__) || defined(__clang__)
+#define KERNEL_TARGET(isa) __attribute__((target(isa)))
+#else
+#define KERNEL_TARGET(isa)
+#endif
+
+typedef struct {
+  data_kernel_t kind;
+  const char * name;
+  int( * is_text)(const unsigned char * data, size_t len);
+  size_t( * hex_dump)(const unsigned char * data, size_t len, char * out);
+  size_t( * find_byteset)(const unsigned char * data, size_t len, const data_byteset_t * set);
+} data_kernel_ops_t;
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/*
+ * Scalar kernels
+ */
+static int is_text_byte(unsigned char c) {
+  return c == 0 || (c >= 32 && c <= 126) || c == '\r' || c == '\n' || c == '\t';
+}
+
+static int is_text_scalar(const unsigned char * data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    if (!is_text_byte(data[i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Encode up to 16 bytes of one line */
+static char * hex_line_scalar(const unsigned char * data, size_t n, char * out) {
+  for (size_t i = 0; i < n; i++) {
+    * out++ = hex_digits[data[i] >> 4];
+    * out++ = hex_digits[data[i] & 0x0f];
+    * out++ = ' ';
+  }
+  return out;
+}
+
+static size_t hex_dump_scalar(const unsigned char * data, size_t len, char * out) {
+  char * p = out;
+  for (size_t i = 0; i < len; i += 16) {
+    if (i > 0) {
+      * p++ = '\n';
+    }
+    p = hex_line_scalar(data + i, len - i < 16 ? len - i : 16, p);
+  }
+  return (size_t)(p - out);
+}
+
+static size_t find_byteset_scalar(const unsigned char * data, size_t len, const data_byteset_t * set) {
+  for (size_t i = 0; i < len; i++) {
+    if (set -> member[data[i]]) {
+      return i;
+    }
+  }
+  return len;
+}
+
+#ifdef DATA_KERNELS_X86
+static int lowest_bit(unsigned int mask) {
+  #if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctz(mask);
+  #elif defined(_MSC_VER)
+  unsigned long index;
+  _BitScanForward( & index, mask);
+  return (int) index;
+  #else
+  int bit = 0;
+  while (!(mask & 1)) {
+    mask >>= 1;
+    bit++;
+  }
+  return bit;
+  #endif
+}
+
+/* First position in a vector hit mask that really is in the set, -1 if none */
+static int first_member(const unsigned char * block, unsigned int mask, const data_byteset_t * set) {
+  while (mask) {
+    int bit = lowest_bit(mask);
+    if (set -> member[block[bit]]) {
+      return bit;
+    }
+    mask &= mask - 1;
+  }
+  return -1;
+}
+
+/*
+ * SSE2 kernels (always available on x86-64)
+ */
+static int is_text_sse2(const unsigned char * data, size_t len) {
+  const __m128i space = _mm_set1_epi8(32);
+  const __m128i del = _mm_set1_epi8(127);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i lf = _mm_set1_epi8('\n');
+  const __m128i cr = _mm_set1_epi8('\r');
+  size_t i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i * )(data + i));
+    // Signed compare: bytes >= 0x80 count as below 32 as well
+    __m128i low = _mm_cmplt_epi8(v, space);
+    __m128i allowed = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, zero), _mm_cmpeq_epi8(v, tab)),
+      _mm_or_si128(_mm_cmpeq_epi8(v, lf), _mm_cmpeq_epi8(v, cr)));
+    __m128i bad = _mm_or_si128(_mm_andnot_si128(allowed, low), _mm_cmpeq_epi8(v, del));
+    if (_mm_movemask_epi8(bad)) {
+      return 0;
+    }
+  }
+  return is_text_scalar(data + i, len - i);
+}
+
+/* Nibbles (0-15) to lowercase hex digits */
+static __m128i hex_digits_sse2(__m128i nibbles) {
+  __m128i letters = _mm_and_si128(_mm_cmpgt_epi8(nibbles, _mm_set1_epi8(9)), _mm_set1_epi8('a' - '0' - 10));
+  return _mm_add_epi8(_mm_add_epi8(nibbles, _mm_set1_epi8('0')), letters);
+}
+
+/*
+ * Pack four "xx  " groups (a digit pair and two spaces per 32-bit lane)
+ * into twelve bytes of "xx " at the bottom of the vector. SSE2 has no byte
+ * shuffle, so each 64-bit lane drops its fourth byte with a shift, then
+ * the upper lane moves down next to the lower one. The top four bytes are
+ * left zero.
+ */
+static __m128i hex_triples_sse2(__m128i groups) {
+  const __m128i keep_first = _mm_set1_epi64x(0x0000000000ffffffLL);
+  const __m128i keep_second = _mm_set1_epi64x(0x0000ffffff000000LL);
+  const __m128i lower_lane = _mm_setr_epi32(-1, 0x0000ffff, 0, 0);
+  const __m128i upper_lane = _mm_setr_epi32(0, (int) 0xffff0000u, -1, 0);
+  __m128i lanes = _mm_or_si128(_mm_and_si128(groups, keep_first),
+    _mm_and_si128(_mm_srli_epi64(groups, 8), keep_second));
+
+  return _mm_or_si128(_mm_and_si128(lanes, lower_lane), _mm_and_si128(_mm_srli_si128(lanes, 2), upper_lane));
+}
+
+static size_t hex_dump_sse2(const unsigned char * data, size_t len, char * out) {
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  const __m128i spaces = _mm_set1_epi8(' ');
+  char * p = out;
+  size_t i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i * )(data + i));
+    __m128i hi = hex_digits_sse2(_mm_and_si128(_mm_srli_epi16(v, 4), mask));
+    __m128i lo = hex_digits_sse2(_mm_and_si128(v, mask));
+    __m128i pairs_lo = _mm_unpacklo_epi8(hi, lo);
+    __m128i pairs_hi = _mm_unpackhi_epi8(hi, lo);
+    char last[16];
+
+    if (i > 0) {
+      * p++ = '\n';
+    }
+    // Each store writes four bytes past its twelve; the next store, or the
+    // line break and next line, overwrite them. The last line must not.
+    _mm_storeu_si128((__m128i * ) p, hex_triples_sse2(_mm_unpacklo_epi16(pairs_lo, spaces)));
+    _mm_storeu_si128((__m128i * )(p + 12), hex_triples_sse2(_mm_unpackhi_epi16(pairs_lo, spaces)));
+    _mm_storeu_si128((__m128i * )(p + 24), hex_triples_sse2(_mm_unpacklo_epi16(pairs_hi, spaces)));
+    if (i + 16 < len) {
+      _mm_storeu_si128((__m128i * )(p + 36), hex_triples_sse2(_mm_unpackhi_epi16(pairs_hi, spaces)));
+    } else {
+      _mm_storeu_si128((__m128i * ) last, hex_triples_sse2(_mm_unpackhi_epi16(pairs_hi, spaces)));
+      memcpy(p + 36, last, 12);
+    }
+    p += 48;
+  }
+
+  if (i < len) {
+    if (i > 0) {
+      * p++ = '\n';
+    }
+    p += hex_dump_scalar(data + i, len - i, p);
+  }
+  return (size_t)(p - out);
+}
+
+/*
+ * AVX2 kernels
+ */
+KERNEL_TARGET("avx2")
+static int is_text_avx2(const unsigned char * data, size_t len) {
+  const __m256i space = _mm256_set1_epi8(32);
+  const __m256i del = _mm256_set1_epi8(127);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i tab = _mm256_set1_epi8('\t');
+  const __m256i lf = _mm256_set1_epi8('\n');
+  const __m256i cr = _mm256_set1_epi8('\r');
+  size_t i = 0;
+
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i * )(data + i));
+    __m256i low = _mm256_cmpgt_epi8(space, v);
+    __m256i allowed = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, zero), _mm256_cmpeq_epi8(v, tab)),
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, lf), _mm256_cmpeq_epi8(v, cr)));
+    __m256i bad = _mm256_or_si256(_mm256_andnot_si256(allowed, low), _mm256_cmpeq_epi8(v, del));
+    if (_mm256_movemask_epi8(bad)) {
+      return 0;
+    }
+  }
+  return is_text_sse2(data + i, len - i);
+}
+
+/*
+ * Spread 16 digit pairs (a: bytes 0-7, b: bytes 8-15) into the 48
+ * character "xx xx ..." layout with three byte shuffles.
+ */
+KERNEL_TARGET("avx2")
+static void hex_line_store_avx2(__m128i a, __m128i b, char * out) {
+  const __m128i shuffle0 = _mm_setr_epi8(0, 1, -1, 2, 3, -1, 4, 5, -1, 6, 7, -1, 8, 9, -1, 10);
+  const __m128i shuffle1a = _mm_setr_epi8(11, -1, 12, 13, -1, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i shuffle1b = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 0, 1, -1, 2, 3, -1, 4, 5);
+  const __m128i shuffle2 = _mm_setr_epi8(-1, 6, 7, -1, 8, 9, -1, 10, 11, -1, 12, 13, -1, 14, 15, -1);
+  const __m128i spaces0 = _mm_setr_epi8(0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0);
+  const __m128i spaces1 = _mm_setr_epi8(0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0);
+  const __m128i spaces2 = _mm_setr_epi8(' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ', 0, 0, ' ');
+
+  _mm_storeu_si128((__m128i * ) out, _mm_or_si128(_mm_shuffle_epi8(a, shuffle0), spaces0));
+  _mm_storeu_si128((__m128i * )(out + 16), _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, shuffle1a),
+    _mm_shuffle_epi8(b, shuffle1b)), spaces1));
+  _mm_storeu_si128((__m128i * )(out + 32), _mm_or_si128(_mm_shuffle_epi8(b, shuffle2), spaces2));
+}
+
+KERNEL_TARGET("avx2")
+static size_t hex_dump_avx2(const unsigned char * data, size_t len, char * out) {
+  const __m256i mask = _mm256_set1_epi8(0x0f);
+  const __m256i lut = _mm256_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f',
+    '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+  char * p = out;
+  size_t i = 0;
+
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i * )(data + i));
+    __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+    __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, mask));
+    // Unpacks work within each 128-bit lane: lane 0 holds bytes 0-15, lane 1 bytes 16-31
+    __m256i pairs_lo = _mm256_unpacklo_epi8(hi, lo);
+    __m256i pairs_hi = _mm256_unpackhi_epi8(hi, lo);
+
+    if (i > 0) {
+      * p++ = '\n';
+    }
+    hex_line_store_avx2(_mm256_castsi256_si128(pairs_lo), _mm256_castsi256_si128(pairs_hi), p);
+    p += 48;
+    * p++ = '\n';
+    hex_line_store_avx2(_mm256_extracti128_si256(pairs_lo, 1), _mm256_extracti128_si256(pairs_hi, 1), p);
+    p += 48;
+  }
+
+  if (i < len) {
+    if (i > 0) {
+      * p++ = '\n';
+    }
+    p += hex_dump_sse2(data + i, len - i, p);
+  }
+  return (size_t)(p - out);
+}
+
+KERNEL_TARGET("avx2")
+static size_t find_byteset_avx2(const unsigned char * data, size_t len, const data_byteset_t * set) {
+  size_t i = 0;
+
+  if (set -> count == 0) {
+    return len;
+  }
+  if (set -> count <= 4) {
+    const __m256i b0 = _mm256_set1_epi8((char) set -> few[0]);
+    const __m256i b1 = _mm256_set1_epi8((char) set -> few[1]);
+    const __m256i b2 = _mm256_set1_epi8((char) set -> few[2]);
+    const __m256i b3 = _mm256_set1_epi8((char) set -> few[3]);
+
+    for (; i + 32 <= len; i += 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i * )(data + i));
+      __m256i eq = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, b0), _mm256_cmpeq_epi8(v, b1)),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, b2), _mm256_cmpeq_epi8(v, b3)));
+      unsigned int mask = (unsigned int) _mm256_movemask_epi8(eq);
+      if (mask) {
+        return i + lowest_bit(mask);
+      }
+    }
+  } else {
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i lo_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i * ) set -> lo_mask));
+    const __m256i hi_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i * ) set -> hi_mask));
+
+    for (; i + 32 <= len; i += 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i * )(data + i));
+      __m256i lo = _mm256_shuffle_epi8(lo_table, _mm256_and_si256(v, nibble));
+      __m256i hi = _mm256_shuffle_epi8(hi_table, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+      unsigned int mask = ~(unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), zero));
+      if (mask) {
+        int hit = first_member(data + i, mask, set);
+        if (hit >= 0) {
+          return i + hit;
+        }
+      }
+    }
+  }
+  return i + find_byteset_scalar(data + i, len - i, set);
+}
+
+static int cpu_has_avx2(void) {
+  #if defined(__GNUC__) || defined(__clang__)
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+  #elif defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7) {
+    return 0;
+  }
+  __cpuid(info, 1);
+  if (!(info[2] & (1 << 27))) {
+    return 0; // No OSXSAVE, the OS does not save YMM state
+  }
+  if ((_xgetbv(0) & 0x6) != 0x6) {
+    return 0;
+  }
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+  #else
+  return 0;
+  #endif
+}
+#endif /* DATA_KERNELS_X86 */
+
+#ifdef DATA_KERNELS_NEON
+/*
+ * NEON kernels (always available on arm64)
+ */
+static int is_text_neon(const unsigned char * data, size_t len) {
+  const uint8x16_t space = vdupq_n_u8(32);
+  const uint8x16_t del = vdupq_n_u8(127);
+  size_t i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    uint8x16_t v = vld1q_u8(data + i);
+    uint8x16_t allowed = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8(0)), vceqq_u8(v, vdupq_n_u8('\t'))),
+      vorrq_u8(vceqq_u8(v, vdupq_n_u8('\n')), vceqq_u8(v, vdupq_n_u8('\r'))));
+    uint8x16_t bad = vorrq_u8(vbicq_u8(vcltq_u8(v, space), allowed), vcgeq_u8(v, del));
+    if (vmaxvq_u8(bad)) {
+      return 0;
+    }
+  }
+  return is_text_scalar(data + i, len - i);
+}
+
+static size_t hex_dump_neon(const unsigned char * data, size_t len, char * out) {
+  const uint8x16_t lut = vld1q_u8((const uint8_t * ) hex_digits);
+  const uint8x16_t mask = vdupq_n_u8(0x0f);
+  char * p = out;
+  size_t i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    uint8x16_t v = vld1q_u8(data + i);
+    uint8x16x3_t line;
+
+    // Interleaving store writes hi digit, lo digit, space for each byte
+    line.val[0] = vqtbl1q_u8(lut, vshrq_n_u8(v, 4));
+    line.val[1] = vqtbl1q_u8(lut, vandq_u8(v, mask));
+    line.val[2] = vdupq_n_u8(' ');
+    if (i > 0) {
+      * p++ = '\n';
+    }
+    vst3q_u8((uint8_t * ) p, line);
+    p += 48;
+  }
+
+  if (i < len) {
+    if (i > 0) {
+      * p++ = '\n';
+    }
+    p += hex_dump_scalar(data + i, len - i, p);
+  }
+  return (size_t)(p - out);
+}
+
+static int lowest_bit64(unsigned long long mask) {
+  #if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctzll(mask);
+  #else
+  unsigned long index;
+  _BitScanForward64( & index, mask);
+  return (int) index;
+  #endif
+}
+
+static size_t find_byteset_neon(const unsigned char * data, size_t len, const data_byteset_t * set) {
+  const uint8x16_t nibble = vdupq_n_u8(0x0f);
+  const uint8x16_t lo_table = vld1q_u8(set -> lo_mask);
+  const uint8x16_t hi_table = vld1q_u8(set -> hi_mask);
+  size_t i = 0;
+
+  if (set -> count == 0) {
+    return len;
+  }
+  for (; i + 16 <= len; i += 16) {
+    uint8x16_t v = vld1q_u8(data + i);
+    uint8x16_t m = vandq_u8(vqtbl1q_u8(lo_table, vandq_u8(v, nibble)), vqtbl1q_u8(hi_table, vshrq_n_u8(v, 4)));
+    // Narrow the 0x00/0xff lanes to 4 bits each to get a scalar hit mask
+    uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(vtstq_u8(m, m)), 4);
+    unsigned long long mask = vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+    while (mask) {
+      int bit = lowest_bit64(mask) >> 2;
+      if (set -> member[data[i + bit]]) {
+        return i + bit;
+      }
+      mask &= ~(0xfULL << (bit * 4));
+    }
+  }
+  return i + find_byteset_scalar(data + i, len - i, set);
+}
+#endif /* DATA_KERNELS_NEON */
+
+static const data_kernel_ops_t g_kernels[] = {
+  {
+    DATA_KERNEL_SCALAR,
+    "scalar",
+    is_text_scalar,
+    hex_dump_scalar,
+    find_byteset_scalar
+  },
+  #ifdef DATA_KERNELS_X86
+  {
+    DATA_KERNEL_SSE2,
+    "sse2",
+    is_text_sse2,
+    hex_dump_sse2,
+    find_byteset_scalar
+  },
+  {
+    DATA_KERNEL_AVX2,
+    "avx2",
+    is_text_avx2,
+    hex_dump_avx2,
+    find_byteset_avx2
+  },
+  #endif
+  #ifdef DATA_KERNELS_NEON
+  {
+    DATA_KERNEL_NEON,
+    "neon",
+    is_text_neon,
+    hex_dump_neon,
+    find_byteset_neon
+  },
+  #endif
+};
+
+static const data_kernel_ops_t * g_data_kernel = NULL;
+
+static int data_kernel_supported(data_kernel_t kernel) {
+  switch (kernel) {
+  case DATA_KERNEL_SCALAR:
+    return 1;
+    #ifdef DATA_KERNELS_X86
+  case DATA_KERNEL_SSE2:
+    return 1;
+  case DATA_KERNEL_AVX2:
+    return cpu_has_avx2();
+    #endif
+    #ifdef DATA_KERNELS_NEON
+  case DATA_KERNEL_NEON:
+    return 1;
+    #endif
+  default:
+    return 0;
+  }
+}
+
+/*
+ * Select the kernel used by data_is_text(), hex_dump_encode() and
+ * data_find_byteset().
+ * DATA_KERNEL_AUTO picks the fastest one this CPU supports. Returns 0 if
+ * the requested kernel is not available here.
+ */
+int select_data_kernel(data_kernel_t kernel) {
+  size_t count = sizeof(g_kernels) / sizeof(g_kernels[0]);
+
+  if (kernel == DATA_KERNEL_AUTO) {
+    // Later entries are faster
+    for (size_t i = count; i-- > 0;) {
+      if (data_kernel_supported(g_kernels[i].kind)) {
+        g_data_kernel = & g_kernels[i];
+        return 1;
+      }
+    }
+    return 0;
+  }
+
+  if (!data_kernel_supported(kernel)) {
+    return 0;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (g_kernels[i].kind == kernel) {
+      g_data_kernel = & g_kernels[i];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static const data_kernel_ops_t * current_kernel(void) {
+  if (!g_data_kernel) {
+    select_data_kernel(DATA_KERNEL_AUTO);
+  }
+  return g_data_kernel;
+}
+
+const char * data_kernel_name(void) {
+  return current_kernel() -> name;
+}
+
+int data_is_text(const unsigned char * data, size_t len) {
+  return current_kernel() -> is_text(data, len);
+}
+
+size_t hex_dump_encode(const unsigned char * data, size_t len, char * out) {
+  return current_kernel() -> hex_dump(data, len, out);
+}
+
+size_t hex_dump_length(size_t len) {
+  return len > 0 ? len * 3 + (len - 1) / 16 : 0;
+}
+
+void data_byteset_init(data_byteset_t * set, const unsigned char * bytes, size_t count) {
+  int buckets = 0;
+
+  memset(set, 0, sizeof( * set));
+  for (size_t i = 0; i < count; i++) {
+    set -> member[bytes[i]] = 1;
+  }
+
+  for (int b = 0; b < 256; b++) {
+    if (set -> member[b]) {
+      if (set -> count < 4) {
+        set -> few[set -> count] = (unsigned char) b;
+      }
+      set -> count++;
+    }
+  }
+  for (int k = set -> count; k < 4 && set -> count > 0; k++) {
+    set -> few[k] = set -> few[0];
+  }
+
+  // One bucket bit per high nibble in use; past eight of them nibbles share
+  // a bit and the tables admit extra bytes, which member[] filters out
+  for (int hi = 0; hi < 16; hi++) {
+    unsigned char bit = 0;
+    for (int lo = 0; lo < 16; lo++) {
+      if (set -> member[hi * 16 + lo]) {
+        if (!bit) {
+          bit = (unsigned char)(1 << (buckets++ % 8));
+          set -> hi_mask[hi] = bit;
+        }
+        set -> lo_mask[lo] |= bit;
+      }
+    }
+  }
+}
+
+size_t data_find_byteset(const unsigned char * data, size_t len, const data_byteset_t * set) {
+  return current_kernel() -> find_byteset(data, len, set);
+}
@@ -0,0 +1,398 @@
+/*
+ * TLS MITM Proxy - DNS Cache Implementation
+ *
+ * Answers live in a fixed array searched linearly, like the upstream
+ * session cache, and the least recently used one makes room when it is
+ * full. Names being resolved are kept apart in a list of reference-counted
+ * lookups: the first connection to miss a name creates its lookup and
+ * resolves it, later ones take a reference and wait on the lookup's event,
+ * or, from the event loop, register a waiter that is notified when it is
+ * done.
+ * Names are lowercased first, so differently cased spellings of a host
+ * share one entry.
+ *
+ * getaddrinfo() does not report record TTLs, so answers are kept for
+ * config.dns_cache_ttl seconds and failures for config.dns_negative_ttl.
+ */
+
+#include "../include/dns_cache.h"
+
+#include <ctype.h>
+
+#define DNS_LOOKUP_WAIT_MS 60000    // Longest a connection waits on a lookup another one started
+
+typedef struct {
+  char host[MAX_HOSTNAME_LEN];
+  struct in_addr addr;
+  int error;                        // getaddrinfo() error of a cached failure, 0 for an address
+  unsigned long long expires;       // Monotonic microseconds
+  unsigned long long last_used;
+} dns_entry_t;
+
+struct dns_lookup {
+  char host[MAX_HOSTNAME_LEN];
+  struct in_addr addr;
+  int error;
+  int done;
+  event_t event;                    // Set once the result is in
+  work_waiter_t * waiters;          // Notified once the result is in
+  int refs;                         // Owner and waiters
+  struct dns_lookup * next;
+};
+
+static struct {
+  mutex_t cs;
+  int initialized;
+  dns_entry_t entries[DNS_CACHE_CAPACITY];
+  int count;
+  dns_lookup_t * lookups;           // Names being resolved
+  work_queue_t * resolvers;         // Runs the lookups of dns_cache_start()
+  dns_cache_stats_t stats;
+} g_dns;
+
+static unsigned long long monotonic_us(void) {
+  #ifdef INTERCEPT_WINDOWS
+  LARGE_INTEGER counter, frequency;
+  QueryPerformanceFrequency( & frequency);
+  QueryPerformanceCounter( & counter);
+  return (unsigned long long)(counter.QuadPart / frequency.QuadPart) * 1000000 +
+    (unsigned long long)(counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+  #else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, & ts);
+  return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  #endif
+}
+
+/* Host names are case-insensitive, so the cache is keyed by the lowercase name */
+static void dns_cache_key(const char * host, char * key_name) {
+  size_t i;
+  for (i = 0; host[i] && i < MAX_HOSTNAME_LEN - 1; i++) {
+    key_name[i] = (char) tolower((unsigned char) host[i]);
+  }
+  key_name[i] = '\0';
+}
+
+static dns_entry_t * dns_find(const char * host) {
+  for (int i = 0; i < g_dns.count; i++) {
+    if (strcmp(g_dns.entries[i].host, host) == 0) {
+      return & g_dns.entries[i];
+    }
+  }
+  return NULL;
+}
+
+static void dns_remove(dns_entry_t * entry) {
+  * entry = g_dns.entries[--g_dns.count];
+  memset( & g_dns.entries[g_dns.count], 0, sizeof(dns_entry_t));
+}
+
+/* Cache a resolver answer; a TTL of 0 for its kind only drops the old one */
+static void dns_store(const char * host, const struct in_addr * addr, int error, unsigned long long now) {
+  int ttl = error ? config.dns_negative_ttl : config.dns_cache_ttl;
+  dns_entry_t * entry = dns_find(host);
+
+  if (ttl <= 0) {
+    if (entry) {
+      dns_remove(entry);
+    }
+    return;
+  }
+
+  if (!entry) {
+    if (g_dns.count >= DNS_CACHE_CAPACITY) {
+      // Evict an expired answer, or else the least recently used one
+      dns_entry_t * victim = & g_dns.entries[0];
+      for (int i = 0; i < g_dns.count; i++) {
+        if (g_dns.entries[i].expires <= now) {
+          victim = & g_dns.entries[i];
+          break;
+        }
+        if (g_dns.entries[i].last_used < victim -> last_used) {
+          victim = & g_dns.entries[i];
+        }
+      }
+      dns_remove(victim);
+    }
+    entry = & g_dns.entries[g_dns.count++];
+    strncpy(entry -> host, host, sizeof(entry -> host) - 1);
+  }
+  entry -> addr = * addr;
+  entry -> error = error;
+  entry -> expires = now + (unsigned long long) ttl * 1000000;
+  entry -> last_used = now;
+}
+
+static int dns_system_resolve(const char * host, struct in_addr * addr) {
+  struct addrinfo hints;
+  struct addrinfo * result = NULL;
+
+  memset( & hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+
+  int error = getaddrinfo(host, NULL, & hints, & result);
+  if (error == 0 && !result) {
+    error = EAI_NONAME;
+  }
+  if (error == 0) {
+    * addr = ((struct sockaddr_in * ) result -> ai_addr) -> sin_addr;
+  }
+  if (result) {
+    freeaddrinfo(result);
+  }
+  return error;
+}
+
+/*
+ * Answer from the cache, or join or start the lookup of the name. Called
+ * with the lock held. Returns DNS_PENDING with a reference to the lookup in
+ * *lookup, with waiter added to its waiters; *owner is set if the caller
+ * created it and has to resolve it.
+ */
+static int dns_acquire(const char * host, struct in_addr * addr, int * error, dns_lookup_t ** lookup, int * owner,
+  work_waiter_t * waiter) {
+  unsigned long long now = monotonic_us();
+  dns_entry_t * entry = dns_find(host);
+
+  g_dns.stats.lookups++;
+  if (entry && entry -> expires > now) {
+    entry -> last_used = now;
+    * addr = entry -> addr;
+    * error = entry -> error;
+    if (entry -> error) {
+      g_dns.stats.negative_hits++;
+      return DNS_FAILED;
+    }
+    g_dns.stats.hits++;
+    return DNS_RESOLVED;
+  }
+
+  for (dns_lookup_t * pending = g_dns.lookups; pending; pending = pending -> next) {
+    if (strcmp(pending -> host, host) == 0) {
+      pending -> refs++;
+      work_waiter_add( & pending -> waiters, waiter);
+      g_dns.stats.shared++;
+      * lookup = pending;
+      * owner = 0;
+      return DNS_PENDING;
+    }
+  }
+
+  dns_lookup_t * created = (dns_lookup_t * ) calloc(1, sizeof(dns_lookup_t));
+  if (created) {
+    created -> event = CREATE_EVENT();
+  }
+  if (!created || !created -> event) {
+    free(created);
+    * error = EAI_MEMORY;
+    return DNS_FAILED;
+  }
+  strncpy(created -> host, host, sizeof(created -> host) - 1);
+  created -> refs = 1;
+  work_waiter_add( & created -> waiters, waiter);
+  created -> next = g_dns.lookups;
+  g_dns.lookups = created;
+  g_dns.stats.misses++;
+
+  * lookup = created;
+  * owner = 1;
+  return DNS_PENDING;
+}
+
+/* Resolve a lookup this thread owns, cache the answer and wake the waiters */
+static void dns_lookup_run(dns_lookup_t * lookup) {
+  struct in_addr addr;
+  memset( & addr, 0, sizeof(addr));
+
+  unsigned long long start = monotonic_us();
+  int error = dns_system_resolve(lookup -> host, & addr);
+  unsigned long long now = monotonic_us();
+  unsigned long long elapsed = now - start;
+
+  LOCK_MUTEX(g_dns.cs);
+  g_dns.stats.resolve_us_total += elapsed;
+  if (elapsed > g_dns.stats.resolve_us_max) {
+    g_dns.stats.resolve_us_max = elapsed;
+  }
+  if (error) {
+    g_dns.stats.failures++;
+  }
+  dns_store(lookup -> host, & addr, error, now);
+
+  dns_lookup_t ** link = & g_dns.lookups;
+  while ( * link && * link != lookup) {
+    link = & ( * link) -> next;
+  }
+  if ( * link) {
+    * link = lookup -> next;
+  }
+  lookup -> addr = addr;
+  lookup -> error = error;
+  lookup -> done = 1;
+  work_waiter_notify_all( & lookup -> waiters);
+  UNLOCK_MUTEX(g_dns.cs);
+
+  SET_EVENT(lookup -> event);
+
+  if (config.verbose) {
+    log_message("Resolved %s in %llu us: %s", lookup -> host, elapsed, error ? gai_strerror(error) : "ok");
+  }
+}
+
+/* Resolver pool job: run the lookup and drop the reference taken for it */
+static void dns_resolver_job(void * arg) {
+  dns_lookup_t * lookup = (dns_lookup_t * ) arg;
+
+  dns_lookup_run(lookup);
+  dns_lookup_release(lookup, NULL);
+}
+
+int init_dns_cache(void) {
+  if (g_dns.initialized) {
+    return 1;
+  }
+  memset( & g_dns, 0, sizeof(g_dns));
+  INIT_MUTEX(g_dns.cs);
+  // Without resolvers dns_cache_start() resolves inline
+  g_dns.resolvers = work_queue_create(DNS_RESOLVER_THREADS);
+  g_dns.initialized = 1;
+  return 1;
+}
+
+/*
+ * Resolve a host name to an IPv4 address, blocking until it is known.
+ * Returns DNS_RESOLVED, or DNS_FAILED with the getaddrinfo() error in
+ * *error. Address literals are returned as they are.
+ */
+int dns_cache_resolve(const char * host, struct in_addr * addr, int * error) {
+  dns_lookup_t * lookup = NULL;
+  char key_name[MAX_HOSTNAME_LEN];
+  int owner = 0;
+
+  * error = 0;
+  if (inet_pton(AF_INET, host, addr) == 1) {
+    return DNS_RESOLVED;
+  }
+
+  dns_cache_key(host, key_name);
+  LOCK_MUTEX(g_dns.cs);
+  int ret = dns_acquire(key_name, addr, error, & lookup, & owner, NULL);
+  UNLOCK_MUTEX(g_dns.cs);
+  if (ret != DNS_PENDING) {
+    return ret;
+  }
+
+  if (owner) {
+    dns_lookup_run(lookup);
+  } else {
+    WAIT_EVENT(lookup -> event, DNS_LOOKUP_WAIT_MS);
+  }
+  ret = dns_lookup_poll(lookup, addr, error);
+  if (ret == DNS_PENDING) {
+    * error = EAI_AGAIN;
+    ret = DNS_FAILED;
+  }
+  dns_lookup_release(lookup, NULL);
+  return ret;
+}
+
+/*
+ * Resolve a host name without blocking. Answers from the cache like
+ * dns_cache_resolve(); otherwise returns DNS_PENDING and a lookup queued
+ * on the resolver pool in *lookup, to be polled with dns_lookup_poll() and
+ * released with dns_lookup_release(). waiter, if not NULL, is notified
+ * from the resolving thread once the lookup is done.
+ */
+int dns_cache_start(const char * host, struct in_addr * addr, int * error, dns_lookup_t ** lookup,
+  work_waiter_t * waiter) {
+  char key_name[MAX_HOSTNAME_LEN];
+  int owner = 0;
+
+  * error = 0;
+  * lookup = NULL;
+  if (inet_pton(AF_INET, host, addr) == 1) {
+    return DNS_RESOLVED;
+  }
+
+  dns_cache_key(host, key_name);
+  LOCK_MUTEX(g_dns.cs);
+  int ret = dns_acquire(key_name, addr, error, lookup, & owner, waiter);
+  if (ret == DNS_PENDING && owner) {
+    ( * lookup) -> refs++; // The resolver job's reference
+  }
+  UNLOCK_MUTEX(g_dns.cs);
+
+  if (ret == DNS_PENDING && owner && !work_queue_submit(g_dns.resolvers, dns_resolver_job, * lookup)) {
+    // Not accepted or no resolvers: resolve on the caller's thread
+    dns_resolver_job( * lookup);
+  }
+  return ret;
+}
+
+/* Result of a lookup: DNS_PENDING until it is done, then as dns_cache_resolve() */
+int dns_lookup_poll(dns_lookup_t * lookup, struct in_addr * addr, int * error) {
+  int ret = DNS_PENDING;
+
+  LOCK_MUTEX(g_dns.cs);
+  if (lookup -> done) {
+    * addr = lookup -> addr;
+    * error = lookup -> error;
+    ret = lookup -> error ? DNS_FAILED : DNS_RESOLVED;
+  }
+  UNLOCK_MUTEX(g_dns.cs);
+  return ret;
+}
+
+/*
+ * Drop a reference to a lookup; the last one frees it. The waiter passed to
+ * dns_cache_start() is not notified once this returns.
+ */
+void dns_lookup_release(dns_lookup_t * lookup, work_waiter_t * waiter) {
+  if (!lookup) {
+    return;
+  }
+
+  LOCK_MUTEX(g_dns.cs);
+  work_waiter_remove( & lookup -> waiters, waiter);
+  int refs = --lookup -> refs;
+  UNLOCK_MUTEX(g_dns.cs);
+
+  if (refs == 0) {
+    CLOSE_EVENT(lookup -> event);
+    free(lookup);
+  }
+}
+
+void get_dns_cache_counters(dns_cache_stats_t * stats) {
+  memset(stats, 0, sizeof( * stats));
+  if (!g_dns.initialized) {
+    return;
+  }
+  LOCK_MUTEX(g_dns.cs);
+  * stats = g_dns.stats;
+  stats -> entries = g_dns.count;
+  stats -> capacity = DNS_CACHE_CAPACITY;
+  UNLOCK_MUTEX(g_dns.cs);
+}
+
+/* Drop all answers, once background lookups still running have finished */
+void cleanup_dns_cache(void) {
+  if (!g_dns.initialized) {
+    return;
+  }
+
+  // Running lookups finish first; queued ones are dropped, no connection waits on them any more
+  work_queue_destroy(g_dns.resolvers);
+  g_dns.resolvers = NULL;
+  while (g_dns.lookups) {
+    dns_lookup_t * next = g_dns.lookups -> next;
+    CLOSE_EVENT(g_dns.lookups -> event);
+    free(g_dns.lookups);
+    g_dns.lookups = next;
+  }
+
+  g_dns.count = 0;
+  DESTROY_MUTEX(g_dns.cs);
+  g_dns.initialized = 0;
+}
@@ -0,0 +1,1357 @@
+/*
+ * TLS MITM Proxy - Event Loop Engine Implementation
+ *
+ * Each reactor thread owns an epoll instance and a set of connections.
+ * The server thread hands accepted sockets to reactors round-robin through
+ * an inbox and an eventfd wakeup. A connection then moves through the
+ * states below without ever blocking its reactor:
+ *
+ *   SOCKS greeting -> SOCKS request -> reply -> [resolve] -> upstream
+ *   connect -> protocol detection -> [ClientHello -> [certificate] ->
+ *   TLS accept -> TLS connect] -> relay
+ *
+ * Host names missing from the DNS cache are resolved on a background
+ * thread. Likewise a leaf certificate missing from the cache is generated
+ * by the certificate workers, so key generation and signing never run on a
+ * reactor. A relay holding intercepted data sleeps until the user answers.
+ * In all three cases the other thread puts the connection on its reactor's
+ * ready list and wakes the reactor through the eventfd, and the reactor
+ * drives only the connections on that list.
+ *
+ * The ClientHello state waits, on edge-triggered readability, for the whole
+ * ClientHello so it can be fingerprinted and its server name matched
+ * against the passthrough list; passthrough connections go straight to
+ * relay.
+ *
+ * Every EL_TICK_MS the reactor walks its connections once for the connect
+ * and ClientHello deadlines, and once a second for intercept hold, idle and
+ * handshake timeouts.
+ */
+
+#include "../include/event_loop.h"
+
+#include "../include/tls_utils.h"
+
+#include "../include/cert_utils.h"
+
+#include "../include/socks5.h"
+
+#include "../include/utils.h"
+
+/* External callback functions from main.c */
+extern void send_connection_notification(const char * client_ip, int client_port,
+  const char * target_host, int target_port, int connection_id);
+extern void send_disconnect_notification(int connection_id,
+  const char * reason);
+
+#ifdef INTERCEPT_LINUX
+
+#include <sys/epoll.h>
+
+#include <sys/eventfd.h>
+
+#define EL_MAX_EVENTS 256
+#define EL_TICK_MS 100              /* Interval of the connect and ClientHello deadline checks */
+#define EL_HANDSHAKE_TIMEOUT 120    /* Seconds allowed before the relay starts */
+#define EL_IDLE_TIMEOUT 60          /* Relay idle timeout, same as relay_bidirectional */
+#define EL_SOCKS_BUFFER 300         /* Largest SOCKS5 greeting/request */
+
+typedef enum {
+  EL_SOCKS_GREETING,
+  EL_SOCKS_REQUEST,
+  EL_SOCKS_REPLY,
+  EL_RESOLVING,
+  EL_CONNECTING,
+  EL_DETECT,
+  EL_CLIENT_HELLO,
+  EL_CERTIFICATE,
+  EL_TLS_ACCEPT,
+  EL_TLS_CONNECT,
+  EL_RELAY,
+  EL_CLOSED
+} el_state_t;
+
+struct el_conn;
+struct el_reactor;
+
+/* epoll user data: which socket of which connection became ready */
+typedef struct {
+  struct el_conn * conn;
+  int is_server;
+} el_handle_t;
+
+typedef struct el_conn {
+  struct el_reactor * reactor;
+  struct el_conn * prev;
+  struct el_conn * next;
+  el_state_t state;
+  el_state_t after_reply;       /* State once the staged SOCKS reply is sent */
+  int connection_id;
+  socket_t client_sock;
+  socket_t server_sock;
+  el_handle_t client_handle;
+  el_handle_t server_handle;
+  uint32_t client_events;       /* Events currently registered with epoll */
+  uint32_t server_events;
+  int client_hung_up;           /* Socket reported a hang-up and left the epoll set */
+  int server_hung_up;
+  struct sockaddr_in client_addr;
+  char client_ip[MAX_IP_ADDR_LEN];
+  char server_ip[MAX_IP_ADDR_LEN];
+  char target_host[MAX_HOSTNAME_LEN];
+  int target_port;
+  unsigned char socks_buf[EL_SOCKS_BUFFER];
+  int socks_len;
+  unsigned char reply[10];
+  int reply_len;
+  int reply_off;
+  int handshake_want;           /* RELAY_WANT_* for the pending TLS handshake */
+  dns_lookup_t * lookup;        /* Host name lookup the connection waits for */
+  cert_job_t * cert_job;        /* Certificate generation the connection waits for */
+  work_waiter_t waiter;         /* Registered with lookup or cert_job, queues the connection when it is done */
+  unsigned long long connect_deadline; /* Monotonic ms after which the upstream connect is given up */
+  unsigned long long hello_deadline; /* Monotonic ms after which an incomplete ClientHello is matched as is */
+  SSL_CTX * server_ctx;
+  SSL * server_ssl;
+  SSL_CTX * client_ctx;
+  SSL * client_ssl;
+  client_sni_callback_args sni_args;
+  client_hello_info_t hello;    /* Parsed ClientHello, read by the relay's filter */
+  int hello_parsed;
+  relay_dir_t * client_to_server;
+  relay_dir_t * server_to_client;
+  struct el_conn * ready_next;  /* Ready list link, under the reactor's ready_cs */
+  int ready_queued;             /* On the ready list or being taken off it, under ready_cs */
+  time_t last_activity;
+} el_conn_t;
+
+/* Accepted socket waiting to be adopted by a reactor */
+typedef struct el_pending {
+  socket_t sock;
+  struct sockaddr_in addr;
+  struct el_pending * next;
+} el_pending_t;
+
+typedef struct el_reactor {
+  int epoll_fd;
+  int wake_fd;
+  thread_t thread;
+  mutex_t inbox_cs;
+  el_pending_t * inbox;
+  el_conn_t * conns;
+  el_conn_t * closed;           /* Freed once the current event batch is done */
+  mutex_t ready_cs;
+  el_conn_t * ready;            /* Queued by other threads to be driven on the next wakeup */
+} el_reactor_t;
+
+static struct {
+  el_reactor_t * reactors;
+  int count;
+  unsigned int next;
+  volatile int should_stop;
+  int running;
+} g_event_loop = {
+  0
+};
+
+static unsigned long long el_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, & ts);
+  return (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t want_to_events(int want) {
+  uint32_t events = 0;
+  if (want & RELAY_WANT_READ) events |= EPOLLIN;
+  if (want & RELAY_WANT_WRITE) events |= EPOLLOUT;
+  return events;
+}
+
+static int el_watch(el_conn_t * conn, int is_server, uint32_t events) {
+  struct epoll_event ev = {
+    0
+  };
+  ev.events = events;
+  ev.data.ptr = is_server ? & conn -> server_handle : & conn -> client_handle;
+
+  socket_t fd = is_server ? conn -> server_sock : conn -> client_sock;
+  if (epoll_ctl(conn -> reactor -> epoll_fd, EPOLL_CTL_ADD, fd, & ev) != 0) {
+    log_message("Event loop: epoll_ctl ADD failed: %s", strerror(errno));
+    return 0;
+  }
+
+  if (is_server) conn -> server_events = events;
+  else conn -> client_events = events;
+  return 1;
+}
+
+/*
+ * Stop watching a socket that hung up. Hang-ups are level triggered and
+ * would be reported on every wait; reading it never blocks any more, so the
+ * relay drains it without readiness events.
+ */
+static void el_unwatch(el_conn_t * conn, int is_server) {
+  socket_t fd = is_server ? conn -> server_sock : conn -> client_sock;
+
+  if (fd != INVALID_SOCKET) {
+    epoll_ctl(conn -> reactor -> epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  }
+  if (is_server) conn -> server_hung_up = 1;
+  else conn -> client_hung_up = 1;
+}
+
+static void el_set_events(el_conn_t * conn, int is_server, uint32_t events) {
+  uint32_t * current = is_server ? & conn -> server_events : & conn -> client_events;
+  socket_t fd = is_server ? conn -> server_sock : conn -> client_sock;
+
+  if (fd == INVALID_SOCKET || * current == events || (is_server ? conn -> server_hung_up : conn -> client_hung_up)) {
+    return;
+  }
+
+  struct epoll_event ev = {
+    0
+  };
+  ev.events = events;
+  ev.data.ptr = is_server ? & conn -> server_handle : & conn -> client_handle;
+  if (epoll_ctl(conn -> reactor -> epoll_fd, EPOLL_CTL_MOD, fd, & ev) == 0) {
+    * current = events;
+  }
+}
+
+/*
+ * Queue a connection for its reactor and wake the reactor. Runs on other
+ * threads: a resolver or certificate worker, under the lock of the job the
+ * connection waits for, or the thread answering an intercept, under
+ * intercept_cs. el_close() unregisters from both before it takes the
+ * connection off the ready list, so the connection is still alive here.
+ */
+static void el_conn_ready(void * arg) {
+  el_conn_t * conn = (el_conn_t * ) arg;
+  el_reactor_t * r = conn -> reactor;
+  uint64_t one = 1;
+
+  LOCK_MUTEX(r -> ready_cs);
+  int queued = conn -> ready_queued;
+  if (!queued) {
+    conn -> ready_queued = 1;
+    conn -> ready_next = r -> ready;
+    r -> ready = conn;
+  }
+  UNLOCK_MUTEX(r -> ready_cs);
+
+  // Already queued means a wakeup is pending or the reactor is about to drive it
+  if (!queued && write(r -> wake_fd, & one, sizeof(one)) < 0) {
+    log_message("Event loop: failed to wake reactor: %s", strerror(errno));
+  }
+}
+
+/* Take a closing connection off the ready list */
+static void el_conn_unready(el_conn_t * conn) {
+  el_reactor_t * r = conn -> reactor;
+
+  LOCK_MUTEX(r -> ready_cs);
+  if (conn -> ready_queued) {
+    el_conn_t ** link = & r -> ready;
+    while ( * link && * link != conn) {
+      link = & ( * link) -> ready_next;
+    }
+    if ( * link) {
+      * link = conn -> ready_next;
+    }
+    conn -> ready_queued = 0;
+  }
+  UNLOCK_MUTEX(r -> ready_cs);
+}
+
+/*
+ * Release every resource of a connection. The structure itself stays alive
+ * until the end of the event batch since other events may still point at it.
+ */
+static void el_close(el_conn_t * conn) {
+  el_reactor_t * r = conn -> reactor;
+
+  if (conn -> state == EL_CLOSED) {
+    return;
+  }
+
+  if (config.verbose) {
+    log_message("Cleaning up connection to %s:%d (ID: %d)", conn -> target_host, conn -> target_port, conn -> connection_id);
+  }
+  send_disconnect_notification(conn -> connection_id, "Connection closed");
+  if (conn -> hello_parsed) {
+    fingerprint_index_remove(conn -> connection_id);
+  }
+  if (conn -> lookup) {
+    dns_lookup_release(conn -> lookup, & conn -> waiter);
+    conn -> lookup = NULL;
+  }
+  if (conn -> cert_job) {
+    cert_job_release(conn -> cert_job, & conn -> waiter);
+    conn -> cert_job = NULL;
+  }
+
+  if (conn -> client_to_server) {
+    relay_dir_cleanup(conn -> client_to_server);
+    free(conn -> client_to_server);
+    conn -> client_to_server = NULL;
+  }
+  if (conn -> server_to_client) {
+    relay_dir_cleanup(conn -> server_to_client);
+    free(conn -> server_to_client);
+    conn -> server_to_client = NULL;
+  }
+  // Nothing can queue the connection any more
+  el_conn_unready(conn);
+
+  if (conn -> server_ssl) {
+    SSL_shutdown(conn -> server_ssl);
+    SSL_free(conn -> server_ssl);
+    conn -> server_ssl = NULL;
+  }
+  if (conn -> sni_args.generated_ctx_for_sni) {
+    SSL_CTX_free(conn -> sni_args.generated_ctx_for_sni);
+    conn -> sni_args.generated_ctx_for_sni = NULL;
+  }
+  if (conn -> server_ctx) {
+    SSL_CTX_free(conn -> server_ctx);
+    conn -> server_ctx = NULL;
+  }
+  if (conn -> client_ssl) {
+    SSL_shutdown(conn -> client_ssl);
+    SSL_free(conn -> client_ssl);
+    conn -> client_ssl = NULL;
+  }
+  if (conn -> client_ctx) {
+    SSL_CTX_free(conn -> client_ctx);
+    conn -> client_ctx = NULL;
+  }
+
+  // Closing the sockets also removes them from the epoll set
+  if (conn -> client_sock != INVALID_SOCKET) {
+    CLOSE_SOCKET(conn -> client_sock);
+    conn -> client_sock = INVALID_SOCKET;
+  }
+  if (conn -> server_sock != INVALID_SOCKET) {
+    CLOSE_SOCKET(conn -> server_sock);
+    conn -> server_sock = INVALID_SOCKET;
+  }
+
+  // Move from the active list to the closed list
+  if (conn -> prev) conn -> prev -> next = conn -> next;
+  else r -> conns = conn -> next;
+  if (conn -> next) conn -> next -> prev = conn -> prev;
+  conn -> prev = NULL;
+  conn -> next = r -> closed;
+  r -> closed = conn;
+
+  conn -> state = EL_CLOSED;
+}
+
+static void el_fail(el_conn_t * conn,
+  const char * reason) {
+  if (reason) {
+    send_disconnect_notification(conn -> connection_id, reason);
+  }
+  el_close(conn);
+}
+
+/* Stage a SOCKS5 reply, continuing with next_state once it is sent */
+static void el_stage_reply(el_conn_t * conn,
+  const unsigned char * reply, int len, el_state_t next_state) {
+  memcpy(conn -> reply, reply, len);
+  conn -> reply_len = len;
+  conn -> reply_off = 0;
+  conn -> after_reply = next_state;
+  conn -> state = EL_SOCKS_REPLY;
+}
+
+/* Bytes required before the SOCKS5 message in socks_buf can be parsed */
+static int el_socks_needed(el_conn_t * conn) {
+  const unsigned char * b = conn -> socks_buf;
+
+  if (conn -> state == EL_SOCKS_GREETING) {
+    return conn -> socks_len < 2 ? 2 : 2 + b[1];
+  }
+
+  if (conn -> socks_len < 4) {
+    return 4;
+  }
+  if (b[3] == SOCKS5_ADDR_IPV4) {
+    return 4 + 4 + 2;
+  }
+  if (b[3] == SOCKS5_ADDR_DOMAIN) {
+    return conn -> socks_len < 5 ? 5 : 5 + b[4] + 2;
+  }
+  return conn -> socks_len; // Unsupported address type, let the parser reject it
+}
+
+/*
+ * Receive exactly the bytes the current SOCKS5 message needs, never reading
+ * into the data that follows the handshake.
+ * Returns 1 when more data may be parsed, 0 when waiting, -1 on close/error.
+ */
+static int el_socks_recv(el_conn_t * conn) {
+  int needed = el_socks_needed(conn);
+  if (needed > (int) sizeof(conn -> socks_buf)) {
+    return -1;
+  }
+  if (needed <= conn -> socks_len) {
+    return 1;
+  }
+
+  int received = recv(conn -> client_sock, (char * ) conn -> socks_buf + conn -> socks_len, needed - conn -> socks_len, 0);
+  if (received > 0) {
+    conn -> socks_len += received;
+    return 1;
+  }
+  if (received < 0 && SOCKET_WOULD_BLOCK(GET_SOCKET_ERROR())) {
+    return 0;
+  }
+  if (config.verbose) {
+    log_message("SOCKS5 error receiving handshake data: %d", received < 0 ? GET_SOCKET_ERROR() : 0);
+  }
+  return -1;
+}
+
+static int el_socks_greeting(el_conn_t * conn) {
+  while (1) {
+    int ret = el_socks_recv(conn);
+    if (ret < 0) {
+      el_fail(conn, "SOCKS5 handshake failed");
+      return 0;
+    } else if (ret == 0) {
+      return 0;
+    }
+
+    int has_no_auth = 0;
+    int used = socks5_parse_greeting(conn -> socks_buf, conn -> socks_len, & has_no_auth);
+    if (used == SOCKS5_PARSE_INCOMPLETE) {
+      continue;
+    } else if (used == SOCKS5_PARSE_ERROR) {
+      el_fail(conn, "SOCKS5 handshake failed");
+      return 0;
+    }
+
+    conn -> socks_len = 0;
+    unsigned char reply[2] = {
+      SOCKS5_VERSION,
+      SOCKS5_AUTH_NONE
+    };
+    if (!has_no_auth) {
+      log_message("Client doesn't support no-auth method, rejecting");
+      reply[1] = SOCKS5_AUTH_NO_ACCEPTABLE;
+      el_stage_reply(conn, reply, 2, EL_CLOSED);
+    } else {
+      el_stage_reply(conn, reply, 2, EL_SOCKS_REQUEST);
+    }
+    return 1;
+  }
+}
+
+static int el_socks_request(el_conn_t * conn) {
+  while (1) {
+    int ret = el_socks_recv(conn);
+    if (ret < 0) {
+      el_fail(conn, "SOCKS5 handshake failed");
+      return 0;
+    } else if (ret == 0) {
+      return 0;
+    }
+
+    int reply_code = SOCKS5_NO_REPLY;
+    int used = socks5_parse_request(conn -> socks_buf, conn -> socks_len, conn -> target_host, & conn -> target_port, & reply_code);
+    if (used == SOCKS5_PARSE_INCOMPLETE) {
+      continue;
+    }
+
+    unsigned char reply[10];
+    if (used == SOCKS5_PARSE_ERROR) {
+      if (reply_code == SOCKS5_NO_REPLY) {
+        el_fail(conn, "SOCKS5 handshake failed");
+        return 0;
+      }
+      socks5_build_reply(reply, (unsigned char) reply_code);
+      el_stage_reply(conn, reply, sizeof(reply), EL_CLOSED);
+      return 1;
+    }
+
+    log_message("SOCKS5 handshake completed successfully for %s:%d", conn -> target_host, conn -> target_port);
+    socks5_build_reply(reply, SOCKS5_REPLY_SUCCESS);
+    el_stage_reply(conn, reply, sizeof(reply), EL_CONNECTING);
+    return 1;
+  }
+}
+
+/* Start a non-blocking connect to the resolved SOCKS target */
+static int el_connect(el_conn_t * conn, const struct in_addr * addr) {
+  struct sockaddr_in server_addr;
+  memset( & server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_addr = * addr;
+  server_addr.sin_port = htons(conn -> target_port);
+
+  inet_ntop(AF_INET, & server_addr.sin_addr, conn -> server_ip, MAX_IP_ADDR_LEN);
+
+  conn -> server_sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (conn -> server_sock == SOCKET_ERROR_VAL) {
+    log_message("Failed to create socket for server connection: %s", strerror(errno));
+    conn -> server_sock = INVALID_SOCKET;
+    el_close(conn);
+    return 0;
+  }
+
+  log_message("Connecting to server %s (%s):%d", conn -> target_host, conn -> server_ip, conn -> target_port);
+  if (connect(conn -> server_sock, (struct sockaddr * ) & server_addr, sizeof(server_addr)) != 0 && errno != EINPROGRESS) {
+    log_message("Connection to %s:%d failed with error %d", conn -> target_host, conn -> target_port, errno);
+    el_close(conn);
+    return 0;
+  }
+
+  if (!el_watch(conn, 1, EPOLLOUT)) {
+    el_close(conn);
+    return 0;
+  }
+
+  conn -> connect_deadline = el_now_ms() + (unsigned long long) config.connect_timeout_ms;
+  conn -> state = EL_CONNECTING;
+  return 0; // Wait for the connect to complete
+}
+
+/* Resolve the SOCKS target through the DNS cache and connect, or wait for the lookup */
+static int el_start_connect(el_conn_t * conn) {
+  send_connection_notification(conn -> client_ip, ntohs(conn -> client_addr.sin_port),
+    conn -> target_host, conn -> target_port, conn -> connection_id);
+
+  if (config.verbose) {
+    log_message("Intercepting connection to %s:%d", conn -> target_host, conn -> target_port);
+  }
+
+  struct in_addr addr;
+  int error = 0;
+  int ret = dns_cache_start(conn -> target_host, & addr, & error, & conn -> lookup, & conn -> waiter);
+  if (ret == DNS_PENDING) {
+    conn -> state = EL_RESOLVING;
+    return 0; // The resolver queues the connection when the lookup is done
+  }
+  if (ret == DNS_FAILED) {
+    log_message("Failed to resolve hostname %s: %s", conn -> target_host, gai_strerror(error));
+    el_close(conn);
+    return 0;
+  }
+  return el_connect(conn, & addr);
+}
+
+/* Connect once the background lookup of the target host is done. No epoll interest; driven from the ready list. */
+static int el_resolving(el_conn_t * conn) {
+  struct in_addr addr;
+  int error = 0;
+  int ret = dns_lookup_poll(conn -> lookup, & addr, & error);
+  if (ret == DNS_PENDING) {
+    return 0;
+  }
+  dns_lookup_release(conn -> lookup, & conn -> waiter);
+  conn -> lookup = NULL;
+
+  if (ret == DNS_FAILED) {
+    log_message("Failed to resolve hostname %s: %s", conn -> target_host, gai_strerror(error));
+    el_close(conn);
+    return 0;
+  }
+  return el_connect(conn, & addr);
+}
+
+static int el_send_reply(el_conn_t * conn) {
+  while (conn -> reply_off < conn -> reply_len) {
+    int sent = send(conn -> client_sock, (char * ) conn -> reply + conn -> reply_off, conn -> reply_len - conn -> reply_off, 0);
+    if (sent <= 0) {
+      if (sent < 0 && SOCKET_WOULD_BLOCK(GET_SOCKET_ERROR())) {
+        return 0;
+      }
+      el_fail(conn, "SOCKS5 handshake failed");
+      return 0;
+    }
+    conn -> reply_off += sent;
+  }
+
+  if (conn -> after_reply == EL_CLOSED) {
+    el_fail(conn, "SOCKS5 handshake failed");
+    return 0;
+  }
+  if (conn -> after_reply == EL_CONNECTING) {
+    return el_start_connect(conn);
+  }
+
+  conn -> state = conn -> after_reply;
+  return 1;
+}
+
+static int el_connecting(el_conn_t * conn) {
+  int error = 0;
+  socklen_t len = sizeof(error);
+  if (getsockopt(conn -> server_sock, SOL_SOCKET, SO_ERROR, & error, & len) != 0) {
+    error = errno;
+  }
+  if (error == EINPROGRESS) {
+    return 0;
+  }
+  if (error != 0) {
+    log_message("Failed to connect to server %s:%d: %d", conn -> target_host, conn -> target_port, error);
+    el_close(conn);
+    return 0;
+  }
+
+  int nodelay = 1;
+  setsockopt(conn -> server_sock, IPPROTO_TCP, TCP_NODELAY, & nodelay, sizeof(nodelay));
+
+  conn -> state = EL_DETECT;
+  return 1;
+}
+
+static void el_start_relay(el_conn_t * conn, int opaque) {
+  conn -> client_to_server = (relay_dir_t * ) malloc(sizeof(relay_dir_t));
+  conn -> server_to_client = (relay_dir_t * ) malloc(sizeof(relay_dir_t));
+  if (!conn -> client_to_server || !conn -> server_to_client) {
+    log_message("Memory allocation failed");
+    free(conn -> client_to_server);
+    free(conn -> server_to_client);
+    conn -> client_to_server = NULL;
+    conn -> server_to_client = NULL;
+    el_close(conn);
+    return;
+  }
+
+  relay_dir_init(conn -> client_to_server, conn -> client_sock, conn -> server_ssl,
+    conn -> server_sock, conn -> client_ssl, "Client->Server",
+    conn -> client_ip, conn -> server_ip, conn -> target_port, conn -> connection_id);
+  relay_dir_init(conn -> server_to_client, conn -> server_sock, conn -> client_ssl,
+    conn -> client_sock, conn -> server_ssl, "Server->Client",
+    conn -> server_ip, conn -> client_ip, ntohs(conn -> client_addr.sin_port), conn -> connection_id);
+  relay_dir_pair(conn -> client_to_server, conn -> server_to_client);
+  relay_dir_set_target(conn -> client_to_server, conn -> target_host, conn -> target_port,
+    conn -> client_ip, conn -> server_ssl, conn -> hello_parsed ? & conn -> hello : NULL);
+  relay_dir_set_target(conn -> server_to_client, conn -> target_host, conn -> target_port,
+    conn -> client_ip, conn -> server_ssl, conn -> hello_parsed ? & conn -> hello : NULL);
+  if (opaque) {
+    relay_dir_set_opaque(conn -> client_to_server);
+    relay_dir_set_opaque(conn -> server_to_client);
+  } else {
+    relay_dir_set_wakeup(conn -> client_to_server, el_conn_ready, conn);
+    relay_dir_set_wakeup(conn -> server_to_client, el_conn_ready, conn);
+  }
+
+  log_message("Established connection: %s -> %s:%d", conn -> client_ip, conn -> server_ip, conn -> target_port);
+  conn -> state = EL_RELAY;
+}
+
+static int el_start_tls_accept(el_conn_t * conn) {
+  send_status_update("Proceeding with TLS interception");
+
+  conn -> server_ctx = get_server_template_ctx();
+  if (!conn -> server_ctx) {
+    log_message("Failed to create server SSL context");
+    el_close(conn);
+    return 0;
+  }
+
+  conn -> sni_args.original_target_host = conn -> target_host;
+
+  conn -> server_ssl = SSL_new(conn -> server_ctx);
+  if (!conn -> server_ssl || SSL_set_fd(conn -> server_ssl, (int) conn -> client_sock) != 1) {
+    log_message("Failed to create server SSL object");
+    print_openssl_error();
+    el_close(conn);
+    return 0;
+  }
+  SSL_set_app_data(conn -> server_ssl, & conn -> sni_args);
+  ktls_enable(conn -> server_ssl);
+  SSL_set_accept_state(conn -> server_ssl);
+
+  conn -> state = EL_TLS_ACCEPT;
+  return 1;
+}
+
+static int el_start_tls_connect(el_conn_t * conn) {
+  conn -> client_ctx = get_client_ssl_ctx();
+  if (!conn -> client_ctx) {
+    log_message("Failed to create client SSL context");
+    el_close(conn);
+    return 0;
+  }
+
+  conn -> client_ssl = SSL_new(conn -> client_ctx);
+  if (!conn -> client_ssl || SSL_set_fd(conn -> client_ssl, (int) conn -> server_sock) != 1) {
+    log_message("Failed to create client SSL object");
+    print_openssl_error();
+    el_close(conn);
+    return 0;
+  }
+
+  if (strlen(conn -> target_host) > 0 && SSL_set_tlsext_host_name(conn -> client_ssl, conn -> target_host) != 1) {
+    if (config.verbose) {
+      log_message("Warning: Failed to set SNI hostname");
+      print_openssl_error();
+    }
+  }
+  alpn_offer_upstream(conn -> client_ssl, & conn -> sni_args);
+  ktls_enable(conn -> client_ssl);
+  attach_upstream_session(conn -> client_ssl, conn -> target_host, conn -> target_port);
+  SSL_set_connect_state(conn -> client_ssl);
+
+  conn -> state = EL_TLS_CONNECT;
+  return 1;
+}
+
+static int el_detect(el_conn_t * conn) {
+  unsigned char peek;
+
+  // detect_protocol() treats "no data yet" as plain TCP, so wait for the first byte
+  int ret = recv(conn -> client_sock, (char * ) & peek, 1, MSG_PEEK);
+  if (ret < 0 && SOCKET_WOULD_BLOCK(GET_SOCKET_ERROR())) {
+    return 0;
+  }
+
+  if (detect_protocol(conn -> client_sock) == PROTOCOL_TLS) {
+    conn -> hello_deadline = el_now_ms() + CLIENT_HELLO_WAIT_MS;
+    conn -> state = EL_CLIENT_HELLO;
+    return 1;
+  }
+
+  int opaque = passthrough_active() && passthrough_connection(conn -> target_host, conn -> target_port,
+    conn -> client_ip, conn -> server_ip, NULL, conn -> connection_id);
+  if (!opaque) {
+    log_message("Forwarding plain TCP traffic with protocol upgrade detection");
+  }
+  el_start_relay(conn, opaque);
+  return conn -> state == EL_RELAY;
+}
+
+/* Hand the context built for the connection's host to the SNI callback and start the handshake */
+static int el_certificate_ready(el_conn_t * conn, SSL_CTX * ctx, const char * hostname) {
+  conn -> sni_args.generated_ctx_for_sni = ctx;
+  strncpy(conn -> sni_args.prepared_hostname, hostname, sizeof(conn -> sni_args.prepared_hostname) - 1);
+  return el_start_tls_accept(conn);
+}
+
+/*
+ * Look up the leaf certificate for the name the SNI callback will ask for,
+ * and wait in the certificate state while a worker generates a missing one.
+ * Without a parsed ClientHello the name is unknown and the SNI callback
+ * generates it itself.
+ */
+static int el_start_certificate(el_conn_t * conn) {
+  const char * hostname = cert_hostname(conn -> hello_parsed ? conn -> hello.sni : NULL, conn -> target_host);
+  SSL_CTX * ctx = NULL;
+
+  if (!conn -> hello_parsed || !hostname) {
+    return el_start_tls_accept(conn);
+  }
+
+  int ret = cert_cache_start(hostname, & ctx, & conn -> cert_job, & conn -> waiter);
+  if (ret == CERT_READY) {
+    return el_certificate_ready(conn, ctx, hostname);
+  } else if (ret == CERT_FAILED) {
+    log_message("SNI: Failed to create SSL_CTX for %s", hostname);
+    el_close(conn);
+    return 0;
+  }
+
+  conn -> state = EL_CERTIFICATE;
+  return 1;
+}
+
+/* Certificate state: wait, driven from the ready list, for the worker generating it */
+static int el_certificate(el_conn_t * conn) {
+  SSL_CTX * ctx = NULL;
+
+  int ret = cert_job_poll(conn -> cert_job, & ctx);
+  if (ret == CERT_PENDING) {
+    return 0;
+  }
+  cert_job_release(conn -> cert_job, & conn -> waiter);
+  conn -> cert_job = NULL;
+
+  const char * hostname = cert_hostname(conn -> hello.sni, conn -> target_host);
+  if (ret == CERT_FAILED) {
+    log_message("SNI: Failed to create SSL_CTX for %s", hostname);
+    el_close(conn);
+    return 0;
+  }
+  return el_certificate_ready(conn, ctx, hostname);
+}
+
+/*
+ * Report a TLS connection's ClientHello once it is in and match the
+ * connection against the passthrough list. The peeked bytes stay readable,
+ * so the client is watched edge-triggered and an incomplete ClientHello is
+ * peeked again only when more arrives, or by the tick once
+ * CLIENT_HELLO_WAIT_MS is up.
+ */
+static int el_client_hello(el_conn_t * conn) {
+  int ret = peek_client_hello(conn -> client_sock, & conn -> hello);
+  if (ret == CLIENT_HELLO_INCOMPLETE && el_now_ms() < conn -> hello_deadline) {
+    return 0;
+  }
+  if (ret == CLIENT_HELLO_OK) {
+    conn -> hello_parsed = 1;
+    client_hello_report(conn -> connection_id, & conn -> hello);
+  }
+
+  if (passthrough_active() && passthrough_connection(conn -> target_host, conn -> target_port, conn -> client_ip,
+      conn -> server_ip, & conn -> hello, conn -> connection_id)) {
+    el_start_relay(conn, 1);
+    return conn -> state == EL_RELAY;
+  }
+  return el_start_certificate(conn);
+}
+
+/*
+ * Advance a TLS handshake. Returns 1 when done, 0 while waiting,
+ * -1 on failure (handshake_want holds the readiness to wait for), and 2
+ * when the client handshake paused on an ALPN offer (see
+ * alpn_client_hello_callback).
+ */
+static int el_handshake_step(el_conn_t * conn, SSL * ssl) {
+  ERR_clear_error();
+  int ret = SSL_do_handshake(ssl);
+  if (ret == 1) {
+    conn -> handshake_want = 0;
+    return 1;
+  }
+
+  int error = SSL_get_error(ssl, ret);
+  if (error == SSL_ERROR_WANT_READ) {
+    conn -> handshake_want = RELAY_WANT_READ;
+    return 0;
+  } else if (error == SSL_ERROR_WANT_WRITE) {
+    conn -> handshake_want = RELAY_WANT_WRITE;
+    return 0;
+  } else if (error == SSL_ERROR_WANT_CLIENT_HELLO_CB) {
+    conn -> handshake_want = 0;
+    return 2;
+  }
+  return -1;
+}
+
+/* Both handshakes are done: record the protocol and start relaying */
+static int el_tls_established(el_conn_t * conn) {
+  alpn_report(conn -> server_ssl, & conn -> sni_args, conn -> connection_id, conn -> target_host);
+  ktls_report(conn -> server_ssl, conn -> client_ssl, conn -> connection_id);
+  if (config.verbose) {
+    log_message("TLS MITM established! Intercepting traffic between client and %s:%d",
+      conn -> target_host, conn -> target_port);
+  }
+  el_start_relay(conn, 0);
+  return conn -> state == EL_RELAY;
+}
+
+static int el_tls_accept(el_conn_t * conn) {
+  int ret = el_handshake_step(conn, conn -> server_ssl);
+  if (ret == 0) {
+    return 0;
+  } else if (ret == 2) {
+    // The server picks the protocol before the ClientHello is answered
+    return el_start_tls_connect(conn);
+  } else if (ret < 0) {
+    unsigned long error_reason = ERR_peek_error();
+    log_message("Failed to perform TLS handshake with client (reason: 0x%lx)", error_reason);
+    if (ERR_GET_REASON(error_reason) == SSL_R_TLSV1_ALERT_BAD_CERTIFICATE ||
+      ERR_GET_REASON(error_reason) == SSL_R_CERTIFICATE_VERIFY_FAILED) {
+      log_message("Certificate was rejected by client. Consider importing myCA.pem into client's trust store");
+    }
+    print_openssl_error();
+    el_close(conn);
+    return 0;
+  }
+
+  if (config.verbose) {
+    const char * negotiated_cipher = SSL_get_cipher_name(conn -> server_ssl);
+    const char * negotiated_version = SSL_get_version(conn -> server_ssl);
+    log_message("TLS handshake with client successful. Cipher: %s, Version: %s",
+      negotiated_cipher ? negotiated_cipher : "N/A",
+      negotiated_version ? negotiated_version : "N/A");
+  }
+
+  // Already connected upstream if the client offered ALPN
+  if (conn -> client_ssl) {
+    return el_tls_established(conn);
+  }
+  return el_start_tls_connect(conn);
+}
+
+static int el_tls_connect(el_conn_t * conn) {
+  int ret = el_handshake_step(conn, conn -> client_ssl);
+  if (ret == 0) {
+    return 0;
+  } else if (ret < 0) {
+    log_message("Failed to perform TLS handshake with server %s:%d", conn -> target_host, conn -> target_port);
+    print_openssl_error();
+    el_close(conn);
+    return 0;
+  }
+
+  record_upstream_handshake(conn -> client_ssl);
+  alpn_upstream_done(conn -> client_ssl, & conn -> sni_args);
+  if (!SSL_is_init_finished(conn -> server_ssl)) {
+    // Resume the client handshake paused on its ALPN offer
+    conn -> state = EL_TLS_ACCEPT;
+    return 1;
+  }
+  return el_tls_established(conn);
+}
+
+static void el_relay(el_conn_t * conn) {
+  relay_pump(conn -> client_to_server);
+  relay_pump(conn -> server_to_client);
+
+  if (conn -> client_to_server -> eof && conn -> server_to_client -> eof) {
+    if (config.verbose) {
+      log_message("Connection to %s:%d closed", conn -> target_host, conn -> target_port);
+    }
+    el_close(conn);
+  }
+}
+
+/* Register the readiness the connection's current state is waiting for */
+static void el_update_events(el_conn_t * conn) {
+  switch (conn -> state) {
+  case EL_SOCKS_GREETING:
+  case EL_SOCKS_REQUEST:
+  case EL_DETECT:
+    el_set_events(conn, 0, EPOLLIN);
+    el_set_events(conn, 1, 0);
+    break;
+  case EL_SOCKS_REPLY:
+    el_set_events(conn, 0, EPOLLOUT);
+    break;
+  case EL_CONNECTING:
+    el_set_events(conn, 0, 0);
+    el_set_events(conn, 1, EPOLLOUT);
+    break;
+  case EL_CLIENT_HELLO:
+    el_set_events(conn, 0, EPOLLIN | EPOLLET);
+    el_set_events(conn, 1, 0);
+    break;
+  case EL_RESOLVING:
+  case EL_CERTIFICATE:
+    el_set_events(conn, 0, 0);
+    el_set_events(conn, 1, 0);
+    break;
+  case EL_TLS_ACCEPT:
+    el_set_events(conn, 0, want_to_events(conn -> handshake_want));
+    el_set_events(conn, 1, 0);
+    break;
+  case EL_TLS_CONNECT:
+    el_set_events(conn, 0, 0);
+    el_set_events(conn, 1, want_to_events(conn -> handshake_want));
+    break;
+  case EL_RELAY:
+    el_set_events(conn, 0, want_to_events(conn -> client_to_server -> src_want | conn -> server_to_client -> dst_want));
+    el_set_events(conn, 1, want_to_events(conn -> client_to_server -> dst_want | conn -> server_to_client -> src_want));
+    break;
+  case EL_CLOSED:
+    break;
+  }
+}
+
+/* Run the connection's state machine until it has to wait for I/O */
+static void el_drive(el_conn_t * conn) {
+  int progress = 1;
+
+  while (progress && conn -> state != EL_CLOSED) {
+    switch (conn -> state) {
+    case EL_SOCKS_GREETING:
+      progress = el_socks_greeting(conn);
+      break;
+    case EL_SOCKS_REQUEST:
+      progress = el_socks_request(conn);
+      break;
+    case EL_SOCKS_REPLY:
+      progress = el_send_reply(conn);
+      break;
+    case EL_RESOLVING:
+      progress = el_resolving(conn);
+      break;
+    case EL_CONNECTING:
+      progress = el_connecting(conn);
+      break;
+    case EL_DETECT:
+      progress = el_detect(conn);
+      break;
+    case EL_CLIENT_HELLO:
+      progress = el_client_hello(conn);
+      break;
+    case EL_CERTIFICATE:
+      progress = el_certificate(conn);
+      break;
+    case EL_TLS_ACCEPT:
+      progress = el_tls_accept(conn);
+      break;
+    case EL_TLS_CONNECT:
+      progress = el_tls_connect(conn);
+      break;
+    case EL_RELAY:
+      el_relay(conn);
+      progress = 0;
+      break;
+    case EL_CLOSED:
+      progress = 0;
+      break;
+    }
+  }
+
+  el_update_events(conn);
+}
+
+/* Drive the connections other threads queued since the last wakeup */
+static void el_run_ready(el_reactor_t * r) {
+  LOCK_MUTEX(r -> ready_cs);
+  el_conn_t * conn = r -> ready;
+  r -> ready = NULL;
+  UNLOCK_MUTEX(r -> ready_cs);
+
+  while (conn) {
+    // Queued again from here on; until then the link is left alone
+    LOCK_MUTEX(r -> ready_cs);
+    el_conn_t * next = conn -> ready_next;
+    conn -> ready_queued = 0;
+    UNLOCK_MUTEX(r -> ready_cs);
+
+    if (conn -> state != EL_CLOSED) {
+      el_drive(conn);
+    }
+    conn = next;
+  }
+}
+
+/* Adopt sockets queued by the server thread */
+static void el_adopt_pending(el_reactor_t * r) {
+  uint64_t value;
+  while (read(r -> wake_fd, & value, sizeof(value)) > 0) {
+    // Drain the eventfd counter
+  }
+
+  LOCK_MUTEX(r -> inbox_cs);
+  el_pending_t * pending = r -> inbox;
+  r -> inbox = NULL;
+  UNLOCK_MUTEX(r -> inbox_cs);
+
+  while (pending) {
+    el_pending_t * next = pending -> next;
+
+    el_conn_t * conn = (el_conn_t * ) calloc(1, sizeof(el_conn_t));
+    if (!conn) {
+      CLOSE_SOCKET(pending -> sock);
+      free(pending);
+      pending = next;
+      continue;
+    }
+
+    conn -> reactor = r;
+    conn -> state = EL_SOCKS_GREETING;
+    conn -> connection_id = allocate_connection_id();
+    conn -> client_sock = pending -> sock;
+    conn -> server_sock = INVALID_SOCKET;
+    conn -> client_handle.conn = conn;
+    conn -> client_handle.is_server = 0;
+    conn -> server_handle.conn = conn;
+    conn -> server_handle.is_server = 1;
+    conn -> waiter.notify = el_conn_ready;
+    conn -> waiter.arg = conn;
+    conn -> client_addr = pending -> addr;
+    conn -> last_activity = time(NULL);
+    inet_ntop(AF_INET, & conn -> client_addr.sin_addr, conn -> client_ip, MAX_IP_ADDR_LEN);
+    free(pending);
+
+    // TCP keepalive to detect dead connections
+    int keep_alive = 1;
+    setsockopt(conn -> client_sock, SOL_SOCKET, SO_KEEPALIVE, & keep_alive, sizeof(keep_alive));
+
+    conn -> next = r -> conns;
+    if (r -> conns) r -> conns -> prev = conn;
+    r -> conns = conn;
+
+    if (!set_socket_nonblocking(conn -> client_sock, 1) || !el_watch(conn, 0, EPOLLIN)) {
+      el_close(conn);
+    }
+
+    pending = next;
+  }
+}
+
+/* Enforce the connect and ClientHello deadlines and, once a second, expire parked intercepts and enforce timeouts */
+static void el_tick(el_reactor_t * r, time_t now, unsigned long long now_ms, int check_idle) {
+  el_conn_t * conn = r -> conns;
+
+  while (conn) {
+    el_conn_t * next = conn -> next;
+
+    if (conn -> state == EL_RELAY) {
+      int held = conn -> client_to_server -> held || conn -> server_to_client -> held;
+      if (held) {
+        if (check_idle) {
+          el_drive(conn); // Releases chunks whose hold timed out
+        }
+      } else if (check_idle && !config.verbose && now - conn -> last_activity > EL_IDLE_TIMEOUT) {
+        el_close(conn);
+      }
+    } else if (conn -> state == EL_CLIENT_HELLO && now_ms >= conn -> hello_deadline) {
+      el_drive(conn); // Matches the incomplete ClientHello as is
+    } else if (conn -> state == EL_CONNECTING && now_ms >= conn -> connect_deadline) {
+      log_message("Connection to %s:%d timed out after %d ms", conn -> target_host, conn -> target_port,
+        config.connect_timeout_ms);
+      el_close(conn);
+    } else if (check_idle && now - conn -> last_activity > EL_HANDSHAKE_TIMEOUT) {
+      log_message("Handshake timeout for connection %d", conn -> connection_id);
+      el_close(conn);
+    }
+
+    conn = next;
+  }
+}
+
+static void el_free_closed(el_reactor_t * r) {
+  while (r -> closed) {
+    el_conn_t * next = r -> closed -> next;
+    free(r -> closed);
+    r -> closed = next;
+  }
+}
+
+static THREAD_RETURN_TYPE THREAD_CALL el_reactor_thread(void * arg) {
+  el_reactor_t * r = (el_reactor_t * ) arg;
+  struct epoll_event events[EL_MAX_EVENTS];
+  time_t last_idle_check = time(NULL);
+  unsigned long long now_ms = el_now_ms();
+  unsigned long long next_tick = now_ms + EL_TICK_MS;
+
+  while (!g_event_loop.should_stop) {
+    int timeout = now_ms >= next_tick ? 0 : (int)(next_tick - now_ms);
+    int n = epoll_wait(r -> epoll_fd, events, EL_MAX_EVENTS, timeout);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      log_message("Event loop: epoll_wait failed: %s", strerror(errno));
+      break;
+    }
+
+    time_t now = time(NULL);
+
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.ptr == NULL) {
+        el_adopt_pending(r);
+        el_run_ready(r);
+        continue;
+      }
+
+      el_handle_t * handle = (el_handle_t * ) events[i].data.ptr;
+      el_conn_t * conn = handle -> conn;
+      uint32_t ev = events[i].events;
+
+      if (conn -> state == EL_CLOSED) {
+        continue;
+      }
+      conn -> last_activity = now;
+
+      // A dead client before the relay starts means there is nothing left to do
+      if ((ev & (EPOLLERR | EPOLLHUP)) && !handle -> is_server && conn -> state != EL_RELAY) {
+        el_close(conn);
+        continue;
+      }
+
+      el_drive(conn);
+
+      // Nothing more reaches a hung-up socket, but what it sent and what is
+      // queued for its peer still goes out before the connection closes
+      if ((ev & (EPOLLERR | EPOLLHUP)) && conn -> state == EL_RELAY) {
+        relay_dir_abort(handle -> is_server ? conn -> client_to_server : conn -> server_to_client);
+        el_unwatch(conn, handle -> is_server);
+        el_drive(conn);
+      }
+    }
+
+    // The tick walks every connection, so it runs on its interval rather than per wakeup
+    now_ms = el_now_ms();
+    if (now_ms >= next_tick) {
+      int check_idle = now != last_idle_check;
+      el_tick(r, now, now_ms, check_idle);
+      if (check_idle) {
+        last_idle_check = now;
+      }
+      next_tick = now_ms + EL_TICK_MS;
+    }
+
+    el_free_closed(r);
+  }
+
+  // Shutdown: close every connection this reactor still owns
+  while (r -> conns) {
+    el_close(r -> conns);
+  }
+  el_free_closed(r);
+
+  THREAD_RETURN;
+}
+
+int event_loop_supported(void) {
+  return 1;
+}
+
+int event_loop_is_running(void) {
+  return g_event_loop.running;
+}
+
+static void el_destroy_reactors(void) {
+  for (int i = 0; i < g_event_loop.count; i++) {
+    el_reactor_t * r = & g_event_loop.reactors[i];
+    el_pending_t * pending = r -> inbox;
+    while (pending) {
+      el_pending_t * next = pending -> next;
+      CLOSE_SOCKET(pending -> sock);
+      free(pending);
+      pending = next;
+    }
+    if (r -> epoll_fd >= 0) close(r -> epoll_fd);
+    if (r -> wake_fd >= 0) close(r -> wake_fd);
+    DESTROY_MUTEX(r -> inbox_cs);
+    DESTROY_MUTEX(r -> ready_cs);
+  }
+  free(g_event_loop.reactors);
+  g_event_loop.reactors = NULL;
+  g_event_loop.count = 0;
+}
+
+int event_loop_start(int reactor_threads) {
+  if (g_event_loop.running) {
+    return 1;
+  }
+
+  if (reactor_threads <= 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    reactor_threads = cpus > 0 ? (int) cpus : 1;
+  }
+  if (reactor_threads > EVENT_LOOP_MAX_REACTORS) {
+    reactor_threads = EVENT_LOOP_MAX_REACTORS;
+  }
+
+  g_event_loop.reactors = (el_reactor_t * ) calloc(reactor_threads, sizeof(el_reactor_t));
+  if (!g_event_loop.reactors) {
+    return 0;
+  }
+  g_event_loop.count = reactor_threads;
+  g_event_loop.next = 0;
+  g_event_loop.should_stop = 0;
+
+  for (int i = 0; i < reactor_threads; i++) {
+    el_reactor_t * r = & g_event_loop.reactors[i];
+    INIT_MUTEX(r -> inbox_cs);
+    INIT_MUTEX(r -> ready_cs);
+    r -> epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    r -> wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    struct epoll_event ev = {
+      0
+    };
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; // NULL marks the wakeup descriptor
+    if (r -> epoll_fd < 0 || r -> wake_fd < 0 ||
+      epoll_ctl(r -> epoll_fd, EPOLL_CTL_ADD, r -> wake_fd, & ev) != 0) {
+      log_message("Event loop: failed to create reactor %d: %s", i, strerror(errno));
+      g_event_loop.count = i + 1;
+      el_destroy_reactors();
+      return 0;
+    }
+  }
+
+  for (int i = 0; i < reactor_threads; i++) {
+    if (CREATE_THREAD(g_event_loop.reactors[i].thread, el_reactor_thread, & g_event_loop.reactors[i]) != 0) {
+      log_message("Event loop: failed to start reactor thread %d", i);
+      g_event_loop.should_stop = 1;
+      for (int j = 0; j < i; j++) {
+        JOIN_THREAD(g_event_loop.reactors[j].thread);
+      }
+      el_destroy_reactors();
+      return 0;
+    }
+  }
+
+  g_event_loop.running = 1;
+  log_message("Event loop engine started with %d reactor thread(s)", reactor_threads);
+  return 1;
+}
+
+void event_loop_stop(void) {
+  if (!g_event_loop.running) {
+    return;
+  }
+
+  g_event_loop.should_stop = 1;
+  for (int i = 0; i < g_event_loop.count; i++) {
+    uint64_t one = 1;
+    if (write(g_event_loop.reactors[i].wake_fd, & one, sizeof(one)) < 0) {
+      // Reactor still notices should_stop on its next tick
+    }
+  }
+  for (int i = 0; i < g_event_loop.count; i++) {
+    JOIN_THREAD(g_event_loop.reactors[i].thread);
+  }
+
+  el_destroy_reactors();
+  g_event_loop.running = 0;
+}
+
+int event_loop_dispatch(socket_t client_sock,
+  const struct sockaddr_in * client_addr) {
+  if (!g_event_loop.running) {
+    return 0;
+  }
+
+  el_pending_t * pending = (el_pending_t * ) malloc(sizeof(el_pending_t));
+  if (!pending) {
+    return 0;
+  }
+  pending -> sock = client_sock;
+  pending -> addr = * client_addr;
+
+  // Only the server thread dispatches, so a plain counter is enough
+  el_reactor_t * r = & g_event_loop.reactors[g_event_loop.next++ % g_event_loop.count];
+
+  LOCK_MUTEX(r -> inbox_cs);
+  pending -> next = r -> inbox;
+  r -> inbox = pending;
+  UNLOCK_MUTEX(r -> inbox_cs);
+
+  uint64_t one = 1;
+  if (write(r -> wake_fd, & one, sizeof(one)) < 0) {
+    log_message("Event loop: failed to wake reactor: %s", strerror(errno));
+  }
+  return 1;
+}
+
+#else /* !INTERCEPT_LINUX */
+
+/* The event loop engine relies on epoll; other platforms use the threaded engine */
+
+int event_loop_supported(void) {
+  return 0;
+}
+
+int event_loop_start(int reactor_threads) {
+  (void) reactor_threads;
+  return 0;
+}
+
+void event_loop_stop(void) {}
+
+int event_loop_is_running(void) {
+  return 0;
+}
+
+int event_loop_dispatch(socket_t client_sock,
+  const struct sockaddr_in * client_addr) {
+  (void) client_sock;
+  (void) client_addr;
+  return 0;
+}
+
+#endif /* INTERCEPT_LINUX */
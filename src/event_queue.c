@@ -0,0 +1,478 @@
+/*
+ * TLS MITM Proxy - Event Queue Implementation
+ *
+ * Bounded multi-producer queue based on per-slot sequence numbers: each
+ * slot records which lap of the ring it is ready for, so producers only
+ * contend on a single compare-and-swap of the enqueue position and never
+ * take a lock. Dequeue uses the same scheme, which lets a producer discard
+ * the oldest event itself under the drop-oldest policy.
+ *
+ * An idle dispatcher sleeps on the ready event and producers blocked on a
+ * full ring on the space event. Each side announces that it is about to
+ * sleep with a compare-and-swap, a full barrier, before checking the ring
+ * once more, so the other side only pays for an event when someone sleeps.
+ */
+
+#include "../include/event_queue.h"
+
+#include "../include/tls_utils.h"
+
+#include "../include/log_writer.h"
+
+typedef struct {
+  volatile unsigned int sequence;
+  event_record_t * record;
+} eq_slot_t;
+
+static struct {
+  eq_slot_t * slots;
+  unsigned int mask;
+  volatile unsigned int enqueue_pos;
+  volatile unsigned int dequeue_pos;
+  volatile int running;
+  volatile int idle;                  // Dispatcher is about to sleep on ready
+  volatile int blocked;               // Producers waiting on space
+  event_t ready;                      // Set when records arrive or on stop
+  event_t space;                      // Set when a slot frees up or on stop
+  event_queue_policy_t policy;
+  THREAD_HANDLE thread;
+  volatile unsigned long long enqueued;
+  volatile unsigned long long dispatched;
+  volatile unsigned long long dropped;
+} g_event_queue = {
+  0
+};
+
+static int eq_try_push(event_record_t * record) {
+  unsigned int pos = ATOMIC_LOAD(g_event_queue.enqueue_pos);
+
+  while (1) {
+    eq_slot_t * slot = & g_event_queue.slots[pos & g_event_queue.mask];
+    unsigned int sequence = ATOMIC_LOAD(slot -> sequence);
+    int diff = (int)(sequence - pos);
+
+    if (diff == 0) {
+      if (ATOMIC_CAS(g_event_queue.enqueue_pos, pos, pos + 1)) {
+        slot -> record = record;
+        ATOMIC_STORE(slot -> sequence, pos + 1);
+        return 1;
+      }
+      pos = ATOMIC_LOAD(g_event_queue.enqueue_pos);
+    } else if (diff < 0) {
+      return 0; // Full
+    } else {
+      pos = ATOMIC_LOAD(g_event_queue.enqueue_pos);
+    }
+  }
+}
+
+static event_record_t * eq_try_pop(void) {
+  unsigned int pos = ATOMIC_LOAD(g_event_queue.dequeue_pos);
+
+  while (1) {
+    eq_slot_t * slot = & g_event_queue.slots[pos & g_event_queue.mask];
+    unsigned int sequence = ATOMIC_LOAD(slot -> sequence);
+    int diff = (int)(sequence - (pos + 1));
+
+    if (diff == 0) {
+      if (ATOMIC_CAS(g_event_queue.dequeue_pos, pos, pos + 1)) {
+        event_record_t * record = slot -> record;
+        ATOMIC_STORE(slot -> sequence, pos + g_event_queue.mask + 1);
+        return record;
+      }
+      pos = ATOMIC_LOAD(g_event_queue.dequeue_pos);
+    } else if (diff < 0) {
+      return NULL; // Empty
+    } else {
+      pos = ATOMIC_LOAD(g_event_queue.dequeue_pos);
+    }
+  }
+}
+
+static void eq_free_record(event_record_t * record) {
+  free(record -> data);
+  http_message_free(record -> http);
+  free(record -> spans);
+  free(record);
+}
+
+/*
+ * Deliver a payload as a log entry: to the raw log callback and its
+ * keyword tags to the tag callback, then formatted once for the string
+ * log callback and the log file if either is in use.
+ */
+static void eq_deliver_log(const event_record_t * record, const unsigned char * data, int data_length,
+  int packet_id, const int * tag_ids, int tag_count) {
+  send_raw_log_entry(record -> timestamp, record -> direction, record -> src_ip, record -> dst_ip,
+    record -> dst_port, data, data_length, record -> connection_id, packet_id);
+  if (tag_count > 0) {
+    send_tag_entry(record -> connection_id, packet_id, tag_ids, tag_count);
+  }
+
+  if (g_log_callback || config.log_fp) {
+    char message[BUFFER_SIZE];
+    const char * message_type = format_log_message(data, data_length, message, sizeof(message));
+
+    send_log_entry(record -> timestamp, record -> src_ip, record -> dst_ip, record -> dst_port,
+      message_type, message, record -> connection_id, packet_id);
+
+    if (config.log_fp) {
+      char tags[KEYWORD_TAGS_MAX_PER_EVENT * 12 + 8] = "";
+      size_t used = 0;
+      for (int i = 0; i < tag_count; i++) {
+        used += snprintf(tags + used, sizeof(tags) - used, "%s%d", i ? "," : "[tags ", tag_ids[i]);
+      }
+      if (used > 0) {
+        snprintf(tags + used, sizeof(tags) - used, "] ");
+      }
+      log_writer_printf("%-15s | %-15s | %-5d | %s%s\n",
+        record -> src_ip, record -> dst_ip, record -> dst_port, tags, message);
+    }
+  }
+}
+
+/*
+ * Deliver one event. HTTP messages and HTTP/2 data pieces go to their own
+ * callbacks first; they take the log path too when they replace the chunk
+ * log entries, a message as a whole and data pieces one by one.
+ */
+static void eq_dispatch(event_record_t * record) {
+  int log_record = record -> kind == EVENT_LOG_ENTRY || record -> as_log_entry;
+
+  if (record -> kind == EVENT_HTTP_MESSAGE) {
+    send_http_message_entry(record -> timestamp, record -> direction, record -> src_ip, record -> dst_ip,
+      record -> dst_port, & record -> http -> info, record -> data, record -> data_length,
+      record -> connection_id, record -> packet_id);
+  } else if (record -> kind == EVENT_HTTP2_DATA) {
+    for (int i = 0; i < record -> span_count; i++) {
+      const http2_span_t * span = & record -> spans[i];
+      send_http2_data_entry(record -> timestamp, record -> direction, record -> src_ip, record -> dst_ip,
+        record -> dst_port, span -> stream_id, record -> data + span -> offset, span -> length,
+        span -> end_stream, record -> connection_id, span -> packet_id);
+    }
+    for (int i = 0; i < record -> span_count && !log_record; i++) {
+      const http2_span_t * span = & record -> spans[i];
+      if (span -> length > 0) {
+        eq_deliver_log(record, record -> data + span -> offset, span -> length, span -> packet_id,
+          span -> tags, span -> tag_count);
+      }
+    }
+  }
+
+  if (log_record) {
+    eq_deliver_log(record, record -> data, record -> data_length, record -> packet_id,
+      record -> tags, record -> tag_count);
+  }
+
+  ATOMIC_INCREMENT64(g_event_queue.dispatched);
+  eq_free_record(record);
+}
+
+/* Dequeue for the dispatcher, letting a producer blocked on a full ring know about the free slot */
+static event_record_t * eq_pop(void) {
+  event_record_t * record = eq_try_pop();
+  // Full barrier read: pairs with the increment in eq_submit()
+  if (record && !ATOMIC_CAS(g_event_queue.blocked, 0, 0)) {
+    SET_EVENT(g_event_queue.space);
+  }
+  return record;
+}
+
+static THREAD_RETURN_TYPE eq_dispatcher_thread(void * arg) {
+  (void) arg;
+
+  while (ATOMIC_LOAD(g_event_queue.running)) {
+    event_record_t * record = eq_pop();
+    if (!record) {
+      // Announce the sleep, then look once more so no record is missed
+      RESET_EVENT(g_event_queue.ready);
+      ATOMIC_CAS(g_event_queue.idle, 0, 1);
+      record = eq_pop();
+      if (!record) {
+        if (ATOMIC_LOAD(g_event_queue.running)) {
+          WAIT_EVENT(g_event_queue.ready, EVENT_WAIT_FOREVER);
+        }
+        continue;
+      }
+      ATOMIC_CAS(g_event_queue.idle, 1, 0);
+    }
+    eq_dispatch(record);
+  }
+
+  // Deliver whatever is still queued before exiting
+  event_record_t * record;
+  while ((record = eq_try_pop()) != NULL) {
+    eq_dispatch(record);
+  }
+
+  THREAD_RETURN;
+}
+
+/*
+ * Allocate the ring (on first start or when the configured capacity
+ * changed) and start the dispatcher thread.
+ */
+int event_queue_start(void) {
+  if (g_event_queue.running) {
+    return 1;
+  }
+
+  unsigned int capacity = 2;
+  while ((int) capacity < config.event_queue_capacity && capacity < EVENT_QUEUE_MAX_CAPACITY) {
+    capacity <<= 1;
+  }
+
+  // Only resize an empty ring; leftovers are dispatched once the thread runs
+  if (!g_event_queue.slots || (capacity != g_event_queue.mask + 1 &&
+      g_event_queue.enqueue_pos == g_event_queue.dequeue_pos)) {
+    eq_slot_t * slots = (eq_slot_t * ) calloc(capacity, sizeof(eq_slot_t));
+    if (!slots) {
+      log_message("Event queue: failed to allocate %u slots", capacity);
+      return 0;
+    }
+    for (unsigned int i = 0; i < capacity; i++) {
+      slots[i].sequence = i;
+    }
+    free(g_event_queue.slots);
+    g_event_queue.slots = slots;
+    g_event_queue.mask = capacity - 1;
+    g_event_queue.enqueue_pos = 0;
+    g_event_queue.dequeue_pos = 0;
+  }
+
+  if (!g_event_queue.ready) {
+    g_event_queue.ready = CREATE_EVENT();
+    g_event_queue.space = CREATE_EVENT();
+    if (!g_event_queue.ready || !g_event_queue.space) {
+      log_message("Event queue: failed to create events");
+      return 0;
+    }
+  }
+
+  g_event_queue.policy = config.event_queue_policy;
+  g_event_queue.idle = 0;
+  ATOMIC_STORE(g_event_queue.running, 1);
+  if (CREATE_THREAD(g_event_queue.thread, eq_dispatcher_thread, NULL) != 0) {
+    ATOMIC_STORE(g_event_queue.running, 0);
+    log_message("Event queue: failed to start dispatcher thread");
+    return 0;
+  }
+  return 1;
+}
+
+/* Stop the dispatcher after it has drained the queue */
+void event_queue_stop(void) {
+  if (!g_event_queue.running) {
+    return;
+  }
+
+  ATOMIC_STORE(g_event_queue.running, 0);
+  SET_EVENT(g_event_queue.ready);
+  SET_EVENT(g_event_queue.space); // Blocked producers deliver synchronously from now on
+  JOIN_THREAD(g_event_queue.thread);
+  #ifdef INTERCEPT_WINDOWS
+  CloseHandle(g_event_queue.thread);
+  #endif
+  g_event_queue.thread = INVALID_THREAD_ID;
+}
+
+/* Free the ring and anything left in it */
+void event_queue_cleanup(void) {
+  event_queue_stop();
+
+  if (g_event_queue.slots) {
+    event_record_t * record;
+    while ((record = eq_try_pop()) != NULL) {
+      eq_free_record(record);
+    }
+    free(g_event_queue.slots);
+    g_event_queue.slots = NULL;
+  }
+  if (g_event_queue.ready) {
+    CLOSE_EVENT(g_event_queue.ready);
+    CLOSE_EVENT(g_event_queue.space);
+    g_event_queue.ready = NULL;
+    g_event_queue.space = NULL;
+  }
+}
+
+static event_record_t * eq_new_record(event_kind_t kind, const char * direction,
+  const char * src_ip, const char * dst_ip, int dst_port, int connection_id, int packet_id,
+    const int * tags, int tag_count) {
+  event_record_t * record = (event_record_t * ) calloc(1, sizeof(event_record_t));
+  if (!record) {
+    ATOMIC_INCREMENT64(g_event_queue.dropped);
+    return NULL;
+  }
+
+  record -> kind = kind;
+  record -> timestamp = time(NULL);
+  record -> connection_id = connection_id;
+  record -> packet_id = packet_id;
+  strncpy(record -> direction, direction, sizeof(record -> direction) - 1);
+  record -> direction[sizeof(record -> direction) - 1] = '\0';
+  strncpy(record -> src_ip, src_ip, sizeof(record -> src_ip) - 1);
+  record -> src_ip[sizeof(record -> src_ip) - 1] = '\0';
+  strncpy(record -> dst_ip, dst_ip, sizeof(record -> dst_ip) - 1);
+  record -> dst_ip[sizeof(record -> dst_ip) - 1] = '\0';
+  record -> dst_port = dst_port;
+  record -> tag_count = tag_count < KEYWORD_TAGS_MAX_PER_EVENT ? tag_count : KEYWORD_TAGS_MAX_PER_EVENT;
+  if (record -> tag_count > 0) {
+    memcpy(record -> tags, tags, record -> tag_count * sizeof(int));
+  }
+  return record;
+}
+
+/*
+ * EVENT_QUEUE_BLOCK: sleep until the dispatcher frees a slot, then push.
+ * Returns 0 if the dispatcher stopped first.
+ */
+static int eq_wait_for_space(event_record_t * record) {
+  int pushed = 0;
+
+  ATOMIC_INCREMENT(g_event_queue.blocked);
+  while (ATOMIC_LOAD(g_event_queue.running)) {
+    RESET_EVENT(g_event_queue.space);
+    if (eq_try_push(record)) {
+      pushed = 1;
+      break;
+    }
+    if (!ATOMIC_LOAD(g_event_queue.running)) {
+      break;
+    }
+    WAIT_EVENT(g_event_queue.space, EVENT_WAIT_FOREVER);
+  }
+  ATOMIC_DECREMENT(g_event_queue.blocked);
+  return pushed;
+}
+
+/*
+ * Hand a record to the dispatcher thread. Without a running dispatcher
+ * the record is delivered synchronously, as before.
+ */
+static void eq_submit(event_record_t * record) {
+  if (!ATOMIC_LOAD(g_event_queue.running)) {
+    eq_dispatch(record);
+    return;
+  }
+
+  while (!eq_try_push(record)) {
+    if (g_event_queue.policy == EVENT_QUEUE_DROP_NEWEST) {
+      eq_free_record(record);
+      ATOMIC_INCREMENT64(g_event_queue.dropped);
+      return;
+    } else if (g_event_queue.policy == EVENT_QUEUE_DROP_OLDEST) {
+      event_record_t * oldest = eq_try_pop();
+      if (oldest) {
+        eq_free_record(oldest);
+        ATOMIC_INCREMENT64(g_event_queue.dropped);
+      }
+    } else if (!eq_wait_for_space(record)) {
+      // Dispatcher went away while we were waiting for room
+      eq_dispatch(record);
+      return;
+    } else {
+      break;
+    }
+  }
+
+  ATOMIC_INCREMENT64(g_event_queue.enqueued);
+
+  // Full barrier, pairs with the dispatcher's announcement
+  if (ATOMIC_CAS(g_event_queue.idle, 1, 0)) {
+    SET_EVENT(g_event_queue.ready);
+  }
+}
+
+/* Record for a chunk of relayed data, with its own copy of the bytes */
+static event_record_t * eq_new_chunk_record(event_kind_t kind, const char * direction,
+  const char * src_ip, const char * dst_ip, int dst_port,
+    const unsigned char * data, int data_length, int connection_id, int packet_id,
+      const int * tags, int tag_count) {
+  event_record_t * record = eq_new_record(kind, direction, src_ip, dst_ip, dst_port,
+    connection_id, packet_id, tags, tag_count);
+  if (!record) {
+    return NULL;
+  }
+
+  record -> data_length = data_length > 0 ? data_length : 0;
+  record -> data = (unsigned char * ) malloc(record -> data_length + 1);
+  if (!record -> data) {
+    free(record);
+    ATOMIC_INCREMENT64(g_event_queue.dropped);
+    return NULL;
+  }
+  if (record -> data_length > 0) {
+    memcpy(record -> data, data, record -> data_length);
+  }
+  return record;
+}
+
+/* Queue a log entry */
+void event_queue_push_log(const char * direction,
+  const char * src_ip, const char * dst_ip, int dst_port,
+    const unsigned char * data, int data_length, int connection_id, int packet_id,
+      const int * tags, int tag_count) {
+  event_record_t * record = eq_new_chunk_record(EVENT_LOG_ENTRY, direction, src_ip, dst_ip, dst_port,
+    data, data_length, connection_id, packet_id, tags, tag_count);
+  if (record) {
+    eq_submit(record);
+  }
+}
+
+/*
+ * Queue a chunk with the HTTP/2 DATA payload pieces found in it (the
+ * record takes over spans). The pieces are offsets into the one copy of
+ * the chunk, so payloads are not copied again. as_log_entry logs the
+ * chunk itself, otherwise each piece is logged as an entry of its own.
+ */
+void event_queue_push_http2_data(const char * direction, const char * src_ip, const char * dst_ip, int dst_port,
+  const unsigned char * data, int data_length, int connection_id, int packet_id,
+    const int * tags, int tag_count, http2_span_t * spans, int span_count, int as_log_entry) {
+  event_record_t * record = eq_new_chunk_record(EVENT_HTTP2_DATA, direction, src_ip, dst_ip, dst_port,
+    data, data_length, connection_id, packet_id, tags, tag_count);
+  if (!record) {
+    free(spans);
+    return;
+  }
+
+  record -> spans = spans;
+  record -> span_count = span_count;
+  record -> as_log_entry = as_log_entry;
+  eq_submit(record);
+}
+
+/*
+ * Queue a reassembled HTTP message. The record takes over the message and
+ * its buffer, so the bytes are not copied again.
+ */
+void event_queue_push_http(const char * direction, const char * src_ip, const char * dst_ip, int dst_port,
+  http_message_t * message, int connection_id, int packet_id, int as_log_entry) {
+  event_record_t * record = eq_new_record(EVENT_HTTP_MESSAGE, direction, src_ip, dst_ip, dst_port,
+    connection_id, packet_id, message -> tags, message -> tag_count);
+  if (!record) {
+    http_message_free(message);
+    return;
+  }
+
+  record -> http = message;
+  record -> as_log_entry = as_log_entry;
+  record -> data = message -> data;
+  record -> data_length = message -> len;
+  message -> data = NULL;
+
+  eq_submit(record);
+}
+
+void event_queue_get_stats(event_queue_stats_t * stats) {
+  memset(stats, 0, sizeof( * stats));
+  stats -> enqueued = g_event_queue.enqueued;
+  stats -> dispatched = g_event_queue.dispatched;
+  stats -> dropped = g_event_queue.dropped;
+  if (g_event_queue.slots) {
+    stats -> capacity = (int)(g_event_queue.mask + 1);
+    stats -> depth = (int)(ATOMIC_LOAD(g_event_queue.enqueue_pos) - ATOMIC_LOAD(g_event_queue.dequeue_pos));
+  } else {
+    stats -> capacity = config.event_queue_capacity;
+  }
+}
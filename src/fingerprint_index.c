@@ -0,0 +1,139 @@
+/*
+ * TLS MITM Proxy - ClientHello Index Implementation
+ *
+ * A hash table (see hash_table.h) of heap entries keyed by connection_id.
+ */
+
+#include "../include/fingerprint_index.h"
+
+#include "../include/hash_table.h"
+
+#include "../include/pattern_match.h"
+
+typedef struct {
+  int connection_id;
+  client_hello_info_t hello;
+} index_entry_t;
+
+static size_t index_hash(int connection_id) {
+  return hash_table_mix((uint32_t) connection_id);
+}
+
+static size_t hash_entry(const void * entry) {
+  return index_hash(((const index_entry_t * ) entry) -> connection_id);
+}
+
+static int match_entry(const void * entry, const void * key) {
+  return ((const index_entry_t * ) entry) -> connection_id == * (const int * ) key;
+}
+
+static struct {
+  mutex_t cs;
+  int initialized;
+  hash_table_t table;
+} g_index = {
+  0
+};
+
+static long index_find(int connection_id) {
+  return hash_table_find( & g_index.table, index_hash(connection_id), match_entry, & connection_id);
+}
+
+int init_fingerprint_index(void) {
+  if (g_index.initialized) {
+    return 1;
+  }
+  INIT_MUTEX(g_index.cs);
+  g_index.table.hash = hash_entry;
+  g_index.initialized = 1;
+  return 1;
+}
+
+/* Record the ClientHello of a connection, replacing an earlier one. Returns 0 if out of memory. */
+int fingerprint_index_add(int connection_id, const client_hello_info_t * hello) {
+  int ok = 1;
+
+  LOCK_MUTEX(g_index.cs);
+  long index = index_find(connection_id);
+  if (index >= 0) {
+    ((index_entry_t * ) g_index.table.slots[index]) -> hello = * hello;
+  } else {
+    index_entry_t * entry = (index_entry_t * ) malloc(sizeof(index_entry_t));
+    if (entry) {
+      entry -> connection_id = connection_id;
+      entry -> hello = * hello;
+    }
+    if (!entry || !hash_table_insert( & g_index.table, entry)) {
+      free(entry);
+      ok = 0;
+    }
+  }
+  UNLOCK_MUTEX(g_index.cs);
+  return ok;
+}
+
+/* Forget a closed connection; does nothing if it has no entry */
+void fingerprint_index_remove(int connection_id) {
+  LOCK_MUTEX(g_index.cs);
+  long index = index_find(connection_id);
+  if (index >= 0) {
+    free(g_index.table.slots[index]);
+    hash_table_remove_at( & g_index.table, (size_t) index);
+  }
+  UNLOCK_MUTEX(g_index.cs);
+}
+
+/* Copy the ClientHello of an open connection; returns 0 if there is none */
+int fingerprint_index_get(int connection_id, client_hello_info_t * hello) {
+  LOCK_MUTEX(g_index.cs);
+  long index = index_find(connection_id);
+  if (index >= 0) {
+    * hello = ((const index_entry_t * ) g_index.table.slots[index]) -> hello;
+  }
+  UNLOCK_MUTEX(g_index.cs);
+  return index >= 0;
+}
+
+/*
+ * Collect the connections whose JA3 or JA4 matches a glob. Copies up to
+ * max_ids ids and returns the number of matches, or -1 if the glob could
+ * not be compiled.
+ */
+int fingerprint_index_find(const char * fingerprint, int * connection_ids, int max_ids) {
+  char * glob = pattern_glob_compile(fingerprint);
+  int found = 0;
+
+  if (!glob) {
+    return -1;
+  }
+  LOCK_MUTEX(g_index.cs);
+  for (size_t i = 0; i < g_index.table.capacity; i++) {
+    const index_entry_t * entry = (const index_entry_t * ) g_index.table.slots[i];
+    if (!entry) {
+      continue;
+    }
+    if ((entry -> hello.ja3[0] && pattern_glob_match(glob, entry -> hello.ja3)) ||
+      (entry -> hello.ja4[0] && pattern_glob_match(glob, entry -> hello.ja4))) {
+      if (connection_ids && found < max_ids) {
+        connection_ids[found] = entry -> connection_id;
+      }
+      found++;
+    }
+  }
+  UNLOCK_MUTEX(g_index.cs);
+  free(glob);
+  return found;
+}
+
+/* Free all entries; no connection may be open */
+void cleanup_fingerprint_index(void) {
+  if (!g_index.initialized) {
+    return;
+  }
+  for (size_t i = 0; i < g_index.table.capacity; i++) {
+    free(g_index.table.slots[i]);
+  }
+  hash_table_free( & g_index.table);
+  DESTROY_MUTEX(g_index.cs);
+  g_index.initialized = 0;
+}
@@ -0,0 +1,112 @@
+/*
+ * TLS MITM Proxy - Hash Table Implementation
+ *
+ * Slots hold entry pointers, NULL when free. An entry sits at or after
+ * its home slot (hash & mask) with no free slot in between, which is what
+ * lookups rely on to stop at the first free slot and what removal
+ * restores by shifting entries back into the hole.
+ */
+
+#include "../include/hash_table.h"
+
+#define HASH_TABLE_INITIAL_CAPACITY 64
+
+/* splitmix64 finalizer, for keys that are small integers */
+size_t hash_table_mix(uint64_t key) {
+  uint64_t x = key;
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return (size_t) x;
+}
+
+/* Slot of the entry with key, or -1; hash must be the key's hash */
+long hash_table_find(const hash_table_t * table, size_t hash, hash_match_fn_t match, const void * key) {
+  if (table -> count == 0) {
+    return -1;
+  }
+
+  size_t mask = table -> capacity - 1;
+  size_t i = hash & mask;
+  while (table -> slots[i]) {
+    if (match(table -> slots[i], key)) {
+      return (long) i;
+    }
+    i = (i + 1) & mask;
+  }
+  return -1;
+}
+
+static void table_place(hash_table_t * table, void * entry) {
+  size_t mask = table -> capacity - 1;
+  size_t i = table -> hash(entry) & mask;
+  while (table -> slots[i]) {
+    i = (i + 1) & mask;
+  }
+  table -> slots[i] = entry;
+  table -> count++;
+}
+
+/*
+ * Add an entry whose key is not in the table yet. Returns 0 if the table
+ * could not grow; the entry is then not stored.
+ */
+int hash_table_insert(hash_table_t * table, void * entry) {
+  // Keep the load factor at or below one half
+  if ((table -> count + 1) * 2 > table -> capacity) {
+    size_t capacity = table -> capacity ? table -> capacity * 2 : HASH_TABLE_INITIAL_CAPACITY;
+    void ** slots = (void ** ) calloc(capacity, sizeof(void * ));
+    if (!slots) {
+      return 0;
+    }
+
+    void ** old_slots = table -> slots;
+    size_t old_capacity = table -> capacity;
+    table -> slots = slots;
+    table -> capacity = capacity;
+    table -> count = 0;
+    for (size_t i = 0; i < old_capacity; i++) {
+      if (old_slots[i]) {
+        table_place(table, old_slots[i]);
+      }
+    }
+    free(old_slots);
+  }
+
+  table_place(table, entry);
+  return 1;
+}
+
+/* Empty a slot returned by hash_table_find(); the entry itself is not freed */
+void hash_table_remove_at(hash_table_t * table, size_t index) {
+  size_t mask = table -> capacity - 1;
+  size_t i = index;
+  size_t j = i;
+
+  table -> slots[i] = NULL;
+  table -> count--;
+
+  // Shift back entries whose probe sequence passes through the hole
+  while (1) {
+    j = (j + 1) & mask;
+    if (!table -> slots[j]) {
+      break;
+    }
+    size_t home = table -> hash(table -> slots[j]) & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      table -> slots[i] = table -> slots[j];
+      table -> slots[j] = NULL;
+      i = j;
+    }
+  }
+}
+
+/* Free the slot array; the owner frees the entries first if it owns them */
+void hash_table_free(hash_table_t * table) {
+  free(table -> slots);
+  table -> slots = NULL;
+  table -> capacity = 0;
+  table -> count = 0;
+}
@@ -0,0 +1,349 @@
+/*
+ * TLS MITM Proxy - HPACK Header Decoder Implementation
+ *
+ * The Huffman code of RFC 7541 is canonical, so it is decoded from the
+ * number of codes of each length and the symbols in code order, without a
+ * decoding tree. Strings are decoded straight into the message buffer and
+ * entries added to the dynamic table are copied from there.
+ */
+
+#include "../include/hpack.h"
+
+#define HPACK_STATIC_ENTRIES 61
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_HUFFMAN_MAX_BITS 30
+#define HPACK_HUFFMAN_EOS 256
+
+static const struct {
+  const char * name;
+  const char * value;
+} hpack_static_table[HPACK_STATIC_ENTRIES] = {
+  {":authority", ""},
+  {":method", "GET"},
+  {":method", "POST"},
+  {":path", "/"},
+  {":path", "/index.html"},
+  {":scheme", "http"},
+  {":scheme", "https"},
+  {":status", "200"},
+  {":status", "204"},
+  {":status", "206"},
+  {":status", "304"},
+  {":status", "400"},
+  {":status", "404"},
+  {":status", "500"},
+  {"accept-charset", ""},
+  {"accept-encoding", "gzip, deflate"},
+  {"accept-language", ""},
+  {"accept-ranges", ""},
+  {"accept", ""},
+  {"access-control-allow-origin", ""},
+  {"age", ""},
+  {"allow", ""},
+  {"authorization", ""},
+  {"cache-control", ""},
+  {"content-disposition", ""},
+  {"content-encoding", ""},
+  {"content-language", ""},
+  {"content-length", ""},
+  {"content-location", ""},
+  {"content-range", ""},
+  {"content-type", ""},
+  {"cookie", ""},
+  {"date", ""},
+  {"etag", ""},
+  {"expect", ""},
+  {"expires", ""},
+  {"from", ""},
+  {"host", ""},
+  {"if-match", ""},
+  {"if-modified-since", ""},
+  {"if-none-match", ""},
+  {"if-range", ""},
+  {"if-unmodified-since", ""},
+  {"last-modified", ""},
+  {"link", ""},
+  {"location", ""},
+  {"max-forwards", ""},
+  {"proxy-authenticate", ""},
+  {"proxy-authorization", ""},
+  {"range", ""},
+  {"referer", ""},
+  {"refresh", ""},
+  {"retry-after", ""},
+  {"server", ""},
+  {"set-cookie", ""},
+  {"strict-transport-security", ""},
+  {"transfer-encoding", ""},
+  {"user-agent", ""},
+  {"vary", ""},
+  {"via", ""},
+  {"www-authenticate", ""}
+};
+
+/* Number of Huffman codes of each bit length */
+static const unsigned char hpack_huffman_count[HPACK_HUFFMAN_MAX_BITS + 1] = {
+  0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3, 0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+
+/* Symbols ordered by code (length, then value); 256 is EOS */
+static const unsigned short hpack_huffman_symbols[257] = {
+  48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+  52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+  110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+  77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118,
+  119, 120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39,
+  43, 124, 35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+  195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+  179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+  163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+  233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+  158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142,
+  144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+  200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+  212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+  2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+  21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22,
+  256
+};
+
+void hpack_decoder_init(hpack_decoder_t * decoder) {
+  memset(decoder, 0, sizeof(hpack_decoder_t));
+  decoder -> max_size = HPACK_DEFAULT_TABLE_SIZE;
+}
+
+void hpack_decoder_free(hpack_decoder_t * decoder) {
+  for (int i = 0; i < decoder -> count; i++) {
+    free(decoder -> entries[(decoder -> head + i) % decoder -> slots].data);
+  }
+  free(decoder -> entries);
+  memset(decoder, 0, sizeof(hpack_decoder_t));
+}
+
+static void evict_to(hpack_decoder_t * decoder, int max_size) {
+  while (decoder -> count > 0 && decoder -> size > max_size) {
+    hpack_entry_t * oldest = & decoder -> entries[(decoder -> head + decoder -> count - 1) % decoder -> slots];
+    decoder -> size -= oldest -> name_length + oldest -> value_length + HPACK_ENTRY_OVERHEAD;
+    free(oldest -> data);
+    oldest -> data = NULL;
+    decoder -> count--;
+  }
+}
+
+/* Insert a field as the newest entry, evicting old ones to make room */
+static int table_add(hpack_decoder_t * decoder, const unsigned char * name, int name_length,
+  const unsigned char * value, int value_length) {
+  int size = name_length + value_length + HPACK_ENTRY_OVERHEAD;
+
+  evict_to(decoder, decoder -> max_size - size);
+  if (size > decoder -> max_size) {
+    return 1; // Larger than the whole table: it just empties it
+  }
+
+  if (decoder -> count == decoder -> slots) {
+    int slots = decoder -> slots ? decoder -> slots * 2 : 16;
+    hpack_entry_t * entries = (hpack_entry_t * ) calloc(slots, sizeof(hpack_entry_t));
+    if (!entries) {
+      return 0;
+    }
+    for (int i = 0; i < decoder -> count; i++) {
+      entries[i] = decoder -> entries[(decoder -> head + i) % decoder -> slots];
+    }
+    free(decoder -> entries);
+    decoder -> entries = entries;
+    decoder -> slots = slots;
+    decoder -> head = 0;
+  }
+
+  unsigned char * data = (unsigned char * ) malloc(name_length + value_length + 1);
+  if (!data) {
+    return 0;
+  }
+  memcpy(data, name, name_length);
+  memcpy(data + name_length, value, value_length);
+
+  decoder -> head = (decoder -> head + decoder -> slots - 1) % decoder -> slots;
+  hpack_entry_t * entry = & decoder -> entries[decoder -> head];
+  entry -> data = data;
+  entry -> name_length = name_length;
+  entry -> value_length = value_length;
+  decoder -> count++;
+  decoder -> size += size;
+  return 1;
+}
+
+/* Resolve a static (1-61) or dynamic (62 and up) table index */
+static int table_get(const hpack_decoder_t * decoder, unsigned int index,
+  const unsigned char ** name, int * name_length, const unsigned char ** value, int * value_length) {
+  if (index == 0) {
+    return 0;
+  }
+  if (index <= HPACK_STATIC_ENTRIES) {
+    * name = (const unsigned char * ) hpack_static_table[index - 1].name;
+    * name_length = (int) strlen(hpack_static_table[index - 1].name);
+    * value = (const unsigned char * ) hpack_static_table[index - 1].value;
+    * value_length = (int) strlen(hpack_static_table[index - 1].value);
+    return 1;
+  }
+  index -= HPACK_STATIC_ENTRIES + 1;
+  if (index >= (unsigned int) decoder -> count) {
+    return 0;
+  }
+  const hpack_entry_t * entry = & decoder -> entries[(decoder -> head + index) % decoder -> slots];
+  * name = entry -> data;
+  * name_length = entry -> name_length;
+  * value = entry -> data + entry -> name_length;
+  * value_length = entry -> value_length;
+  return 1;
+}
+
+/* Integer with an N-bit prefix (RFC 7541 section 5.1) */
+static int decode_integer(const unsigned char ** p, const unsigned char * end, int prefix_bits, unsigned int * value) {
+  unsigned int max = (1u << prefix_bits) - 1;
+  unsigned int v = ** p & max;
+
+  ( * p) ++;
+  if (v < max) {
+    * value = v;
+    return 1;
+  }
+  for (int shift = 0; * p < end && shift <= 21; shift += 7) {
+    unsigned char b = * ( * p) ++;
+    v += (unsigned int)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      * value = v;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int huffman_decode(const unsigned char * src, int len, http_message_t * message) {
+  // Codes are at least 5 bits long, which bounds the output
+  if (!http_message_reserve(message, len * 8 / 5 + 1)) {
+    return 0;
+  }
+
+  unsigned char * out = message -> data + message -> len;
+  int code = 0, first = 0, index = 0, bits = 0, ones = 1;
+  for (int i = 0; i < len; i++) {
+    for (int shift = 7; shift >= 0; shift--) {
+      int bit = (src[i] >> shift) & 1;
+      code |= bit;
+      ones &= bit;
+      bits++;
+      int count = hpack_huffman_count[bits];
+      if (code - first < count) {
+        int symbol = hpack_huffman_symbols[index + code - first];
+        if (symbol == HPACK_HUFFMAN_EOS) {
+          return 0;
+        }
+        * out++ = (unsigned char) symbol;
+        code = first = index = bits = 0;
+        ones = 1;
+        continue;
+      }
+      if (bits == HPACK_HUFFMAN_MAX_BITS) {
+        return 0;
+      }
+      index += count;
+      first = (first + count) << 1;
+      code <<= 1;
+    }
+  }
+  // Padding is the start of EOS: at most 7 one bits
+  if (bits > 7 || !ones) {
+    return 0;
+  }
+  message -> len = (int)(out - message -> data);
+  return 1;
+}
+
+/* String literal (RFC 7541 section 5.2), appended to the message */
+static int decode_string(const unsigned char ** p, const unsigned char * end, http_message_t * message) {
+  int huffman = ** p & 0x80;
+  unsigned int length;
+
+  if (!decode_integer(p, end, 7, & length) || length > (unsigned int)(end - * p)) {
+    return 0;
+  }
+  int ok = huffman ? huffman_decode( * p, (int) length, message) : http_message_append(message, * p, (int) length);
+  * p += length;
+  return ok;
+}
+
+/*
+ * Decode a complete header block and append each field to message as a
+ * "name: value" line with its offsets. Returns 0 on a malformed block;
+ * the dynamic table can no longer be trusted after that.
+ */
+int hpack_decode(hpack_decoder_t * decoder, const unsigned char * block, int len, http_message_t * message) {
+  const unsigned char * p = block;
+  const unsigned char * end = block + len;
+
+  while (p < end) {
+    unsigned char first = * p;
+    const unsigned char * name, * value;
+    int name_length, value_length;
+    unsigned int index;
+
+    if ((first & 0xe0) == 0x20) {
+      // Dynamic table size update
+      if (!decode_integer( & p, end, 5, & index) || index > HPACK_MAX_TABLE_SIZE) {
+        return 0;
+      }
+      decoder -> max_size = (int) index;
+      evict_to(decoder, decoder -> max_size);
+      continue;
+    }
+
+    int name_offset = message -> len;
+    int value_offset;
+    int indexing = 0;
+    if (first & 0x80) {
+      // Indexed field
+      if (!decode_integer( & p, end, 7, & index) ||
+        !table_get(decoder, index, & name, & name_length, & value, & value_length) ||
+        !http_message_append(message, name, name_length) || !http_message_append(message, ": ", 2)) {
+        return 0;
+      }
+      value_offset = message -> len;
+      if (!http_message_append(message, value, value_length)) {
+        return 0;
+      }
+    } else {
+      // Literal, with incremental indexing (01), without (0000) or never indexed (0001)
+      indexing = (first & 0xc0) == 0x40;
+      if (!decode_integer( & p, end, indexing ? 6 : 4, & index)) {
+        return 0;
+      }
+      if (index > 0) {
+        if (!table_get(decoder, index, & name, & name_length, & value, & value_length) ||
+          !http_message_append(message, name, name_length)) {
+          return 0;
+        }
+      } else if (p >= end || !decode_string( & p, end, message)) {
+        return 0;
+      }
+      if (!http_message_append(message, ": ", 2)) {
+        return 0;
+      }
+      value_offset = message -> len;
+      if (p >= end || !decode_string( & p, end, message)) {
+        return 0;
+      }
+    }
+
+    name_length = value_offset - 2 - name_offset;
+    value_length = message -> len - value_offset;
+    if (!http_message_append(message, "\r\n", 2) ||
+      !http_message_add_header(message, name_offset, name_length, value_offset, value_length)) {
+      return 0;
+    }
+    if (indexing && !table_add(decoder, message -> data + name_offset, name_length,
+        message -> data + value_offset, value_length)) {
+      return 0;
+    }
+  }
+  return 1;
+}
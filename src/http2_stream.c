@@ -0,0 +1,317 @@
+/*
+ * TLS MITM Proxy - HTTP/2 Frame Decoder Implementation
+ *
+ * Only the 9-byte frame header and header block fragments are ever
+ * buffered. DATA payloads are reported piece by piece as they arrive and
+ * every other frame is skipped by length, so the decoder keeps up with the
+ * relay whatever the size of the bodies. Any framing or HPACK error stops
+ * the decoder for the rest of the connection: without the full header
+ * history the HPACK table can no longer be trusted.
+ */
+
+#include "../include/http2_stream.h"
+
+#define HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_LEN 24
+
+// Frame types
+#define HTTP2_DATA 0x0
+#define HTTP2_HEADERS 0x1
+#define HTTP2_SETTINGS 0x4
+#define HTTP2_PUSH_PROMISE 0x5
+#define HTTP2_CONTINUATION 0x9
+
+// Frame flags
+#define HTTP2_FLAG_END_STREAM 0x01
+#define HTTP2_FLAG_END_HEADERS 0x04
+#define HTTP2_FLAG_PADDED 0x08
+#define HTTP2_FLAG_PRIORITY 0x20
+
+static int stream_id_at(const unsigned char * p) {
+  return ((p[0] & 0x7f) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static int fail_stream(http2_stream_t * stream) {
+  http2_stream_stop(stream);
+  return 0;
+}
+
+static int header_is(const http_message_t * message, const http_header_field_t * header, const char * name) {
+  int length = (int) strlen(name);
+  return header -> name_length == length && memcmp(message -> data + header -> name_offset, name, length) == 0;
+}
+
+/* Decode the collected header block and hand it on as a message */
+static int emit_headers(http2_stream_t * stream, http_message_sink_t sink, void * context) {
+  http_message_t * message = (http_message_t * ) calloc(1, sizeof(http_message_t));
+  int ok = message && hpack_decode( & stream -> hpack, stream -> block, stream -> block_len, message) &&
+    http_message_append(message, "\r\n", 2);
+
+  stream -> block_len = 0;
+  stream -> block_stream_id = 0;
+  if (!ok) {
+    http_message_free(message);
+    return 0;
+  }
+
+  http_message_info_t * info = & message -> info;
+  info -> is_request = stream -> is_client || (stream -> block_flags & HTTP_MESSAGE_PUSH_PROMISE);
+  info -> stream_id = stream -> message_stream_id;
+  info -> flags = stream -> block_flags;
+  info -> headers = message -> headers;
+  info -> body_offset = message -> len;
+
+  // Pseudo-headers fill the same fields as an HTTP/1.x start line
+  for (int i = 0; i < info -> header_count; i++) {
+    const http_header_field_t * header = & message -> headers[i];
+    const unsigned char * value = message -> data + header -> value_offset;
+    if (header_is(message, header, ":method")) {
+      info -> method_offset = header -> value_offset;
+      info -> method_length = header -> value_length;
+    } else if (header_is(message, header, ":path")) {
+      info -> target_offset = header -> value_offset;
+      info -> target_length = header -> value_length;
+    } else if (header_is(message, header, ":status") && header -> value_length == 3) {
+      info -> status_code = (value[0] - '0') * 100 + (value[1] - '0') * 10 + (value[2] - '0');
+    }
+  }
+
+  sink(context, message);
+  return 1;
+}
+
+/* The payload of a frame carrying a header block fragment is complete */
+static int end_fragment(http2_stream_t * stream, http_message_sink_t sink, void * context) {
+  unsigned char * fragment = stream -> block + stream -> fragment_start;
+  int len = stream -> block_len - stream -> fragment_start;
+
+  if (stream -> type != HTTP2_CONTINUATION) {
+    // Strip the pad length, priority or promised stream fields and the padding
+    int skip = 0, pad = 0;
+    if (stream -> flags & HTTP2_FLAG_PADDED) {
+      if (len < 1) {
+        return 0;
+      }
+      pad = fragment[0];
+      skip = 1;
+    }
+    if (stream -> type == HTTP2_HEADERS && (stream -> flags & HTTP2_FLAG_PRIORITY)) {
+      skip += 5;
+    }
+    if (stream -> type == HTTP2_PUSH_PROMISE) {
+      skip += 4;
+    }
+    if (skip + pad > len) {
+      return 0;
+    }
+
+    stream -> message_stream_id = stream -> stream_id;
+    if (stream -> type == HTTP2_PUSH_PROMISE) {
+      stream -> message_stream_id = stream_id_at(fragment + skip - 4);
+      stream -> block_flags |= HTTP_MESSAGE_PUSH_PROMISE;
+    } else if (stream -> flags & HTTP2_FLAG_END_STREAM) {
+      stream -> block_flags |= HTTP_MESSAGE_END_STREAM;
+    }
+    memmove(fragment, fragment + skip, len - skip - pad);
+    stream -> block_len -= skip + pad;
+  }
+
+  stream -> state = HTTP2_STREAM_FRAME_HEADER;
+  return !(stream -> flags & HTTP2_FLAG_END_HEADERS) || emit_headers(stream, sink, context);
+}
+
+/* Hand on n payload bytes of the current DATA frame and move on at its end */
+static void data_piece(http2_stream_t * stream, const unsigned char * data, int n,
+  http2_data_sink_t body, void * context) {
+  stream -> remaining -= n;
+  int last = stream -> remaining == stream -> padding;
+  int end_stream = last && (stream -> flags & HTTP2_FLAG_END_STREAM);
+
+  if (n > 0 || end_stream) {
+    body(context, stream -> stream_id, data, n, end_stream);
+  }
+  if (last) {
+    stream -> state = stream -> remaining > 0 ? HTTP2_STREAM_SKIP : HTTP2_STREAM_FRAME_HEADER;
+  }
+}
+
+/* Set up for the payload of the frame whose header was just read */
+static int begin_frame(http2_stream_t * stream) {
+  const unsigned char * h = stream -> header;
+
+  stream -> remaining = (h[0] << 16) | (h[1] << 8) | h[2];
+  stream -> type = h[3];
+  stream -> flags = h[4];
+  stream -> stream_id = stream_id_at(h + 5);
+  stream -> padding = 0;
+
+  if (stream -> settings_expected) {
+    if (stream -> type != HTTP2_SETTINGS || stream -> flags != 0 || stream -> stream_id != 0 ||
+      stream -> remaining % 6 != 0) {
+      return 0;
+    }
+    stream -> settings_expected = 0;
+  }
+
+  // A header block continues in CONTINUATION frames of its stream and nothing else
+  if ((stream -> block_stream_id != 0) != (stream -> type == HTTP2_CONTINUATION) ||
+    (stream -> type == HTTP2_CONTINUATION && stream -> stream_id != stream -> block_stream_id)) {
+    return 0;
+  }
+
+  switch (stream -> type) {
+  case HTTP2_DATA:
+    if (stream -> stream_id == 0 || ((stream -> flags & HTTP2_FLAG_PADDED) && stream -> remaining == 0)) {
+      return 0;
+    }
+    stream -> state = (stream -> flags & HTTP2_FLAG_PADDED) ? HTTP2_STREAM_PAD_LENGTH : HTTP2_STREAM_DATA;
+    return 1;
+
+  case HTTP2_HEADERS:
+  case HTTP2_PUSH_PROMISE:
+  case HTTP2_CONTINUATION:
+    if (stream -> stream_id == 0 || stream -> block_len + stream -> remaining > HTTP2_STREAM_MAX_BLOCK) {
+      return 0;
+    }
+    if (stream -> type != HTTP2_CONTINUATION) {
+      stream -> block_stream_id = stream -> stream_id;
+      stream -> block_flags = 0;
+      stream -> block_len = 0;
+    }
+    if (stream -> block_len + stream -> remaining > stream -> block_cap) {
+      int cap = stream -> block_cap ? stream -> block_cap : 4096;
+      while (cap < stream -> block_len + stream -> remaining) {
+        cap *= 2;
+      }
+      unsigned char * grown = (unsigned char * ) realloc(stream -> block, cap);
+      if (!grown) {
+        return 0;
+      }
+      stream -> block = grown;
+      stream -> block_cap = cap;
+    }
+    stream -> fragment_start = stream -> block_len;
+    stream -> state = HTTP2_STREAM_BLOCK;
+    return 1;
+
+  default:
+    // SETTINGS, WINDOW_UPDATE, PING, PRIORITY, RST_STREAM, GOAWAY, extensions
+    stream -> state = stream -> remaining > 0 ? HTTP2_STREAM_SKIP : HTTP2_STREAM_FRAME_HEADER;
+    return 1;
+  }
+}
+
+/*
+ * Decode the next chunk of a direction. Header blocks go to headers as
+ * messages (owned by the sink), DATA payload pieces to body as pointers
+ * into data. Returns 1 while the direction is (or may still turn out to
+ * be) HTTP/2, 0 once it is not.
+ */
+int http2_stream_feed(http2_stream_t * stream, const unsigned char * data, int len,
+  http_message_sink_t headers, http2_data_sink_t body, void * context) {
+  int pos = 0;
+
+  if (stream -> state == HTTP2_STREAM_OFF) {
+    return 0;
+  }
+
+  while (pos < len) {
+    int n;
+
+    switch (stream -> state) {
+    case HTTP2_STREAM_DETECT:
+      if (stream -> header_len == 0 && data[pos] == 0x00) {
+        // Server side: no preface, but its first frame has to be SETTINGS
+        stream -> settings_expected = 1;
+        hpack_decoder_init( & stream -> hpack);
+        stream -> state = HTTP2_STREAM_FRAME_HEADER;
+        break;
+      }
+      n = HTTP2_PREFACE_LEN - stream -> header_len < len - pos ? HTTP2_PREFACE_LEN - stream -> header_len : len - pos;
+      if (memcmp(data + pos, HTTP2_PREFACE + stream -> header_len, n) != 0) {
+        return fail_stream(stream);
+      }
+      stream -> header_len += n;
+      pos += n;
+      if (stream -> header_len == HTTP2_PREFACE_LEN) {
+        stream -> is_client = 1;
+        stream -> header_len = 0;
+        hpack_decoder_init( & stream -> hpack);
+        stream -> state = HTTP2_STREAM_FRAME_HEADER;
+      }
+      break;
+
+    case HTTP2_STREAM_FRAME_HEADER:
+      n = HTTP2_FRAME_HEADER_SIZE - stream -> header_len < len - pos ? HTTP2_FRAME_HEADER_SIZE - stream -> header_len : len - pos;
+      memcpy(stream -> header + stream -> header_len, data + pos, n);
+      stream -> header_len += n;
+      pos += n;
+      if (stream -> header_len == HTTP2_FRAME_HEADER_SIZE) {
+        stream -> header_len = 0;
+        if (!begin_frame(stream)) {
+          return fail_stream(stream);
+        }
+        if (stream -> state == HTTP2_STREAM_DATA && stream -> remaining == 0) {
+          data_piece(stream, data + pos, 0, body, context);
+        } else if (stream -> state == HTTP2_STREAM_BLOCK && stream -> remaining == 0 &&
+          !end_fragment(stream, headers, context)) {
+          return fail_stream(stream);
+        }
+      }
+      break;
+
+    case HTTP2_STREAM_PAD_LENGTH:
+      stream -> padding = data[pos++];
+      stream -> remaining--;
+      if (stream -> padding > stream -> remaining) {
+        return fail_stream(stream);
+      }
+      stream -> state = HTTP2_STREAM_DATA;
+      if (stream -> remaining == stream -> padding) {
+        data_piece(stream, data + pos, 0, body, context);
+      }
+      break;
+
+    case HTTP2_STREAM_DATA:
+      n = stream -> remaining - stream -> padding < len - pos ? stream -> remaining - stream -> padding : len - pos;
+      data_piece(stream, data + pos, n, body, context);
+      pos += n;
+      break;
+
+    case HTTP2_STREAM_BLOCK:
+      n = stream -> remaining < len - pos ? stream -> remaining : len - pos;
+      memcpy(stream -> block + stream -> block_len, data + pos, n);
+      stream -> block_len += n;
+      stream -> remaining -= n;
+      pos += n;
+      if (stream -> remaining == 0 && !end_fragment(stream, headers, context)) {
+        return fail_stream(stream);
+      }
+      break;
+
+    case HTTP2_STREAM_SKIP:
+      n = stream -> remaining < len - pos ? stream -> remaining : len - pos;
+      stream -> remaining -= n;
+      pos += n;
+      if (stream -> remaining == 0) {
+        stream -> state = HTTP2_STREAM_FRAME_HEADER;
+      }
+      break;
+
+    default:
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Stop decoding this direction and free the header block and HPACK table */
+void http2_stream_stop(http2_stream_t * stream) {
+  free(stream -> block);
+  stream -> block = NULL;
+  stream -> block_len = 0;
+  stream -> block_cap = 0;
+  stream -> block_stream_id = 0;
+  hpack_decoder_free( & stream -> hpack);
+  stream -> state = HTTP2_STREAM_OFF;
+}
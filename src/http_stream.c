@@ -0,0 +1,560 @@
+/*
+ * TLS MITM Proxy - HTTP/1.x Message Reassembly Implementation
+ *
+ * The parser walks each chunk once. Head bytes are appended to the message
+ * buffer up to each line feed, so the blank line ending the head is found
+ * without rescanning; the start line is checked as it arrives so that a
+ * non-HTTP stream is given up on after its first bytes. Once the head is
+ * complete it is parsed in place into offsets and the body framing is
+ * decided from the headers and, for responses, from the request it
+ * answers: the request side records HEAD requests with its peer.
+ */
+
+#include "../include/http_stream.h"
+
+#include <ctype.h>
+
+#define HTTP_STREAM_MAX_PIPELINED 64    // Outstanding requests tracked for HEAD responses
+
+static http_message_t * message_new(void) {
+  return (http_message_t * ) calloc(1, sizeof(http_message_t));
+}
+
+void http_message_free(http_message_t * message) {
+  if (!message) {
+    return;
+  }
+  free(message -> data);
+  free(message -> headers);
+  free(message);
+}
+
+/* Make room for len more bytes after the message data */
+int http_message_reserve(http_message_t * message, int len) {
+  if (message -> len + len > message -> cap) {
+    int cap = message -> cap ? message -> cap : 4096;
+    while (cap < message -> len + len) {
+      cap *= 2;
+    }
+    unsigned char * grown = (unsigned char * ) realloc(message -> data, cap);
+    if (!grown) {
+      return 0;
+    }
+    message -> data = grown;
+    message -> cap = cap;
+  }
+  return 1;
+}
+
+int http_message_append(http_message_t * message, const void * data, int len) {
+  if (len <= 0) {
+    return 1;
+  }
+  if (!http_message_reserve(message, len)) {
+    return 0;
+  }
+  memcpy(message -> data + message -> len, data, len);
+  message -> len += len;
+  return 1;
+}
+
+static void message_add_tags(http_message_t * message, const int * tags, int tag_count) {
+  for (int i = 0; i < tag_count && message -> tag_count < KEYWORD_TAGS_MAX_PER_EVENT; i++) {
+    int seen = 0;
+    for (int k = 0; k < message -> tag_count && !seen; k++) {
+      seen = message -> tags[k] == tags[i];
+    }
+    if (!seen) {
+      message -> tags[message -> tag_count++] = tags[i];
+    }
+  }
+}
+
+int http_message_add_header(http_message_t * message, int name_offset, int name_length, int value_offset, int value_length) {
+  if (message -> info.header_count == message -> header_cap) {
+    int cap = message -> header_cap ? message -> header_cap * 2 : 16;
+    http_header_field_t * grown = (http_header_field_t * ) realloc(message -> headers, cap * sizeof(http_header_field_t));
+    if (!grown) {
+      return 0;
+    }
+    message -> headers = grown;
+    message -> header_cap = cap;
+  }
+  http_header_field_t * header = & message -> headers[message -> info.header_count++];
+  header -> name_offset = name_offset;
+  header -> name_length = name_length;
+  header -> value_offset = value_offset;
+  header -> value_length = value_length;
+  return 1;
+}
+
+static int equal_nocase(const unsigned char * data, const char * text, int len) {
+  for (int i = 0; i < len; i++) {
+    if (tolower(data[i]) != tolower((unsigned char) text[i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static const http_header_field_t * find_header(const http_message_t * message, const char * name) {
+  int name_length = (int) strlen(name);
+  for (int i = 0; i < message -> info.header_count; i++) {
+    const http_header_field_t * header = & message -> headers[i];
+    if (header -> name_length == name_length && equal_nocase(message -> data + header -> name_offset, name, name_length)) {
+      return header;
+    }
+  }
+  return NULL;
+}
+
+static int is_token_char(unsigned char c) {
+  return c > 0x20 && c < 0x7f && !strchr("()<>@,;:\\\"/[]?={}", c);
+}
+
+/* Whether the first n bytes of a line can still begin an HTTP/1.x start line */
+static int start_line_plausible(const unsigned char * p, int n) {
+  static const char version[] = "HTTP/1.";
+  int i;
+
+  for (i = 0; i < n && i < 7 && p[i] == (unsigned char) version[i]; i++) {}
+  if (i == n || i == 7) {
+    return 1; // Status line so far
+  }
+
+  // Request line: method, space, then printable target and version
+  for (i = 0; i < n && i < 24 && ((p[i] >= 'A' && p[i] <= 'Z') || p[i] == '-' || p[i] == '_'); i++) {}
+  if (i == n) {
+    return i < 24;
+  }
+  if (i == 0 || p[i] != ' ') {
+    return 0;
+  }
+  for (i++; i < n; i++) {
+    if ((p[i] < 0x20 || p[i] >= 0x7f) && !(p[i] == '\r' && i == n - 1)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Offset of the line feed ending the line at pos, and the line length without CR/LF */
+static int line_bounds(const unsigned char * data, int pos, int len, int * line_len) {
+  const unsigned char * nl = (const unsigned char * ) memchr(data + pos, '\n', len - pos);
+  int end = nl ? (int)(nl - data) : len;
+  * line_len = end - pos;
+  if ( * line_len > 0 && data[end - 1] == '\r') {
+    ( * line_len) --;
+  }
+  return end;
+}
+
+/* Parse the complete head in message data into info and header offsets */
+static int parse_head(http_message_t * message) {
+  const unsigned char * d = message -> data;
+  http_message_info_t * info = & message -> info;
+  int line_len;
+  int end = line_bounds(d, 0, message -> len, & line_len);
+
+  if (line_len >= 12 && memcmp(d, "HTTP/1.", 7) == 0) {
+    if (!isdigit(d[7]) || d[8] != ' ' || !isdigit(d[9]) || !isdigit(d[10]) || !isdigit(d[11]) ||
+      (line_len > 12 && d[12] != ' ')) {
+      return 0;
+    }
+    info -> is_request = 0;
+    info -> status_code = (d[9] - '0') * 100 + (d[10] - '0') * 10 + (d[11] - '0');
+  } else {
+    int i = 0;
+    while (i < line_len && is_token_char(d[i])) {
+      i++;
+    }
+    if (i == 0 || i >= line_len || d[i] != ' ') {
+      return 0;
+    }
+    int target = i + 1;
+    const unsigned char * space = (const unsigned char * ) memchr(d + target, ' ', line_len - target);
+    if (!space || space == d + target) {
+      return 0;
+    }
+    int version = (int)(space - d) + 1;
+    if (line_len - version != 8 || memcmp(d + version, "HTTP/1.", 7) != 0 || !isdigit(d[version + 7])) {
+      return 0;
+    }
+    info -> is_request = 1;
+    info -> method_offset = 0;
+    info -> method_length = i;
+    info -> target_offset = target;
+    info -> target_length = version - 1 - target;
+  }
+
+  for (int pos = end + 1; pos < message -> len; pos = end + 1) {
+    end = line_bounds(d, pos, message -> len, & line_len);
+    if (line_len == 0) {
+      info -> body_offset = end + 1;
+      return 1;
+    }
+
+    if (d[pos] == ' ' || d[pos] == '\t') {
+      // Obsolete line folding: the value continues on this line
+      if (info -> header_count == 0) {
+        return 0;
+      }
+      http_header_field_t * header = & message -> headers[info -> header_count - 1];
+      int value_end = pos + line_len;
+      while (value_end > pos && (d[value_end - 1] == ' ' || d[value_end - 1] == '\t')) {
+        value_end--;
+      }
+      if (value_end > pos) {
+        header -> value_length = value_end - header -> value_offset;
+      }
+      continue;
+    }
+
+    int name_length = 0;
+    while (name_length < line_len && is_token_char(d[pos + name_length])) {
+      name_length++;
+    }
+    if (name_length == 0 || name_length == line_len || d[pos + name_length] != ':') {
+      return 0;
+    }
+    int value_start = pos + name_length + 1;
+    int value_end = pos + line_len;
+    while (value_start < value_end && (d[value_start] == ' ' || d[value_start] == '\t')) {
+      value_start++;
+    }
+    while (value_end > value_start && (d[value_end - 1] == ' ' || d[value_end - 1] == '\t')) {
+      value_end--;
+    }
+    if (!http_message_add_header(message, pos, name_length, value_start, value_end - value_start)) {
+      return 0;
+    }
+  }
+  return 0; // Called without the blank line
+}
+
+static int header_has_token(const http_message_t * message, const http_header_field_t * header, const char * token) {
+  int token_length = (int) strlen(token);
+  const unsigned char * value = message -> data + header -> value_offset;
+  for (int i = 0; i + token_length <= header -> value_length; i++) {
+    if (equal_nocase(value + i, token, token_length)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static long long parse_content_length(const http_message_t * message, const http_header_field_t * header) {
+  const unsigned char * value = message -> data + header -> value_offset;
+  long long length = 0;
+
+  if (header -> value_length == 0 || header -> value_length > 15) {
+    return -1;
+  }
+  for (int i = 0; i < header -> value_length; i++) {
+    if (!isdigit(value[i])) {
+      return -1;
+    }
+    length = length * 10 + (value[i] - '0');
+  }
+  return length;
+}
+
+/* Hand the finished message to the sink and wait for the next one */
+static void complete_message(http_stream_t * stream, int flags, http_message_sink_t sink, void * context) {
+  http_message_t * message = stream -> message;
+
+  stream -> message = NULL;
+  stream -> state = HTTP_STREAM_START;
+  message -> info.flags |= flags;
+  message -> info.headers = message -> headers;
+  message -> info.body_length = message -> len - message -> info.body_offset;
+  sink(context, message);
+}
+
+/* Give up on the stream. A message whose head was parsed is handed over as incomplete. */
+static int fail_stream(http_stream_t * stream, http_message_sink_t sink, void * context) {
+  if (stream -> message && stream -> message -> info.body_offset > 0) {
+    complete_message(stream, HTTP_MESSAGE_INCOMPLETE, sink, context);
+  }
+  http_stream_stop(stream);
+  return 0;
+}
+
+/* Store body bytes up to the configured limit; the rest is only counted */
+static void body_append(http_stream_t * stream, const unsigned char * data, int len) {
+  http_message_t * message = stream -> message;
+  int stored = message -> len - message -> info.body_offset;
+  int room = config.http_message_max_body - stored;
+
+  message -> info.body_total += len;
+  if (room < len) {
+    message -> info.flags |= HTTP_MESSAGE_TRUNCATED;
+    len = room > 0 ? room : 0;
+  }
+  if (!http_message_append(message, data, len)) {
+    message -> info.flags |= HTTP_MESSAGE_TRUNCATED;
+  }
+}
+
+/* Decide how the body of a parsed head is delimited; 0 if the head is unusable */
+static int begin_body(http_stream_t * stream, http_message_sink_t sink, void * context) {
+  http_message_t * message = stream -> message;
+  const http_header_field_t * transfer_encoding = find_header(message, "Transfer-Encoding");
+  const http_header_field_t * content_length = find_header(message, "Content-Length");
+  int chunked = transfer_encoding && header_has_token(message, transfer_encoding, "chunked");
+  int switching = !message -> info.is_request && message -> info.status_code == 101;
+  long long length = -1;
+  int no_body = 0;
+
+  if (!chunked && content_length && (length = parse_content_length(message, content_length)) < 0) {
+    return 0;
+  }
+
+  if (message -> info.is_request) {
+    http_stream_t * peer = stream -> peer;
+    if (peer && peer -> pending_requests < HTTP_STREAM_MAX_PIPELINED) {
+      if (message -> info.method_length == 4 && memcmp(message -> data, "HEAD", 4) == 0) {
+        peer -> head_requests |= 1ULL << peer -> pending_requests;
+      }
+      peer -> pending_requests++;
+    }
+    no_body = !chunked && length <= 0;
+  } else {
+    int status = message -> info.status_code;
+    if (status >= 200 || status == 101) {
+      // Final response: take the request it answers off the queue
+      int head = stream -> pending_requests > 0 && (stream -> head_requests & 1);
+      if (stream -> pending_requests > 0) {
+        stream -> head_requests >>= 1;
+        stream -> pending_requests--;
+      }
+      no_body = head;
+    }
+    no_body = no_body || status < 200 || status == 204 || status == 304;
+  }
+
+  if (no_body) {
+    complete_message(stream, 0, sink, context);
+    if (switching) {
+      // Switching protocols: neither side is HTTP/1.x from here on
+      http_stream_stop(stream);
+      if (stream -> peer) {
+        http_stream_stop(stream -> peer);
+      }
+    }
+    return 1;
+  }
+
+  if (chunked) {
+    message -> info.flags |= HTTP_MESSAGE_CHUNKED;
+    stream -> state = HTTP_STREAM_CHUNK_SIZE;
+  } else if (length > 0) {
+    stream -> state = HTTP_STREAM_BODY;
+    stream -> remaining = length;
+  } else if (length == 0) {
+    complete_message(stream, 0, sink, context);
+  } else {
+    stream -> state = HTTP_STREAM_UNTIL_CLOSE;
+  }
+  return 1;
+}
+
+/* Collect a line into stream->line; returns bytes consumed and sets *done at its end */
+static int read_line(http_stream_t * stream, const unsigned char * data, int len, int * done) {
+  const unsigned char * nl = (const unsigned char * ) memchr(data, '\n', len);
+  int take = nl ? (int)(nl - data) + 1 : len;
+  int copy = nl ? take - 1 : take;
+
+  if (stream -> line_len + copy > HTTP_STREAM_MAX_LINE - 1) {
+    stream -> line_overflow = 1;
+    copy = HTTP_STREAM_MAX_LINE - 1 - stream -> line_len;
+  }
+  memcpy(stream -> line + stream -> line_len, data, copy);
+  stream -> line_len += copy;
+  * done = nl != NULL;
+  if ( * done) {
+    if (stream -> line_len > 0 && stream -> line[stream -> line_len - 1] == '\r') {
+      stream -> line_len--;
+    }
+    stream -> line[stream -> line_len] = '\0';
+  }
+  return take;
+}
+
+static long long parse_chunk_size(const char * line) {
+  long long size = 0;
+  int digits = 0;
+
+  for (; isxdigit((unsigned char) * line); line++, digits++) {
+    if (digits == 12) {
+      return -1;
+    }
+    size = size * 16 + (isdigit((unsigned char) * line) ? * line - '0' : (tolower((unsigned char) * line) - 'a' + 10));
+  }
+  while ( * line == ' ' || * line == '\t') {
+    line++;
+  }
+  return digits > 0 && ( * line == '\0' || * line == ';') ? size : -1;
+}
+
+/* Handle a complete chunk size, chunk end or trailer line */
+static int line_done(http_stream_t * stream, http_message_sink_t sink, void * context) {
+  int ok = !stream -> line_overflow || stream -> state == HTTP_STREAM_TRAILERS;
+  long long size;
+
+  if (ok) {
+    switch (stream -> state) {
+    case HTTP_STREAM_CHUNK_SIZE:
+      size = parse_chunk_size(stream -> line);
+      if (size < 0) {
+        ok = 0;
+      } else if (size == 0) {
+        stream -> state = HTTP_STREAM_TRAILERS;
+      } else {
+        stream -> state = HTTP_STREAM_CHUNK_DATA;
+        stream -> remaining = size;
+      }
+      break;
+    case HTTP_STREAM_CHUNK_END:
+      ok = stream -> line_len == 0;
+      stream -> state = HTTP_STREAM_CHUNK_SIZE;
+      break;
+    default:
+      // Trailers are not kept; the blank line ends the message
+      if (stream -> line_len == 0 && !stream -> line_overflow) {
+        complete_message(stream, 0, sink, context);
+      }
+      break;
+    }
+  }
+  stream -> line_len = 0;
+  stream -> line_overflow = 0;
+  return ok;
+}
+
+/*
+ * Link the two directions of a connection so responses to HEAD requests
+ * are known to have no body and a protocol switch stops both parsers.
+ */
+void http_stream_pair(http_stream_t * requests, http_stream_t * responses) {
+  requests -> peer = responses;
+  responses -> peer = requests;
+}
+
+/*
+ * Parse the next chunk of a direction. Finished messages go to sink; tags
+ * are the keyword ids found in the chunk and are added to every message
+ * it belongs to. Returns 1 if every byte of the chunk is part of HTTP/1.x
+ * messages, 0 if the direction is not (or stopped being) HTTP/1.x.
+ */
+int http_stream_feed(http_stream_t * stream, const unsigned char * data, int len,
+  const int * tags, int tag_count, http_message_sink_t sink, void * context) {
+  int pos = 0;
+
+  if (stream -> state == HTTP_STREAM_OFF) {
+    return 0;
+  }
+  if (stream -> message) {
+    message_add_tags(stream -> message, tags, tag_count);
+  }
+
+  while (pos < len) {
+    http_message_t * message = stream -> message;
+    int n;
+
+    switch (stream -> state) {
+    case HTTP_STREAM_START:
+      if (data[pos] == '\r' || data[pos] == '\n') {
+        pos++; // Stray line breaks between messages
+        continue;
+      }
+      if (!start_line_plausible(data + pos, 1) || !(stream -> message = message_new())) {
+        return fail_stream(stream, sink, context);
+      }
+      message_add_tags(stream -> message, tags, tag_count);
+      stream -> line_start = 0;
+      stream -> state = HTTP_STREAM_HEAD;
+      break;
+
+    case HTTP_STREAM_HEAD: {
+      const unsigned char * nl = (const unsigned char * ) memchr(data + pos, '\n', len - pos);
+      n = nl ? (int)(nl - (data + pos)) + 1 : len - pos;
+      if (message -> len + n > HTTP_STREAM_MAX_HEAD || !http_message_append(message, data + pos, n)) {
+        return fail_stream(stream, sink, context);
+      }
+      pos += n;
+      if (stream -> line_start == 0 && !start_line_plausible(message -> data, message -> len - (nl ? 1 : 0))) {
+        return fail_stream(stream, sink, context);
+      }
+      if (nl) {
+        int line_len = message -> len - stream -> line_start;
+        int blank = stream -> line_start > 0 &&
+          (line_len == 1 || (line_len == 2 && message -> data[stream -> line_start] == '\r'));
+        stream -> line_start = message -> len;
+        if (blank && (!parse_head(message) || !begin_body(stream, sink, context))) {
+          return fail_stream(stream, sink, context);
+        }
+      }
+      break;
+    }
+
+    case HTTP_STREAM_BODY:
+    case HTTP_STREAM_CHUNK_DATA:
+      n = stream -> remaining < len - pos ? (int) stream -> remaining : len - pos;
+      body_append(stream, data + pos, n);
+      pos += n;
+      stream -> remaining -= n;
+      if (stream -> remaining == 0) {
+        if (stream -> state == HTTP_STREAM_BODY) {
+          complete_message(stream, 0, sink, context);
+        } else {
+          stream -> state = HTTP_STREAM_CHUNK_END;
+        }
+      }
+      break;
+
+    case HTTP_STREAM_CHUNK_SIZE:
+    case HTTP_STREAM_CHUNK_END:
+    case HTTP_STREAM_TRAILERS: {
+      int done;
+      pos += read_line(stream, data + pos, len - pos, & done);
+      if (done && !line_done(stream, sink, context)) {
+        return fail_stream(stream, sink, context);
+      }
+      break;
+    }
+
+    case HTTP_STREAM_UNTIL_CLOSE:
+      body_append(stream, data + pos, len - pos);
+      pos = len;
+      break;
+
+    default:
+      return 0; // Stopped while handling this chunk (protocol switch)
+    }
+  }
+  return 1;
+}
+
+/*
+ * The direction reached end of stream: a body delimited by the close is
+ * complete now, anything else still in progress is handed over as
+ * incomplete.
+ */
+void http_stream_finish(http_stream_t * stream, http_message_sink_t sink, void * context) {
+  if (stream -> message) {
+    if (stream -> state == HTTP_STREAM_UNTIL_CLOSE) {
+      complete_message(stream, 0, sink, context);
+    } else if (stream -> message -> info.body_offset > 0) {
+      complete_message(stream, HTTP_MESSAGE_INCOMPLETE, sink, context);
+    }
+  }
+  http_stream_stop(stream);
+}
+
+/* Stop parsing this direction and free a partial message */
+void http_stream_stop(http_stream_t * stream) {
+  http_message_free(stream -> message);
+  stream -> message = NULL;
+  stream -> state = HTTP_STREAM_OFF;
+}
@@ -0,0 +1,240 @@
+/*
+ * TLS MITM Proxy - Intercept Filter Implementation
+ *
+ * set_intercept_filter() compiles the rule text into an immutable set of
+ * globs, IPv4 networks, port ranges and compiled payload patterns and
+ * publishes it with pattern_rules_set() (see pattern_match.h); a replaced
+ * set is freed once no forwarding thread can still be walking it.
+ *
+ * Host, SNI, fingerprint, client and port terms only depend on the
+ * connection, so each relay direction evaluates them once per filter set
+ * and caches the result as a bit mask of candidate rules in its
+ * intercept_target_t. Per chunk only the direction and payload terms of
+ * candidate rules run.
+ */
+
+#include "../include/intercept_filter.h"
+
+#include "../include/pattern_match.h"
+
+#include <stdint.h>
+
+#define FILTER_MASK_RULES 64            // Rules covered by the candidate mask
+
+typedef struct {
+  int directions;                       // INTERCEPT_* flags the rule applies to
+  pattern_conn_terms_t conn;
+  pattern_bytes_t contains;
+  int has_regex;
+  pattern_regex_t regex;
+} filter_rule_t;
+
+typedef struct {
+  pattern_set_t base;
+  filter_rule_t * rules;
+  int count;
+} filter_set_t;
+
+static pattern_slot_t g_filter;
+
+/* The connection attributes of a target, NULL without a target */
+static const pattern_conn_t * target_conn(const intercept_target_t * target, pattern_conn_t * conn) {
+  if (!target) {
+    return NULL;
+  }
+  conn -> host = target -> host;
+  conn -> sni = target -> sni;
+  conn -> ja3 = target -> ja3;
+  conn -> ja4 = target -> ja4;
+  conn -> client_ip = target -> client_ip;
+  conn -> server_ip = NULL;
+  conn -> port = target -> port;
+  return conn;
+}
+
+static void init_rule(void * rule) {
+  ((filter_rule_t * ) rule) -> directions = INTERCEPT_BOTH;
+}
+
+static void free_rule(void * arg) {
+  filter_rule_t * rule = (filter_rule_t * ) arg;
+  pattern_conn_terms_free( & rule -> conn);
+  pattern_bytes_free( & rule -> contains);
+  pattern_regex_free( & rule -> regex);
+}
+
+static void free_set(pattern_set_t * base) {
+  filter_set_t * set = (filter_set_t * ) base;
+  for (int i = 0; i < set -> count; i++) {
+    free_rule( & set -> rules[i]);
+  }
+  free(set -> rules);
+  free(set);
+}
+
+/* Apply one key=value term to the rule being built */
+static int apply_term(void * arg, const char * key, const char * value, char * error, size_t error_size) {
+  filter_rule_t * rule = (filter_rule_t * ) arg;
+  int ret = pattern_conn_terms_parse( & rule -> conn, key, value, 0, error, error_size);
+
+  if (ret >= 0) {
+    return ret;
+  } else if (strcmp(key, "dir") == 0) {
+    if (strcmp(value, "c2s") == 0) {
+      rule -> directions = INTERCEPT_CLIENT_TO_SERVER;
+    } else if (strcmp(value, "s2c") == 0) {
+      rule -> directions = INTERCEPT_SERVER_TO_CLIENT;
+    } else {
+      snprintf(error, error_size, "dir: expected c2s or s2c, got '%.64s'", value);
+      return 0;
+    }
+  } else if (strcmp(key, "contains") == 0) {
+    if (rule -> contains.bytes || !pattern_bytes_compile( & rule -> contains, value)) {
+      snprintf(error, error_size, "contains: duplicate, empty or bad escape");
+      return 0;
+    }
+  } else if (strcmp(key, "regex") == 0) {
+    if (rule -> has_regex || ! * value) {
+      snprintf(error, error_size, "regex: duplicate or empty");
+      return 0;
+    }
+    if (!pattern_regex_compile( & rule -> regex, value, error, error_size)) {
+      return 0;
+    }
+    rule -> has_regex = 1;
+  } else {
+    snprintf(error, error_size, "unknown key '%s'", key);
+    return 0;
+  }
+  return 1;
+}
+
+/* Append a finished rule to the set */
+static int push_rule(pattern_set_t * base, void * rule, char * error, size_t error_size) {
+  filter_set_t * set = (filter_set_t * ) base;
+  filter_rule_t * rules = (filter_rule_t * ) realloc(set -> rules, (set -> count + 1) * sizeof(filter_rule_t));
+  if (!rules) {
+    snprintf(error, error_size, "out of memory");
+    return 0;
+  }
+  set -> rules = rules;
+  set -> rules[set -> count++] = * (filter_rule_t * ) rule;
+  return 1;
+}
+
+static const pattern_rule_kind_t g_filter_kind = {
+  "Intercept filter",
+  sizeof(filter_set_t),
+  sizeof(filter_rule_t),
+  init_rule,
+  apply_term,
+  push_rule,
+  free_rule,
+  free_set
+};
+
+/*
+ * Compile and activate a rule set, replacing the current one. NULL or an
+ * empty string removes the filter so every chunk is held again. Returns 0
+ * and keeps the current filter if the rules do not parse.
+ */
+int intercept_filter_set(const char * rules) {
+  return pattern_rules_set( & g_filter, & g_filter_kind, rules);
+}
+
+/* Refresh the target's candidate mask if the filter set changed */
+static void prepare_target(const filter_set_t * set, intercept_target_t * target, const pattern_conn_t * conn) {
+  if (target && target -> prepared_for != set -> base.generation) {
+    target -> candidates = 0;
+    for (int i = 0; i < set -> count && i < FILTER_MASK_RULES; i++) {
+      if (pattern_conn_terms_match( & set -> rules[i].conn, conn)) {
+        target -> candidates |= 1ULL << i;
+      }
+    }
+    target -> prepared_for = set -> base.generation;
+  }
+}
+
+/*
+ * Whether any chunk of the target's connection travelling in direction
+ * could be held, whatever its payload: there is no filter, or a rule for
+ * that direction matches the connection. Same threading rules as
+ * intercept_filter_match().
+ */
+int intercept_filter_active(int direction, intercept_target_t * target) {
+  int epoch;
+  const filter_set_t * set = (const filter_set_t * ) pattern_slot_enter( & g_filter, & epoch);
+  if (!set) {
+    pattern_slot_leave( & g_filter, epoch);
+    return 1;
+  }
+
+  pattern_conn_t conn_buf;
+  const pattern_conn_t * conn = target_conn(target, & conn_buf);
+  int active = 0;
+  prepare_target(set, target, conn);
+  for (int i = 0; i < set -> count && !active; i++) {
+    const filter_rule_t * rule = & set -> rules[i];
+    if (!(rule -> directions & direction)) {
+      continue;
+    }
+    if (target && i < FILTER_MASK_RULES) {
+      active = (target -> candidates & (1ULL << i)) != 0;
+    } else {
+      active = pattern_conn_terms_match( & rule -> conn, conn);
+    }
+  }
+  pattern_slot_leave( & g_filter, epoch);
+  return active;
+}
+
+/*
+ * Decide whether a chunk travelling in direction (INTERCEPT_CLIENT_TO_SERVER
+ * or INTERCEPT_SERVER_TO_CLIENT) is held. Lock-free; the target's candidate
+ * mask is refreshed when the filter set changed, so a target must only be
+ * used by one thread at a time. A NULL target only matches rules without
+ * connection terms.
+ */
+int intercept_filter_match(int direction, intercept_target_t * target,
+  const unsigned char * data, int len) {
+  int epoch;
+  const filter_set_t * set = (const filter_set_t * ) pattern_slot_enter( & g_filter, & epoch);
+  if (!set) {
+    pattern_slot_leave( & g_filter, epoch);
+    return 1;
+  }
+
+  pattern_conn_t conn_buf;
+  const pattern_conn_t * conn = target_conn(target, & conn_buf);
+  int held = 0;
+  prepare_target(set, target, conn);
+  for (int i = 0; i < set -> count && !held; i++) {
+    const filter_rule_t * rule = & set -> rules[i];
+
+    if (!(rule -> directions & direction)) {
+      continue;
+    }
+    if (target && i < FILTER_MASK_RULES) {
+      if (!(target -> candidates & (1ULL << i))) {
+        continue;
+      }
+    } else if (!pattern_conn_terms_match( & rule -> conn, conn)) {
+      continue;
+    }
+    int match_len;
+    if (rule -> contains.bytes && pattern_bytes_find( & rule -> contains, data, len) < 0) {
+      continue;
+    }
+    if (rule -> has_regex && pattern_regex_find( & rule -> regex, data, len, & match_len) < 0) {
+      continue;
+    }
+    held = 1;
+  }
+  pattern_slot_leave( & g_filter, epoch);
+  return held;
+}
+
+/* Free the active and all replaced rule sets; no relay may be running */
+void cleanup_intercept_filters(void) {
+  pattern_slot_cleanup( & g_filter, free_set);
+}
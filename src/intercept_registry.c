@@ -0,0 +1,165 @@
+/*
+ * TLS MITM Proxy - Intercept Registry Implementation
+ *
+ * Two hash tables (see hash_table.h) of intercept_data_t pointers: one
+ * keyed by (connection_id, packet_id), one keyed by connection_id that
+ * points at the oldest held message of each connection. Messages of a
+ * connection are chained through conn_next/conn_prev in registration
+ * order, with the head's conn_prev pointing at the tail.
+ */
+
+#include "../include/intercept_registry.h"
+
+#include "../include/hash_table.h"
+
+typedef struct {
+  int connection_id;
+  int packet_id;
+} registry_key_t;
+
+static size_t registry_hash(int connection_id, int packet_id) {
+  return hash_table_mix(((uint64_t)(uint32_t) connection_id << 32) | (uint32_t) packet_id);
+}
+
+static size_t hash_by_packet(const void * entry) {
+  const intercept_data_t * item = (const intercept_data_t * ) entry;
+  return registry_hash(item -> connection_id, item -> packet_id);
+}
+
+static size_t hash_by_connection(const void * entry) {
+  return registry_hash(((const intercept_data_t * ) entry) -> connection_id, 0);
+}
+
+static int match_packet(const void * entry, const void * key) {
+  const intercept_data_t * item = (const intercept_data_t * ) entry;
+  const registry_key_t * k = (const registry_key_t * ) key;
+  return item -> connection_id == k -> connection_id && item -> packet_id == k -> packet_id;
+}
+
+static int match_connection(const void * entry, const void * key) {
+  return ((const intercept_data_t * ) entry) -> connection_id == ((const registry_key_t * ) key) -> connection_id;
+}
+
+static hash_table_t g_by_packet = {
+  NULL,
+  0,
+  0,
+  hash_by_packet
+};
+static hash_table_t g_by_connection = {
+  NULL,
+  0,
+  0,
+  hash_by_connection
+};
+
+static long find_packet(int connection_id, int packet_id) {
+  registry_key_t key = {
+    connection_id,
+    packet_id
+  };
+  return hash_table_find( & g_by_packet, registry_hash(connection_id, packet_id), match_packet, & key);
+}
+
+static long find_connection(int connection_id) {
+  registry_key_t key = {
+    connection_id,
+    0
+  };
+  return hash_table_find( & g_by_connection, registry_hash(connection_id, 0), match_connection, & key);
+}
+
+/*
+ * Register a held message under its connection_id and packet_id.
+ * Returns 0 if the tables could not grow; the message is then not
+ * reachable by respond_to_intercept().
+ */
+int intercept_registry_add(intercept_data_t * intercept) {
+  if (find_packet(intercept -> connection_id, intercept -> packet_id) >= 0) {
+    return 0; // Only one message per (connection, packet) can be held
+  }
+  if (!hash_table_insert( & g_by_packet, intercept)) {
+    return 0;
+  }
+
+  long head_index = find_connection(intercept -> connection_id);
+  intercept -> conn_next = NULL;
+  if (head_index < 0) {
+    intercept -> conn_prev = intercept;
+    if (!hash_table_insert( & g_by_connection, intercept)) {
+      hash_table_remove_at( & g_by_packet, (size_t) find_packet(intercept -> connection_id, intercept -> packet_id));
+      return 0;
+    }
+  } else {
+    intercept_data_t * head = (intercept_data_t * ) g_by_connection.slots[head_index];
+    intercept_data_t * tail = head -> conn_prev;
+    tail -> conn_next = intercept;
+    intercept -> conn_prev = tail;
+    head -> conn_prev = intercept;
+  }
+  return 1;
+}
+
+/* Remove a held message; does nothing if it is not registered */
+void intercept_registry_remove(intercept_data_t * intercept) {
+  long index = find_packet(intercept -> connection_id, intercept -> packet_id);
+  if (index < 0 || g_by_packet.slots[index] != intercept) {
+    return;
+  }
+  hash_table_remove_at( & g_by_packet, (size_t) index);
+
+  long head_index = find_connection(intercept -> connection_id);
+  if (head_index < 0) {
+    return;
+  }
+  intercept_data_t * head = (intercept_data_t * ) g_by_connection.slots[head_index];
+
+  if (head == intercept) {
+    intercept_data_t * next = intercept -> conn_next;
+    if (next) {
+      next -> conn_prev = intercept -> conn_prev; // Inherit the tail pointer
+      g_by_connection.slots[head_index] = next;
+    } else {
+      hash_table_remove_at( & g_by_connection, (size_t) head_index);
+    }
+  } else {
+    intercept -> conn_prev -> conn_next = intercept -> conn_next;
+    if (intercept -> conn_next) {
+      intercept -> conn_next -> conn_prev = intercept -> conn_prev;
+    } else {
+      head -> conn_prev = intercept -> conn_prev;
+    }
+  }
+  intercept -> conn_next = NULL;
+  intercept -> conn_prev = NULL;
+}
+
+/* Look up the message held for a specific packet */
+intercept_data_t * intercept_registry_find(int connection_id, int packet_id) {
+  long index = find_packet(connection_id, packet_id);
+  return index >= 0 ? (intercept_data_t * ) g_by_packet.slots[index] : NULL;
+}
+
+/* Oldest message of a connection that is still waiting for a response */
+intercept_data_t * intercept_registry_find_waiting(int connection_id) {
+  long index = find_connection(connection_id);
+  if (index < 0) {
+    return NULL;
+  }
+  for (intercept_data_t * item = (intercept_data_t * ) g_by_connection.slots[index]; item; item = item -> conn_next) {
+    if (item -> is_waiting_for_response) {
+      return item;
+    }
+  }
+  return NULL;
+}
+
+int intercept_registry_count(void) {
+  return (int) g_by_packet.count;
+}
+
+/* Free the tables; the messages themselves belong to their forwarding threads */
+void cleanup_intercept_registry(void) {
+  hash_table_free( & g_by_packet);
+  hash_table_free( & g_by_connection);
+}
@@ -0,0 +1,393 @@
+/*
+ * TLS MITM Proxy - Keyword Tags Implementation
+ *
+ * The keywords are compiled into a dense Aho-Corasick DFA: every state has
+ * a transition for every byte class, failure links already folded in, so
+ * the scan is one table lookup per byte with no backtracking. Bytes that
+ * occur in no keyword share a class (and with ignore_case so do the two
+ * cases of a letter), which keeps the rows short. Table entries hold the
+ * target row offset with a flag bit for states that end a keyword.
+ *
+ * In the root state most bytes lead straight back to the root, so when
+ * only a few bytes leave it the scan skips ahead with data_find_byteset()
+ * to the next byte that can start a keyword.
+ *
+ * Sets are published through a pattern_slot_t (see pattern_match.h), so a
+ * replaced set is freed once no scan can still be using it.
+ */
+
+#include "../include/keyword_tags.h"
+
+#include "../include/pattern_match.h"
+
+#include "../include/data_kernels.h"
+
+#include <stdint.h>
+
+#define TAG_ACCEPT 0x80000000u          // Transition enters a state that ends a keyword
+#define TAG_MAX_TABLE_BYTES (64 * 1024 * 1024)
+#define TAG_PREFILTER_MAX_START 32      // More root exits than this and skipping rarely pays off
+
+typedef struct {
+  pattern_set_t base;
+  uint32_t * delta;                     // [row + class] = target row | TAG_ACCEPT, row = state * classes
+  int classes;
+  int states;
+  unsigned char byte_class[256];
+  int * own;                            // Per state: a keyword ending exactly here, -1 if none
+  int * dict;                           // Per state: nearest failure state with own >= 0, -1 if none
+  int * next_same;                      // Per keyword: next keyword with the same bytes, -1 if none
+  int * ids;                            // Per keyword: id reported for it
+  int count;
+  int prefilter;
+  data_byteset_t start;                 // Bytes that leave the root state
+} tag_set_t;
+
+static pattern_slot_t g_tags;
+
+static unsigned char fold_byte(unsigned char c, int ignore_case) {
+  return (ignore_case && c >= 'A' && c <= 'Z') ? (unsigned char)(c - 'A' + 'a') : c;
+}
+
+static void free_set(tag_set_t * set) {
+  free(set -> delta);
+  free(set -> own);
+  free(set -> dict);
+  free(set -> next_same);
+  free(set -> ids);
+  free(set);
+}
+
+static void free_published(pattern_set_t * set) {
+  free_set((tag_set_t * ) set);
+}
+
+/*
+ * Build the DFA for count keywords. Returns NULL with error set if the
+ * table would be too large or memory runs out.
+ */
+static tag_set_t * build_automaton(const pattern_bytes_t * keywords, const int * ids, int count,
+  int ignore_case, char * error, size_t error_size) {
+  tag_set_t * set = (tag_set_t * ) calloc(1, sizeof(tag_set_t));
+  unsigned char used[256] = {
+    0
+  };
+  int class_of[256];
+  int * fail = NULL;
+  int * queue = NULL;
+  size_t total = 0;
+
+  if (!set) {
+    snprintf(error, error_size, "out of memory");
+    return NULL;
+  }
+
+  // Byte classes: 0 for bytes in no keyword, one per (folded) byte otherwise
+  for (int k = 0; k < count; k++) {
+    for (int i = 0; i < keywords[k].len; i++) {
+      used[fold_byte(keywords[k].bytes[i], ignore_case)] = 1;
+    }
+    total += (size_t) keywords[k].len;
+  }
+  set -> classes = 1;
+  for (int b = 0; b < 256; b++) {
+    class_of[b] = used[b] ? set -> classes++ : 0;
+  }
+  for (int b = 0; b < 256; b++) {
+    set -> byte_class[b] = (unsigned char) class_of[fold_byte((unsigned char) b, ignore_case)];
+  }
+
+  size_t max_states = total + 1;
+  size_t cells = max_states * (size_t) set -> classes;
+  if (cells * sizeof(uint32_t) > TAG_MAX_TABLE_BYTES || cells >= TAG_ACCEPT) {
+    snprintf(error, error_size, "%d keywords with %zu bytes in total are too many for one automaton", count, total);
+    goto fail;
+  }
+
+  set -> delta = (uint32_t * ) calloc(cells, sizeof(uint32_t));
+  set -> own = (int * ) malloc(max_states * sizeof(int));
+  set -> dict = (int * ) malloc(max_states * sizeof(int));
+  set -> next_same = (int * ) malloc(count * sizeof(int));
+  set -> ids = (int * ) malloc(count * sizeof(int));
+  fail = (int * ) malloc(max_states * sizeof(int));
+  queue = (int * ) malloc(max_states * sizeof(int));
+  if (!set -> delta || !set -> own || !set -> dict || !set -> next_same || !set -> ids || !fail || !queue) {
+    snprintf(error, error_size, "out of memory");
+    goto fail;
+  }
+
+  // Trie; while building, entries are plain state numbers and 0 means no edge
+  set -> states = 1;
+  set -> count = count;
+  for (size_t s = 0; s < max_states; s++) {
+    set -> own[s] = -1;
+    set -> dict[s] = -1;
+  }
+  for (int k = 0; k < count; k++) {
+    uint32_t s = 0;
+    for (int i = 0; i < keywords[k].len; i++) {
+      uint32_t * edge = & set -> delta[s * set -> classes + set -> byte_class[keywords[k].bytes[i]]];
+      if (! * edge) {
+        * edge = (uint32_t) set -> states++;
+      }
+      s = * edge;
+    }
+    set -> next_same[k] = set -> own[s];
+    set -> own[s] = k;
+    set -> ids[k] = ids[k];
+  }
+
+  // Breadth-first: a state's failure state is shallower, so its row is
+  // already complete when the missing edges of this row are copied from it
+  int head = 0;
+  int tail = 0;
+  fail[0] = 0;
+  for (int c = 0; c < set -> classes; c++) {
+    uint32_t t = set -> delta[c];
+    if (t) {
+      fail[t] = 0;
+      queue[tail++] = (int) t;
+    }
+  }
+  while (head < tail) {
+    int s = queue[head++];
+    uint32_t * row = & set -> delta[(size_t) s * set -> classes];
+    const uint32_t * fail_row = & set -> delta[(size_t) fail[s] * set -> classes];
+
+    for (int c = 0; c < set -> classes; c++) {
+      uint32_t t = row[c];
+      if (!t) {
+        row[c] = fail_row[c];
+        continue;
+      }
+      int f = (int) fail_row[c];
+      fail[t] = f;
+      set -> dict[t] = set -> own[f] >= 0 ? f : set -> dict[f];
+      queue[tail++] = (int) t;
+    }
+  }
+
+  // Final encoding: row offsets instead of state numbers, flag accepting targets
+  cells = (size_t) set -> states * set -> classes;
+  for (size_t i = 0; i < cells; i++) {
+    uint32_t t = set -> delta[i];
+    set -> delta[i] = t * (uint32_t) set -> classes |
+      ((set -> own[t] >= 0 || set -> dict[t] >= 0) ? TAG_ACCEPT : 0);
+  }
+  uint32_t * shrunk = (uint32_t * ) realloc(set -> delta, cells * sizeof(uint32_t));
+  if (shrunk) {
+    set -> delta = shrunk;
+  }
+
+  unsigned char start[256];
+  size_t start_count = 0;
+  for (int b = 0; b < 256; b++) {
+    if (set -> delta[set -> byte_class[b]]) {
+      start[start_count++] = (unsigned char) b;
+    }
+  }
+  data_byteset_init( & set -> start, start, start_count);
+  set -> prefilter = start_count <= TAG_PREFILTER_MAX_START;
+
+  free(fail);
+  free(queue);
+  return set;
+
+  fail:
+    free(fail);
+  free(queue);
+  free_set(set);
+  return NULL;
+}
+
+static tag_set_t * compile_keywords(const char * text, int ignore_case, char * error, size_t error_size) {
+  pattern_bytes_t * keywords = NULL;
+  int * ids = NULL;
+  int count = 0;
+  pattern_bytes_t match;
+  int id = -1;
+  int terms = 0;
+  tag_set_t * set = NULL;
+  const char * p = text;
+
+  memset( & match, 0, sizeof(match));
+
+  while (1) {
+    char key[16];
+    char value[PATTERN_MAX_VALUE];
+    int ret = pattern_next_term( & p, key, sizeof(key), value, sizeof(value), error, error_size);
+
+    if (ret == PATTERN_ERROR) {
+      goto done;
+    } else if (ret == PATTERN_TERM) {
+      if (strcmp(key, "match") == 0) {
+        if (match.bytes || !pattern_bytes_compile( & match, value)) {
+          snprintf(error, error_size, "match: duplicate, empty or bad escape");
+          goto done;
+        }
+      } else if (strcmp(key, "id") == 0) {
+        char * end;
+        long n = strtol(value, & end, 10);
+        if (id >= 0 || ! * value || * end || n < 0 || n > 0x7fffffff) {
+          snprintf(error, error_size, "id: duplicate or not a number: '%.64s'", value);
+          goto done;
+        }
+        id = (int) n;
+      } else {
+        snprintf(error, error_size, "unknown key '%s'", key);
+        goto done;
+      }
+      terms++;
+      continue;
+    }
+
+    // End of a keyword
+    if (terms > 0) {
+      if (!match.bytes) {
+        snprintf(error, error_size, "keyword %d: needs match", count + 1);
+        goto done;
+      }
+      if (count == KEYWORD_TAGS_MAX_PATTERNS) {
+        snprintf(error, error_size, "more than %d keywords", KEYWORD_TAGS_MAX_PATTERNS);
+        goto done;
+      }
+      pattern_bytes_t * grown_keywords = (pattern_bytes_t * ) realloc(keywords, (count + 1) * sizeof(pattern_bytes_t));
+      if (grown_keywords) {
+        keywords = grown_keywords;
+      }
+      int * grown_ids = (int * ) realloc(ids, (count + 1) * sizeof(int));
+      if (grown_ids) {
+        ids = grown_ids;
+      }
+      if (!grown_keywords || !grown_ids) {
+        snprintf(error, error_size, "out of memory");
+        goto done;
+      }
+      keywords[count] = match;
+      ids[count] = id >= 0 ? id : count;
+      count++;
+      memset( & match, 0, sizeof(match));
+      id = -1;
+      terms = 0;
+    }
+    if (ret == PATTERN_TEXT_END) {
+      break;
+    }
+  }
+
+  if (count > 0) {
+    set = build_automaton(keywords, ids, count, ignore_case, error, error_size);
+  }
+
+  done:
+    pattern_bytes_free( & match);
+  for (int k = 0; k < count; k++) {
+    pattern_bytes_free( & keywords[k]);
+  }
+  free(keywords);
+  free(ids);
+  return set;
+}
+
+/*
+ * Compile and activate a keyword set, replacing the current one. NULL or
+ * an empty string turns tagging off. Returns 0 and keeps the current set
+ * if the text does not parse.
+ */
+int keyword_tags_set(const char * keywords, int ignore_case) {
+  tag_set_t * set = NULL;
+  char error[256];
+
+  if (keywords && * keywords) {
+    error[0] = '\0';
+    set = compile_keywords(keywords, ignore_case, error, sizeof(error));
+    if (!set && error[0]) {
+      log_message("Keyword tags error: %s", error);
+      return 0;
+    }
+  }
+
+  int count = set ? set -> count : 0;
+  int states = set ? set -> states : 0;
+  pattern_slot_publish( & g_tags, set ? & set -> base : NULL, free_published);
+
+  if (count) {
+    log_message("Keyword tags active: %d keyword(s), %d automaton states", count, states);
+  } else {
+    log_message("Keyword tags cleared");
+  }
+  return 1;
+}
+
+/* Add the ids of every keyword ending in state, skipping ones already reported */
+static int report_state(const tag_set_t * set, int state, int * ids, int found, int max_ids) {
+  for (int s = set -> own[state] >= 0 ? state : set -> dict[state]; s >= 0; s = set -> dict[s]) {
+    for (int k = set -> own[s]; k >= 0; k = set -> next_same[k]) {
+      int id = set -> ids[k];
+      int seen = 0;
+      for (int i = 0; i < found && !seen; i++) {
+        seen = ids[i] == id;
+      }
+      if (!seen) {
+        if (found == max_ids) {
+          return found;
+        }
+        ids[found++] = id;
+      }
+    }
+  }
+  return found;
+}
+
+/*
+ * Scan a chunk and store the ids of the keywords found in it (at most
+ * max_ids, each once). stream carries the state from the previous chunk
+ * of the same direction and may be NULL to scan the chunk on its own.
+ * Returns the number of ids stored; 0 without an active keyword set.
+ */
+int keyword_tags_scan(keyword_tag_stream_t * stream, const unsigned char * data, int len,
+  int * ids, int max_ids) {
+  int epoch;
+  const tag_set_t * set = (const tag_set_t * ) pattern_slot_enter( & g_tags, & epoch);
+  uint32_t state = 0;
+  int found = 0;
+
+  if (!set) {
+    pattern_slot_leave( & g_tags, epoch);
+    return 0;
+  }
+  if (stream && stream -> set == set -> base.generation) {
+    state = stream -> state;
+  }
+
+  const uint32_t * delta = set -> delta;
+  const unsigned char * byte_class = set -> byte_class;
+  int prefilter = set -> prefilter;
+  size_t n = len > 0 ? (size_t) len : 0;
+  size_t i = 0;
+  while (i < n) {
+    if (prefilter && state == 0) {
+      i += data_find_byteset(data + i, n - i, & set -> start);
+      if (i == n) {
+        break;
+      }
+    }
+    uint32_t next = delta[state + byte_class[data[i++]]];
+    state = next & ~TAG_ACCEPT;
+    if ((next & TAG_ACCEPT) && found < max_ids) {
+      found = report_state(set, (int)(state / set -> classes), ids, found, max_ids);
+    }
+  }
+
+  if (stream) {
+    stream -> set = set -> base.generation;
+    stream -> state = state;
+  }
+  pattern_slot_leave( & g_tags, epoch);
+  return found;
+}
+
+/* Free the active and all replaced keyword sets; no relay may be running */
+void cleanup_keyword_tags(void) {
+  pattern_slot_cleanup( & g_tags, free_published);
+}
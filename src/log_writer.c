@@ -0,0 +1,278 @@
+/*
+ * TLS MITM Proxy - Log File Writer Implementation
+ *
+ * Producers copy formatted records into the active buffer under a mutex
+ * that is only held for the memcpy. The writer thread swaps the buffers
+ * when the active one fills up, when the flush interval passes, or right
+ * away under the flushed/synced durability modes, and writes the full
+ * buffer with a single fwrite outside the lock.
+ *
+ * Between batches the writer sleeps on the wake event, timed to the end of
+ * the flush interval while records are pending. Producers set it when a
+ * batch is due, and sleep on the room event while both buffers are full.
+ */
+
+#include "../include/log_writer.h"
+
+#include <stdarg.h>
+
+#ifdef INTERCEPT_WINDOWS
+#include <io.h>
+#endif
+
+static struct {
+  mutex_t lock;
+  int initialized;
+  volatile int running;
+  THREAD_HANDLE thread;
+  char * buffers[2];
+  int active;                   // Buffer producers append to
+  size_t active_len;
+  volatile int full;            // A producer is waiting for room
+  event_t wake;                 // Set when a batch is due or on stop
+  event_t room;                 // Set when the writer swapped buffers
+} g_log_writer = {
+  0
+};
+
+static unsigned long long monotonic_ms(void) {
+  #ifdef INTERCEPT_WINDOWS
+  return (unsigned long long) GetTickCount64();
+  #else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, & ts);
+  return (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  #endif
+}
+
+/* Write one batch to the log file; called without the lock held */
+static void write_batch(const char * data, size_t len) {
+  if (!config.log_fp) {
+    return;
+  }
+
+  fwrite(data, 1, len, config.log_fp);
+  fflush(config.log_fp);
+
+  if (config.log_durability == LOG_DURABILITY_SYNCED) {
+    #ifdef INTERCEPT_WINDOWS
+    _commit(_fileno(config.log_fp));
+    #else
+    fsync(fileno(config.log_fp));
+    #endif
+  }
+}
+
+static THREAD_RETURN_TYPE log_writer_thread(void * arg) {
+  (void) arg;
+  unsigned long long last_write = monotonic_ms();
+
+  while (1) {
+    char * batch = NULL;
+    size_t batch_len = 0;
+    long timeout = EVENT_WAIT_FOREVER;
+
+    LOCK_MUTEX(g_log_writer.lock);
+    int stopping = !ATOMIC_LOAD(g_log_writer.running);
+    unsigned long long elapsed = monotonic_ms() - last_write;
+    if (g_log_writer.active_len > 0 &&
+      (stopping || g_log_writer.full ||
+        config.log_durability != LOG_DURABILITY_BATCHED ||
+        elapsed >= (unsigned long long) config.log_flush_interval_ms)) {
+      // Swap buffers; the other one is free because only this thread writes
+      batch = g_log_writer.buffers[g_log_writer.active];
+      batch_len = g_log_writer.active_len;
+      g_log_writer.active ^= 1;
+      g_log_writer.active_len = 0;
+      g_log_writer.full = 0;
+    } else if (!stopping) {
+      // Producers set it again under the lock
+      RESET_EVENT(g_log_writer.wake);
+      if (g_log_writer.active_len > 0) {
+        timeout = (long)((unsigned long long) config.log_flush_interval_ms - elapsed);
+      }
+    }
+    UNLOCK_MUTEX(g_log_writer.lock);
+
+    if (batch) {
+      SET_EVENT(g_log_writer.room);
+      write_batch(batch, batch_len);
+      last_write = monotonic_ms();
+    } else if (stopping) {
+      break; // Drained
+    } else {
+      WAIT_EVENT(g_log_writer.wake, timeout);
+    }
+  }
+
+  THREAD_RETURN;
+}
+
+/* Set up the writer state; called once when the library loads */
+int init_log_writer(void) {
+  if (g_log_writer.initialized) {
+    return 1;
+  }
+  g_log_writer.wake = CREATE_EVENT();
+  g_log_writer.room = CREATE_EVENT();
+  if (!g_log_writer.wake || !g_log_writer.room) {
+    CLOSE_EVENT(g_log_writer.wake);
+    CLOSE_EVENT(g_log_writer.room);
+    return 0;
+  }
+  INIT_MUTEX(g_log_writer.lock);
+  g_log_writer.initialized = 1;
+  return 1;
+}
+
+/* Stop the writer and release its buffers */
+void cleanup_log_writer(void) {
+  if (!g_log_writer.initialized) {
+    return;
+  }
+  log_writer_stop();
+  free(g_log_writer.buffers[0]);
+  free(g_log_writer.buffers[1]);
+  g_log_writer.buffers[0] = NULL;
+  g_log_writer.buffers[1] = NULL;
+  CLOSE_EVENT(g_log_writer.wake);
+  CLOSE_EVENT(g_log_writer.room);
+  DESTROY_MUTEX(g_log_writer.lock);
+  g_log_writer.initialized = 0;
+}
+
+/*
+ * Start the writer thread for the currently open log file. Without it,
+ * records are written and flushed directly, as before.
+ */
+int log_writer_start(void) {
+  if (!g_log_writer.initialized || g_log_writer.running) {
+    return g_log_writer.running;
+  }
+
+  for (int i = 0; i < 2; i++) {
+    if (!g_log_writer.buffers[i]) {
+      g_log_writer.buffers[i] = (char * ) malloc(LOG_WRITER_BUFFER_SIZE);
+      if (!g_log_writer.buffers[i]) {
+        return 0;
+      }
+    }
+  }
+  g_log_writer.active = 0;
+  g_log_writer.active_len = 0;
+  g_log_writer.full = 0;
+
+  ATOMIC_STORE(g_log_writer.running, 1);
+  if (CREATE_THREAD(g_log_writer.thread, log_writer_thread, NULL) != 0) {
+    ATOMIC_STORE(g_log_writer.running, 0);
+    return 0;
+  }
+  return 1;
+}
+
+/* Stop the writer thread; everything appended so far reaches the file */
+void log_writer_stop(void) {
+  if (!g_log_writer.running) {
+    return;
+  }
+
+  LOCK_MUTEX(g_log_writer.lock);
+  ATOMIC_STORE(g_log_writer.running, 0);
+  SET_EVENT(g_log_writer.wake);
+  UNLOCK_MUTEX(g_log_writer.lock);
+  JOIN_THREAD(g_log_writer.thread);
+  #ifdef INTERCEPT_WINDOWS
+  CloseHandle(g_log_writer.thread);
+  #endif
+  g_log_writer.thread = INVALID_THREAD_ID;
+
+  // Records appended while the thread was exiting
+  LOCK_MUTEX(g_log_writer.lock);
+  if (g_log_writer.active_len > 0) {
+    write_batch(g_log_writer.buffers[g_log_writer.active], g_log_writer.active_len);
+    g_log_writer.active_len = 0;
+  }
+  UNLOCK_MUTEX(g_log_writer.lock);
+}
+
+/* Append a record to the log file */
+void log_writer_write(const char * text, size_t len) {
+  if (!g_log_writer.initialized) {
+    if (config.log_fp) {
+      fwrite(text, 1, len, config.log_fp);
+      fflush(config.log_fp);
+    }
+    return;
+  }
+
+  LOCK_MUTEX(g_log_writer.lock);
+  int was_empty = g_log_writer.active_len == 0;
+  while (len > 0) {
+    if (!ATOMIC_LOAD(g_log_writer.running)) {
+      // No writer thread: write through, serialized by the lock
+      if (config.log_fp) {
+        fwrite(text, 1, len, config.log_fp);
+        fflush(config.log_fp);
+      }
+      break;
+    }
+
+    size_t room = LOG_WRITER_BUFFER_SIZE - g_log_writer.active_len;
+    if (room == 0) {
+      // Both buffers busy: wait for the writer thread to swap
+      g_log_writer.full = 1;
+      SET_EVENT(g_log_writer.wake);
+      RESET_EVENT(g_log_writer.room);
+      UNLOCK_MUTEX(g_log_writer.lock);
+      WAIT_EVENT(g_log_writer.room, EVENT_WAIT_FOREVER);
+      LOCK_MUTEX(g_log_writer.lock);
+      continue;
+    }
+
+    size_t chunk = len < room ? len : room;
+    memcpy(g_log_writer.buffers[g_log_writer.active] + g_log_writer.active_len, text, chunk);
+    g_log_writer.active_len += chunk;
+    text += chunk;
+    len -= chunk;
+  }
+
+  if (g_log_writer.active_len >= LOG_WRITER_BUFFER_SIZE / 2) {
+    g_log_writer.full = 1; // Ask for an early swap so producers rarely wait
+  }
+  // Wake the writer when a batch is due now, or to time the flush interval
+  // from the first record of a batch
+  if (ATOMIC_LOAD(g_log_writer.running) && g_log_writer.active_len > 0 &&
+    (was_empty || g_log_writer.full || config.log_durability != LOG_DURABILITY_BATCHED)) {
+    SET_EVENT(g_log_writer.wake);
+  }
+  UNLOCK_MUTEX(g_log_writer.lock);
+}
+
+/* Format and append a record to the log file */
+void log_writer_printf(const char * format, ...) {
+  char stack_buffer[4096];
+  va_list args;
+
+  va_start(args, format);
+  int len = vsnprintf(stack_buffer, sizeof(stack_buffer), format, args);
+  va_end(args);
+  if (len < 0) {
+    return;
+  }
+
+  if ((size_t) len < sizeof(stack_buffer)) {
+    log_writer_write(stack_buffer, (size_t) len);
+    return;
+  }
+
+  // Long records (hex dumps) do not fit on the stack
+  char * heap_buffer = (char * ) malloc((size_t) len + 1);
+  if (!heap_buffer) {
+    return;
+  }
+  va_start(args, format);
+  vsnprintf(heap_buffer, (size_t) len + 1, format, args);
+  va_end(args);
+  log_writer_write(heap_buffer, (size_t) len);
+  free(heap_buffer);
+}
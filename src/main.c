@@ -17,6 +17,28 @@
 
 #include "../include/tls_proxy_dll.h"
 
+#include "../include/event_loop.h"
+
+#include "../include/event_queue.h"
+
+#include "../include/data_kernels.h"
+
+#include "../include/log_writer.h"
+
+#include "../include/intercept_registry.h"
+
+#include "../include/intercept_filter.h"
+
+#include "../include/rewrite_rules.h"
+
+#include "../include/passthrough.h"
+
+#include "../include/fingerprint_index.h"
+
+#include "../include/keyword_tags.h"
+
+#include "../include/dns_cache.h"
+
 #ifdef INTERCEPT_WINDOWS
 #include <iphlpapi.h>
 
@@ -36,9 +58,16 @@ EVP_PKEY * ca_key = NULL;
 
 /* Global callback functions */
 log_callback_t g_log_callback = NULL;
+raw_log_callback_t g_raw_log_callback = NULL;
+tag_callback_t g_tag_callback = NULL;
+http_message_callback_t g_http_message_callback = NULL;
+http2_data_callback_t g_http2_data_callback = NULL;
 status_callback_t g_status_callback = NULL;
 connection_callback_t g_connection_callback = NULL;
 disconnect_callback_t g_disconnect_callback = NULL;
+protocol_callback_t g_protocol_callback = NULL;
+ktls_callback_t g_ktls_callback = NULL;
+client_hello_callback_t g_client_hello_callback = NULL;
 
 /* Global interception configuration */
 intercept_config_t g_intercept_config = {
@@ -48,11 +77,6 @@ intercept_config_t g_intercept_config = {
 /* Global interception callback */
 intercept_callback_t g_intercept_callback = NULL;
 
-/* Active interception data storage */
-intercept_data_t * g_active_intercepts[100] = {
-  0
-}; // Support up to 100 concurrent intercepts
-int g_intercept_count = 0;
 
 /* Statistics */
 static int g_total_connections = 0;
@@ -63,14 +87,29 @@ static int initialize_library(void) {
   /* Initialize default configuration */
   init_config();
 
+  /* Initialize the batched log file writer */
+  init_log_writer();
+
   /* Initialize OpenSSL */
   SSL_library_init();
   OpenSSL_add_all_algorithms();
   SSL_load_error_strings();
   ERR_load_crypto_strings();
 
-  /* Initialize interception mutex */
+  /* Initialize interception mutex and the ClientHello index */
   INIT_MUTEX(g_intercept_config.intercept_cs);
+  init_fingerprint_index();
+
+  /* Initialize shared TLS state: leaf certificate cache, key pool, upstream sessions */
+  init_cert_cache();
+  init_key_pool();
+  init_upstream_sessions();
+
+  /* Initialize the upstream host name cache */
+  init_dns_cache();
+
+  /* Pick the SIMD kernels used to format logged data */
+  select_data_kernel(DATA_KERNEL_AUTO);
 
   /* Initialize network subsystem */
   #ifdef INTERCEPT_WINDOWS
@@ -96,8 +135,27 @@ static void cleanup_library(void) {
   EVP_cleanup();
   CRYPTO_cleanup_all_ex_data();
 
-  /* Destroy interception mutex */
+  /* Destroy interception mutex, the held message index, filters, rewrite rules, passthrough rules, keyword tags
+   and the ClientHello index */
   DESTROY_MUTEX(g_intercept_config.intercept_cs);
+  cleanup_intercept_registry();
+  cleanup_intercept_filters();
+  cleanup_rewrite_rules();
+  cleanup_passthrough_rules();
+  cleanup_keyword_tags();
+  cleanup_fingerprint_index();
+
+  /* Free cached contexts, pooled keys and upstream sessions */
+  cleanup_cert_cache();
+  cleanup_key_pool();
+  cleanup_upstream_sessions();
+
+  /* Drop cached host names once background lookups are done */
+  cleanup_dns_cache();
+
+  /* Free the log event queue and log file buffers */
+  event_queue_cleanup();
+  cleanup_log_writer();
 
   /* Cleanup network subsystem */
   #ifdef INTERCEPT_WINDOWS
@@ -175,6 +233,21 @@ INTERCEPT_API intercept_bool_t start_proxy(void) {
   }
   log_message("Proxy initialization completed successfully");
 
+  /* Pre-generate leaf keys in the background */
+  if (config.key_pool_depth > 0 && !start_key_pool()) {
+    log_message("WARNING: Failed to start key pool, keys will be generated per handshake");
+  }
+
+  /* Hand log events to a dispatcher thread instead of the forwarding threads */
+  if (!event_queue_start()) {
+    log_message("WARNING: Failed to start event queue, log events will be delivered synchronously");
+  }
+
+  /* Start reactor threads when the event loop engine is selected */
+  if (config.engine == PROXY_ENGINE_EVENT_LOOP && !event_loop_start(config.reactor_threads)) {
+    log_message("WARNING: Failed to start event loop engine, using threaded engine");
+  }
+
   /* Start proxy server */
   /* Initialize critical section/mutex */
   INIT_MUTEX(g_server.cs);
@@ -293,6 +366,15 @@ INTERCEPT_API void stop_proxy(void) {
     g_server.thread_handle = 0;
   }
 
+  /* Stop reactor threads and close their connections */
+  event_loop_stop();
+
+  /* Stop background key generation */
+  stop_key_pool();
+
+  /* Deliver queued log events before the log file is closed */
+  event_queue_stop();
+
   /* Delete critical section/mutex */
   DESTROY_MUTEX(g_server.cs);
 
@@ -329,6 +411,24 @@ INTERCEPT_API intercept_bool_t set_config(const char * bind_addr, int port,
   return TRUE;
 }
 
+INTERCEPT_API intercept_bool_t set_proxy_engine(int engine, int reactor_threads) {
+  if (engine != PROXY_ENGINE_THREADED && engine != PROXY_ENGINE_EVENT_LOOP) {
+    return FALSE;
+  }
+
+  if (engine == PROXY_ENGINE_EVENT_LOOP && !event_loop_supported()) {
+    log_message("ERROR: Event loop engine is only available on Linux");
+    return FALSE;
+  }
+
+  /* The engine is picked up by the next start_proxy() */
+  config.engine = (proxy_engine_t) engine;
+  config.reactor_threads = reactor_threads > EVENT_LOOP_MAX_REACTORS ? EVENT_LOOP_MAX_REACTORS : reactor_threads;
+
+  log_message("Proxy engine set to %s", engine == PROXY_ENGINE_EVENT_LOOP ? "event loop" : "threaded");
+  return TRUE;
+}
+
 /* Network subsystem initialization and cleanup */
 int init_winsock(void) {
   #ifdef INTERCEPT_WINDOWS
@@ -413,6 +513,15 @@ THREAD_RETURN_TYPE THREAD_CALL run_server_thread(void * arg) {
       continue;
     }
 
+    // Hand the socket to a reactor when the event loop engine is running
+    if (config.engine == PROXY_ENGINE_EVENT_LOOP && event_loop_is_running()) {
+      if (!event_loop_dispatch(client -> client_sock, & client -> client_addr)) {
+        CLOSE_SOCKET(client -> client_sock);
+      }
+      free(client);
+      continue;
+    }
+
     // Set to blocking mode for normal operation
     #ifdef INTERCEPT_WINDOWS
     unsigned long nonBlocking = 0;
@@ -457,20 +566,52 @@ void send_status_update(const char * message) {
 }
 
 /* Helper function to send log entries */
-void send_log_entry(const char * src_ip,
+void send_log_entry(time_t when, const char * src_ip,
   const char * dst_ip, int dst_port,
     const char * msg_type,
       const char * data, int connection_id, int packet_id) {
   if (g_log_callback && src_ip && dst_ip && msg_type && data) {
     char timestamp[64];
-    time_t now = time(NULL);
-    struct tm * tm_info = localtime( & now);
+    struct tm * tm_info = localtime( & when);
     strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", tm_info);
 
     g_log_callback(timestamp, connection_id, packet_id, src_ip, dst_ip, dst_port, msg_type, data);
   }
 }
 
+void send_raw_log_entry(time_t when, const char * direction,
+  const char * src_ip, const char * dst_ip, int dst_port,
+    const unsigned char * data, int data_length, int connection_id, int packet_id) {
+  if (g_raw_log_callback && direction && src_ip && dst_ip && data) {
+    g_raw_log_callback((long long) when, connection_id, packet_id, direction, src_ip, dst_ip, dst_port, data, data_length);
+  }
+}
+
+void send_tag_entry(int connection_id, int packet_id, const int * ids, int count) {
+  if (g_tag_callback && ids && count > 0) {
+    g_tag_callback(connection_id, packet_id, ids, count);
+  }
+}
+
+void send_http_message_entry(time_t when, const char * direction,
+  const char * src_ip, const char * dst_ip, int dst_port,
+    const http_message_info_t * message, const unsigned char * data, int data_length,
+      int connection_id, int packet_id) {
+  if (g_http_message_callback && direction && src_ip && dst_ip && message && data) {
+    g_http_message_callback((long long) when, connection_id, packet_id, direction, src_ip, dst_ip, dst_port,
+      message, data, data_length);
+  }
+}
+
+void send_http2_data_entry(time_t when, const char * direction,
+  const char * src_ip, const char * dst_ip, int dst_port, int stream_id,
+    const unsigned char * data, int data_length, int end_stream, int connection_id, int packet_id) {
+  if (g_http2_data_callback && direction && src_ip && dst_ip && data) {
+    g_http2_data_callback((long long) when, connection_id, packet_id, direction, src_ip, dst_ip, dst_port,
+      stream_id, data, data_length, end_stream);
+  }
+}
+
 /* Helper function to send connection notifications */
 void send_connection_notification(const char * client_ip, int client_port,
   const char * target_host, int target_port, int connection_id) {
@@ -488,11 +629,48 @@ void send_disconnect_notification(int connection_id,
   }
 }
 
+/* Helper function to report the negotiated application protocol */
+void send_protocol_notification(int connection_id, const char * protocol) {
+  if (g_protocol_callback && protocol) {
+    g_protocol_callback(connection_id, protocol);
+  }
+}
+
+/* Helper function to report kernel TLS offload of a connection */
+void send_ktls_notification(int connection_id, int flags) {
+  if (g_ktls_callback) {
+    g_ktls_callback(connection_id, flags);
+  }
+}
+
+/* Helper function to report the ClientHello of a TLS connection */
+void send_client_hello_notification(int connection_id, const client_hello_info_t * hello) {
+  if (g_client_hello_callback) {
+    g_client_hello_callback(connection_id, hello);
+  }
+}
+
 /* Set callback functions */
 INTERCEPT_API void set_log_callback(log_callback_t callback) {
   g_log_callback = callback;
 }
 
+INTERCEPT_API void set_raw_log_callback(raw_log_callback_t callback) {
+  g_raw_log_callback = callback;
+}
+
+INTERCEPT_API void set_tag_callback(tag_callback_t callback) {
+  g_tag_callback = callback;
+}
+
+INTERCEPT_API void set_http_message_callback(http_message_callback_t callback) {
+  g_http_message_callback = callback;
+}
+
+INTERCEPT_API void set_http2_data_callback(http2_data_callback_t callback) {
+  g_http2_data_callback = callback;
+}
+
 INTERCEPT_API void set_status_callback(status_callback_t callback) {
   g_status_callback = callback;
 }
@@ -505,6 +683,18 @@ INTERCEPT_API void set_disconnect_callback(disconnect_callback_t callback) {
   g_disconnect_callback = callback;
 }
 
+INTERCEPT_API void set_protocol_callback(protocol_callback_t callback) {
+  g_protocol_callback = callback;
+}
+
+INTERCEPT_API void set_ktls_callback(ktls_callback_t callback) {
+  g_ktls_callback = callback;
+}
+
+INTERCEPT_API void set_client_hello_callback(client_hello_callback_t callback) {
+  g_client_hello_callback = callback;
+}
+
 /* Interception callback and control functions */
 
 INTERCEPT_API void set_intercept_callback(intercept_callback_t callback) {
@@ -560,43 +750,111 @@ INTERCEPT_API intercept_status_t get_intercept_config(void) {
   return result;
 }
 
+/* Apply a user response to a held message; caller holds intercept_cs */
+static void apply_intercept_response(intercept_data_t * intercept, int action,
+  const unsigned char * modified_data, int modified_length) {
+  intercept -> action = (intercept_action_t) action;
+
+  // Handle modified data if provided
+  if (action == INTERCEPT_ACTION_MODIFY && modified_data && modified_length > 0) {
+    // Free existing modified data if any
+    if (intercept -> modified_data) {
+      free(intercept -> modified_data);
+    }
+
+    // Allocate and copy new data
+    intercept -> modified_data = malloc(modified_length);
+    if (intercept -> modified_data) {
+      memcpy(intercept -> modified_data, modified_data, modified_length);
+      intercept -> modified_length = modified_length;
+    } else {
+      // Fall back to forward if allocation fails
+      intercept -> action = INTERCEPT_ACTION_FORWARD;
+    }
+  }
+
+  intercept -> is_waiting_for_response = 0;
+  if (intercept -> wakeup) {
+    intercept -> wakeup(intercept -> wakeup_arg);
+  }
+}
+
 INTERCEPT_API void respond_to_intercept(int connection_id, int action,
   const unsigned char * modified_data, int modified_length) {
   LOCK_MUTEX(g_intercept_config.intercept_cs);
 
-  // Find the intercept data for this connection
-  for (int i = 0; i < g_intercept_count; i++) {
-    if (g_active_intercepts[i] && g_active_intercepts[i] -> connection_id == connection_id &&
-      g_active_intercepts[i] -> is_waiting_for_response) {
+  // Oldest held message of this connection
+  intercept_data_t * intercept = intercept_registry_find_waiting(connection_id);
+  if (intercept) {
+    apply_intercept_response(intercept, action, modified_data, modified_length);
+  }
 
-      intercept_data_t * intercept = g_active_intercepts[i];
-      intercept -> action = (intercept_action_t) action;
+  UNLOCK_MUTEX(g_intercept_config.intercept_cs);
+}
 
-      // Handle modified data if provided
-      if (action == INTERCEPT_ACTION_MODIFY && modified_data && modified_length > 0) {
-        // Free existing modified data if any
-        if (intercept -> modified_data) {
-          free(intercept -> modified_data);
-        }
+INTERCEPT_API intercept_bool_t respond_to_intercept_packet(int connection_id, int packet_id, int action,
+  const unsigned char * modified_data, int modified_length) {
+  intercept_bool_t found = FALSE;
 
-        // Allocate and copy new data
-        intercept -> modified_data = malloc(modified_length);
-        if (intercept -> modified_data) {
-          memcpy(intercept -> modified_data, modified_data, modified_length);
-          intercept -> modified_length = modified_length;
-        } else {
-          // Fall back to forward if allocation fails
-          intercept -> action = INTERCEPT_ACTION_FORWARD;
-        }
-      }
+  LOCK_MUTEX(g_intercept_config.intercept_cs);
 
-      intercept -> is_waiting_for_response = 0;
-      SET_EVENT(intercept -> response_event);
-      break;
-    }
+  intercept_data_t * intercept = intercept_registry_find(connection_id, packet_id);
+  if (intercept && intercept -> is_waiting_for_response) {
+    apply_intercept_response(intercept, action, modified_data, modified_length);
+    found = TRUE;
   }
 
   UNLOCK_MUTEX(g_intercept_config.intercept_cs);
+  return found;
+}
+
+INTERCEPT_API intercept_bool_t set_intercept_filter(const char * rules) {
+  return intercept_filter_set(rules) ? TRUE : FALSE;
+}
+
+INTERCEPT_API intercept_bool_t set_rewrite_rules(const char * rules) {
+  return rewrite_rules_set(rules) ? TRUE : FALSE;
+}
+
+INTERCEPT_API int get_rewrite_rule_hits(long long * hits, int max_rules) {
+  return rewrite_rules_hits(hits, max_rules);
+}
+
+INTERCEPT_API intercept_bool_t set_passthrough_rules(const char * rules) {
+  return passthrough_rules_set(rules) ? TRUE : FALSE;
+}
+
+INTERCEPT_API int get_passthrough_rule_hits(long long * hits, int max_rules) {
+  return passthrough_rule_hits(hits, max_rules);
+}
+
+INTERCEPT_API intercept_bool_t get_client_hello_info(int connection_id, client_hello_info_t * hello) {
+  if (!hello) {
+    return FALSE;
+  }
+  return fingerprint_index_get(connection_id, hello) ? TRUE : FALSE;
+}
+
+INTERCEPT_API int find_connections_by_fingerprint(const char * fingerprint, int * connection_ids, int max_ids) {
+  if (!fingerprint) {
+    return 0;
+  }
+  int found = fingerprint_index_find(fingerprint, connection_ids, max_ids);
+  return found < 0 ? 0 : found;
+}
+
+INTERCEPT_API intercept_bool_t set_keyword_tags(const char * keywords, int ignore_case) {
+  return keyword_tags_set(keywords, ignore_case) ? TRUE : FALSE;
+}
+
+INTERCEPT_API intercept_bool_t set_intercept_hold_budget(int bytes) {
+  if (bytes < BUFFER_SIZE) {
+    return FALSE; // Must fit at least one read
+  }
+
+  /* Checked by the relays before every read, so this applies immediately */
+  config.intercept_hold_budget = bytes;
+  return TRUE;
 }
 
 /* Get system IP addresses */
@@ -692,6 +950,152 @@ INTERCEPT_API proxy_config_t get_proxy_config(void) {
   return result;
 }
 
+INTERCEPT_API intercept_bool_t set_leaf_key_algorithm(int algorithm) {
+  if (algorithm < LEAF_KEY_RSA_2048 || algorithm > LEAF_KEY_ECDSA_P384) {
+    return FALSE;
+  }
+
+  if (algorithm != (int) config.leaf_key_algorithm) {
+    change_leaf_key_algorithm((leaf_key_algorithm_t) algorithm);
+  }
+
+  static const char * names[] = {
+    "RSA-2048",
+    "RSA-3072",
+    "ECDSA P-256",
+    "ECDSA P-384"
+  };
+  log_message("Leaf certificate key algorithm set to %s", names[algorithm]);
+  return TRUE;
+}
+
+INTERCEPT_API int get_leaf_key_algorithm(void) {
+  return (int) config.leaf_key_algorithm;
+}
+
+INTERCEPT_API intercept_bool_t set_key_pool_depth(int depth) {
+  if (depth < 0 || depth > KEY_POOL_MAX_DEPTH) {
+    return FALSE;
+  }
+
+  resize_key_pool(depth);
+
+  /* Start refilling right away when the pool is enabled on a running proxy */
+  if (depth > 0 && g_server.thread_handle) {
+    start_key_pool();
+  }
+  return TRUE;
+}
+
+INTERCEPT_API key_pool_stats_t get_key_pool_stats(void) {
+  key_pool_stats_t result;
+  get_key_pool_counters( & result);
+  return result;
+}
+
+INTERCEPT_API intercept_bool_t set_event_queue_policy(int policy, int capacity) {
+  if (policy < EVENT_QUEUE_BLOCK || policy > EVENT_QUEUE_DROP_NEWEST || capacity > EVENT_QUEUE_MAX_CAPACITY) {
+    return FALSE;
+  }
+
+  /* Picked up by the next start_proxy() */
+  config.event_queue_policy = (event_queue_policy_t) policy;
+  if (capacity > 0) {
+    config.event_queue_capacity = capacity;
+  }
+  return TRUE;
+}
+
+INTERCEPT_API intercept_bool_t set_log_durability(int durability, int flush_interval_ms) {
+  if (durability < LOG_DURABILITY_BATCHED || durability > LOG_DURABILITY_SYNCED || flush_interval_ms < 0) {
+    return FALSE;
+  }
+
+  /* Read by the log writer thread on every pass, so this applies immediately */
+  config.log_durability = (log_durability_t) durability;
+  if (flush_interval_ms > 0) {
+    config.log_flush_interval_ms = flush_interval_ms;
+  }
+  return TRUE;
+}
+
+INTERCEPT_API intercept_bool_t set_http_message_events(int mode, int max_body) {
+  if (mode < HTTP_MESSAGES_OFF || mode > HTTP_MESSAGES_ONLY) {
+    return FALSE;
+  }
+
+  /* Relays pick the mode up when they start */
+  config.http_message_mode = (http_message_mode_t) mode;
+  if (max_body >= 0) {
+    config.http_message_max_body = max_body;
+  }
+  return TRUE;
+}
+
+INTERCEPT_API intercept_bool_t set_ktls_enabled(int enabled) {
+  #if !defined(SSL_OP_ENABLE_KTLS) || defined(OPENSSL_NO_KTLS)
+  if (enabled) {
+    return FALSE;
+  }
+  #endif
+
+  /* Handshakes pick the setting up when they start */
+  config.ktls = enabled ? 1 : 0;
+  return TRUE;
+}
+
+INTERCEPT_API event_queue_stats_t get_event_queue_stats(void) {
+  event_queue_stats_t result;
+  event_queue_get_stats( & result);
+  return result;
+}
+
+INTERCEPT_API const char * format_log_data(const unsigned char * data, int data_length, char * buffer, int buffer_size) {
+  if (!buffer || buffer_size <= 0 || (!data && data_length > 0)) {
+    return NULL;
+  }
+  return format_log_message(data, data_length, buffer, (size_t) buffer_size);
+}
+
+INTERCEPT_API upstream_session_stats_t get_upstream_session_stats(void) {
+  upstream_session_stats_t result;
+  get_upstream_session_counters( & result);
+  return result;
+}
+
+INTERCEPT_API intercept_bool_t set_dns_cache_ttl(int positive_ttl, int negative_ttl) {
+  if (positive_ttl < 0 || negative_ttl < 0) {
+    return FALSE;
+  }
+
+  /* Lookups read the TTLs when they store an answer */
+  config.dns_cache_ttl = positive_ttl;
+  config.dns_negative_ttl = negative_ttl;
+  return TRUE;
+}
+
+INTERCEPT_API dns_cache_stats_t get_dns_cache_stats(void) {
+  dns_cache_stats_t result;
+  get_dns_cache_counters( & result);
+  return result;
+}
+
+INTERCEPT_API intercept_bool_t set_connect_timeout(int timeout_ms) {
+  if (timeout_ms <= 0) {
+    return FALSE;
+  }
+
+  /* Read when each upstream connect starts */
+  config.connect_timeout_ms = timeout_ms;
+  return TRUE;
+}
+
+INTERCEPT_API cert_cache_stats_t get_cert_cache_stats(void) {
+  cert_cache_stats_t result;
+  get_cert_cache_counters( & result);
+  return result;
+}
+
 /* Get proxy statistics */
 /* Process enumeration functionality has been removed as it was only needed for WinDivert */
 
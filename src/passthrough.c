@@ -0,0 +1,132 @@
+/*
+ * TLS MITM Proxy - Passthrough List Implementation
+ *
+ * Rules are compiled and published by pattern_rules_set() (see
+ * pattern_match.h); a replaced list is freed once no connection setup can
+ * still be matching against it. A connection is matched once, when it is
+ * set up, so there is no per-chunk work and no candidate mask. Only the
+ * hit counters are written after publication, with atomic increments.
+ */
+
+#include "../include/passthrough.h"
+
+#include "../include/pattern_match.h"
+
+typedef struct {
+  pattern_conn_terms_t conn;
+  volatile long long hits;              // Connections this rule passed through
+} passthrough_rule_t;
+
+typedef struct {
+  pattern_set_t base;
+  passthrough_rule_t * rules;
+  int count;
+} passthrough_set_t;
+
+static pattern_slot_t g_passthrough;
+
+static void free_rule(void * rule) {
+  pattern_conn_terms_free( & ((passthrough_rule_t * ) rule) -> conn);
+}
+
+static void free_set(pattern_set_t * base) {
+  passthrough_set_t * set = (passthrough_set_t * ) base;
+  for (int i = 0; i < set -> count; i++) {
+    free_rule( & set -> rules[i]);
+  }
+  free(set -> rules);
+  free(set);
+}
+
+/* Apply one key=value term to the rule being built */
+static int apply_term(void * rule, const char * key, const char * value, char * error, size_t error_size) {
+  int ret = pattern_conn_terms_parse( & ((passthrough_rule_t * ) rule) -> conn, key, value, 1, error, error_size);
+  if (ret < 0) {
+    snprintf(error, error_size, "unknown key '%s'", key);
+  }
+  return ret > 0;
+}
+
+/* Append a finished rule to the set */
+static int push_rule(pattern_set_t * base, void * rule, char * error, size_t error_size) {
+  passthrough_set_t * set = (passthrough_set_t * ) base;
+  passthrough_rule_t * rules = (passthrough_rule_t * ) realloc(set -> rules, (set -> count + 1) * sizeof(passthrough_rule_t));
+  if (!rules) {
+    snprintf(error, error_size, "out of memory");
+    return 0;
+  }
+  set -> rules = rules;
+  set -> rules[set -> count++] = * (passthrough_rule_t * ) rule;
+  return 1;
+}
+
+static const pattern_rule_kind_t g_passthrough_kind = {
+  "Passthrough rules",
+  sizeof(passthrough_set_t),
+  sizeof(passthrough_rule_t),
+  NULL,
+  apply_term,
+  push_rule,
+  free_rule,
+  free_set
+};
+
+/*
+ * Compile and activate a passthrough list, replacing the current one. NULL
+ * or an empty string intercepts everything again. Returns 0 and keeps the
+ * current list if the rules do not parse. Connections already set up keep
+ * the treatment they got.
+ */
+int passthrough_rules_set(const char * rules) {
+  return pattern_rules_set( & g_passthrough, & g_passthrough_kind, rules);
+}
+
+/* Whether any rule is active, so callers can skip matching */
+int passthrough_active(void) {
+  return ATOMIC_LOAD_PTR(g_passthrough.current) != NULL;
+}
+
+/*
+ * Return the index of the first rule the connection matches and count the
+ * hit, or -1 if the connection is intercepted as usual. Lock-free.
+ */
+int passthrough_match(const passthrough_target_t * target) {
+  int epoch;
+  passthrough_set_t * set = (passthrough_set_t * ) pattern_slot_enter( & g_passthrough, & epoch);
+  pattern_conn_t conn;
+  int match = -1;
+
+  conn.host = target -> host;
+  conn.sni = target -> sni;
+  conn.ja3 = target -> ja3;
+  conn.ja4 = target -> ja4;
+  conn.client_ip = target -> client_ip;
+  conn.server_ip = target -> server_ip;
+  conn.port = target -> port;
+  for (int i = 0; set && i < set -> count && match < 0; i++) {
+    if (pattern_conn_terms_match( & set -> rules[i].conn, & conn)) {
+      ATOMIC_INCREMENT64(set -> rules[i].hits);
+      match = i;
+    }
+  }
+  pattern_slot_leave( & g_passthrough, epoch);
+  return match;
+}
+
+/* Copy up to max_rules hit counters, in rule order; returns the number of active rules */
+int passthrough_rule_hits(long long * hits, int max_rules) {
+  int epoch;
+  const passthrough_set_t * set = (const passthrough_set_t * ) pattern_slot_enter( & g_passthrough, & epoch);
+  int count = set ? set -> count : 0;
+
+  for (int i = 0; hits && i < count && i < max_rules; i++) {
+    hits[i] = set -> rules[i].hits;
+  }
+  pattern_slot_leave( & g_passthrough, epoch);
+  return count;
+}
+
+/* Free the active and all replaced rule sets; no connection may be setting up */
+void cleanup_passthrough_rules(void) {
+  pattern_slot_cleanup( & g_passthrough, free_set);
+}
@@ -0,0 +1,803 @@
+/*
+ * TLS MITM Proxy - Pattern Matching Implementation
+ *
+ * Regexes compile to a flat list of atoms, each a 256-bit set of accepted
+ * bytes with a repeat range, and are matched by greedy backtracking. The
+ * number of backtracking steps per search is capped so a pathological
+ * pattern degrades to "no match" instead of stalling a relay thread.
+ *
+ * A rule set slot counts its readers under the parity of an epoch that
+ * each publication flips, so readers arriving after a flip never hold up
+ * the counter of the readers before it. A replaced set is freed once both
+ * counters have been seen at zero after the swap: every reader that could
+ * have loaded it was counted in one of them. The check runs whenever a
+ * set is published, so a replaced set lives until the next publication or
+ * the one after, or until cleanup.
+ */
+
+#include "../include/pattern_match.h"
+
+#include <ctype.h>
+
+#define PATTERN_REGEX_STEP_LIMIT (1L << 20) // Backtracking budget per search
+
+#define ATOM_ACCEPTS(atom, c) ((atom) -> accept[(c) >> 3] & (1 << ((c) & 7)))
+
+static void accept_byte(pattern_atom_t * atom, int c) {
+  atom -> accept[c >> 3] |= (unsigned char)(1 << (c & 7));
+}
+
+static void accept_range(pattern_atom_t * atom, int lo, int hi) {
+  for (int c = lo; c <= hi; c++) {
+    accept_byte(atom, c);
+  }
+}
+
+static int hex_value(int c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+/*
+ * Read the next key=value term of a rule. Values may be double-quoted;
+ * escapes inside quotes are kept for the term parser, the reader only uses
+ * them to find the closing quote.
+ */
+int pattern_next_term(const char ** text, char * key, size_t key_size,
+  char * value, size_t value_size, char * error, size_t error_size) {
+  const char * p = * text;
+  size_t key_len = 0;
+  size_t value_len = 0;
+
+  while ( * p == ' ' || * p == '\t' || * p == '\r') {
+    p++;
+  }
+  if ( * p == '\0') {
+    * text = p;
+    return PATTERN_TEXT_END;
+  }
+  if ( * p == ';' || * p == '\n') {
+    * text = p + 1;
+    return PATTERN_RULE_END;
+  }
+
+  while (isalpha((unsigned char) * p) || * p == '_' || (key_len > 0 && isdigit((unsigned char) * p))) {
+    if (key_len < key_size - 1) {
+      key[key_len++] = (char) tolower((unsigned char) * p);
+    }
+    p++;
+  }
+  key[key_len] = '\0';
+  if (key_len == 0 || * p != '=') {
+    snprintf(error, error_size, "expected key=value near '%.20s'", p);
+    return PATTERN_ERROR;
+  }
+  p++;
+
+  if ( * p == '"') {
+    p++;
+    while ( * p && * p != '"' && value_len < value_size - 2) {
+      if ( * p == '\\' && p[1]) {
+        value[value_len++] = * p++;
+      }
+      value[value_len++] = * p++;
+    }
+    if ( * p != '"') {
+      snprintf(error, error_size, "%s: unterminated or too long value", key);
+      return PATTERN_ERROR;
+    }
+    p++;
+  } else {
+    while ( * p && !strchr(" \t\r\n;", * p)) {
+      if (value_len == value_size - 1) {
+        snprintf(error, error_size, "%s: value too long", key);
+        return PATTERN_ERROR;
+      }
+      value[value_len++] = * p++;
+    }
+  }
+  value[value_len] = '\0';
+
+  * text = p;
+  return PATTERN_TERM;
+}
+
+/* Escapes shared by regexes and byte patterns; *p points after the backslash */
+int pattern_parse_escape(const char ** p) {
+  int c = (unsigned char) ** p;
+  if (c == 'x') {
+    int hi = hex_value((unsigned char)( * p)[1]);
+    int lo = hi >= 0 ? hex_value((unsigned char)( * p)[2]) : -1;
+    if (lo < 0) {
+      return -1;
+    }
+    * p += 3;
+    return hi * 16 + lo;
+  }
+  if (!c) {
+    return -1;
+  }
+  ( * p) ++;
+  switch (c) {
+  case 'n':
+    return '\n';
+  case 'r':
+    return '\r';
+  case 't':
+    return '\t';
+  case '0':
+    return 0;
+  default:
+    return c;
+  }
+}
+
+/* Lowercase copy of a glob for pattern_glob_match(); NULL if out of memory */
+char * pattern_glob_compile(const char * glob) {
+  size_t len = strlen(glob);
+  char * copy = (char * ) malloc(len + 1);
+  if (copy) {
+    for (size_t i = 0; i <= len; i++) {
+      copy[i] = (char) tolower((unsigned char) glob[i]);
+    }
+  }
+  return copy;
+}
+
+/* Case-insensitive glob with * and ?; the glob comes from pattern_glob_compile() */
+int pattern_glob_match(const char * glob, const char * text) {
+  const char * star = NULL;
+  const char * resume = NULL;
+
+  while ( * text) {
+    if ( * glob == '*') {
+      star = glob++;
+      resume = text;
+    } else if ( * glob == '?' || * glob == tolower((unsigned char) * text)) {
+      glob++;
+      text++;
+    } else if (star) {
+      glob = star + 1;
+      text = ++resume;
+    } else {
+      return 0;
+    }
+  }
+  while ( * glob == '*') {
+    glob++;
+  }
+  return * glob == '\0';
+}
+
+/* Parse a comma-separated list of ports and lo-hi ranges; 0 if malformed or too long */
+int pattern_ports_parse(pattern_ports_t * ports, const char * value) {
+  const char * p = value;
+
+  ports -> count = 0;
+  while ( * p) {
+    char * end;
+    long lo = strtol(p, & end, 10);
+    long hi = lo;
+    if (end == p) {
+      return 0;
+    }
+    p = end;
+    if ( * p == '-') {
+      hi = strtol(p + 1, & end, 10);
+      if (end == p + 1) {
+        return 0;
+      }
+      p = end;
+    }
+    if (lo < 0 || hi > 65535 || hi < lo || ports -> count == PATTERN_MAX_PORT_RANGES) {
+      return 0;
+    }
+    ports -> lo[ports -> count] = (int) lo;
+    ports -> hi[ports -> count] = (int) hi;
+    ports -> count++;
+    if ( * p == ',') {
+      p++;
+    } else if ( * p) {
+      return 0;
+    }
+  }
+  return ports -> count > 0;
+}
+
+int pattern_ports_match(const pattern_ports_t * ports, int port) {
+  for (int i = 0; i < ports -> count; i++) {
+    if (port >= ports -> lo[i] && port <= ports -> hi[i]) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int parse_ipv4(const char * text, unsigned int * addr) {
+  struct in_addr in;
+  if (inet_pton(AF_INET, text, & in) != 1) {
+    return 0;
+  }
+  * addr = ntohl(in.s_addr);
+  return 1;
+}
+
+/* Parse an IPv4 address or address/bits network */
+int pattern_net_parse(pattern_net_t * net, const char * value) {
+  char address[64];
+  int bits = 32;
+  const char * slash = strchr(value, '/');
+  size_t len = slash ? (size_t)(slash - value) : strlen(value);
+
+  if (len >= sizeof(address)) {
+    return 0;
+  }
+  memcpy(address, value, len);
+  address[len] = '\0';
+
+  if (slash) {
+    char * end;
+    bits = (int) strtol(slash + 1, & end, 10);
+    if (end == slash + 1 || * end || bits < 0 || bits > 32) {
+      return 0;
+    }
+  }
+  if (!parse_ipv4(address, & net -> net)) {
+    return 0;
+  }
+  net -> mask = bits == 0 ? 0 : 0xFFFFFFFFu << (32 - bits);
+  net -> net &= net -> mask;
+  net -> is_set = 1;
+  return 1;
+}
+
+/* Whether a dotted IPv4 address lies in the network */
+int pattern_net_match(const pattern_net_t * net, const char * address) {
+  unsigned int addr;
+  return address && parse_ipv4(address, & addr) && (addr & net -> mask) == net -> net;
+}
+
+/*
+ * Compile a byte pattern: "hex:" followed by hex digits (spaces and colons
+ * ignored), or text with \xNN \n \r \t \\ escapes. Returns 0 if the value
+ * is empty or malformed.
+ */
+/*
+ * Apply a connection term to a rule's terms. dest is only a term where
+ * with_dest is set. Returns 1 if applied, 0 with a message in error if the
+ * value is bad or repeated, -1 if key is not a connection term.
+ */
+int pattern_conn_terms_parse(pattern_conn_terms_t * terms, const char * key, const char * value, int with_dest,
+  char * error, size_t error_size) {
+  if (strcmp(key, "host") == 0 || strcmp(key, "sni") == 0 || strcmp(key, "ja3") == 0 || strcmp(key, "ja4") == 0) {
+    char ** glob = key[0] == 'h' ? & terms -> host : key[0] == 's' ? & terms -> sni :
+      key[2] == '3' ? & terms -> ja3 : & terms -> ja4;
+    if ( * glob || ! * value) {
+      snprintf(error, error_size, "%s: duplicate or empty", key);
+      return 0;
+    }
+    * glob = pattern_glob_compile(value);
+    if (! * glob) {
+      snprintf(error, error_size, "out of memory");
+      return 0;
+    }
+  } else if (strcmp(key, "client") == 0 || (with_dest && strcmp(key, "dest") == 0)) {
+    pattern_net_t * net = key[0] == 'c' ? & terms -> client : & terms -> dest;
+    if (net -> is_set || !pattern_net_parse(net, value)) {
+      snprintf(error, error_size, "%s: expected one IPv4 address or network, got '%.64s'", key, value);
+      return 0;
+    }
+  } else if (strcmp(key, "port") == 0) {
+    if (terms -> ports.count > 0 || !pattern_ports_parse( & terms -> ports, value)) {
+      snprintf(error, error_size, "port: expected ports or ranges (up to %d), got '%.64s'", PATTERN_MAX_PORT_RANGES, value);
+      return 0;
+    }
+  } else {
+    return -1;
+  }
+  return 1;
+}
+
+/*
+ * Whether a connection satisfies every term given. A term on an attribute
+ * the connection does not know never matches; a NULL connection only
+ * matches rules without connection terms.
+ */
+int pattern_conn_terms_match(const pattern_conn_terms_t * terms, const pattern_conn_t * conn) {
+  if (terms -> host && !(conn && conn -> host && pattern_glob_match(terms -> host, conn -> host))) {
+    return 0;
+  }
+  if (terms -> sni && !(conn && conn -> sni && pattern_glob_match(terms -> sni, conn -> sni))) {
+    return 0;
+  }
+  if (terms -> ja3 && !(conn && conn -> ja3 && pattern_glob_match(terms -> ja3, conn -> ja3))) {
+    return 0;
+  }
+  if (terms -> ja4 && !(conn && conn -> ja4 && pattern_glob_match(terms -> ja4, conn -> ja4))) {
+    return 0;
+  }
+  if (terms -> client.is_set && !(conn && pattern_net_match( & terms -> client, conn -> client_ip))) {
+    return 0;
+  }
+  if (terms -> dest.is_set && !(conn && pattern_net_match( & terms -> dest, conn -> server_ip))) {
+    return 0;
+  }
+  if (terms -> ports.count > 0 && !(conn && pattern_ports_match( & terms -> ports, conn -> port))) {
+    return 0;
+  }
+  return 1;
+}
+
+void pattern_conn_terms_free(pattern_conn_terms_t * terms) {
+  free(terms -> host);
+  free(terms -> sni);
+  free(terms -> ja3);
+  free(terms -> ja4);
+}
+
+int pattern_bytes_compile(pattern_bytes_t * pattern, const char * value) {
+  unsigned char * bytes = (unsigned char * ) malloc(strlen(value) + 1);
+  int len = 0;
+
+  memset(pattern, 0, sizeof( * pattern));
+  if (!bytes) {
+    return 0;
+  }
+
+  if (strncmp(value, "hex:", 4) == 0) {
+    for (const char * p = value + 4; * p; p++) {
+      if ( * p == ' ' || * p == ':') {
+        continue;
+      }
+      int hi = hex_value((unsigned char) p[0]);
+      int lo = hi >= 0 ? hex_value((unsigned char) p[1]) : -1;
+      if (lo < 0) {
+        free(bytes);
+        return 0;
+      }
+      bytes[len++] = (unsigned char)(hi * 16 + lo);
+      p++;
+    }
+  } else {
+    for (const char * p = value; * p;) {
+      int c = (unsigned char) * p++;
+      if (c == '\\') {
+        c = pattern_parse_escape( & p);
+        if (c < 0) {
+          free(bytes);
+          return 0;
+        }
+      }
+      bytes[len++] = (unsigned char) c;
+    }
+  }
+
+  if (len == 0) {
+    free(bytes);
+    return 0;
+  }
+
+  pattern -> bytes = bytes;
+  pattern -> len = len;
+  for (int c = 0; c < 256; c++) {
+    pattern -> shift[c] = len;
+  }
+  for (int i = 0; i < len - 1; i++) {
+    pattern -> shift[bytes[i]] = len - 1 - i;
+  }
+  return 1;
+}
+
+/* Offset of the first occurrence, or -1 */
+int pattern_bytes_find(const pattern_bytes_t * pattern, const unsigned char * data, int len) {
+  int last = pattern -> len - 1;
+
+  for (int i = 0; i + last < len; i += pattern -> shift[data[i + last]]) {
+    if (data[i + last] == pattern -> bytes[last] && memcmp(data + i, pattern -> bytes, last) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void pattern_bytes_free(pattern_bytes_t * pattern) {
+  free(pattern -> bytes);
+  pattern -> bytes = NULL;
+  pattern -> len = 0;
+}
+
+/* Add a \d \w \s (or negated) class to an atom; returns 0 for other letters */
+static int regex_class_escape(pattern_atom_t * atom, int c) {
+  pattern_atom_t cls;
+  memset( & cls, 0, sizeof(cls));
+
+  switch (tolower(c)) {
+  case 'd':
+    accept_range( & cls, '0', '9');
+    break;
+  case 'w':
+    accept_range( & cls, '0', '9');
+    accept_range( & cls, 'a', 'z');
+    accept_range( & cls, 'A', 'Z');
+    accept_byte( & cls, '_');
+    break;
+  case 's':
+    accept_byte( & cls, ' ');
+    accept_range( & cls, '\t', '\r');
+    break;
+  default:
+    return 0;
+  }
+
+  for (int i = 0; i < 32; i++) {
+    atom -> accept[i] |= isupper(c) ? (unsigned char) ~cls.accept[i] : cls.accept[i];
+  }
+  return 1;
+}
+
+int pattern_regex_compile(pattern_regex_t * re, const char * pattern, char * error, size_t error_size) {
+  const char * p = pattern;
+  pattern_atom_t atoms[PATTERN_MAX_REGEX_ATOMS];
+  int count = 0;
+
+  memset(re, 0, sizeof( * re));
+  re -> first_byte = -1;
+  if ( * p == '^') {
+    re -> anchor_start = 1;
+    p++;
+  }
+
+  while ( * p) {
+    if ( * p == '$' && p[1] == '\0') {
+      re -> anchor_end = 1;
+      break;
+    }
+    if (strchr("()|{}", * p)) {
+      snprintf(error, error_size, "regex: '%c' is not supported", * p);
+      return 0;
+    }
+    if (strchr("*+?", * p)) {
+      snprintf(error, error_size, "regex: '%c' has nothing to repeat", * p);
+      return 0;
+    }
+    if (count == PATTERN_MAX_REGEX_ATOMS) {
+      snprintf(error, error_size, "regex: pattern too long");
+      return 0;
+    }
+
+    pattern_atom_t * atom = & atoms[count++];
+    memset(atom, 0, sizeof( * atom));
+    atom -> min = 1;
+    atom -> max = 1;
+
+    if ( * p == '.') {
+      memset(atom -> accept, 0xFF, sizeof(atom -> accept));
+      p++;
+    } else if ( * p == '[') {
+      int negate = 0;
+      p++;
+      if ( * p == '^') {
+        negate = 1;
+        p++;
+      }
+      int first = 1;
+      while ( * p && ( * p != ']' || first)) {
+        int lo;
+        first = 0;
+        if ( * p == '\\') {
+          p++;
+          if (regex_class_escape(atom, * p)) {
+            p++;
+            continue;
+          }
+          lo = pattern_parse_escape( & p);
+        } else {
+          lo = (unsigned char) * p++;
+        }
+        if (lo < 0) {
+          snprintf(error, error_size, "regex: bad escape");
+          return 0;
+        }
+
+        int hi = lo;
+        if ( * p == '-' && p[1] && p[1] != ']') {
+          p++;
+          if ( * p == '\\') {
+            p++;
+            hi = pattern_parse_escape( & p);
+          } else {
+            hi = (unsigned char) * p++;
+          }
+          if (hi < lo) {
+            snprintf(error, error_size, "regex: bad range in []");
+            return 0;
+          }
+        }
+        accept_range(atom, lo, hi);
+      }
+      if ( * p != ']') {
+        snprintf(error, error_size, "regex: missing ]");
+        return 0;
+      }
+      p++;
+      if (negate) {
+        for (int i = 0; i < 32; i++) {
+          atom -> accept[i] = (unsigned char) ~atom -> accept[i];
+        }
+      }
+    } else if ( * p == '\\') {
+      p++;
+      if (regex_class_escape(atom, * p)) {
+        p++;
+      } else {
+        int c = pattern_parse_escape( & p);
+        if (c < 0) {
+          snprintf(error, error_size, "regex: bad escape");
+          return 0;
+        }
+        accept_byte(atom, c);
+      }
+    } else {
+      accept_byte(atom, (unsigned char) * p++);
+    }
+
+    if ( * p == '*' || * p == '+' || * p == '?') {
+      atom -> min = * p == '+' ? 1 : 0;
+      atom -> max = * p == '?' ? 1 : -1;
+      p++;
+      if ( * p && strchr("*+?", * p)) {
+        snprintf(error, error_size, "regex: '%c' has nothing to repeat", * p);
+        return 0;
+      }
+    }
+  }
+
+  if (count > 0) {
+    re -> atoms = (pattern_atom_t * ) malloc(count * sizeof(pattern_atom_t));
+    if (!re -> atoms) {
+      snprintf(error, error_size, "out of memory");
+      return 0;
+    }
+    memcpy(re -> atoms, atoms, count * sizeof(pattern_atom_t));
+  }
+  re -> count = count;
+
+  // A mandatory single-byte first atom lets the search skip with memchr
+  if (count > 0 && atoms[0].min > 0) {
+    int found = -1;
+    for (int c = 0; c < 256; c++) {
+      if (ATOM_ACCEPTS( & atoms[0], c)) {
+        if (found >= 0) {
+          found = -1;
+          break;
+        }
+        found = c;
+      }
+    }
+    re -> first_byte = found;
+  }
+  return 1;
+}
+
+/* Length of the match of atoms[0..count) at s, or -1 */
+static int regex_match_here(const pattern_atom_t * atom, int count, const unsigned char * s, int len,
+  int anchor_end, long * steps) {
+  if (count == 0) {
+    return !anchor_end || len == 0 ? 0 : -1;
+  }
+  if (--( * steps) < 0) {
+    return -1;
+  }
+
+  int max = atom -> max < 0 || atom -> max > len ? len : atom -> max;
+  int n = 0;
+  while (n < max && ATOM_ACCEPTS(atom, s[n])) {
+    n++;
+  }
+  // Greedy, then back off one repetition at a time
+  for (; n >= atom -> min; n--) {
+    int rest = regex_match_here(atom + 1, count - 1, s + n, len - n, anchor_end, steps);
+    if (rest >= 0) {
+      return n + rest;
+    }
+  }
+  return -1;
+}
+
+/* Offset of the leftmost match, or -1; *match_len receives its length */
+int pattern_regex_find(const pattern_regex_t * re, const unsigned char * data, int len, int * match_len) {
+  long steps = PATTERN_REGEX_STEP_LIMIT;
+  int last_start = re -> anchor_start ? 0 : len;
+
+  for (int start = 0; start <= last_start && steps > 0; start++) {
+    if (re -> first_byte >= 0) {
+      const unsigned char * next = (const unsigned char * ) memchr(data + start, re -> first_byte, len - start);
+      if (!next || (re -> anchor_start && next != data)) {
+        return -1;
+      }
+      start = (int)(next - data);
+    }
+    int matched = regex_match_here(re -> atoms, re -> count, data + start, len - start, re -> anchor_end, & steps);
+    if (matched >= 0) {
+      * match_len = matched;
+      return start;
+    }
+  }
+  return -1;
+}
+
+void pattern_regex_free(pattern_regex_t * re) {
+  free(re -> atoms);
+  re -> atoms = NULL;
+  re -> count = 0;
+}
+
+/*
+ * Take the current set of a slot, NULL if there is none. It stays valid
+ * until pattern_slot_leave() with the returned epoch.
+ */
+const pattern_set_t * pattern_slot_enter(pattern_slot_t * slot, int * epoch) {
+  * epoch = (int)(ATOMIC_LOAD(slot -> epoch) & 1);
+  ATOMIC_INCREMENT(slot -> readers[ * epoch]); // Full barrier: counted before the load below
+  return (const pattern_set_t * ) ATOMIC_LOAD_PTR(slot -> current);
+}
+
+void pattern_slot_leave(pattern_slot_t * slot, int epoch) {
+  ATOMIC_DECREMENT(slot -> readers[epoch]);
+}
+
+/* Free the retired sets no reader can hold any more; caller holds intercept_cs */
+static void slot_reclaim(pattern_slot_t * slot, pattern_set_free_t free_set) {
+  pattern_set_t ** link = & slot -> retired;
+
+  while ( * link) {
+    pattern_set_t * set = * link;
+    for (int parity = 0; parity < 2; parity++) {
+      if (ATOMIC_CAS(slot -> readers[parity], 0, 0)) {
+        set -> drained |= 1 << parity;
+      }
+    }
+    if (set -> drained == 3) {
+      * link = set -> retired_next;
+      free_set(set);
+    } else {
+      link = & set -> retired_next;
+    }
+  }
+}
+
+/*
+ * Make set (NULL for none) the current set of the slot and retire the one
+ * it replaces. Lock-free for readers; publications are serialized on
+ * intercept_cs.
+ */
+void pattern_slot_publish(pattern_slot_t * slot, pattern_set_t * set, pattern_set_free_t free_set) {
+  LOCK_MUTEX(g_intercept_config.intercept_cs);
+  if (set) {
+    set -> generation = ++slot -> generation;
+  }
+  pattern_set_t * old = (pattern_set_t * ) ATOMIC_EXCHANGE_PTR(slot -> current, set);
+  if (old) {
+    old -> drained = 0;
+    old -> retired_next = slot -> retired;
+    slot -> retired = old;
+  }
+  // Readers from now on count under the other parity, so this one drains
+  ATOMIC_INCREMENT(slot -> epoch);
+  slot_reclaim(slot, free_set);
+  UNLOCK_MUTEX(g_intercept_config.intercept_cs);
+}
+
+/* Free the current and all retired sets; no reader may be running */
+void pattern_slot_cleanup(pattern_slot_t * slot, pattern_set_free_t free_set) {
+  pattern_set_t * set = (pattern_set_t * ) ATOMIC_EXCHANGE_PTR(slot -> current, NULL);
+  if (set) {
+    free_set(set);
+  }
+  while (slot -> retired) {
+    set = slot -> retired;
+    slot -> retired = set -> retired_next;
+    free_set(set);
+  }
+}
+
+/*
+ * Compile rule text into a new set of the given kind. Returns NULL with an
+ * empty error for text with nothing but separators, and NULL with the
+ * reason in error for text that does not parse.
+ */
+static pattern_set_t * compile_rules(const pattern_rule_kind_t * kind, const char * text, int * count,
+  char * error, size_t error_size) {
+  pattern_set_t * set = (pattern_set_t * ) calloc(1, kind -> set_size);
+  void * rule = calloc(1, kind -> rule_size);
+  int terms = 0;
+  const char * p = text;
+
+  * count = 0;
+  if (!set || !rule) {
+    free(set);
+    free(rule);
+    snprintf(error, error_size, "out of memory");
+    return NULL;
+  }
+  if (kind -> init_rule) {
+    kind -> init_rule(rule);
+  }
+
+  while (1) {
+    char key[16];
+    char value[PATTERN_MAX_VALUE];
+    int ret = pattern_next_term( & p, key, sizeof(key), value, sizeof(value), error, error_size);
+
+    if (ret == PATTERN_ERROR) {
+      goto fail;
+    } else if (ret == PATTERN_TERM) {
+      if (!kind -> apply_term(rule, key, value, error, error_size)) {
+        goto fail;
+      }
+      terms++;
+      continue;
+    }
+
+    // End of a rule
+    if (terms > 0) {
+      if (!kind -> push_rule(set, rule, error, error_size)) {
+        goto fail;
+      }
+      ( * count)++;
+      memset(rule, 0, kind -> rule_size);
+      if (kind -> init_rule) {
+        kind -> init_rule(rule);
+      }
+      terms = 0;
+    }
+    if (ret == PATTERN_TEXT_END) {
+      break;
+    }
+  }
+
+  free(rule);
+  if ( * count == 0) {
+    kind -> free_set(set);
+    return NULL; // Nothing but separators: no rules
+  }
+  return set;
+
+  fail:
+    kind -> free_rule(rule);
+  free(rule);
+  kind -> free_set(set);
+  * count = 0;
+  return NULL;
+}
+
+/*
+ * Compile rule text of one kind and publish it in the slot, replacing the
+ * current set. NULL or an empty string clears the slot. Returns 0 and
+ * keeps the current set if the text does not parse.
+ */
+int pattern_rules_set(pattern_slot_t * slot, const pattern_rule_kind_t * kind, const char * text) {
+  pattern_set_t * set = NULL;
+  int count = 0;
+  char error[256];
+
+  if (text && * text) {
+    error[0] = '\0';
+    set = compile_rules(kind, text, & count, error, sizeof(error));
+    if (!set && error[0]) {
+      log_message("%s error: %s", kind -> name, error);
+      return 0;
+    }
+  }
+
+  pattern_slot_publish(slot, set, kind -> free_set);
+
+  if (count) {
+    log_message("%s active: %d rule(s)", kind -> name, count);
+  } else {
+    log_message("%s cleared", kind -> name);
+  }
+  return 1;
+}
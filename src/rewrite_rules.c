@@ -0,0 +1,614 @@
+/*
+ * TLS MITM Proxy - Match and Replace Rules Implementation
+ *
+ * Rules are compiled and published by pattern_rules_set() (see
+ * pattern_match.h). Host terms are cached per relay direction as a
+ * candidate mask, and only the hit counters are written after
+ * publication, with atomic increments.
+ *
+ * A chunk no rule changes is passed through untouched. The first rule that
+ * changes it produces a heap copy, and later rules work on that copy.
+ */
+
+#include "../include/rewrite_rules.h"
+
+#include "../include/pattern_match.h"
+
+#include <ctype.h>
+
+#define REWRITE_MASK_RULES 64           // Rules covered by the candidate mask
+
+typedef struct {
+  int directions;                       // INTERCEPT_* flags the rule applies to
+  char * host;                          // Compiled glob
+  char * header;                        // HTTP header name, NULL for the whole payload
+  int header_len;
+  pattern_bytes_t match;
+  int has_regex;
+  pattern_regex_t regex;
+  int has_replace;
+  unsigned char * replace;
+  int replace_len;
+  volatile long long hits;              // Chunks this rule changed
+} rewrite_rule_t;
+
+typedef struct {
+  pattern_set_t base;                   // Publication header, must come first
+  rewrite_rule_t * rules;
+  int count;
+} rewrite_set_t;
+
+typedef struct {
+  unsigned char * data;
+  int len;
+  int cap;
+  int failed;                           // An allocation failed, discard the result
+} rewrite_buf_t;
+
+static pattern_slot_t g_rewrite;
+
+static void buf_append(rewrite_buf_t * buf, const unsigned char * data, int len) {
+  if (buf -> failed || len <= 0) {
+    return;
+  }
+  if (buf -> len + len > buf -> cap) {
+    int cap = buf -> cap ? buf -> cap : 256;
+    while (cap < buf -> len + len) {
+      cap *= 2;
+    }
+    unsigned char * grown = (unsigned char * ) realloc(buf -> data, cap);
+    if (!grown) {
+      buf -> failed = 1;
+      return;
+    }
+    buf -> data = grown;
+    buf -> cap = cap;
+  }
+  memcpy(buf -> data + buf -> len, data, len);
+  buf -> len += len;
+}
+
+/* Hand out the built buffer; an empty result still gets an allocation */
+static unsigned char * buf_finish(rewrite_buf_t * buf, int * out_len) {
+  if (!buf -> failed && !buf -> data) {
+    buf -> data = (unsigned char * ) malloc(1);
+    buf -> failed = !buf -> data;
+  }
+  if (buf -> failed) {
+    free(buf -> data);
+    log_message("Error: Out of memory while rewriting data, forwarding it unchanged");
+    return NULL;
+  }
+  * out_len = buf -> len;
+  return buf -> data;
+}
+
+/* Offset of the next match of the rule's match/regex term, or -1 */
+static int rule_find(const rewrite_rule_t * rule, const unsigned char * data, int len, int * match_len) {
+  if (rule -> has_regex) {
+    return pattern_regex_find( & rule -> regex, data, len, match_len);
+  }
+  * match_len = rule -> match.len;
+  return pattern_bytes_find( & rule -> match, data, len);
+}
+
+/* Copy data[start, end) to buf with every match replaced; returns the number of matches */
+static int replace_range(const rewrite_rule_t * rule, const unsigned char * data, int start, int end,
+  rewrite_buf_t * buf) {
+  int pos = start;
+  int count = 0;
+
+  while (pos < end) {
+    int match_len;
+    if (rule -> has_regex && rule -> regex.anchor_start && pos > start) {
+      break;
+    }
+    int found = rule_find(rule, data + pos, end - pos, & match_len);
+    if (found < 0) {
+      break;
+    }
+    if (match_len == 0) {
+      // Empty regex matches replace nothing
+      buf_append(buf, data + pos, found + 1);
+      pos += found + 1;
+      continue;
+    }
+    buf_append(buf, data + pos, found);
+    buf_append(buf, rule -> replace, rule -> replace_len);
+    pos += found + match_len;
+    count++;
+  }
+  buf_append(buf, data + pos, end - pos);
+  return count;
+}
+
+static unsigned char * rewrite_payload(const rewrite_rule_t * rule, const unsigned char * data, int len,
+  int * out_len) {
+  rewrite_buf_t buf = {
+    0
+  };
+  int match_len;
+
+  if (rule_find(rule, data, len, & match_len) < 0) {
+    return NULL; // Common case: no copy at all
+  }
+  if (replace_range(rule, data, 0, len, & buf) == 0) {
+    free(buf.data);
+    return NULL;
+  }
+  return buf_finish( & buf, out_len);
+}
+
+/*
+ * Length of the HTTP/1.x header block at the start of data, including the
+ * blank line, or 0 if data does not start an HTTP/1.x message. *complete
+ * is cleared (and len returned) if the block does not end in this chunk.
+ */
+static int http_head_length(const unsigned char * data, int len, int * complete) {
+  int line_end = 0;
+  * complete = 0;
+
+  while (line_end + 1 < len && !(data[line_end] == '\r' && data[line_end + 1] == '\n')) {
+    line_end++;
+  }
+
+  if (len >= 7 && memcmp(data, "HTTP/1.", 7) == 0) {
+    // Status line
+  } else {
+    // Request line: METHOD SP target SP HTTP/1.x
+    int method = 0;
+    while (method < len && method < 16 && isupper(data[method])) {
+      method++;
+    }
+    if (method < 3 || method >= len || data[method] != ' ' || line_end < 9 ||
+      memcmp(data + line_end - 9, " HTTP/1.", 8) != 0) {
+      return 0;
+    }
+  }
+
+  for (int i = line_end; i + 3 < len; i++) {
+    if (data[i] == '\r' && data[i + 1] == '\n' && data[i + 2] == '\r' && data[i + 3] == '\n') {
+      * complete = 1;
+      return i + 4;
+    }
+  }
+  return len;
+}
+
+/*
+ * Find the next header line called name at or after *pos in the header
+ * block. Fills the ranges of the whole line and of its value (without
+ * leading spaces and the line break) and moves *pos past the line.
+ */
+static int http_next_header(const unsigned char * data, int head_len, const char * name, int name_len, int * pos,
+  int * line_start, int * value_start, int * value_end, int * line_end) {
+  while ( * pos < head_len) {
+    int start = * pos;
+    int end = start;
+    while (end + 1 < head_len && !(data[end] == '\r' && data[end + 1] == '\n')) {
+      end++;
+    }
+    int next = end + 1 < head_len ? end + 2 : head_len;
+    if (end + 1 >= head_len) {
+      end = head_len; // Unterminated last line of a partial block
+    }
+    * pos = next;
+
+    if (end == start) {
+      return 0; // Blank line ends the block
+    }
+    if (end - start > name_len && data[start + name_len] == ':') {
+      int i;
+      for (i = 0; i < name_len; i++) {
+        if (tolower(data[start + i]) != tolower((unsigned char) name[i])) {
+          break;
+        }
+      }
+      if (i == name_len) {
+        int value = start + name_len + 1;
+        while (value < end && (data[value] == ' ' || data[value] == '\t')) {
+          value++;
+        }
+        * line_start = start;
+        * value_start = value;
+        * value_end = end;
+        * line_end = next;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/* Offset of the first header line (after the request or status line) */
+static int http_first_header(const unsigned char * data, int head_len) {
+  for (int i = 0; i + 1 < head_len; i++) {
+    if (data[i] == '\r' && data[i + 1] == '\n') {
+      return i + 2;
+    }
+  }
+  return head_len;
+}
+
+static unsigned char * rewrite_header(const rewrite_rule_t * rule, const unsigned char * data, int len,
+  int * out_len) {
+  rewrite_buf_t buf = {
+    0
+  };
+  int complete;
+  int head_len = http_head_length(data, len, & complete);
+  int pos, line_start, value_start, value_end, line_end;
+  int copied = 0;
+  int count = 0;
+  int has_pattern = rule -> match.bytes || rule -> has_regex;
+
+  if (head_len == 0) {
+    return NULL;
+  }
+
+  pos = http_first_header(data, head_len);
+  while (http_next_header(data, head_len, rule -> header, rule -> header_len, & pos,
+      & line_start, & value_start, & value_end, & line_end)) {
+    int match_len;
+    if (has_pattern) {
+      if (rule_find(rule, data + value_start, value_end - value_start, & match_len) < 0) {
+        continue;
+      }
+      buf_append( & buf, data + copied, value_start - copied);
+      replace_range(rule, data, value_start, value_end, & buf);
+      copied = value_end;
+    } else if (rule -> has_replace) {
+      // Set the whole value
+      buf_append( & buf, data + copied, value_start - copied);
+      buf_append( & buf, rule -> replace, rule -> replace_len);
+      copied = value_end;
+    } else {
+      // Remove the header line
+      buf_append( & buf, data + copied, line_start - copied);
+      copied = line_end;
+    }
+    count++;
+  }
+
+  if (count == 0) {
+    free(buf.data);
+    return NULL;
+  }
+  buf_append( & buf, data + copied, len - copied);
+  return buf_finish( & buf, out_len);
+}
+
+static long http_content_length(const unsigned char * data, int head_len, int * value_start, int * value_end) {
+  int pos = http_first_header(data, head_len);
+  int line_start, line_end;
+  long length = 0;
+
+  if (!http_next_header(data, head_len, "content-length", 14, & pos, & line_start, value_start, value_end, & line_end) ||
+    * value_start == * value_end) {
+    return -1;
+  }
+  for (int i = * value_start; i < * value_end; i++) {
+    if (!isdigit(data[i]) || length > 0x7FFFFFFF / 10) {
+      return data[i] == ' ' || data[i] == '\t' ? length : -1;
+    }
+    length = length * 10 + (data[i] - '0');
+  }
+  return length;
+}
+
+/*
+ * If the original chunk held a complete HTTP/1.x message with
+ * Content-Length, make the rewritten message declare its new body length.
+ */
+static unsigned char * fix_content_length(const unsigned char * original, int original_len,
+  unsigned char * data, int * len) {
+  int complete;
+  int value_start, value_end;
+  int head_len = http_head_length(original, original_len, & complete);
+  if (head_len == 0 || !complete) {
+    return data;
+  }
+  long declared = http_content_length(original, head_len, & value_start, & value_end);
+  if (declared < 0 || declared != original_len - head_len) {
+    return data;
+  }
+
+  head_len = http_head_length(data, * len, & complete);
+  if (head_len == 0 || !complete || * len - head_len == declared ||
+    http_content_length(data, head_len, & value_start, & value_end) < 0) {
+    return data;
+  }
+
+  char digits[16];
+  int digits_len = snprintf(digits, sizeof(digits), "%d", * len - head_len);
+  rewrite_buf_t buf = {
+    0
+  };
+  buf_append( & buf, data, value_start);
+  buf_append( & buf, (const unsigned char * ) digits, digits_len);
+  buf_append( & buf, data + value_end, * len - value_end);
+
+  int fixed_len;
+  unsigned char * fixed = buf_finish( & buf, & fixed_len);
+  if (!fixed) {
+    return data;
+  }
+  free(data);
+  * len = fixed_len;
+  return fixed;
+}
+
+/*
+ * Whether payload rules may turn the original chunk into one of a
+ * different length without breaking the framing of the stream: the chunk
+ * starts an HTTP/1.x message and only its header block changed, or it
+ * holds the complete message with a Content-Length that
+ * fix_content_length() updates. Anything else (a body spread over several
+ * reads, HTTP/2 frames, other protocols) must keep its length.
+ */
+static int length_change_framed(const unsigned char * original, int original_len,
+  const unsigned char * data, int len) {
+  int complete, data_complete;
+  int value_start, value_end;
+  int head_len = http_head_length(original, original_len, & complete);
+  int data_head_len = http_head_length(data, len, & data_complete);
+
+  if (head_len == 0 || data_head_len == 0 || complete != data_complete) {
+    return 0;
+  }
+  if (!complete) {
+    return 1; // The whole chunk is header block
+  }
+
+  int body_len = original_len - head_len;
+  if (len - data_head_len == body_len && memcmp(original + head_len, data + data_head_len, body_len) == 0) {
+    return 1;
+  }
+  return http_content_length(original, head_len, & value_start, & value_end) == body_len &&
+    http_content_length(data, data_head_len, & value_start, & value_end) >= 0;
+}
+
+/* Refresh the target's candidate mask if the rule set changed */
+static void prepare_target(const rewrite_set_t * set, intercept_target_t * target) {
+  if (target && target -> rewrite_prepared_for != set -> base.generation) {
+    target -> rewrite_candidates = 0;
+    for (int i = 0; i < set -> count && i < REWRITE_MASK_RULES; i++) {
+      const rewrite_rule_t * rule = & set -> rules[i];
+      if (!rule -> host || (target -> host && pattern_glob_match(rule -> host, target -> host))) {
+        target -> rewrite_candidates |= 1ULL << i;
+      }
+    }
+    target -> rewrite_prepared_for = set -> base.generation;
+  }
+}
+
+/* Whether rule i may rewrite the target's chunks in direction; target prepared */
+static int rule_applies(const rewrite_set_t * set, int i, int direction, const intercept_target_t * target) {
+  const rewrite_rule_t * rule = & set -> rules[i];
+
+  if (!(rule -> directions & direction)) {
+    return 0;
+  }
+  if (target && i < REWRITE_MASK_RULES) {
+    return (target -> rewrite_candidates & (1ULL << i)) != 0;
+  }
+  return !rule -> host || (target && target -> host && pattern_glob_match(rule -> host, target -> host));
+}
+
+/*
+ * Whether any rule may rewrite chunks of the target's connection travelling
+ * in direction. Same threading rules as rewrite_apply().
+ */
+int rewrite_rules_active(int direction, intercept_target_t * target) {
+  int epoch;
+  const rewrite_set_t * set = (const rewrite_set_t * ) pattern_slot_enter( & g_rewrite, & epoch);
+  int active = 0;
+
+  if (set) {
+    prepare_target(set, target);
+    for (int i = 0; i < set -> count && !active; i++) {
+      active = rule_applies(set, i, direction, target);
+    }
+  }
+  pattern_slot_leave( & g_rewrite, epoch);
+  return active;
+}
+
+/*
+ * Apply the active rules to a chunk travelling in direction
+ * (INTERCEPT_CLIENT_TO_SERVER or INTERCEPT_SERVER_TO_CLIENT). Returns NULL
+ * if nothing changed, otherwise a malloc'd buffer of *out_len bytes (which
+ * may be 0) that the caller frees. Lock-free; as with the intercept
+ * filter, a target must only be used by one thread at a time.
+ */
+unsigned char * rewrite_apply(int direction, intercept_target_t * target,
+  const unsigned char * data, int len, int * out_len) {
+  int epoch;
+  rewrite_set_t * set = (rewrite_set_t * ) pattern_slot_enter( & g_rewrite, & epoch);
+  unsigned char * owned = NULL;
+  const unsigned char * current = data;
+  int current_len = len;
+
+  if (!set) {
+    pattern_slot_leave( & g_rewrite, epoch);
+    return NULL;
+  }
+
+  prepare_target(set, target);
+  for (int i = 0; i < set -> count; i++) {
+    rewrite_rule_t * rule = & set -> rules[i];
+    int next_len;
+    unsigned char * next;
+
+    if (!rule_applies(set, i, direction, target)) {
+      continue;
+    }
+
+    next = rule -> header ? rewrite_header(rule, current, current_len, & next_len) :
+      rewrite_payload(rule, current, current_len, & next_len);
+    if (next && !rule -> header && next_len != current_len &&
+      !length_change_framed(data, len, next, next_len)) {
+      free(next); // The receiver would misread where the message ends
+      next = NULL;
+    }
+    if (next) {
+      free(owned);
+      owned = next;
+      current = next;
+      current_len = next_len;
+      ATOMIC_INCREMENT64(rule -> hits);
+    }
+  }
+  pattern_slot_leave( & g_rewrite, epoch);
+
+  if (owned) {
+    owned = fix_content_length(data, len, owned, & current_len);
+    * out_len = current_len;
+  }
+  return owned;
+}
+
+static void init_rule(void * rule) {
+  ((rewrite_rule_t * ) rule) -> directions = INTERCEPT_BOTH;
+}
+
+static void free_rule(void * arg) {
+  rewrite_rule_t * rule = (rewrite_rule_t * ) arg;
+  free(rule -> host);
+  free(rule -> header);
+  free(rule -> replace);
+  pattern_bytes_free( & rule -> match);
+  pattern_regex_free( & rule -> regex);
+}
+
+static void free_set(pattern_set_t * base) {
+  rewrite_set_t * set = (rewrite_set_t * ) base;
+  for (int i = 0; i < set -> count; i++) {
+    free_rule( & set -> rules[i]);
+  }
+  free(set -> rules);
+  free(set);
+}
+
+/* Apply one key=value term to the rule being built */
+static int apply_term(void * arg, const char * key, const char * value, char * error, size_t error_size) {
+  rewrite_rule_t * rule = (rewrite_rule_t * ) arg;
+
+  if (strcmp(key, "host") == 0) {
+    if (rule -> host || ! * value || !(rule -> host = pattern_glob_compile(value))) {
+      snprintf(error, error_size, "host: duplicate or empty");
+      return 0;
+    }
+  } else if (strcmp(key, "dir") == 0) {
+    if (strcmp(value, "c2s") == 0) {
+      rule -> directions = INTERCEPT_CLIENT_TO_SERVER;
+    } else if (strcmp(value, "s2c") == 0) {
+      rule -> directions = INTERCEPT_SERVER_TO_CLIENT;
+    } else {
+      snprintf(error, error_size, "dir: expected c2s or s2c, got '%.64s'", value);
+      return 0;
+    }
+  } else if (strcmp(key, "match") == 0) {
+    if (rule -> match.bytes || rule -> has_regex || !pattern_bytes_compile( & rule -> match, value)) {
+      snprintf(error, error_size, "match: duplicate, empty or bad escape (use either match or regex)");
+      return 0;
+    }
+  } else if (strcmp(key, "regex") == 0) {
+    if (rule -> match.bytes || rule -> has_regex || ! * value) {
+      snprintf(error, error_size, "regex: duplicate or empty (use either match or regex)");
+      return 0;
+    }
+    if (!pattern_regex_compile( & rule -> regex, value, error, error_size)) {
+      return 0;
+    }
+    rule -> has_regex = 1;
+  } else if (strcmp(key, "replace") == 0) {
+    pattern_bytes_t bytes;
+    if (rule -> has_replace || ( * value && !pattern_bytes_compile( & bytes, value))) {
+      snprintf(error, error_size, "replace: duplicate or bad escape");
+      return 0;
+    }
+    if ( * value) {
+      rule -> replace = bytes.bytes; // Only the decoded bytes are needed
+      rule -> replace_len = bytes.len;
+    }
+    rule -> has_replace = 1;
+  } else if (strcmp(key, "header") == 0) {
+    if (rule -> header || ! * value || strpbrk(value, ": \t")) {
+      snprintf(error, error_size, "header: duplicate, empty or not a header name");
+      return 0;
+    }
+    rule -> header = strdup(value);
+    if (!rule -> header) {
+      snprintf(error, error_size, "out of memory");
+      return 0;
+    }
+    rule -> header_len = (int) strlen(value);
+  } else {
+    snprintf(error, error_size, "unknown key '%s'", key);
+    return 0;
+  }
+  return 1;
+}
+
+/* Check that a finished rule does something and append it to the set */
+static int push_rule(pattern_set_t * base, void * arg, char * error, size_t error_size) {
+  rewrite_set_t * set = (rewrite_set_t * ) base;
+  rewrite_rule_t * rule = (rewrite_rule_t * ) arg;
+  int has_pattern = rule -> match.bytes || rule -> has_regex;
+  if (!rule -> header && !has_pattern) {
+    snprintf(error, error_size, "rule %d: needs match, regex or header", set -> count + 1);
+    return 0;
+  }
+  if (has_pattern && !rule -> has_replace) {
+    snprintf(error, error_size, "rule %d: match and regex need replace (use replace=\"\" to delete)", set -> count + 1);
+    return 0;
+  }
+
+  rewrite_rule_t * rules = (rewrite_rule_t * ) realloc(set -> rules, (set -> count + 1) * sizeof(rewrite_rule_t));
+  if (!rules) {
+    snprintf(error, error_size, "out of memory");
+    return 0;
+  }
+  set -> rules = rules;
+  set -> rules[set -> count++] = * rule;
+  return 1;
+}
+
+static const pattern_rule_kind_t g_rewrite_kind = {
+  "Rewrite rules",
+  sizeof(rewrite_set_t),
+  sizeof(rewrite_rule_t),
+  init_rule,
+  apply_term,
+  push_rule,
+  free_rule,
+  free_set
+};
+
+/*
+ * Compile and activate a rule set, replacing the current one and resetting
+ * the hit counters. NULL or an empty string removes all rules. Returns 0
+ * and keeps the current rules if the text does not parse.
+ */
+int rewrite_rules_set(const char * rules) {
+  return pattern_rules_set( & g_rewrite, & g_rewrite_kind, rules);
+}
+
+/* Copy up to max_rules hit counters, in rule order; returns the number of active rules */
+int rewrite_rules_hits(long long * hits, int max_rules) {
+  int epoch;
+  const rewrite_set_t * set = (const rewrite_set_t * ) pattern_slot_enter( & g_rewrite, & epoch);
+  int count = set ? set -> count : 0;
+
+  for (int i = 0; hits && i < count && i < max_rules; i++) {
+    hits[i] = set -> rules[i].hits;
+  }
+  pattern_slot_leave( & g_rewrite, epoch);
+  return count;
+}
+
+/* Free the active and all replaced rule sets; no relay may be running */
+void cleanup_rewrite_rules(void) {
+  pattern_slot_cleanup( & g_rewrite, free_set);
+}
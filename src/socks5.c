@@ -386,4 +386,147 @@ int handle_socks5_handshake(socket_t client_sock, char * target_host, int * targ
   log_message("SOCKS5 handshake completed successfully for %s:%d", target_host, * target_port);
 
   return 1;
-}
\ No newline at end of file
+}
+
+/*
+ * Parse the method negotiation greeting from a buffer without blocking.
+ * Sets has_no_auth when the client offers the no-authentication method.
+ */
+int socks5_parse_greeting(const unsigned char * buf, int len, int * has_no_auth) {
+  * has_no_auth = 0;
+
+  if (len < 2) {
+    return SOCKS5_PARSE_INCOMPLETE;
+  }
+
+  if (buf[0] != SOCKS5_VERSION) {
+    if (config.verbose) {
+      log_message("Not a SOCKS5 request (version: %d)\n", buf[0]);
+    }
+    return SOCKS5_PARSE_ERROR;
+  }
+
+  int nmethods = buf[1];
+  if (nmethods <= 0) {
+    if (config.verbose) {
+      log_message("Invalid number of authentication methods: %d\n", nmethods);
+    }
+    return SOCKS5_PARSE_ERROR;
+  }
+
+  if (len < 2 + nmethods) {
+    return SOCKS5_PARSE_INCOMPLETE;
+  }
+
+  for (int i = 0; i < nmethods; i++) {
+    if (buf[2 + i] == SOCKS5_AUTH_NONE) {
+      * has_no_auth = 1;
+      break;
+    }
+  }
+
+  return 2 + nmethods;
+}
+
+/*
+ * Parse a CONNECT request from a buffer without blocking.
+ * On SOCKS5_PARSE_ERROR, reply_code holds the failure reply to send to the
+ * client, or SOCKS5_NO_REPLY when the connection should just be dropped.
+ */
+int socks5_parse_request(const unsigned char * buf, int len, char * target_host,
+  int * target_port, int * reply_code) {
+  int addr_len;
+  int offset;
+
+  * reply_code = SOCKS5_NO_REPLY;
+
+  if (len < 4) {
+    return SOCKS5_PARSE_INCOMPLETE;
+  }
+
+  if (buf[0] != SOCKS5_VERSION) {
+    log_message("Invalid SOCKS version: received %d, expected %d", buf[0], SOCKS5_VERSION);
+    return SOCKS5_PARSE_ERROR;
+  }
+
+  if (buf[1] != SOCKS5_CMD_CONNECT) {
+    if (config.verbose) {
+      log_message("Unsupported command: %d (only CONNECT=%d supported)\n", buf[1], SOCKS5_CMD_CONNECT);
+    }
+    * reply_code = SOCKS5_REPLY_CMD_NOTSUP;
+    return SOCKS5_PARSE_ERROR;
+  }
+
+  switch (buf[3]) {
+  case SOCKS5_ADDR_IPV4:
+    addr_len = 4;
+    offset = 4;
+    break;
+  case SOCKS5_ADDR_DOMAIN:
+    if (len < 5) {
+      return SOCKS5_PARSE_INCOMPLETE;
+    }
+    addr_len = buf[4];
+    offset = 5;
+    if (addr_len <= 0 || addr_len >= MAX_HOSTNAME_LEN - 1) {
+      if (config.verbose) {
+        log_message("Invalid domain name length: %d\n", addr_len);
+      }
+      return SOCKS5_PARSE_ERROR;
+    }
+    break;
+  case SOCKS5_ADDR_IPV6:
+    log_message("Client requested unsupported IPv6 connection");
+    * reply_code = SOCKS5_REPLY_ADDR_NOTSUP;
+    return SOCKS5_PARSE_ERROR;
+  default:
+    if (config.verbose) {
+      log_message("Unknown address type: %d\n", buf[3]);
+    }
+    * reply_code = SOCKS5_REPLY_ADDR_NOTSUP;
+    return SOCKS5_PARSE_ERROR;
+  }
+
+  // Address followed by a 2 byte big-endian port
+  if (len < offset + addr_len + 2) {
+    return SOCKS5_PARSE_INCOMPLETE;
+  }
+
+  if (buf[3] == SOCKS5_ADDR_IPV4) {
+    snprintf(target_host, MAX_HOSTNAME_LEN, "%d.%d.%d.%d",
+      buf[offset], buf[offset + 1], buf[offset + 2], buf[offset + 3]);
+  } else {
+    memcpy(target_host, buf + offset, addr_len);
+    target_host[addr_len] = '\0';
+  }
+
+  * target_port = (buf[offset + addr_len] << 8) | buf[offset + addr_len + 1];
+
+  if (config.verbose) {
+    log_message("SOCKS5 connection request for %s:%d\n", target_host, * target_port);
+  }
+
+  return offset + addr_len + 2;
+}
+
+/*
+ * Build a 10 byte reply. Successful replies carry the proxy bind address and
+ * port, failures use an all-zero IPv4 address.
+ */
+void socks5_build_reply(unsigned char reply[10], unsigned char reply_code) {
+  memset(reply, 0, 10);
+  reply[0] = SOCKS5_VERSION;
+  reply[1] = reply_code;
+  reply[2] = 0; // Reserved
+  reply[3] = SOCKS5_ADDR_IPV4;
+
+  if (reply_code == SOCKS5_REPLY_SUCCESS) {
+    struct in_addr addr;
+    if (inet_pton(AF_INET, config.bind_addr, & addr) != 1) {
+      inet_pton(AF_INET, "127.0.0.1", & addr);
+    }
+    memcpy( & reply[4], & addr.s_addr, 4);
+    reply[8] = (config.port >> 8) & 0xFF;
+    reply[9] = config.port & 0xFF;
+  }
+}
@@ -4,6 +4,10 @@
 
 #define _CRT_SECURE_NO_WARNINGS // Suppress strncpy warnings
 
+#ifdef INTERCEPT_LINUX
+#define _GNU_SOURCE // For splice()
+#endif
+
 #include <openssl/ssl.h> // Ensure OpenSSL function prototypes are available
 
 #include <openssl/err.h> // For OpenSSL error handling functions
@@ -18,26 +22,32 @@
 
 #include "../include/tls_proxy_dll.h"
 
+#include "../include/event_queue.h"
+
+#include "../include/data_kernels.h"
+
+#include "../include/intercept_registry.h"
+
 #include <ctype.h>  /* For isprint() */
 
 #include <stdbool.h> // For bool type if not already included
 
 #include <errno.h> // For errno
 
+#ifndef INTERCEPT_WINDOWS
+#include <sys/ioctl.h> // For FIONREAD
+#endif
+
 /* External callback functions from main.c */
-extern void send_log_entry(const char * src_ip,
-  const char * dst_ip, int dst_port,
-    const char * message_type,
-      const char * data, int connection_id, int packet_id);
 extern void send_status_update(const char * message);
 extern void send_connection_notification(const char * client_ip, int client_port,
   const char * target_host, int target_port, int connection_id);
 extern void send_disconnect_notification(int connection_id,
   const char * reason);
+extern void send_protocol_notification(int connection_id, const char * protocol);
+extern void send_ktls_notification(int connection_id, int flags);
+extern void send_client_hello_notification(int connection_id, const client_hello_info_t * hello);
 
-/* External interception data arrays from main.c */
-extern intercept_data_t * g_active_intercepts[100];
-extern int g_intercept_count;
 
 /* Global connection ID counter */
 static int g_connection_id_counter = 0;
@@ -46,624 +56,212 @@ static int g_connection_id_counter = 0;
 static int g_packet_id_counter = 0;
 
 /*
- * Pretty print intercepted data in table format
+ * Allocate a unique connection ID (shared by all connection engines)
  */
-void pretty_print_data(const char * direction,
-  const unsigned char * data, int len,
-    const char * src_ip,
-      const char * dst_ip, int dst_port, int connection_id, int packet_id) {
-
-  char message[BUFFER_SIZE] = {
-    0
-  }; // In non-verbose mode, filter protocol handshake messages more intelligently
-  if (!config.verbose) {
-    // Skip very small messages that are likely TLS protocol overhead
-    if (len < 3) {
-      return;
-    } // For messages between 3-10 bytes, check if they look like TLS protocol messages
-    // TLS protocol messages typically have specific patterns
-    if (len <= 10) {
-      // Check for common TLS record type markers (should be filtered)
-      if (len >= 1 && (data[0] == 0x14 || data[0] == 0x15 || data[0] == 0x16 || data[0] == 0x17)) {
-        // This looks like a TLS record header, skip it
-        if (config.verbose) {
-          char debug_msg[256];
-          snprintf(debug_msg, sizeof(debug_msg), "[DEBUG] Filtered TLS protocol message (%s): len=%d, type=0x%02x", direction, len, data[0]);
-          log_message(debug_msg);
-        }
-        return;
-      }
-
-      // For very short messages, be more permissive with text content
-      int printable_chars = 0;
-      for (int i = 0; i < len; i++) {
-        if (isprint(data[i]) || data[i] == '\r' || data[i] == '\n' || data[i] == '\t') {
-          printable_chars++;
-        }
-      }
-
-      // If less than 70% of characters are printable, it's likely protocol data
-      if (printable_chars < (len * 0.7)) {
-        if (config.verbose) {
-          char debug_msg[256];
-          snprintf(debug_msg, sizeof(debug_msg), "[DEBUG] Filtered low-printable message (%s): len=%d, printable=%d/%d", direction, len, printable_chars, len);
-          log_message(debug_msg);
-        }
-        return;
-      }
-    }
-  } // Format the message content
-  // Show full data content without redundant type prefixes
-  if (len > 0) {
-    // Check if the data appears to be text
-    int is_text = 1;
-    for (int i = 0; i < len && i < 100; i++) {
-      if (data[i] != 0 && (data[i] < 32 || data[i] > 126)) {
-        // ASCII control characters or non-ASCII characters
-        // that are not space, newline, tab, etc.
-        if (data[i] != '\r' && data[i] != '\n' && data[i] != '\t') {
-          is_text = 0;
-          break;
-        }
-      }
-    }
-
-    if (is_text) {
-      // For text data, use most of the buffer but leave room for truncation warning
-      // BUFFER_SIZE is 16384, but message array is sized to BUFFER_SIZE
-      // Leave ~100 bytes for the truncation warning and null terminator
-      int max_safe_len = sizeof(message) - 100;
-      int copy_len = (len > max_safe_len) ? max_safe_len : len;
-
-      snprintf(message, sizeof(message), "%.*s%s",
-        copy_len, data, (copy_len < len) ? "...(truncated)" : "");
-    } else {
-      // For binary data, show a more comprehensive hex representation
-      message[0] = '\0'; // Start with empty string
-      char * msg_ptr = message;
-      size_t remaining = sizeof(message) - 1; // Calculate how many bytes we can safely display
-      // Each byte takes ~3 chars (2 hex digits + space)
-      // Leave ~30 bytes for the truncation warning
-      int max_bytes = (int)((remaining - 30) / 3);
-      int hex_len = (len > max_bytes) ? max_bytes : len;
-
-      // Format with line breaks every 16 bytes for better readability
-      for (int i = 0; i < hex_len && remaining > 3; i++) {
-        int bytes_written;
-
-        // Add a line break every 16 bytes
-        if (i > 0 && i % 16 == 0) {
-          bytes_written = snprintf(msg_ptr, remaining, "\n");
-          msg_ptr += bytes_written;
-          remaining -= bytes_written;
-        }
-
-        bytes_written = snprintf(msg_ptr, remaining, "%02x ", data[i]);
-        msg_ptr += bytes_written;
-        remaining -= bytes_written;
-      }
-
-      if (hex_len < len && remaining > 15) {
-        snprintf(msg_ptr, remaining, "\n...(truncated)");
-      }
-    }
-  } else {
-    strncpy(message, "", sizeof(message) - 1);
-  }
-
-  // Determine message type for the callback
-  const char * message_type;
-  if (len == 0) {
-    message_type = "Empty";
-  } else {
-    // Check if the data appears to be text
-    int is_text = 1;
-    for (int i = 0; i < len && i < 100; i++) {
-      if (data[i] != 0 && (data[i] < 32 || data[i] > 126)) {
-        // ASCII control characters or non-ASCII characters
-        // that are not space, newline, tab, etc.
-        if (data[i] != '\r' && data[i] != '\n' && data[i] != '\t') {
-          is_text = 0;
-          break;
-        }
-      }
-    }
-    message_type = is_text ? "Text" : "Binary";
-  }
+int allocate_connection_id(void) {
+  return (int) ATOMIC_INCREMENT(g_connection_id_counter);
+}
 
-  // Send to callback instead of printf
-  send_log_entry(src_ip, dst_ip, dst_port, message_type, message, connection_id, packet_id);
+static unsigned long long monotonic_ms(void) {
+  #ifdef INTERCEPT_WINDOWS
+  return (unsigned long long) GetTickCount64();
+  #else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, & ts);
+  return (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  #endif
+}
 
-  // Log to file if configured
-  if (config.log_fp) {
-    fprintf(config.log_fp, "%-15s | %-15s | %-5d | %s\n",
-      src_ip, dst_ip, dst_port, message);
-    fflush(config.log_fp);
+/* Where the HTTP messages of one direction are reported */
+typedef struct {
+  const char * direction;
+  const char * src_ip;
+  const char * dst_ip;
+  int dst_port;
+  int connection_id;
+  http_message_mode_t mode;
+  const unsigned char * chunk;   /* Chunk being decoded, for HTTP/2 DATA offsets */
+  http2_span_t * spans;          /* HTTP/2 DATA pieces found in it */
+  int span_count;
+  int span_cap;
+} http_message_target_t;
+
+/* http_message_sink_t: queue a finished message under its own packet id */
+static void emit_http_message(void * context, http_message_t * message) {
+  http_message_target_t * target = (http_message_target_t * ) context;
+
+  if (message -> info.stream_id > 0) {
+    // HPACK-decoded headers never appeared in the chunks, so scan them here
+    message -> tag_count = keyword_tags_scan(NULL, message -> data, message -> len, message -> tags,
+      KEYWORD_TAGS_MAX_PER_EVENT);
   }
+  event_queue_push_http(target -> direction, target -> src_ip, target -> dst_ip, target -> dst_port, message,
+    target -> connection_id, (int) ATOMIC_INCREMENT(g_packet_id_counter), target -> mode == HTTP_MESSAGES_ONLY);
 }
 
-/*
- * Forward data between SSL connections
- */
-void forward_data(SSL * src, SSL * dst,
-    const char * direction,
-      const char * src_ip,
-        const char * dst_ip, int dst_port, int connection_id) {
-    unsigned char buffer[BUFFER_SIZE];
-    int len;
-    int fd;
-    fd_set readfds;
-    struct timeval tv;
-    int ret;
-    int activity_timeout = 0;
-    int packet_id = ++g_packet_id_counter;
+/* http2_data_sink_t: note where a DATA payload piece lies in the chunk */
+static void emit_http2_data(void * context, int stream_id, const unsigned char * data, int length, int end_stream) {
+  http_message_target_t * target = (http_message_target_t * ) context;
 
-    // Comprehensive parameter validation
-    if (!src || !dst || !direction || !src_ip || !dst_ip) {
-      log_message("Error: Invalid parameters passed to forward_data");
+  if (target -> span_count == target -> span_cap) {
+    int cap = target -> span_cap ? target -> span_cap * 2 : 8;
+    http2_span_t * grown = (http2_span_t * ) realloc(target -> spans, cap * sizeof(http2_span_t));
+    if (!grown) {
       return;
     }
+    target -> spans = grown;
+    target -> span_cap = cap;
+  }
 
-    // Validate SSL objects are properly initialized
-    if (SSL_get_fd(src) == -1 || SSL_get_fd(dst) == -1) {
-      log_message("Error: SSL objects not properly initialized");
-      return;
-    }
+  http2_span_t * span = & target -> spans[target -> span_count++];
+  span -> stream_id = stream_id;
+  span -> offset = (int)(data - target -> chunk);
+  span -> length = length;
+  span -> end_stream = end_stream;
+  span -> packet_id = (int) ATOMIC_INCREMENT(g_packet_id_counter);
+  span -> tag_count = target -> mode == HTTP_MESSAGES_ONLY ?
+    keyword_tags_scan(NULL, data, length, span -> tags, KEYWORD_TAGS_MAX_PER_EVENT) : 0;
+}
 
-    // Check SSL state before proceeding
-    if (SSL_get_state(src) != TLS_ST_OK || SSL_get_state(dst) != TLS_ST_OK) {
+/* Whether a chunk looks like TLS protocol overhead rather than application data */
+static int is_protocol_noise(const char * direction, const unsigned char * data, int len) {
+  // Skip very small messages that are likely TLS protocol overhead
+  if (len < 3) {
+    return 1;
+  } // For messages between 3-10 bytes, check if they look like TLS protocol messages
+  // TLS protocol messages typically have specific patterns
+  if (len <= 10) {
+    // Check for common TLS record type markers (should be filtered)
+    if (len >= 1 && (data[0] == 0x14 || data[0] == 0x15 || data[0] == 0x16 || data[0] == 0x17)) {
+      // This looks like a TLS record header, skip it
       if (config.verbose) {
-        char status_msg[256];
-        snprintf(status_msg, sizeof(status_msg), "Warning: SSL connection not in OK state (%s)", direction);
-        log_message(status_msg);
+        char debug_msg[256];
+        snprintf(debug_msg, sizeof(debug_msg), "[DEBUG] Filtered TLS protocol message (%s): len=%d, type=0x%02x", direction, len, data[0]);
+        log_message(debug_msg);
       }
+      return 1;
     }
 
-    // Add exception handling with OpenSSL's error queue
-    ERR_clear_error(); // Clear any previous errors
-
-    // Get the socket file descriptor from the SSL with validation
-    fd = SSL_get_fd(src);
-    if (fd < 0) {
-      log_message("Error: Failed to get socket fd from SSL");
-      print_openssl_error();
-      return;
+    // For very short messages, be more permissive with text content
+    int printable_chars = 0;
+    for (int i = 0; i < len; i++) {
+      if (isprint(data[i]) || data[i] == '\r' || data[i] == '\n' || data[i] == '\t') {
+        printable_chars++;
+      }
     }
 
-    // Validate the socket is still valid
-    int socket_error = 0;
-    socklen_t len_opt = sizeof(socket_error);
-    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (char * ) & socket_error, & len_opt) != 0 || socket_error != 0) {
+    // If less than 70% of characters are printable, it's likely protocol data
+    if (printable_chars < (len * 0.7)) {
       if (config.verbose) {
-        char status_msg[256];
-        snprintf(status_msg, sizeof(status_msg), "Socket error detected before forwarding (%s): %d", direction, socket_error);
-        log_message(status_msg);
+        char debug_msg[256];
+        snprintf(debug_msg, sizeof(debug_msg), "[DEBUG] Filtered low-printable message (%s): len=%d, printable=%d/%d", direction, len, printable_chars, len);
+        log_message(debug_msg);
       }
-      return;
+      return 1;
     }
+  }
+  return 0;
+}
 
-    // Log start of data forwarding
-    if (config.verbose) {
-      char status_msg[256];
-      snprintf(status_msg, sizeof(status_msg), "Starting data forwarding: %s -> %s:%d", src_ip, dst_ip, dst_port);
-      log_message(status_msg);
+/*
+ * Pretty print intercepted data in table format. stream carries the log
+ * state of the relay direction (keyword scan position and HTTP/1.x and
+ * HTTP/2 decoding); NULL scans each chunk on its own and skips decoding.
+ */
+void pretty_print_data(const char * direction,
+  const unsigned char * data, int len,
+    const char * src_ip,
+      const char * dst_ip, int dst_port, int connection_id, int packet_id,
+        log_stream_t * stream) {
+  // Every chunk goes through the scanner and the HTTP decoders, even ones
+  // filtered out below, so their state stays in step with the stream
+  int tag_ids[KEYWORD_TAGS_MAX_PER_EVENT];
+  int tag_count = keyword_tags_scan(stream ? & stream -> tags : NULL, data, len, tag_ids, KEYWORD_TAGS_MAX_PER_EVENT);
+  http_message_target_t target = {
+    direction, src_ip, dst_ip, dst_port, connection_id, stream ? stream -> http_mode : HTTP_MESSAGES_OFF, data, NULL, 0, 0
+  };
+  int decoded = 0;
+
+  if (stream && stream -> h2.state != HTTP2_STREAM_OFF) {
+    int detecting = stream -> h2.state == HTTP2_STREAM_DETECT && stream -> h2.header_len > 0;
+    decoded = http2_stream_feed( & stream -> h2, data, len, emit_http_message, emit_http2_data, & target);
+    if (decoded || detecting) {
+      // The HTTP/1.x parser did not see these bytes
+      http_stream_stop( & stream -> http);
     }
+  }
+  if (stream && stream -> http.state != HTTP_STREAM_OFF) {
+    decoded = http_stream_feed( & stream -> http, data, len, tag_ids, tag_count, emit_http_message, & target);
+  }
 
-    while (1) {
-      // Set up the select() call with a timeout
-      FD_ZERO( & readfds);
-      FD_SET(fd, & readfds);
-
-      // Set a 1 second timeout to allow for more responsive termination
-      tv.tv_sec = 1;
-      tv.tv_usec = 0;
-      ret = select((int)(fd + 1), & readfds, NULL, NULL, & tv);
-      if (ret < 0) {
-        log_message("Error: select() failed in data forwarding");
-        break;
-      } else if (ret == 0) {
-        // Timeout occurred, continue waiting but increment timeout counter
-        activity_timeout++;
-
-        // If we've been idle for over 60 seconds in non-verbose mode, exit
-        // In verbose mode, we might want to wait longer
-        if (!config.verbose && activity_timeout > 60) {
-          if (config.verbose) {
-            char status_msg[256];
-            snprintf(status_msg, sizeof(status_msg), "Connection idle timeout (%s)", direction);
-            log_message(status_msg);
-          }
-          break;
-        }
-        continue;
-      }
-
-      // Reset timeout counter when there's activity
-      activity_timeout = 0;
-
-      // Additional SSL state validation before read
-      if (!SSL_is_init_finished(src)) {
-        log_message("Error: SSL handshake not completed for source");
-        break;
-      }
-
-      // Data is available to read - perform SSL_read with additional error handling
-      ERR_clear_error(); // Clear error queue before operation
-      len = SSL_read(src, buffer, sizeof(buffer));
-      if (len <= 0) {
-        int error = SSL_get_error(src, len);
-
-        if (error == SSL_ERROR_ZERO_RETURN) {
-          // Connection closed cleanly
-          if (config.verbose) {
-            char status_msg[256];
-            snprintf(status_msg, sizeof(status_msg), "Connection closed by peer (%s)", direction);
-            log_message(status_msg);
-          }
-        } else if (error == SSL_ERROR_SYSCALL) {
-          unsigned long ssl_err = ERR_peek_error();
-          if (ssl_err == 0) {
-            // System call error without OpenSSL error - usually connection closed
-            if (config.verbose) {
-              char status_msg[256];
-              snprintf(status_msg, sizeof(status_msg), "Connection closed abruptly (%s)", direction);
-              log_message(status_msg);
-            }
-          } else {
-            // Actual system error
-            char error_msg[256];
-            snprintf(error_msg, sizeof(error_msg), "SSL_read system error in %s: %d", direction, error);
-            log_message(error_msg);
-            print_openssl_error();
-          }
-        } else if (error == SSL_ERROR_SSL &&
-          ERR_GET_REASON(ERR_peek_error()) == SSL_R_UNEXPECTED_EOF_WHILE_READING) {
-          // Common case: unexpected EOF (client closed connection)
-          if (config.verbose) {
-            char status_msg[256];
-            snprintf(status_msg, sizeof(status_msg), "Connection closed by peer with unexpected EOF (%s)", direction);
-            log_message(status_msg);
-          }
-          ERR_clear_error(); // Clear the error queue
-        } else if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
-          // Non-blocking operation would block - continue loop
-          continue;
-        } else {
-          char error_msg[256];
-          snprintf(error_msg, sizeof(error_msg), "SSL_read error in %s: %d", direction, error);
-          log_message(error_msg);
-          print_openssl_error();
-        }
-        break;
-      } // Print the intercepted data
-      pretty_print_data(direction, buffer, len, src_ip, dst_ip, dst_port, connection_id, packet_id);
-
-      // Check if we should intercept this data
-      if (should_intercept_data(direction, connection_id)) {
-        // Create intercept data structure
-        intercept_data_t intercept_data = {
-          0
-        };
-        intercept_data.connection_id = connection_id;
-        strncpy(intercept_data.direction, direction, sizeof(intercept_data.direction) - 1);
-        strncpy(intercept_data.src_ip, src_ip, sizeof(intercept_data.src_ip) - 1);
-        strncpy(intercept_data.dst_ip, dst_ip, sizeof(intercept_data.dst_ip) - 1);
-        intercept_data.dst_port = dst_port;
-        intercept_data.data_length = len;
-        intercept_data.is_waiting_for_response = 1;
-        intercept_data.action = INTERCEPT_ACTION_FORWARD;
-        intercept_data.modified_data = NULL;
-        intercept_data.modified_length = 0;
-
-        // Create response event
-        intercept_data.response_event = CREATE_EVENT();
-        #ifdef INTERCEPT_WINDOWS
-        if (!intercept_data.response_event) {
-          #else
-          // POSIX: Assume event creation succeeded
-          if (0) {
-            #endif
-            log_message("Error: Failed to create intercept response event");
-            break;
-          }
-
-          // Copy data to intercept structure
-          intercept_data.data = malloc(len);
-          if (!intercept_data.data) {
-            CLOSE_EVENT(intercept_data.response_event);
-            log_message("Error: Failed to allocate memory for intercept data");
-            break;
-          }
-          memcpy(intercept_data.data, buffer, len);
-
-          // Store in global array for response handling
-          LOCK_MUTEX(g_intercept_config.intercept_cs);
-          if (g_intercept_count < 100) {
-            g_active_intercepts[g_intercept_count] = & intercept_data;
-            g_intercept_count++;
-          }
-          UNLOCK_MUTEX(g_intercept_config.intercept_cs);
-
-          // Send data to GUI for interception
-          send_intercept_data(connection_id, direction, src_ip, dst_ip, dst_port, buffer, len, packet_id);
-
-          // Wait for user response
-          if (!wait_for_intercept_response( & intercept_data)) {
-            // Cleanup on error
-            free(intercept_data.data);
-            if (intercept_data.modified_data) free(intercept_data.modified_data);
-            CLOSE_EVENT(intercept_data.response_event);
-            break;
-          }
-
-          // Remove from active intercepts array
-          LOCK_MUTEX(g_intercept_config.intercept_cs);
-          for (int i = 0; i < g_intercept_count; i++) {
-            if (g_active_intercepts[i] == & intercept_data) {
-              // Shift remaining elements
-              for (int j = i; j < g_intercept_count - 1; j++) {
-                g_active_intercepts[j] = g_active_intercepts[j + 1];
-              }
-              g_intercept_count--;
-              break;
-            }
-          }
-          UNLOCK_MUTEX(g_intercept_config.intercept_cs);
-
-          // Handle user response
-          if (intercept_data.action == INTERCEPT_ACTION_DROP) {
-            // Drop the data - don't forward it
-            free(intercept_data.data);
-            if (intercept_data.modified_data) free(intercept_data.modified_data);
-            CLOSE_EVENT(intercept_data.response_event);
-            continue; // Skip forwarding and go to next iteration
-          } else if (intercept_data.action == INTERCEPT_ACTION_MODIFY && intercept_data.modified_data) {
-            // Use modified data instead of original
-            memcpy(buffer, intercept_data.modified_data, intercept_data.modified_length);
-            len = intercept_data.modified_length;
-          }
-
-          // Cleanup intercept data
-          free(intercept_data.data);
-          if (intercept_data.modified_data) free(intercept_data.modified_data);
-          CLOSE_EVENT(intercept_data.response_event);
-        }
-
-        // Additional SSL state validation before write
-        if (!SSL_is_init_finished(dst)) {
-          log_message("Error: SSL handshake not completed for destination");
-          break;
-        }
-
-        // Forward to the destination with retry mechanism
-        int bytes_written = 0;
-        int total_written = 0;
-
-        while (total_written < len) {
-          ERR_clear_error(); // Clear error queue before operation
-          bytes_written = SSL_write(dst, buffer + total_written, len - total_written);
-
-          if (bytes_written <= 0) {
-            int error = SSL_get_error(dst, bytes_written);
-
-            if (error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ) {
-              // Non-blocking operation would block - wait a bit and retry
-              SLEEP(10);
-              continue;
-            } else if (error == SSL_ERROR_ZERO_RETURN ||
-              (error == SSL_ERROR_SYSCALL && ERR_peek_error() == 0)) {
-              char status_msg[256];
-              snprintf(status_msg, sizeof(status_msg), "Peer closed connection while writing (%s)", direction);
-              log_message(status_msg);
-            } else {
-              char error_msg[256];
-              snprintf(error_msg, sizeof(error_msg), "SSL_write error in %s: %d", direction, error);
-              log_message(error_msg);
-              print_openssl_error();
-            }
-            return; // Exit the function on write error
-          }
+  // In HTTP_MESSAGES_ONLY mode the message events stand in for their chunks.
+  // In non-verbose mode, filter protocol handshake messages more intelligently
+  int log_chunk = !(decoded && target.mode == HTTP_MESSAGES_ONLY) &&
+    (config.verbose || !is_protocol_noise(direction, data, len));
 
-          total_written += bytes_written;
-        }
-      }
+  // Hand the raw bytes to the dispatcher thread; formatting only happens
+  // there, and only if a string log callback or log file needs it
+  if (target.span_count > 0) {
+    event_queue_push_http2_data(direction, src_ip, dst_ip, dst_port, data, len, connection_id, packet_id,
+      tag_ids, tag_count, target.spans, target.span_count, log_chunk);
+  } else {
+    free(target.spans);
+    if (log_chunk) {
+      event_queue_push_log(direction, src_ip, dst_ip, dst_port, data, len, connection_id, packet_id,
+        tag_ids, tag_count);
     }
+  }
+}
 
-    /*
-     * Forward data between plain TCP sockets (non-TLS)
-     */
-    void forward_tcp_data(socket_t src, socket_t dst,
-        const char * direction,
-          const char * src_ip,
-            const char * dst_ip, int dst_port, int connection_id) {
-        unsigned char buffer[BUFFER_SIZE];
-        int len;
-        fd_set readfds;
-        struct timeval tv;
-        int ret;
-        int activity_timeout = 0;
-        int packet_id = ++g_packet_id_counter;
-
-        // Validate parameters
-        if (src == INVALID_SOCKET || dst == INVALID_SOCKET || !direction || !src_ip || !dst_ip) {
-          log_message("Error: Invalid parameters passed to forward_tcp_data");
-          return;
-        }
-
-        // Log start of TCP data forwarding
-        if (config.verbose) {
-          char status_msg[256];
-          snprintf(status_msg, sizeof(status_msg), "Starting TCP data forwarding: %s -> %s:%d", src_ip, dst_ip, dst_port);
-          log_message(status_msg);
-        }
-
-        while (1) {
-          // Set up the select() call with a timeout
-          FD_ZERO( & readfds);
-          FD_SET(src, & readfds);
-
-          // Set a 1 second timeout
-          tv.tv_sec = 1;
-          tv.tv_usec = 0;
-          ret = select((int)(src + 1), & readfds, NULL, NULL, & tv);
-          if (ret < 0) {
-            log_message("Error: select() failed in TCP data forwarding");
-            break;
-          } else if (ret == 0) {
-            // Timeout occurred
-            activity_timeout++;
-
-            // If idle for too long, exit
-            if (!config.verbose && activity_timeout > 60) {
-              if (config.verbose) {
-                char status_msg[256];
-                snprintf(status_msg, sizeof(status_msg), "TCP connection idle timeout (%s)", direction);
-                log_message(status_msg);
-              }
-              break;
-            }
-            continue;
-          }
-
-          // Reset timeout counter when there's activity
-          activity_timeout = 0;
+/*
+ * Format a payload for the string log callback and the log file: text is
+ * copied as is, binary data becomes a hex dump with 16 bytes per line.
+ * Both are truncated to fit the buffer. Returns the message type.
+ */
+const char * format_log_message(const unsigned char * data, int len, char * message, size_t size) {
+  const char * truncated = "\n...(truncated)";
 
-          // Data is available to read
-          len = recv(src, (char * ) buffer, sizeof(buffer), 0);
-          if (len <= 0) {
-            if (len == 0) {
-              // Connection closed cleanly
-              if (config.verbose) {
-                char status_msg[256];
-                snprintf(status_msg, sizeof(status_msg), "TCP connection closed by peer (%s)", direction);
-                log_message(status_msg);
-              }
-            } else { // Error
-              if (config.verbose) {
-                char status_msg[256];
-                #ifdef INTERCEPT_WINDOWS
-                snprintf(status_msg, sizeof(status_msg), "TCP recv error (%s): %d", direction, GET_SOCKET_ERROR());
-                #else
-                snprintf(status_msg, sizeof(status_msg), "TCP recv error (%s): %s", direction, strerror(errno));
-                #endif
-                log_message(status_msg);
-              }
-            }
-            break;
-          } // Print the intercepted data
-          pretty_print_data(direction, buffer, len, src_ip, dst_ip, dst_port, connection_id, packet_id);
-
-          // Check if we should intercept this data
-          if (should_intercept_data(direction, connection_id)) {
-            // Create intercept data structure
-            intercept_data_t intercept_data = {
-              0
-            };
-            intercept_data.connection_id = connection_id;
-            strncpy(intercept_data.direction, direction, sizeof(intercept_data.direction) - 1);
-            strncpy(intercept_data.src_ip, src_ip, sizeof(intercept_data.src_ip) - 1);
-            strncpy(intercept_data.dst_ip, dst_ip, sizeof(intercept_data.dst_ip) - 1);
-            intercept_data.dst_port = dst_port;
-            intercept_data.data_length = len;
-            intercept_data.is_waiting_for_response = 1;
-            intercept_data.action = INTERCEPT_ACTION_FORWARD;
-            intercept_data.modified_data = NULL;
-            intercept_data.modified_length = 0;
-
-            // Create response event
-            intercept_data.response_event = CREATE_EVENT();
-            #ifdef INTERCEPT_WINDOWS
-            if (!intercept_data.response_event) {
-              #else
-              // POSIX: Assume event creation succeeded
-              if (0) {
-                #endif
-                log_message("Error: Failed to create intercept response event");
-                break;
-              }
+  if (len <= 0) {
+    if (size > 0) {
+      message[0] = '\0';
+    }
+    return "Empty";
+  }
 
-              // Copy data to intercept structure
-              intercept_data.data = malloc(len);
-              if (!intercept_data.data) {
-                CLOSE_EVENT(intercept_data.response_event);
-                log_message("Error: Failed to allocate memory for intercept data");
-                break;
-              }
-              memcpy(intercept_data.data, buffer, len);
+  // Only the first 100 bytes decide whether a chunk is shown as text
+  int is_text = data_is_text(data, len < 100 ? (size_t) len : 100);
+  if (size == 0) {
+    return is_text ? "Text" : "Binary";
+  }
 
-              // Store in global array for response handling
-              LOCK_MUTEX(g_intercept_config.intercept_cs);
-              if (g_intercept_count < 100) {
-                g_active_intercepts[g_intercept_count] = & intercept_data;
-                g_intercept_count++;
-              }
-              UNLOCK_MUTEX(g_intercept_config.intercept_cs);
-
-              // Send data to GUI for interception
-              send_intercept_data(connection_id, direction, src_ip, dst_ip, dst_port, buffer, len, packet_id);
-
-              // Wait for user response
-              if (!wait_for_intercept_response( & intercept_data)) {
-                // Cleanup on error
-                free(intercept_data.data);
-                if (intercept_data.modified_data) free(intercept_data.modified_data);
-                CLOSE_EVENT(intercept_data.response_event);
-                break;
-              }
+  if (is_text) {
+    // Leave ~100 bytes for the truncation warning and null terminator
+    int max_safe_len = size > 100 ? (int)(size - 100) : 0;
+    int copy_len = (len > max_safe_len) ? max_safe_len : len;
 
-              // Remove from active intercepts array
-              LOCK_MUTEX(g_intercept_config.intercept_cs);
-              for (int i = 0; i < g_intercept_count; i++) {
-                if (g_active_intercepts[i] == & intercept_data) {
-                  // Shift remaining elements
-                  for (int j = i; j < g_intercept_count - 1; j++) {
-                    g_active_intercepts[j] = g_active_intercepts[j + 1];
-                  }
-                  g_intercept_count--;
-                  break;
-                }
-              }
-              UNLOCK_MUTEX(g_intercept_config.intercept_cs);
-
-              // Handle user response
-              if (intercept_data.action == INTERCEPT_ACTION_DROP) {
-                // Drop the data - don't forward it
-                free(intercept_data.data);
-                if (intercept_data.modified_data) free(intercept_data.modified_data);
-                CLOSE_EVENT(intercept_data.response_event);
-                continue; // Skip forwarding and go to next iteration
-              } else if (intercept_data.action == INTERCEPT_ACTION_MODIFY && intercept_data.modified_data) {
-                // Use modified data instead of original
-                memcpy(buffer, intercept_data.modified_data, intercept_data.modified_length);
-                len = intercept_data.modified_length;
-              }
+    snprintf(message, size, "%.*s%s",
+      copy_len, data, (copy_len < len) ? "...(truncated)" : "");
+    return "Text";
+  }
 
-              // Cleanup intercept data
-              free(intercept_data.data);
-              if (intercept_data.modified_data) free(intercept_data.modified_data);
-              CLOSE_EVENT(intercept_data.response_event);
-            }
+  // Each byte takes 3 chars (2 hex digits + space) plus a line break every
+  // 16 bytes; keep room for the truncation warning and null terminator
+  size_t reserve = strlen(truncated) + 1;
+  size_t hex_len = (size_t) len;
+  if (hex_dump_length(hex_len) + 1 > size) {
+    hex_len = size > reserve ? (size - reserve) * 16 / 49 : 0;
+    while (hex_len > 0 && hex_dump_length(hex_len) + reserve > size) {
+      hex_len--;
+    }
+  }
 
-            // Forward to the destination
-            int sent = 0;
-            while (sent < len) {
-              int written = send(dst, (char * ) buffer + sent, len - sent, 0);
-              if (written <= 0) {
-                if (config.verbose) {
-                  char status_msg[256];
-                  #ifdef INTERCEPT_WINDOWS
-                  snprintf(status_msg, sizeof(status_msg), "TCP send error (%s): %d", direction, GET_SOCKET_ERROR());
-                  #else
-                  snprintf(status_msg, sizeof(status_msg), "TCP send error (%s): %s", direction, strerror(errno));
-                  #endif
-                  log_message(status_msg);
-                }
-                return;
-              }
-              sent += written;
-            }
-          }
-        }
+  size_t pos = hex_dump_encode(data, hex_len, message);
+  message[pos] = '\0';
+  if (hex_len < (size_t) len && pos + reserve <= size) {
+    memcpy(message + pos, truncated, reserve);
+  }
+  return "Binary";
+}
 
         /*
          * Detect protocol type (TLS, HTTP, or other TCP)
@@ -712,285 +310,118 @@ void forward_data(SSL * src, SSL * dst,
           return PROTOCOL_PLAIN_TCP;
         }
 
-        /*
-         * Thread function for forwarding SSL data
-         */
-        THREAD_RETURN_TYPE forward_data_thread(void * arg) {
-          if (arg == NULL) {
-            log_message("Error: NULL argument passed to forward_data_thread\n");
-            THREAD_RETURN;
-          }
-
-          forward_info * info = (forward_info * ) arg;
-
-          // Validate all pointers and parameters
-          if (info -> src && info -> dst &&
-            info -> direction && strlen(info -> direction) > 0 &&
-            info -> src_ip && strlen(info -> src_ip) > 0 &&
-            info -> dst_ip && strlen(info -> dst_ip) > 0) {
+        /* peek_client_hello(), also returning how many bytes were queued */
+        static int peek_client_hello_bytes(socket_t sock, client_hello_info_t * hello, int * bytes_peeked) {
+          unsigned char peek_buffer[CLIENT_HELLO_PEEK_SIZE];
 
-            forward_data(info -> src, info -> dst, info -> direction, info -> src_ip, info -> dst_ip, info -> dst_port, info -> connection_id);
-          } else {
-            log_message("Error: Invalid parameters in forward_data_thread\n");
+          * bytes_peeked = recv(sock, (char * ) peek_buffer, sizeof(peek_buffer), MSG_PEEK);
+          if ( * bytes_peeked < 0 && SOCKET_WOULD_BLOCK(GET_SOCKET_ERROR())) {
+            * bytes_peeked = 0; // Nothing more yet
+          } else if ( * bytes_peeked <= 0) {
+            memset(hello, 0, sizeof( * hello));
+            return CLIENT_HELLO_INVALID;
           }
+          return client_hello_parse(peek_buffer, * bytes_peeked, hello);
+        }
 
-          // Free the allocated structure
-          free(info);
-          THREAD_RETURN;
+        /*
+         * Parse the ClientHello waiting on a TLS client socket without
+         * consuming it. Returns CLIENT_HELLO_INCOMPLETE while more of the
+         * record is still to come; a client that closed before sending all
+         * of it is CLIENT_HELLO_INVALID.
+         */
+        int peek_client_hello(socket_t sock, client_hello_info_t * hello) {
+          int bytes_peeked;
+          return peek_client_hello_bytes(sock, hello, & bytes_peeked);
         }
 
         /*
-         * Thread function for forwarding TCP data
+         * Wait until more than queued bytes can be read from a blocking
+         * socket, for at most timeout_ms. Returns 0 on timeout, on error and
+         * once the peer closed without sending more.
          */
-        THREAD_RETURN_TYPE forward_tcp_thread(void * arg) {
-          if (arg == NULL) {
-            log_message("Error: NULL argument passed to forward_tcp_thread\n");
-            THREAD_RETURN;
+        static int wait_for_more_bytes(socket_t sock, int queued, int timeout_ms) {
+          #ifdef INTERCEPT_WINDOWS
+          // Winsock has no receive low-water mark, so check again after a short pause
+          u_long available = 0;
+          SLEEP(timeout_ms < 10 ? timeout_ms : 10);
+          return ioctlsocket(sock, FIONREAD, & available) == 0 && (int) available > queued;
+          #else
+          // With the low-water mark past the queued bytes, select() only returns once more arrive
+          int lowat = queued + 1;
+          if (setsockopt(sock, SOL_SOCKET, SO_RCVLOWAT, & lowat, sizeof(lowat)) != 0) {
+            return 0;
           }
 
-          forward_tcp_info * info = (forward_tcp_info * ) arg;
-
-          // Validate all parameters
-          if (info -> src != INVALID_SOCKET && info -> dst != INVALID_SOCKET &&
-            info -> direction && strlen(info -> direction) > 0 &&
-            info -> src_ip && strlen(info -> src_ip) > 0 &&
-            info -> dst_ip && strlen(info -> dst_ip) > 0) {
+          fd_set readfds;
+          struct timeval tv;
+          FD_ZERO( & readfds);
+          FD_SET(sock, & readfds);
+          tv.tv_sec = timeout_ms / 1000;
+          tv.tv_usec = (timeout_ms % 1000) * 1000;
+          int ret = select((int)(sock + 1), & readfds, NULL, NULL, & tv);
 
-            forward_tcp_data(info -> src, info -> dst, info -> direction, info -> src_ip, info -> dst_ip, info -> dst_port, info -> connection_id);
-          } else {
-            log_message("Error: Invalid parameters in forward_tcp_thread\n");
-          }
+          lowat = 1;
+          setsockopt(sock, SOL_SOCKET, SO_RCVLOWAT, & lowat, sizeof(lowat));
 
-          // Free the allocated structure
-          free(info);
-          THREAD_RETURN;
+          // A close is readable too, without adding any bytes
+          int available = 0;
+          return ret > 0 && ioctl(sock, FIONREAD, & available) == 0 && available > queued;
+          #endif
         }
 
         /*
-         /*
-         * Forward data between SSL connections (with protocol detection)
+         * Parse the ClientHello of a blocking TLS client socket like
+         * peek_client_hello(), giving the rest of an incomplete record up to
+         * timeout_ms to arrive. The record is peeked again only after more
+         * of it came in.
          */
-        void forward_data_with_detection(SSL * src, SSL * dst,
-          const char * src_ip,
-            const char * dst_ip, int dst_port, int connection_id) {
-          unsigned char buffer[BUFFER_SIZE];
-          int len;
-          int fd;
-          fd_set readfds;
-          struct timeval tv;
+        int wait_client_hello(socket_t sock, client_hello_info_t * hello, int timeout_ms) {
+          unsigned long long deadline = monotonic_ms() + (unsigned long long) timeout_ms;
+          int bytes_peeked = 0;
           int ret;
-          int activity_timeout = 0;
-          int packet_id = ++g_packet_id_counter;
-
-          // Enhanced parameter validation
-          if (!src || !dst || !src_ip || !dst_ip) {
-            log_message("Error: Invalid parameters passed to forward_data_with_detection");
-            return;
-          }
-
-          // Validate SSL objects are properly initialized
-          if (SSL_get_fd(src) == -1 || SSL_get_fd(dst) == -1) {
-            log_message("Error: SSL objects not properly initialized in detection");
-            return;
-          }
-
-          // Check SSL state before proceeding
-          if (SSL_get_state(src) != TLS_ST_OK || SSL_get_state(dst) != TLS_ST_OK) {
-            if (config.verbose) {
-              char status_msg[256];
-              snprintf(status_msg, sizeof(status_msg), "Warning: SSL connection not in OK state (with detection)");
-              log_message(status_msg);
-            }
-          }
 
-          // Get the socket file descriptor from the SSL with validation
-          fd = SSL_get_fd(src);
-          if (fd < 0) {
-            log_message("Error: Failed to get socket fd from SSL");
-            print_openssl_error();
-            return;
-          }
-
-          // Validate the socket is still valid
-          int socket_error = 0;
-          socklen_t len_opt = sizeof(socket_error);
-          if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (char * ) & socket_error, & len_opt) != 0 || socket_error != 0) {
-            if (config.verbose) {
-              char status_msg[256];
-              snprintf(status_msg, sizeof(status_msg), "Socket error detected in detection: %d", socket_error);
-              log_message(status_msg);
+          while ((ret = peek_client_hello_bytes(sock, hello, & bytes_peeked)) == CLIENT_HELLO_INCOMPLETE) {
+            unsigned long long now = monotonic_ms();
+            if (now >= deadline || !wait_for_more_bytes(sock, bytes_peeked, (int)(deadline - now))) {
+              break;
             }
-            return;
           }
+          return ret;
+        }
 
-          // Log start of data forwarding
+        /* Index a parsed ClientHello under its connection and hand it to the application */
+        void client_hello_report(int connection_id, const client_hello_info_t * hello) {
+          fingerprint_index_add(connection_id, hello);
           if (config.verbose) {
-            char status_msg[256];
-            snprintf(status_msg, sizeof(status_msg), "Starting data forwarding with detection: %s -> %s:%d", src_ip, dst_ip, dst_port);
-            log_message(status_msg);
-          }
-
-          while (1) {
-            // Set up the select() call with a timeout
-            FD_ZERO( & readfds);
-            FD_SET(fd, & readfds);
-
-            // Set a 1 second timeout to allow for more responsive termination
-            tv.tv_sec = 1;
-            tv.tv_usec = 0;
-            ret = select((int)(fd + 1), & readfds, NULL, NULL, & tv);
-            if (ret < 0) {
-              log_message("Error: select() failed in data forwarding with detection");
-              break;
-            } else if (ret == 0) {
-              // Timeout occurred, continue waiting but increment timeout counter
-              activity_timeout++;
-
-              // If we've been idle for over 60 seconds in non-verbose mode, exit
-              // In verbose mode, we might want to wait longer
-              if (!config.verbose && activity_timeout > 60) {
-                if (config.verbose) {
-                  char status_msg[256];
-                  snprintf(status_msg, sizeof(status_msg), "Connection idle timeout (with detection)");
-                  log_message(status_msg);
-                }
-                break;
-              }
-              continue;
-            } // Reset timeout counter when there's activity
-            activity_timeout = 0;
-
-            // Additional SSL state validation before read
-            if (!SSL_is_init_finished(src)) {
-              log_message("Error: SSL handshake not completed for source (with detection)");
-              break;
-            }
-
-            // Data is available to read - perform SSL_read with additional error handling
-            ERR_clear_error(); // Clear error queue before operation
-            len = SSL_read(src, buffer, sizeof(buffer));
-            if (len <= 0) {
-              int error = SSL_get_error(src, len);
-
-              if (error == SSL_ERROR_ZERO_RETURN) {
-                // Connection closed cleanly
-                if (config.verbose) {
-                  char status_msg[256];
-                  snprintf(status_msg, sizeof(status_msg), "Connection closed by peer (with detection)");
-                  log_message(status_msg);
-                }
-              } else if (error == SSL_ERROR_SYSCALL) {
-                unsigned long ssl_err = ERR_peek_error();
-                if (ssl_err == 0) {
-                  // System call error without OpenSSL error - usually connection closed
-                  if (config.verbose) {
-                    char status_msg[256];
-                    snprintf(status_msg, sizeof(status_msg), "Connection closed abruptly (with detection)");
-                    log_message(status_msg);
-                  }
-                } else {
-                  // Actual system error
-                  char error_msg[256];
-                  snprintf(error_msg, sizeof(error_msg), "SSL_read system error in detection: %d", error);
-                  log_message(error_msg);
-                  print_openssl_error();
-                }
-              } else if (error == SSL_ERROR_SSL &&
-                ERR_GET_REASON(ERR_peek_error()) == SSL_R_UNEXPECTED_EOF_WHILE_READING) {
-                // Common case: unexpected EOF (client closed connection)
-                if (config.verbose) {
-                  char status_msg[256];
-                  snprintf(status_msg, sizeof(status_msg), "Connection closed by peer with unexpected EOF (with detection)");
-                  log_message(status_msg);
-                }
-                ERR_clear_error(); // Clear the error queue
-              } else if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
-                // Non-blocking operation would block - continue loop
-                continue;
-              } else {
-                char error_msg[256];
-                snprintf(error_msg, sizeof(error_msg), "SSL_read error in data forwarding with detection: %d", error);
-                log_message(error_msg);
-                print_openssl_error();
-              }
-              break;
-            }
-
-            // Print the intercepted data
-            pretty_print_data("??", buffer, len, src_ip, dst_ip, dst_port, connection_id, packet_id);
-
-            // Additional SSL state validation before write
-            if (!SSL_is_init_finished(dst)) {
-              log_message("Error: SSL handshake not completed for destination (with detection)");
-              break;
-            } // Detect protocol and handle accordingly
-            int protocol = detect_protocol(fd);
-            if (protocol == PROTOCOL_TLS) {
-              // Forward as TLS with retry mechanism
-              int bytes_written = 0;
-              int total_written = 0;
-
-              while (total_written < len) {
-                ERR_clear_error(); // Clear error queue before operation
-                bytes_written = SSL_write(dst, buffer + total_written, len - total_written);
-
-                if (bytes_written <= 0) {
-                  int error = SSL_get_error(dst, bytes_written);
-
-                  if (error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ) {
-                    // Non-blocking operation would block - wait a bit and retry
-                    SLEEP(10);
-                    continue;
-                  } else if (error == SSL_ERROR_ZERO_RETURN ||
-                    (error == SSL_ERROR_SYSCALL && ERR_peek_error() == 0)) {
-                    char status_msg[256];
-                    snprintf(status_msg, sizeof(status_msg), "Peer closed connection while writing (with detection)");
-                    log_message(status_msg);
-                  } else {
-                    char error_msg[256];
-                    snprintf(error_msg, sizeof(error_msg), "SSL_write error in data forwarding with detection");
-                    log_message(error_msg);
-                    print_openssl_error();
-                  }
-                  break; // Exit the while loop on write error
-                }
-
-                total_written += bytes_written;
-              }
-            } else {
-              // For any non-TLS protocol, forward as plain TCP
-              // This includes HTTP, PostgreSQL, SMTP, etc.
-              // TLS upgrade detection is handled separately in protocol_detector.c
-              forward_tcp_data(fd, SSL_get_fd(dst), "??", src_ip, dst_ip, dst_port, connection_id);
-            }
+            log_message("ClientHello of connection %d: SNI %s, ALPN %s, JA3 %s, JA4 %s", connection_id,
+              hello -> sni[0] ? hello -> sni : "-", hello -> alpn[0] ? hello -> alpn : "-", hello -> ja3, hello -> ja4);
           }
+          send_client_hello_notification(connection_id, hello);
         }
 
         /*
-         * Thread function for forwarding data with protocol detection
+         * Match a connection against the passthrough list. hello is NULL for
+         * plain TCP. Returns 1 if the connection is to be tunnelled untouched.
          */
-        THREAD_RETURN_TYPE forward_data_with_detection_thread(void * arg) {
-          if (arg == NULL) {
-            log_message("Error: NULL argument passed to forward_data_with_detection_thread\n");
-            THREAD_RETURN;
-          }
-
-          forward_info * info = (forward_info * ) arg;
-
-          // Validate all pointers and parameters before using them
-          if (info -> src && info -> dst &&
-            info -> direction && strlen(info -> direction) > 0 &&
-            info -> src_ip && strlen(info -> src_ip) > 0 &&
-            info -> dst_ip && strlen(info -> dst_ip) > 0) {
-
-            forward_data_with_detection(info -> src, info -> dst, info -> src_ip, info -> dst_ip, info -> dst_port, info -> connection_id);
-          } else {
-            log_message("Error: Invalid parameters in forward_data_with_detection_thread\n");
+        int passthrough_connection(const char * target_host, int target_port, const char * client_ip,
+          const char * server_ip, const client_hello_info_t * hello, int connection_id) {
+          passthrough_target_t target;
+          target.host = target_host;
+          target.sni = (hello && hello -> sni[0]) ? hello -> sni : NULL;
+          target.ja3 = (hello && hello -> ja3[0]) ? hello -> ja3 : NULL;
+          target.ja4 = (hello && hello -> ja4[0]) ? hello -> ja4 : NULL;
+          target.client_ip = client_ip;
+          target.server_ip = server_ip;
+          target.port = target_port;
+
+          int rule = passthrough_match( & target);
+          if (rule < 0) {
+            return 0;
           }
-
-          // Free the allocated structure
-          free(info);
-          THREAD_RETURN;
+          log_message("Passing through connection %d to %s:%d untouched (rule %d%s%s)", connection_id,
+            target_host, target_port, rule + 1, target.sni ? ", SNI " : "", target.sni ? target.sni : "");
+          return 1;
         }
 
         // Helper to check if a string is an IP address (basic version)
@@ -1001,101 +432,294 @@ void forward_data(SSL * src, SSL * dst,
           return inet_pton(AF_INET, str, & (sa.sin_addr)) != 0 || inet_pton(AF_INET6, str, & (sa6.sin6_addr)) != 0;
         }
 
-        typedef struct {
-          const char * original_target_host; // From SOCKS
-          SSL_CTX * generated_ctx_for_sni;
-          X509 * generated_cert_for_sni; // Owned by generated_ctx_for_sni
-          EVP_PKEY * generated_key_for_sni; // Owned by generated_ctx_for_sni
+        /* Name the generated certificate is issued for: the SNI, else a SOCKS target that is not an address */
+        const char * cert_hostname(const char * sni_hostname, const char * target_host) {
+          if (sni_hostname && sni_hostname[0]) {
+            return sni_hostname;
+          }
+          if (target_host && !is_ip_address(target_host)) {
+            return target_host;
+          }
+          return NULL;
         }
-        client_sni_callback_args;
 
-        static int sni_cert_setup_callback(SSL * s, int * ad, void * arg) {
-          client_sni_callback_args * cb_args = (client_sni_callback_args * ) arg;
+        int sni_cert_setup_callback(SSL * s, int * ad, void * arg) {
+          // The template context is shared, so the per-connection args travel with the SSL object
+          client_sni_callback_args * cb_args = (client_sni_callback_args * ) SSL_get_app_data(s);
           const char * sni_hostname = SSL_get_servername(s, TLSEXT_NAMETYPE_host_name);
           const char * hostname_to_use = NULL;
 
+          if (!cb_args) {
+            log_message("SNI: Missing connection state for SNI callback");
+            * ad = SSL_AD_INTERNAL_ERROR;
+            return SSL_TLSEXT_ERR_ALERT_FATAL;
+          }
+
           if (sni_hostname && strlen(sni_hostname) > 0) {
-            hostname_to_use = sni_hostname;
             if (config.verbose) {
               log_message("SNI: Received hostname: %s", sni_hostname);
             }
-          } else {
-            if (config.verbose) {
-              log_message("SNI: No SNI hostname. Falling back to SOCKS target: %s", cb_args -> original_target_host ? cb_args -> original_target_host : "N/A");
-            }
-            if (cb_args && cb_args -> original_target_host && !is_ip_address(cb_args -> original_target_host)) {
-              hostname_to_use = cb_args -> original_target_host;
-            } else {
-              log_message("SNI: No usable hostname (SNI absent or SOCKS target is IP/unavailable).");
-              * ad = SSL_AD_UNRECOGNIZED_NAME;
-              return SSL_TLSEXT_ERR_ALERT_FATAL;
-            }
+          } else if (config.verbose) {
+            log_message("SNI: No SNI hostname. Falling back to SOCKS target: %s", cb_args -> original_target_host ? cb_args -> original_target_host : "N/A");
           }
 
+          hostname_to_use = cert_hostname(sni_hostname, cb_args -> original_target_host);
           if (!hostname_to_use) {
-            log_message("SNI: Critical - No hostname available to generate certificate.");
-            * ad = SSL_AD_INTERNAL_ERROR;
+            log_message("SNI: No usable hostname (SNI absent or SOCKS target is IP/unavailable).");
+            * ad = SSL_AD_UNRECOGNIZED_NAME;
             return SSL_TLSEXT_ERR_ALERT_FATAL;
           }
 
-          // Clean up any previous attempt for this session (should not happen if callback is once per handshake)
+          // The event loop builds the context before the handshake, off its reactor thread
+          if (cb_args -> generated_ctx_for_sni && strcmp(cb_args -> prepared_hostname, hostname_to_use) == 0) {
+            SSL_set_SSL_CTX(s, cb_args -> generated_ctx_for_sni);
+            cb_args -> generated_cert_for_sni = SSL_CTX_get0_certificate(cb_args -> generated_ctx_for_sni);
+            cb_args -> generated_key_for_sni = SSL_CTX_get0_privatekey(cb_args -> generated_ctx_for_sni);
+            return SSL_TLSEXT_ERR_OK;
+          }
+
+          // Clean up a context prepared for another name
           if (cb_args -> generated_ctx_for_sni) {
             SSL_CTX_free(cb_args -> generated_ctx_for_sni);
             cb_args -> generated_ctx_for_sni = NULL;
           }
           // Cert and key are owned by context, no separate free here if they were part of a previous context.
 
-          X509 * new_cert = NULL;
-          EVP_PKEY * new_key = NULL;
-
-          log_message("SNI: Generating certificate for: %s", hostname_to_use);
-          if (!generate_cert_for_host(hostname_to_use, & new_cert, & new_key)) {
-            log_message("SNI: Failed to generate certificate for %s", hostname_to_use);
-            * ad = SSL_AD_INTERNAL_ERROR;
+          // Shared per-host context, built once and reused by every connection to this host
+          SSL_CTX * new_ctx_for_sni = get_ssl_ctx_for_host(hostname_to_use);
+          if (!new_ctx_for_sni) {
+            log_message("SNI: Failed to create SSL_CTX for %s", hostname_to_use);
+            * ad = SSL_AD_CERTIFICATE_UNOBTAINABLE;
             return SSL_TLSEXT_ERR_ALERT_FATAL;
           }
 
-          SSL_CTX * original_ctx = SSL_get_SSL_CTX(s); // This is the server_ctx passed to SSL_new
-          SSL_CTX * new_ctx_for_sni = SSL_CTX_new(SSL_CTX_get_ssl_method(original_ctx)); // Use the same method
-          if (!new_ctx_for_sni) {
-            log_message("SNI: Failed to create new SSL_CTX for %s", hostname_to_use);
-            X509_free(new_cert);
-            EVP_PKEY_free(new_key);
-            * ad = SSL_AD_INTERNAL_ERROR;
-            return SSL_TLSEXT_ERR_ALERT_FATAL;
+          SSL_set_SSL_CTX(s, new_ctx_for_sni);
+
+          // Our reference is released in the connection cleanup
+          cb_args -> generated_ctx_for_sni = new_ctx_for_sni;
+          cb_args -> generated_cert_for_sni = SSL_CTX_get0_certificate(new_ctx_for_sni); // For tracking, owned by context
+          cb_args -> generated_key_for_sni = SSL_CTX_get0_privatekey(new_ctx_for_sni); // For tracking, owned by context
+
+          return SSL_TLSEXT_ERR_OK;
+        }
+
+        /* Client hello callback: hold a ClientHello that offers ALPN until the upstream has chosen */
+        int alpn_client_hello_callback(SSL * s, int * al, void * arg) {
+          client_sni_callback_args * cb_args = (client_sni_callback_args * ) SSL_get_app_data(s);
+          const unsigned char * ext = NULL;
+          size_t ext_len = 0;
+          size_t i;
+
+          (void) al;
+          (void) arg;
+          // Called again when the handshake resumes, and for a second ClientHello after a HelloRetryRequest
+          if (!cb_args || cb_args -> upstream_ready) {
+            return SSL_CLIENT_HELLO_SUCCESS;
+          }
+          if (!SSL_client_hello_get0_ext(s, TLSEXT_TYPE_application_layer_protocol_negotiation, & ext, & ext_len)) {
+            return SSL_CLIENT_HELLO_SUCCESS;
+          }
+
+          // Two byte list length, then protocol names each prefixed with a length byte
+          if (ext_len <= 2 || ext_len - 2 > sizeof(cb_args -> client_alpn) ||
+            (((size_t) ext[0] << 8) | ext[1]) != ext_len - 2) {
+            if (config.verbose) {
+              log_message("ALPN: Client protocol list not passed through (%zu bytes)", ext_len);
+            }
+            return SSL_CLIENT_HELLO_SUCCESS;
+          }
+          for (i = 2; i < ext_len; i += 1 + ext[i]) {
+            if (ext[i] == 0 || i + 1 + ext[i] > ext_len) {
+              if (config.verbose) {
+                log_message("ALPN: Malformed client protocol list");
+              }
+              return SSL_CLIENT_HELLO_SUCCESS;
+            }
+          }
+
+          memcpy(cb_args -> client_alpn, ext + 2, ext_len - 2);
+          cb_args -> client_alpn_len = (int)(ext_len - 2);
+          return SSL_CLIENT_HELLO_RETRY;
+        }
+
+        /* ALPN select callback: answer the client with the protocol the upstream selected */
+        int alpn_select_callback(SSL * s, const unsigned char ** out, unsigned char * outlen,
+          const unsigned char * in, unsigned int inlen, void * arg) {
+          client_sni_callback_args * cb_args = (client_sni_callback_args * ) SSL_get_app_data(s);
+          unsigned int i;
+
+          (void) arg;
+          if (!cb_args || !cb_args -> upstream_ready || !cb_args -> protocol[0]) {
+            return SSL_TLSEXT_ERR_NOACK;
+          }
+
+          // out must outlive the callback, so point into the client's list
+          size_t length = strlen(cb_args -> protocol);
+          for (i = 0; i < inlen; i += 1 + in[i]) {
+            if (in[i] == length && i + 1 + length <= inlen && memcmp(in + i + 1, cb_args -> protocol, length) == 0) {
+              * out = in + i + 1;
+              * outlen = in[i];
+              return SSL_TLSEXT_ERR_OK;
+            }
           }
+          return SSL_TLSEXT_ERR_NOACK;
+        }
 
-          // Configure new_ctx_for_sni similar to the one from create_server_ssl_context()
-          // This should ideally be a function or copied settings.
-          // Copy options from the original context
-          long options = SSL_CTX_get_options(original_ctx);
-          SSL_CTX_set_options(new_ctx_for_sni, options); // Copy cipher list - Use a standard secure cipher list instead of copying
-          if (SSL_CTX_set_cipher_list(new_ctx_for_sni, "HIGH:!aNULL:!eNULL:!EXPORT:!DES:!RC4:!MD5:!PSK:!SRP:!CAMELLIA") != 1) {
-            log_message("SNI: Warning: Failed to set cipher list on new_ctx_for_sni\\n");
+        /* Offer the client's ALPN list, if it sent one, on the upstream SSL object. Call before the handshake. */
+        void alpn_offer_upstream(SSL * upstream_ssl, const client_sni_callback_args * args) {
+          if (!args || args -> client_alpn_len == 0) {
+            return;
+          }
+          // Unlike most of OpenSSL, 0 means success here
+          if (SSL_set_alpn_protos(upstream_ssl, args -> client_alpn, (unsigned int) args -> client_alpn_len) != 0) {
+            if (config.verbose) {
+              log_message("Warning: Failed to offer ALPN upstream");
+              print_openssl_error();
+            }
           }
+        }
 
-          // Copy session cache mode
-          long cache_mode = SSL_CTX_get_session_cache_mode(original_ctx);
-          SSL_CTX_set_session_cache_mode(new_ctx_for_sni, cache_mode);
+        /* Take the upstream's protocol choice and let the client handshake continue */
+        void alpn_upstream_done(SSL * upstream_ssl, client_sni_callback_args * args) {
+          const unsigned char * selected = NULL;
+          unsigned int length = 0;
 
-          if (SSL_CTX_use_certificate(new_ctx_for_sni, new_cert) != 1 ||
-            SSL_CTX_use_PrivateKey(new_ctx_for_sni, new_key) != 1 ||
-            !SSL_CTX_check_private_key(new_ctx_for_sni)) {
-            log_message("SNI: Failed to use generated cert/key for %s", hostname_to_use);
+          if (!args) {
+            return;
+          }
+          SSL_get0_alpn_selected(upstream_ssl, & selected, & length);
+          if (!selected || length > ALPN_MAX_LIST) {
+            length = 0;
+          }
+          if (length > 0) {
+            memcpy(args -> protocol, selected, length);
+          }
+          args -> protocol[length] = '\0';
+          args -> upstream_ready = 1;
+        }
+
+        /* Record the protocol negotiated with the client once both handshakes are done */
+        void alpn_report(SSL * client_side_ssl, client_sni_callback_args * args, int connection_id, const char * target_host) {
+          const unsigned char * selected = NULL;
+          unsigned int length = 0;
+
+          SSL_get0_alpn_selected(client_side_ssl, & selected, & length);
+          if (!selected) {
+            length = 0;
+          }
+          if (length > 0) {
+            memcpy(args -> protocol, selected, length);
+          }
+          args -> protocol[length] = '\0';
+
+          if (config.verbose) {
+            log_message("ALPN: %s negotiated for %s (connection %d)",
+              length > 0 ? args -> protocol : "no protocol", target_host, connection_id);
+          }
+          send_protocol_notification(connection_id, args -> protocol);
+        }
+
+        /* Ask for kernel TLS offload on an SSL object if enabled. Call before the handshake. */
+        void ktls_enable(SSL * ssl) {
+          #if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+          if (config.ktls && ssl) {
+            SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+          }
+          #else
+          (void) ssl;
+          #endif
+        }
+
+        /* Report which record directions the kernel took over once both handshakes are done */
+        void ktls_report(SSL * client_side_ssl, SSL * server_side_ssl, int connection_id) {
+          int flags = 0;
+
+          if (!config.ktls) {
+            return;
+          }
+          // OpenSSL silently keeps user space crypto if the kernel or cipher does not allow offload
+          if (BIO_get_ktls_send(SSL_get_wbio(client_side_ssl))) flags |= KTLS_CLIENT_SEND;
+          if (BIO_get_ktls_recv(SSL_get_rbio(client_side_ssl))) flags |= KTLS_CLIENT_RECV;
+          if (BIO_get_ktls_send(SSL_get_wbio(server_side_ssl))) flags |= KTLS_SERVER_SEND;
+          if (BIO_get_ktls_recv(SSL_get_rbio(server_side_ssl))) flags |= KTLS_SERVER_RECV;
+
+          if (config.verbose) {
+            log_message("kTLS for connection %d: client %s/%s, server %s/%s (send/recv)", connection_id,
+              (flags & KTLS_CLIENT_SEND) ? "on" : "off", (flags & KTLS_CLIENT_RECV) ? "on" : "off",
+              (flags & KTLS_SERVER_SEND) ? "on" : "off", (flags & KTLS_SERVER_RECV) ? "on" : "off");
+          }
+          send_ktls_notification(connection_id, flags);
+        }
+
+        /*
+         * TLS handshake with the real server on server_sock, offering the
+         * client's ALPN list and recording the server's choice in cb_args.
+         * Returns the connected SSL object, NULL on failure.
+         */
+        static SSL * connect_upstream_tls(SSL_CTX * client_ctx, socket_t server_sock,
+          const char * target_host, int target_port, client_sni_callback_args * cb_args) {
+          SSL * client_ssl;
+          int ret;
+
+          // Create client SSL object and attach to server socket
+          if (config.verbose) {
+            log_message("Performing TLS handshake with server...\n");
+          }
+
+          client_ssl = SSL_new(client_ctx);
+          if (!client_ssl) {
+            log_message("Failed to create client SSL object\n");
             print_openssl_error();
-            SSL_CTX_free(new_ctx_for_sni); // new_cert and new_key are freed when new_ctx_for_sni is freed if they were successfully added
-            // If not successfully added, they need explicit free. X509_free(new_cert); EVP_PKEY_free(new_key);
-            * ad = SSL_AD_CERTIFICATE_UNOBTAINABLE;
-            return SSL_TLSEXT_ERR_ALERT_FATAL;
+            return NULL;
           }
 
-          SSL_set_SSL_CTX(s, new_ctx_for_sni);
+          // Validate server socket before setting fd
+          if (server_sock == INVALID_SOCKET) {
+            log_message("Error: Invalid server socket for SSL\n");
+            SSL_free(client_ssl);
+            return NULL;
+          }
 
-          cb_args -> generated_ctx_for_sni = new_ctx_for_sni;
-          cb_args -> generated_cert_for_sni = new_cert; // For tracking, owned by context
-          cb_args -> generated_key_for_sni = new_key; // For tracking, owned by context
+          // Set socket with error checking
+          if (SSL_set_fd(client_ssl, (int) server_sock) != 1) {
+            log_message("Failed to set server socket fd for SSL\n");
+            print_openssl_error();
+            SSL_free(client_ssl);
+            return NULL;
+          }
 
-          return SSL_TLSEXT_ERR_OK;
+          // Set Server Name Indication (SNI) with validation
+          if (target_host && strlen(target_host) > 0) {
+            if (SSL_set_tlsext_host_name(client_ssl, target_host) != 1) {
+              if (config.verbose) {
+                log_message("Warning: Failed to set SNI hostname\n");
+                print_openssl_error();
+              }
+            }
+          }
+
+          alpn_offer_upstream(client_ssl, cb_args);
+          ktls_enable(client_ssl);
+
+          // Offer the session from the last connection to this origin
+          attach_upstream_session(client_ssl, target_host, target_port);
+
+          // Clear OpenSSL error queue before handshake
+          ERR_clear_error();
+
+          ret = SSL_connect(client_ssl);
+          if (ret != 1) {
+            int ssl_error = SSL_get_error(client_ssl, ret);
+            log_message("Failed to perform TLS handshake with server: %d\n", ssl_error);
+            print_openssl_error();
+            SSL_shutdown(client_ssl);
+            SSL_free(client_ssl);
+            return NULL;
+          }
+
+          record_upstream_handshake(client_ssl);
+          alpn_upstream_done(client_ssl, cb_args);
+          return client_ssl;
         }
 
         /*
@@ -1117,7 +741,6 @@ void forward_data(SSL * src, SSL * dst,
             0
           }; // Initialize our callback args
 
-          THREAD_HANDLE thread_id = INVALID_THREAD_ID;
           char target_host[MAX_HOSTNAME_LEN];
           char client_ip[MAX_IP_ADDR_LEN];
           char server_ip[MAX_IP_ADDR_LEN];
@@ -1125,9 +748,12 @@ void forward_data(SSL * src, SSL * dst,
           int ret;
           int connection_id;
           int protocol_type;
+          int passthrough = 0;
+          client_hello_info_t hello; // Parsed before any handshake, read by the relay's filter
+          int hello_parsed = 0;
 
           // Generate unique connection ID
-          connection_id = ++g_connection_id_counter;
+          connection_id = allocate_connection_id();
 
           // Get client IP address as string
           inet_ntop(AF_INET, & (client -> client_addr.sin_addr), client_ip, MAX_IP_ADDR_LEN); // Set socket options for better compatibility
@@ -1166,7 +792,20 @@ void forward_data(SSL * src, SSL * dst,
             log_message("\nIntercepting connection to %s:%d\n", target_host, target_port);
           }
 
-          // Connect to the real server before deciding protocol type
+          // Resolve the target through the DNS cache; hosts seen recently skip the resolver
+          struct sockaddr_in server_addr;
+          int connect_error = 0;
+          memset( & server_addr, 0, sizeof(server_addr));
+          server_addr.sin_family = AF_INET;
+          server_addr.sin_port = htons(target_port);
+          if (dns_cache_resolve(target_host, & server_addr.sin_addr, & connect_error) != DNS_RESOLVED) {
+            log_message("Failed to resolve hostname %s: %s\n", target_host, gai_strerror(connect_error));
+            goto cleanup;
+          }
+
+          // Get server IP as string
+          inet_ntop(AF_INET, & (server_addr.sin_addr), server_ip, MAX_IP_ADDR_LEN);
+
           server_sock = socket(AF_INET, SOCK_STREAM, 0);
           if (server_sock == SOCKET_ERROR_VAL) {
             #ifdef INTERCEPT_WINDOWS
@@ -1194,38 +833,38 @@ void forward_data(SSL * src, SSL * dst,
             }
           }
 
-          // Resolve hostname
-          struct hostent * host = gethostbyname(target_host);
-          if (!host) {
-            log_message("Failed to resolve hostname %s: %d\n", target_host, GET_SOCKET_ERROR());
-            goto cleanup;
+          if (config.verbose) {
+            log_message("Connecting to real server at %s:%d...\n", target_host, target_port);
           }
 
-          struct sockaddr_in server_addr;
-          memset( & server_addr, 0, sizeof(server_addr));
-          server_addr.sin_family = AF_INET;
-          memcpy( & server_addr.sin_addr.s_addr, host -> h_addr, host -> h_length);
-          server_addr.sin_port = htons(target_port);
+          // Log connection attempt; the connect runs while the client's first bytes are examined
+          log_message("Connecting to server %s (%s):%d", target_host, server_ip, target_port);
+          unsigned long long connect_started = monotonic_ms();
+          if (!upstream_connect_start(server_sock, & server_addr, & connect_error)) {
+            log_message("Failed to connect to server %s:%d: %d\n",
+              target_host, target_port, connect_error);
+            log_message("Connection to %s:%d failed with error %d", target_host, target_port, connect_error);
+            goto cleanup;
+          }
 
-          // Get server IP as string
-          inet_ntop(AF_INET, & (server_addr.sin_addr), server_ip, MAX_IP_ADDR_LEN);
+          // Detect protocol type (TLS, HTTP, or plain TCP)
+          protocol_type = detect_protocol(client_sock);
 
-          if (config.verbose) {
-            log_message("Connecting to real server at %s:%d...\n", target_host, target_port);
+          // Read the ClientHello off the socket, giving all of it time to arrive
+          if (protocol_type == PROTOCOL_TLS) {
+            ret = wait_client_hello(client_sock, & hello, CLIENT_HELLO_WAIT_MS);
+            if (ret == CLIENT_HELLO_OK) {
+              hello_parsed = 1;
+              client_hello_report(connection_id, & hello);
+            }
           }
 
-          // Log connection attempt
-          log_message("Connecting to server %s (%s):%d", target_host, server_ip, target_port);
-          ret = connect(server_sock, (struct sockaddr * ) & server_addr, sizeof(server_addr));
-          if (ret == SOCKET_OPTS_ERROR) {
-            #ifdef INTERCEPT_WINDOWS
-            int error = GET_SOCKET_ERROR();
-            #else
-            int error = errno;
-            #endif
+          // Wait out what is left of the connect timeout
+          int connect_waited = (int)(monotonic_ms() - connect_started);
+          if (!upstream_connect_finish(server_sock, config.connect_timeout_ms - connect_waited, & connect_error)) {
             log_message("Failed to connect to server %s:%d: %d\n",
-              target_host, target_port, error);
-            log_message("Connection to %s:%d failed with error %d", target_host, target_port, error);
+              target_host, target_port, connect_error);
+            log_message("Connection to %s:%d failed with error %d", target_host, target_port, connect_error);
             goto cleanup;
           }
 
@@ -1236,8 +875,16 @@ void forward_data(SSL * src, SSL * dst,
           #else
           // On POSIX systems, TCP_NODELAY is included from netinet/tcp.h
           setsockopt(server_sock, IPPROTO_TCP, TCP_NODELAY, & nodelay, sizeof(nodelay));
-          #endif // Detect protocol type (TLS, HTTP, or plain TCP)
-          protocol_type = detect_protocol(client_sock);
+          #endif
+
+          // Connections on the passthrough list are tunnelled before any handshake
+          if (passthrough_active()) {
+            passthrough = passthrough_connection(target_host, target_port, client_ip, server_ip,
+              protocol_type == PROTOCOL_TLS ? & hello : NULL, connection_id);
+            if (passthrough) {
+              protocol_type = PROTOCOL_PLAIN_TCP;
+            }
+          }
 
           if (protocol_type == PROTOCOL_TLS) {
             // TLS handling path
@@ -1252,17 +899,14 @@ void forward_data(SSL * src, SSL * dst,
             //     goto cleanup;
             // }
 
-            // Create server context (for client -> proxy)
-            server_ctx = create_server_ssl_context(); // This is our base/template context
+            // Shared template context (for client -> proxy), its SNI callback picks the per-host context
+            server_ctx = get_server_template_ctx();
             if (!server_ctx) {
               log_message(stderr, "Failed to create server SSL context\\n");
               goto cleanup;
             }
 
-            // Setup SNI callback
             sni_cb_args.original_target_host = target_host; // Pass the SOCKS target as a fallback
-            SSL_CTX_set_tlsext_servername_callback(server_ctx, sni_cert_setup_callback);
-            SSL_CTX_set_tlsext_servername_arg(server_ctx, & sni_cb_args);
 
             // Use the generated certificate and key -- THIS BLOCK IS REMOVED/MODIFIED
             // if (SSL_CTX_use_certificate(server_ctx, cert) != 1 ||
@@ -1307,11 +951,26 @@ void forward_data(SSL * src, SSL * dst,
               server_ssl = NULL;
               goto cleanup;
             }
+            SSL_set_app_data(server_ssl, & sni_cb_args);
+            ktls_enable(server_ssl);
 
             // Clear OpenSSL error queue before handshake
             ERR_clear_error();
 
             ret = SSL_accept(server_ssl);
+            if (ret != 1 && SSL_get_error(server_ssl, ret) == SSL_ERROR_WANT_CLIENT_HELLO_CB) {
+              // The client offered ALPN: let the server choose before the ClientHello is answered
+              client_ctx = get_client_ssl_ctx(); // Shared, carries the upstream session cache
+              if (!client_ctx) {
+                log_message("Failed to create client SSL context\n");
+                goto cleanup;
+              }
+              client_ssl = connect_upstream_tls(client_ctx, server_sock, target_host, target_port, & sni_cb_args);
+              if (!client_ssl) {
+                goto cleanup;
+              }
+              ret = SSL_accept(server_ssl);
+            }
             if (ret != 1) {
               int ssl_error = SSL_get_error(server_ssl, ret);
               unsigned long error_reason = ERR_peek_error();
@@ -1369,134 +1028,41 @@ void forward_data(SSL * src, SSL * dst,
               }
             }
 
-            // Create client context (for proxy -> server) - only if still doing TLS
-            if (protocol_type == PROTOCOL_TLS) {
-              client_ctx = create_client_ssl_context();
-              if (!client_ctx) {
-                log_message("Failed to create client SSL context\n");
-                goto cleanup;
-              }
-
-              // Create client SSL object and attach to server socket
-              if (config.verbose) {
-                log_message("Performing TLS handshake with server...\n");
-              }
-
-              // Additional validation before creating client SSL object
+            // Connect to the server now, unless the client's ALPN offer already had us do it
+            if (protocol_type == PROTOCOL_TLS && !client_ssl) {
               if (!client_ctx) {
-                log_message("Error: client_ctx is NULL when creating SSL object\n");
-                goto cleanup;
-              }
-
-              client_ssl = SSL_new(client_ctx);
-              if (!client_ssl) {
-                log_message("Failed to create client SSL object\n");
-                print_openssl_error();
-                goto cleanup;
-              }
-
-              // Validate server socket before setting fd
-              if (server_sock == INVALID_SOCKET) {
-                log_message("Error: Invalid server socket for SSL\n");
-                SSL_free(client_ssl);
-                client_ssl = NULL;
-                goto cleanup;
-              }
-
-              // Set socket with error checking
-              if (SSL_set_fd(client_ssl, (int) server_sock) != 1) {
-                log_message("Failed to set server socket fd for SSL\n");
-                print_openssl_error();
-                SSL_free(client_ssl);
-                client_ssl = NULL;
-                goto cleanup;
-              }
-
-              // Set Server Name Indication (SNI) with validation
-              if (target_host && strlen(target_host) > 0) {
-                if (SSL_set_tlsext_host_name(client_ssl, target_host) != 1) {
-                  if (config.verbose) {
-                    log_message("Warning: Failed to set SNI hostname\n");
-                    print_openssl_error();
-                  }
+                client_ctx = get_client_ssl_ctx(); // Shared, carries the upstream session cache
+                if (!client_ctx) {
+                  log_message("Failed to create client SSL context\n");
+                  goto cleanup;
                 }
               }
 
-              // Clear OpenSSL error queue before handshake
-              ERR_clear_error();
-
-              ret = SSL_connect(client_ssl);
-              if (ret != 1) {
-                int ssl_error = SSL_get_error(client_ssl, ret);
-                log_message("Failed to perform TLS handshake with server: %d\n", ssl_error);
-                print_openssl_error();
-
+              client_ssl = connect_upstream_tls(client_ctx, server_sock, target_host, target_port, & sni_cb_args);
+              if (!client_ssl) {
                 // Fall back to TCP if server handshake fails
                 protocol_type = PROTOCOL_PLAIN_TCP;
-
-                // Clean up client SSL resources
-                if (client_ssl) {
-                  SSL_shutdown(client_ssl);
-                  SSL_free(client_ssl);
-                  client_ssl = NULL;
-                }
-                if (client_ctx) {
-                  SSL_CTX_free(client_ctx);
-                  client_ctx = NULL;
-                }
               }
             }
+            if (server_ssl && client_ssl) {
+              alpn_report(server_ssl, & sni_cb_args, connection_id, target_host);
+              ktls_report(server_ssl, client_ssl, connection_id);
+            }
             if (config.verbose) {
               log_message("TLS MITM established! Intercepting traffic between client and %s:%d\n",
                 target_host, target_port);
             }
-            // Create a thread to forward data from client to server
-            forward_info * client_to_server = (forward_info * ) malloc(sizeof(forward_info));
-            if (!client_to_server) {
-              log_message(stderr, "Memory allocation failed\n");
-              goto cleanup;
-            }
-            client_to_server -> src = server_ssl;
-            client_to_server -> dst = client_ssl;
-            strncpy(client_to_server -> direction, "Client->Server", sizeof(client_to_server -> direction) - 1);
-            client_to_server -> direction[sizeof(client_to_server -> direction) - 1] = '\0';
-            strncpy(client_to_server -> src_ip, client_ip, MAX_IP_ADDR_LEN - 1);
-            strncpy(client_to_server -> dst_ip, server_ip, MAX_IP_ADDR_LEN - 1);
-            client_to_server -> dst_port = target_port;
-            client_to_server -> connection_id = connection_id;
-
             // Log connection info
-            log_message("Established connection: %s -> %s:%d", client_ip, server_ip, target_port); // Create a second thread for server->client direction
-            forward_info * server_to_client = (forward_info * ) malloc(sizeof(forward_info));
-            if (!server_to_client) {
-              fprintf(stderr, "Memory allocation failed\n");
-              free(client_to_server); // Don't leak memory
-              goto cleanup;
-            }
-            server_to_client -> src = client_ssl;
-            server_to_client -> dst = server_ssl;
-            strncpy(server_to_client -> direction, "Server->Client", sizeof(server_to_client -> direction) - 1);
-            server_to_client -> direction[sizeof(server_to_client -> direction) - 1] = '\0';
-            strncpy(server_to_client -> src_ip, server_ip, MAX_IP_ADDR_LEN - 1);
-            strncpy(server_to_client -> dst_ip, client_ip, MAX_IP_ADDR_LEN - 1);
-            server_to_client -> dst_port = ntohs(client -> client_addr.sin_port);
-            server_to_client -> connection_id = connection_id;
-
-            // Make sure strings are null-terminated
-            client_to_server -> src_ip[MAX_IP_ADDR_LEN - 1] = '\0';
-            client_to_server -> dst_ip[MAX_IP_ADDR_LEN - 1] = '\0';
-            server_to_client -> src_ip[MAX_IP_ADDR_LEN - 1] = '\0';
-            server_to_client -> dst_ip[MAX_IP_ADDR_LEN - 1] = '\0'; // Start both forwarding threads
-
-            THREAD_HANDLE thread_id2 = INVALID_THREAD_ID;
-            CREATE_THREAD(thread_id, forward_data_thread, client_to_server);
-            CREATE_THREAD(thread_id2, forward_data_thread, server_to_client);
-
-            // Wait for both threads to finish
-            if (thread_id != INVALID_THREAD_ID) JOIN_THREAD(thread_id);
-            if (thread_id2 != INVALID_THREAD_ID) JOIN_THREAD(thread_id2);
-
+            log_message("Established connection: %s -> %s:%d", client_ip, server_ip, target_port);
 
+            // Relay both directions from this thread; the SSL objects are not shared
+            if (server_ssl && client_ssl) {
+              relay_bidirectional(client_sock, server_ssl, server_sock, client_ssl,
+                client_ip, ntohs(client -> client_addr.sin_port), server_ip, target_port, target_host,
+                hello_parsed ? & hello : NULL, connection_id, 0);
+            } else {
+              log_message("Error: Invalid parameters passed to relay_bidirectional");
+            }
 
             if (config.verbose) {
               log_message("Connection to %s:%d closed\n", target_host, target_port);
@@ -1504,61 +1070,23 @@ void forward_data(SSL * src, SSL * dst,
           } else if (protocol_type == PROTOCOL_PLAIN_TCP) {
             // Non-TLS handling path (any protocol that doesn't start with TLS)
             // This includes HTTP, PostgreSQL, SMTP, and any protocol that might upgrade to TLS later
-            if (config.verbose) {
+            if (config.verbose && !passthrough) {
               log_message("Detected plain TCP protocol (may upgrade to TLS later)\n");
             }
-            log_message("Forwarding plain TCP traffic with protocol upgrade detection");
+            if (!passthrough) {
+              log_message("Forwarding plain TCP traffic with protocol upgrade detection");
+            }
 
             if (config.verbose) {
               log_message("Setting up direct TCP forwarding between client and %s:%d\n", target_host, target_port);
             }
 
-            // Create TCP forwarding info structs
-            forward_tcp_info * client_to_server = (forward_tcp_info * ) malloc(sizeof(forward_tcp_info));
-            if (!client_to_server) {
-              log_message("Memory allocation failed\n");
-              goto cleanup;
-            }
-            client_to_server -> src = client_sock;
-            client_to_server -> dst = server_sock;
-            strncpy(client_to_server -> direction, "Client->Server", sizeof(client_to_server -> direction) - 1);
-            client_to_server -> direction[sizeof(client_to_server -> direction) - 1] = '\0';
-            strncpy(client_to_server -> src_ip, client_ip, MAX_IP_ADDR_LEN - 1);
-            strncpy(client_to_server -> dst_ip, server_ip, MAX_IP_ADDR_LEN - 1);
-            client_to_server -> dst_port = target_port;
-            client_to_server -> connection_id = connection_id;
-
-            // Create a second TCP info struct for server->client direction
-            forward_tcp_info * server_to_client = (forward_tcp_info * ) malloc(sizeof(forward_tcp_info));
-            if (!server_to_client) {
-              log_message("Memory allocation failed\n");
-              free(client_to_server); // Don't leak memory
-              goto cleanup;
-            }
-            server_to_client -> src = server_sock;
-            server_to_client -> dst = client_sock;
-            strncpy(server_to_client -> direction, "Server->Client", sizeof(server_to_client -> direction) - 1);
-            server_to_client -> direction[sizeof(server_to_client -> direction) - 1] = '\0';
-            strncpy(server_to_client -> src_ip, server_ip, MAX_IP_ADDR_LEN - 1);
-            strncpy(server_to_client -> dst_ip, client_ip, MAX_IP_ADDR_LEN - 1);
-            server_to_client -> dst_port = ntohs(client -> client_addr.sin_port);
-            server_to_client -> connection_id = connection_id;
-
-            // Make sure strings are null-terminated
-            client_to_server -> src_ip[MAX_IP_ADDR_LEN - 1] = '\0';
-            client_to_server -> dst_ip[MAX_IP_ADDR_LEN - 1] = '\0';
-            server_to_client -> src_ip[MAX_IP_ADDR_LEN - 1] = '\0';
-            server_to_client -> dst_ip[MAX_IP_ADDR_LEN - 1] = '\0';
-
             // Log connection info
-            log_message("Established direct TCP connection: %s -> %s:%d", client_ip, server_ip, target_port); // Start TCP forwarding threads
-            THREAD_HANDLE thread_id2 = INVALID_THREAD_ID;
-            CREATE_THREAD(thread_id, forward_tcp_thread, client_to_server);
-            CREATE_THREAD(thread_id2, forward_tcp_thread, server_to_client);
+            log_message("Established direct TCP connection: %s -> %s:%d", client_ip, server_ip, target_port);
 
-            // Wait for both threads to finish
-            if (thread_id != INVALID_THREAD_ID) JOIN_THREAD(thread_id);
-            if (thread_id2 != INVALID_THREAD_ID) JOIN_THREAD(thread_id2);
+            relay_bidirectional(client_sock, NULL, server_sock, NULL,
+              client_ip, ntohs(client -> client_addr.sin_port), server_ip, target_port, target_host,
+              hello_parsed ? & hello : NULL, connection_id, passthrough);
 
             if (config.verbose) {
               log_message("TCP connection to %s:%d closed\n", target_host, target_port);
@@ -1570,19 +1098,18 @@ void forward_data(SSL * src, SSL * dst,
               log_message("Cleaning up connection to %s:%d (ID: %d)\\n", target_host, target_port, connection_id);
             }
           send_disconnect_notification(connection_id, "Connection closed");
+          fingerprint_index_remove(connection_id);
 
           if (server_ssl) {
             SSL_shutdown(server_ssl);
             SSL_free(server_ssl);
           }
-          // server_ctx is the base/template context, sni_cb_args.generated_ctx_for_sni is the one actually used by server_ssl if SNI callback succeeded.
-          // SSL_set_SSL_CTX replaces the SSL's CTX, but the original server_ctx (template) still needs freeing.
-          // The new CTX created in the SNI callback (sni_cb_args.generated_ctx_for_sni) is associated with the SSL object
-          // and should be freed if it was created.
+          // server_ctx and sni_cb_args.generated_ctx_for_sni are references to the shared
+          // template and per-host contexts; dropping them leaves the cached contexts alive.
           if (sni_cb_args.generated_ctx_for_sni) {
-            SSL_CTX_free(sni_cb_args.generated_ctx_for_sni); // This also frees its cert and key
+            SSL_CTX_free(sni_cb_args.generated_ctx_for_sni);
           }
-          if (server_ctx) { // Free the base/template server_ctx
+          if (server_ctx) {
             SSL_CTX_free(server_ctx);
           }
           // cert and key are no longer managed at this level for server_ssl
@@ -1597,6 +1124,12 @@ void forward_data(SSL * src, SSL * dst,
             SSL_CTX_free(client_ctx);
           }
 
+          // Close both sockets so a client whose upstream failed hears about it right away
+          if (server_sock != SOCKET_ERROR_VAL) {
+            CLOSE_SOCKET(server_sock);
+          }
+          CLOSE_SOCKET(client_sock);
+
           // Free client info struct - only free once and null the pointer
           if (client) {
             free(client);
@@ -1608,24 +1141,29 @@ void forward_data(SSL * src, SSL * dst,
 
         /* Interception support functions */
 
-        int should_intercept_data(const char * direction, int connection_id) {
+        /* INTERCEPT_* flag for a direction name, INTERCEPT_NONE if unknown */
+        int relay_direction_flag(const char * direction) {
+          if (strcmp(direction, "Client->Server") == 0) {
+            return INTERCEPT_CLIENT_TO_SERVER;
+          } else if (strcmp(direction, "Server->Client") == 0) {
+            return INTERCEPT_SERVER_TO_CLIENT;
+          }
+          return INTERCEPT_NONE;
+        }
+
+        int should_intercept_data(const char * direction, intercept_target_t * target,
+          const unsigned char * data, int len) {
           if (!g_intercept_config.is_interception_enabled) {
             return 0;
           }
 
-          LOCK_MUTEX(g_intercept_config.intercept_cs);
-
-          int should_intercept = 0;
-          if (strcmp(direction, "Client->Server") == 0 &&
-            (g_intercept_config.enabled_directions & INTERCEPT_CLIENT_TO_SERVER)) {
-            should_intercept = 1;
-          } else if (strcmp(direction, "Server->Client") == 0 &&
-            (g_intercept_config.enabled_directions & INTERCEPT_SERVER_TO_CLIENT)) {
-            should_intercept = 1;
+          // Plain int reads; the filter itself is published atomically
+          int flag = relay_direction_flag(direction);
+          if (!(g_intercept_config.enabled_directions & flag)) {
+            return 0;
           }
 
-          UNLOCK_MUTEX(g_intercept_config.intercept_cs);
-          return should_intercept;
+          return intercept_filter_match(flag, target, data, len);
         }
 
         void send_intercept_data(int connection_id,
@@ -1638,28 +1176,913 @@ void forward_data(SSL * src, SSL * dst,
           }
         }
 
-        int wait_for_intercept_response(intercept_data_t * intercept_data) {
-            if (!intercept_data || !intercept_data -> response_event) {
-              return 0;
-            } // Wait for user response with a reasonable timeout (60 seconds)
-            #ifdef INTERCEPT_WINDOWS
-            DWORD wait_result = WAIT_EVENT(intercept_data -> response_event, 60000);
-            if (wait_result == WAIT_TIMEOUT) {
-              #else
-              int wait_result = WAIT_EVENT(intercept_data -> response_event, 60000);
-              if (wait_result != 0) { // Non-zero in POSIX typically means timeout or error
-                #endif
-                // Timeout - default to forwarding
-                intercept_data -> action = INTERCEPT_ACTION_FORWARD;
-                intercept_data -> is_waiting_for_response = 0;
-                if (g_status_callback) {
-                  log_message("Intercept timeout - data forwarded automatically");
-                }
-              }
+/* Non-blocking relay support */
 
-              #ifdef INTERCEPT_WINDOWS
-              return (wait_result == WAIT_OBJECT_0 || wait_result == WAIT_TIMEOUT);
-              #else
-              return (wait_result == 0 || wait_result != 0); // In POSIX, 0 is success
-              #endif
-            }
\ No newline at end of file
+/*
+ * Switch a socket between blocking and non-blocking mode
+ */
+int set_socket_nonblocking(socket_t sock, int enabled) {
+  #ifdef INTERCEPT_WINDOWS
+  unsigned long mode = enabled ? 1 : 0;
+  return ioctlsocket(sock, FIONBIO, & mode) == 0;
+  #else
+  int flags = fcntl(sock, F_GETFL, 0);
+  if (flags == -1) {
+    return 0;
+  }
+  flags = enabled ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+  return fcntl(sock, F_SETFL, flags) != -1;
+  #endif
+}
+
+/*
+ * Open a non-blocking UDP socket connected to itself on the loopback
+ * interface. A datagram sent to it from any thread makes it readable, so it
+ * can end a select() on every platform. INVALID_SOCKET on failure.
+ */
+static socket_t open_wakeup_socket(void) {
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  socket_t sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock == INVALID_SOCKET) {
+    return INVALID_SOCKET;
+  }
+
+  memset( & addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  if (bind(sock, (struct sockaddr * ) & addr, sizeof(addr)) != 0 ||
+    getsockname(sock, (struct sockaddr * ) & addr, & addr_len) != 0 ||
+    connect(sock, (struct sockaddr * ) & addr, addr_len) != 0 ||
+    !set_socket_nonblocking(sock, 1)) {
+    CLOSE_SOCKET(sock);
+    return INVALID_SOCKET;
+  }
+  return sock;
+}
+
+/* relay_dir_t wakeup for relay_bidirectional; arg points to its wakeup socket */
+static void signal_wakeup_socket(void * arg) {
+  char signal = 0;
+  if (send( * (socket_t * ) arg, & signal, 1, 0) < 0) {
+    // Already pending wakeups fill the buffer; one is enough
+  }
+}
+
+static void drain_wakeup_socket(socket_t sock) {
+  char signal[64];
+  while (recv(sock, signal, sizeof(signal), 0) > 0) {
+    // Discard queued wakeups
+  }
+}
+
+/*
+ * Start connecting to the upstream server without waiting for it. Returns 1
+ * while the connect is in progress (or already done), 0 on failure with
+ * the socket error in *error. Leaves the socket non-blocking.
+ */
+int upstream_connect_start(socket_t sock, const struct sockaddr_in * addr, int * error) {
+  * error = 0;
+  if (!set_socket_nonblocking(sock, 1)) {
+    * error = GET_SOCKET_ERROR();
+    return 0;
+  }
+  if (connect(sock, (const struct sockaddr * ) addr, sizeof( * addr)) == 0) {
+    return 1;
+  }
+  * error = GET_SOCKET_ERROR();
+  #ifdef INTERCEPT_WINDOWS
+  if ( * error == WSAEWOULDBLOCK) {
+  #else
+  if ( * error == EINPROGRESS) {
+  #endif
+    * error = 0;
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Wait up to timeout_ms for a connect started by upstream_connect_start()
+ * and put the socket back into blocking mode. Returns 1 once connected, 0
+ * on failure with the socket error in *error (ETIMEDOUT if it timed out).
+ */
+int upstream_connect_finish(socket_t sock, int timeout_ms, int * error) {
+  fd_set writefds, exceptfds;
+  struct timeval tv;
+
+  if (timeout_ms < 0) {
+    timeout_ms = 0;
+  }
+  FD_ZERO( & writefds);
+  FD_ZERO( & exceptfds);
+  FD_SET(sock, & writefds);
+  FD_SET(sock, & exceptfds); // Windows reports a failed connect here
+  tv.tv_sec = timeout_ms / 1000;
+  tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+  int ret = select((int)(sock + 1), NULL, & writefds, & exceptfds, & tv);
+  if (ret == 0) {
+    #ifdef INTERCEPT_WINDOWS
+    * error = WSAETIMEDOUT;
+    #else
+    * error = ETIMEDOUT;
+    #endif
+    return 0;
+  }
+  if (ret < 0) {
+    * error = GET_SOCKET_ERROR();
+    return 0;
+  }
+
+  int so_error = 0;
+  socklen_t len = sizeof(so_error);
+  if (getsockopt(sock, SOL_SOCKET, SO_ERROR, (char * ) & so_error, & len) != 0) {
+    so_error = GET_SOCKET_ERROR();
+  }
+  * error = so_error;
+  if (so_error != 0) {
+    return 0;
+  }
+  if (!set_socket_nonblocking(sock, 0)) {
+    * error = GET_SOCKET_ERROR();
+    return 0;
+  }
+  return 1;
+}
+
+void relay_dir_init(relay_dir_t * dir, socket_t src_fd, SSL * src_ssl,
+  socket_t dst_fd, SSL * dst_ssl,
+    const char * direction,
+      const char * src_ip,
+        const char * dst_ip, int dst_port, int connection_id) {
+  memset(dir, 0, sizeof(relay_dir_t));
+  dir -> src.fd = src_fd;
+  dir -> src.ssl = src_ssl;
+  dir -> dst.fd = dst_fd;
+  dir -> dst.ssl = dst_ssl;
+  strncpy(dir -> direction, direction, sizeof(dir -> direction) - 1);
+  strncpy(dir -> src_ip, src_ip, sizeof(dir -> src_ip) - 1);
+  strncpy(dir -> dst_ip, dst_ip, sizeof(dir -> dst_ip) - 1);
+  dir -> dst_port = dst_port;
+  dir -> connection_id = connection_id;
+  dir -> packet_id = (int) ATOMIC_INCREMENT(g_packet_id_counter);
+  dir -> out = dir -> buffer;
+  dir -> out_owned = NULL;
+  dir -> out_len = 0;
+  dir -> out_off = 0;
+  dir -> src_want = RELAY_WANT_READ;
+  dir -> dst_want = 0;
+  dir -> eof = 0;
+  dir -> held = NULL;
+  dir -> log.http_mode = config.http_message_mode;
+  if (dir -> log.http_mode == HTTP_MESSAGES_OFF) {
+    dir -> log.http.state = HTTP_STREAM_OFF;
+    dir -> log.h2.state = HTTP2_STREAM_OFF;
+  }
+  #ifdef INTERCEPT_LINUX
+  dir -> pipe_fds[0] = -1;
+  dir -> pipe_fds[1] = -1;
+  #endif
+}
+
+/* Let the HTTP parsers of a connection match responses to their requests */
+void relay_dir_pair(relay_dir_t * client_to_server, relay_dir_t * server_to_client) {
+  http_stream_pair( & client_to_server -> log.http, & server_to_client -> log.http);
+}
+
+/*
+ * Record what the intercept filter matches this direction against. The
+ * strings and hello must outlive the relay; the SNI is read from the
+ * client-facing TLS session when there is one, the fingerprints from the
+ * parsed ClientHello (NULL for plain TCP).
+ */
+void relay_dir_set_target(relay_dir_t * dir, const char * host, int port,
+  const char * client_ip, SSL * client_side_ssl, const client_hello_info_t * hello) {
+  dir -> target.host = host;
+  dir -> target.port = port;
+  dir -> target.client_ip = client_ip;
+  dir -> target.sni = client_side_ssl ? SSL_get_servername(client_side_ssl, TLSEXT_NAMETYPE_host_name) : NULL;
+  dir -> target.ja3 = (hello && hello -> ja3[0]) ? hello -> ja3 : NULL;
+  dir -> target.ja4 = (hello && hello -> ja4[0]) ? hello -> ja4 : NULL;
+  dir -> target.prepared_for = 0;
+  dir -> target.rewrite_prepared_for = 0;
+}
+
+/*
+ * Mark a direction of a passthrough connection: its bytes are forwarded as
+ * read, without rewriting, interception or logging, and spliced where the
+ * platform allows
+ */
+void relay_dir_set_opaque(relay_dir_t * dir) {
+  dir -> opaque = 1;
+  http_stream_stop( & dir -> log.http);
+  http2_stream_stop( & dir -> log.h2);
+}
+
+/*
+ * Have wakeup(arg) called, under intercept_cs, whenever a chunk this
+ * direction holds is answered, so the relay resumes without polling. The
+ * hold timeout is still up to the caller to check about once a second.
+ */
+void relay_dir_set_wakeup(relay_dir_t * dir, void( * wakeup)(void * arg), void * arg) {
+  dir -> wakeup = wakeup;
+  dir -> wakeup_arg = arg;
+}
+
+/* Unregister and free a hold queue chunk */
+static void relay_free_chunk(relay_chunk_t * chunk) {
+  intercept_data_t * held = chunk -> intercept;
+
+  if (held) {
+    LOCK_MUTEX(g_intercept_config.intercept_cs);
+    intercept_registry_remove(held);
+    UNLOCK_MUTEX(g_intercept_config.intercept_cs);
+
+    if (held -> modified_data) free(held -> modified_data);
+    free(held);
+  }
+  free(chunk -> data);
+  free(chunk);
+}
+
+/*
+ * Register a queued chunk for interception and hand it to the intercept
+ * callback. Each intercepted chunk gets its own packet id so it can be
+ * answered individually. Returns 0 if the chunk cannot be intercepted and
+ * should just be forwarded in order.
+ */
+static int relay_intercept_chunk(relay_dir_t * dir, relay_chunk_t * chunk, int packet_id) {
+  intercept_data_t * held = (intercept_data_t * ) calloc(1, sizeof(intercept_data_t));
+  if (!held) {
+    log_message("Error: Failed to allocate memory for intercept data");
+    return 0;
+  }
+
+  held -> connection_id = dir -> connection_id;
+  strncpy(held -> direction, dir -> direction, sizeof(held -> direction) - 1);
+  strncpy(held -> src_ip, dir -> src_ip, sizeof(held -> src_ip) - 1);
+  strncpy(held -> dst_ip, dir -> dst_ip, sizeof(held -> dst_ip) - 1);
+  held -> dst_port = dir -> dst_port;
+  held -> packet_id = packet_id;
+  held -> data = chunk -> data; // Owned by the chunk
+  held -> data_length = chunk -> len;
+  held -> is_waiting_for_response = 1;
+  held -> action = INTERCEPT_ACTION_FORWARD;
+  held -> wakeup = dir -> wakeup;
+  held -> wakeup_arg = dir -> wakeup_arg;
+
+  LOCK_MUTEX(g_intercept_config.intercept_cs);
+  int registered = intercept_registry_add(held);
+  UNLOCK_MUTEX(g_intercept_config.intercept_cs);
+  if (!registered) {
+    free(held);
+    log_message("Error: Failed to register intercepted data, forwarding it unchanged");
+    return 0;
+  }
+
+  chunk -> intercept = held;
+  chunk -> held_since = time(NULL);
+  send_intercept_data(dir -> connection_id, dir -> direction, dir -> src_ip, dir -> dst_ip,
+    dir -> dst_port, chunk -> data, chunk -> len, packet_id);
+  return 1;
+}
+
+/*
+ * Append a chunk to the hold queue, intercepting it if requested. A heap
+ * chunk (owned) is taken over, anything else is copied. Returns 0 if it
+ * could not be queued; the caller then still owns the data.
+ */
+static int relay_queue_chunk(relay_dir_t * dir, unsigned char * data, int len, int owned,
+  int intercept, int packet_id) {
+  relay_chunk_t * chunk = (relay_chunk_t * ) calloc(1, sizeof(relay_chunk_t));
+  if (chunk && owned) {
+    chunk -> data = data;
+  } else if (chunk && (chunk -> data = (unsigned char * ) malloc(len))) {
+    memcpy(chunk -> data, data, len);
+  } else {
+    free(chunk);
+    log_message("Error: Failed to allocate memory for held data");
+    return 0;
+  }
+  chunk -> len = len;
+
+  if (intercept) {
+    relay_intercept_chunk(dir, chunk, packet_id);
+  }
+
+  if (dir -> held_tail) {
+    dir -> held_tail -> next = chunk;
+  } else {
+    dir -> held = chunk;
+  }
+  dir -> held_tail = chunk;
+  dir -> held_bytes += len;
+  return 1;
+}
+
+/*
+ * Release the chunk at the head of the hold queue into the output buffer
+ * once the user has answered it (or the 60 second intercept timeout
+ * expired). Returns 1 while the head is still waiting.
+ */
+static int relay_release_head(relay_dir_t * dir) {
+  relay_chunk_t * chunk = dir -> held;
+  intercept_data_t * held = chunk -> intercept;
+  unsigned char * data = chunk -> data;
+  int len = chunk -> len;
+
+  if (held) {
+    LOCK_MUTEX(g_intercept_config.intercept_cs);
+    int waiting = held -> is_waiting_for_response;
+    if (waiting && time(NULL) - chunk -> held_since >= 60) {
+      // Timeout - default to forwarding
+      held -> action = INTERCEPT_ACTION_FORWARD;
+      held -> is_waiting_for_response = 0;
+      waiting = 0;
+      log_message("Intercept timeout - data forwarded automatically");
+    }
+    UNLOCK_MUTEX(g_intercept_config.intercept_cs);
+
+    if (waiting) {
+      return 1;
+    }
+
+    if (held -> action == INTERCEPT_ACTION_DROP) {
+      len = 0;
+    } else if (held -> action == INTERCEPT_ACTION_MODIFY && held -> modified_data) {
+      // Send the modified data instead, it may be larger than the original
+      free(data);
+      data = held -> modified_data;
+      len = held -> modified_length;
+      held -> modified_data = NULL;
+    }
+  }
+
+  dir -> held = chunk -> next;
+  if (!dir -> held) {
+    dir -> held_tail = NULL;
+  }
+  dir -> held_bytes -= chunk -> len;
+
+  // The output buffer takes ownership of the data
+  chunk -> data = NULL;
+  relay_free_chunk(chunk);
+  if (len > 0) {
+    dir -> out_owned = data;
+    dir -> out = data;
+    dir -> out_len = len;
+    dir -> out_off = 0;
+  } else {
+    free(data);
+  }
+  return 0;
+}
+
+/* Propagate end of stream from src to dst */
+static void relay_shutdown_dst(relay_dir_t * dir) {
+  if (dir -> dst.ssl) {
+    SSL_shutdown(dir -> dst.ssl);
+  } else {
+    shutdown(dir -> dst.fd, SD_SEND);
+  }
+}
+
+/*
+ * Read from src into the buffer. Returns bytes read, 0 when the call would
+ * block (src_want is set) or -1 once src has closed or failed.
+ */
+static int relay_read(relay_dir_t * dir) {
+  int len;
+
+  if (dir -> src.ssl) {
+    ERR_clear_error();
+    len = SSL_read(dir -> src.ssl, dir -> buffer, sizeof(dir -> buffer));
+    if (len > 0) {
+      return len;
+    }
+
+    int error = SSL_get_error(dir -> src.ssl, len);
+    if (error == SSL_ERROR_WANT_READ) {
+      dir -> src_want = RELAY_WANT_READ;
+      return 0;
+    } else if (error == SSL_ERROR_WANT_WRITE) {
+      dir -> src_want = RELAY_WANT_WRITE;
+      return 0;
+    } else if (error == SSL_ERROR_ZERO_RETURN ||
+      (error == SSL_ERROR_SYSCALL && ERR_peek_error() == 0) ||
+      (error == SSL_ERROR_SSL && ERR_GET_REASON(ERR_peek_error()) == SSL_R_UNEXPECTED_EOF_WHILE_READING)) {
+      if (config.verbose) {
+        log_message("Connection closed by peer (%s)", dir -> direction);
+      }
+      ERR_clear_error();
+      return -1;
+    }
+
+    log_message("SSL_read error in %s: %d", dir -> direction, error);
+    print_openssl_error();
+    return -1;
+  }
+
+  len = recv(dir -> src.fd, (char * ) dir -> buffer, sizeof(dir -> buffer), 0);
+  if (len > 0) {
+    return len;
+  } else if (len == 0) {
+    if (config.verbose) {
+      log_message("TCP connection closed by peer (%s)", dir -> direction);
+    }
+    return -1;
+  }
+
+  int err = GET_SOCKET_ERROR();
+  if (SOCKET_WOULD_BLOCK(err)) {
+    dir -> src_want = RELAY_WANT_READ;
+    return 0;
+  }
+  if (config.verbose) {
+    log_message("TCP recv error (%s): %d", dir -> direction, err);
+  }
+  return -1;
+}
+
+/*
+ * Write pending output to dst. Returns 1 when flushed, 0 when the call
+ * would block (dst_want is set) or RELAY_ERROR.
+ */
+static int relay_flush(relay_dir_t * dir) {
+  while (dir -> out_off < dir -> out_len) {
+    int remaining = dir -> out_len - dir -> out_off;
+    int written;
+
+    if (dir -> dst.ssl) {
+      ERR_clear_error();
+      written = SSL_write(dir -> dst.ssl, dir -> out + dir -> out_off, remaining);
+      if (written <= 0) {
+        int error = SSL_get_error(dir -> dst.ssl, written);
+        if (error == SSL_ERROR_WANT_WRITE) {
+          dir -> dst_want = RELAY_WANT_WRITE;
+          return 0;
+        } else if (error == SSL_ERROR_WANT_READ) {
+          dir -> dst_want = RELAY_WANT_READ;
+          return 0;
+        } else if (error == SSL_ERROR_ZERO_RETURN ||
+          (error == SSL_ERROR_SYSCALL && ERR_peek_error() == 0)) {
+          log_message("Peer closed connection while writing (%s)", dir -> direction);
+        } else {
+          log_message("SSL_write error in %s: %d", dir -> direction, error);
+          print_openssl_error();
+        }
+        return RELAY_ERROR;
+      }
+    } else {
+      written = send(dir -> dst.fd, (char * ) dir -> out + dir -> out_off, remaining, 0);
+      if (written <= 0) {
+        int err = GET_SOCKET_ERROR();
+        if (written < 0 && SOCKET_WOULD_BLOCK(err)) {
+          dir -> dst_want = RELAY_WANT_WRITE;
+          return 0;
+        }
+        if (config.verbose) {
+          log_message("TCP send error (%s): %d", dir -> direction, err);
+        }
+        return RELAY_ERROR;
+      }
+    }
+
+    dir -> out_off += written;
+  }
+
+  // Fully flushed, release any modified intercept data
+  if (dir -> out_owned) {
+    free(dir -> out_owned);
+    dir -> out_owned = NULL;
+  }
+  dir -> out = dir -> buffer;
+  dir -> out_len = 0;
+  dir -> out_off = 0;
+  dir -> dst_want = 0;
+  return 1;
+}
+
+/*
+ * Whether anything looks at the bytes of a direction. Log consumers take
+ * every connection's bytes; match and replace rules and interception only
+ * count where a rule or filter can match this connection and direction.
+ * Never for a passthrough direction. Checked before every read, so a change
+ * mid-connection takes effect on the next chunk.
+ */
+static int relay_bytes_observed(relay_dir_t * dir) {
+  if (dir -> opaque) {
+    return 0;
+  }
+  if (g_log_callback || g_raw_log_callback || g_tag_callback ||
+    g_http_message_callback || g_http2_data_callback || config.log_fp) {
+    return 1;
+  }
+  int flag = relay_direction_flag(dir -> direction);
+  if (rewrite_rules_active(flag, & dir -> target)) {
+    return 1;
+  }
+  return g_intercept_config.is_interception_enabled &&
+    (g_intercept_config.enabled_directions & flag) &&
+    intercept_filter_active(flag, & dir -> target);
+}
+
+#ifdef INTERCEPT_LINUX
+/*
+ * Whether a direction may take the splice() path: nothing observes it, and
+ * each end is a plain socket or a kTLS session, so the kernel sees the
+ * plaintext on both sides. OpenSSL must not hold decrypted bytes that the
+ * splice would overtake.
+ */
+static int relay_can_splice(relay_dir_t * dir) {
+  if (dir -> held || dir -> splice_unavailable || dir -> splice_bypass) {
+    return 0;
+  }
+  if (dir -> src.ssl && (!BIO_get_ktls_recv(SSL_get_rbio(dir -> src.ssl)) || SSL_has_pending(dir -> src.ssl))) {
+    return 0;
+  }
+  if (dir -> dst.ssl && !BIO_get_ktls_send(SSL_get_wbio(dir -> dst.ssl))) {
+    return 0;
+  }
+  return !relay_bytes_observed(dir);
+}
+
+/*
+ * Zero-copy path for unobserved plaintext: splice() from src into
+ * the direction's pipe and from there into dst, so the payload never enters
+ * user space. The pipe is drained before the next read, which keeps the
+ * stream in order when the relay switches back to copying. Returns 1 on
+ * progress (src closing or failing sets src_closed, dst failing aborts the
+ * direction) or 0 when a call would block (src_want or dst_want is set).
+ */
+static int relay_splice(relay_dir_t * dir) {
+  ssize_t moved;
+
+  if (dir -> pipe_len > 0) {
+    moved = splice(dir -> pipe_fds[0], NULL, dir -> dst.fd, NULL, (size_t) dir -> pipe_len,
+      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (moved > 0) {
+      dir -> pipe_len -= (int) moved;
+      dir -> dst_want = 0;
+      return 1;
+    } else if (moved < 0 && SOCKET_WOULD_BLOCK(errno)) {
+      dir -> dst_want = RELAY_WANT_WRITE;
+      dir -> src_want = 0;
+      return 0;
+    }
+    if (config.verbose) {
+      log_message("TCP splice error (%s): %d", dir -> direction, errno);
+    }
+    relay_dir_abort(dir);
+    return 1;
+  }
+
+  if (dir -> pipe_fds[0] < 0) {
+    if (pipe2(dir -> pipe_fds, O_NONBLOCK | O_CLOEXEC) != 0) {
+      dir -> pipe_fds[0] = -1;
+      dir -> pipe_fds[1] = -1;
+      dir -> splice_unavailable = 1;
+      return 1;
+    }
+    if (config.verbose) {
+      log_message("Relaying %s of connection %d with splice()", dir -> direction, dir -> connection_id);
+    }
+  }
+
+  moved = splice(dir -> src.fd, NULL, dir -> pipe_fds[1], NULL, RELAY_SPLICE_CHUNK,
+    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (moved > 0) {
+    // The decoders would lose their place in the stream, so they stop here
+    http_stream_stop( & dir -> log.http);
+    http2_stream_stop( & dir -> log.h2);
+    memset( & dir -> log.tags, 0, sizeof(dir -> log.tags));
+    dir -> pipe_len = (int) moved;
+    return 1;
+  } else if (moved == 0) {
+    if (config.verbose) {
+      log_message("TCP connection closed by peer (%s)", dir -> direction);
+    }
+  } else if (SOCKET_WOULD_BLOCK(errno)) {
+    dir -> src_want = RELAY_WANT_READ;
+    return 0;
+  } else if (errno == EINVAL && dir -> src.ssl) {
+    dir -> splice_bypass = 1; // A kTLS control record (alert, ticket, key update) is next
+    return 1;
+  } else if (errno == EINVAL || errno == ENOSYS) {
+    dir -> splice_unavailable = 1; // Copy instead
+    return 1;
+  } else if (config.verbose) {
+    log_message("TCP splice error (%s): %d", dir -> direction, errno);
+  }
+  dir -> src_closed = 1;
+  dir -> src_want = 0;
+  return 1;
+}
+#endif
+
+/*
+ * Move as much data as possible from src to dst without blocking.
+ * Keeps going until a read or write would block so that data buffered
+ * inside OpenSSL is never left behind waiting for socket readiness.
+ * Intercepted chunks wait in the hold queue while reading continues behind
+ * them; reading only pauses once the queue reaches the hold budget.
+ * A failing src is treated like its end of stream, so whatever is queued
+ * still reaches dst; a failing dst aborts the direction (relay_dir_abort).
+ */
+int relay_pump(relay_dir_t * dir) {
+  while (1) {
+    if (dir -> out_off < dir -> out_len) {
+      int ret = relay_flush(dir);
+      if (ret == RELAY_ERROR) {
+        relay_dir_abort(dir);
+        return RELAY_EOF;
+      } else if (ret == 0) {
+        dir -> src_want = 0;
+        return RELAY_OK;
+      }
+    }
+
+    // Release answered chunks in order; the output buffer is empty here
+    if (dir -> held) {
+      if (relay_release_head(dir) == 0) {
+        continue;
+      }
+      dir -> dst_want = 0;
+    }
+
+    if (dir -> eof) {
+      dir -> src_want = 0;
+      return RELAY_EOF;
+    }
+
+    if (dir -> src_closed) {
+      if (dir -> held) {
+        return RELAY_OK; // Shut down dst once the queue drained
+      }
+      dir -> eof = 1;
+      relay_shutdown_dst(dir);
+      return RELAY_EOF;
+    }
+
+    if (dir -> held && dir -> held_bytes >= config.intercept_hold_budget) {
+      dir -> src_want = 0; // Hold budget exhausted, let the peer back off
+      return RELAY_OK;
+    }
+
+    #ifdef INTERCEPT_LINUX
+    // Unobserved plaintext goes kernel to kernel; spliced bytes leave first
+    if (dir -> pipe_len > 0 || relay_can_splice(dir)) {
+      if (relay_splice(dir) == 0) {
+        return RELAY_OK;
+      }
+      continue;
+    }
+    #endif
+
+    int len = relay_read(dir);
+    #ifdef INTERCEPT_LINUX
+    dir -> splice_bypass = 0;
+    #endif
+    if (len == 0) {
+      return RELAY_OK;
+    } else if (len < 0) {
+      dir -> src_closed = 1;
+      dir -> src_want = 0;
+      continue;
+    }
+
+    if (dir -> opaque) {
+      dir -> out = dir -> buffer; // Passthrough: forward as read
+      dir -> out_len = len;
+      dir -> out_off = 0;
+      continue;
+    }
+
+    // Apply match and replace rules before anything else sees the chunk
+    unsigned char * data = dir -> buffer;
+    int rewritten_len;
+    unsigned char * rewritten = rewrite_apply(relay_direction_flag(dir -> direction), & dir -> target,
+      dir -> buffer, len, & rewritten_len);
+    if (rewritten) {
+      data = rewritten;
+      len = rewritten_len;
+      if (len == 0) {
+        free(rewritten);
+        continue; // Rewritten to nothing
+      }
+    }
+
+    // Each intercepted chunk needs its own packet id while others are held
+    int intercept = should_intercept_data(dir -> direction, & dir -> target, data, len);
+    int packet_id = intercept ? (int) ATOMIC_INCREMENT(g_packet_id_counter) : dir -> packet_id;
+
+    // Print the intercepted data
+    pretty_print_data(dir -> direction, data, len, dir -> src_ip, dir -> dst_ip,
+      dir -> dst_port, dir -> connection_id, packet_id, & dir -> log);
+
+    // Queue the chunk if it is intercepted or has to wait behind one
+    if ((intercept || dir -> held) && relay_queue_chunk(dir, data, len, rewritten != NULL, intercept, packet_id)) {
+      continue;
+    }
+
+    dir -> out_owned = rewritten;
+    dir -> out = data;
+    dir -> out_len = len;
+    dir -> out_off = 0;
+  }
+}
+
+/* Drop everything a direction still has to deliver */
+static void relay_discard(relay_dir_t * dir) {
+  while (dir -> held) {
+    relay_chunk_t * chunk = dir -> held;
+    dir -> held = chunk -> next;
+    relay_free_chunk(chunk);
+  }
+  dir -> held_tail = NULL;
+  dir -> held_bytes = 0;
+  if (dir -> out_owned) {
+    free(dir -> out_owned);
+    dir -> out_owned = NULL;
+  }
+  dir -> out = dir -> buffer;
+  dir -> out_len = 0;
+  dir -> out_off = 0;
+  #ifdef INTERCEPT_LINUX
+  if (dir -> pipe_fds[0] >= 0) {
+    close(dir -> pipe_fds[0]);
+    close(dir -> pipe_fds[1]);
+    dir -> pipe_fds[0] = -1;
+    dir -> pipe_fds[1] = -1;
+  }
+  dir -> pipe_len = 0;
+  #endif
+}
+
+/*
+ * Release anything a direction still owns (hold queue, modified data,
+ * decoder state) and report the HTTP message its end of stream completes
+ */
+void relay_dir_cleanup(relay_dir_t * dir) {
+  if (dir -> log.http.state != HTTP_STREAM_OFF) {
+    http_message_target_t target = {
+      dir -> direction, dir -> src_ip, dir -> dst_ip, dir -> dst_port, dir -> connection_id, dir -> log.http_mode,
+      NULL, NULL, 0, 0
+    };
+    http_stream_finish( & dir -> log.http, emit_http_message, & target);
+  }
+  http2_stream_stop( & dir -> log.h2);
+  relay_discard(dir);
+}
+
+/*
+ * Give up on a direction whose dst has gone away: whatever it still holds
+ * can no longer be delivered, so it is dropped and the direction counts as
+ * finished. The other direction carries on until it is done as well.
+ */
+void relay_dir_abort(relay_dir_t * dir) {
+  if (dir -> eof) {
+    return;
+  }
+  if (config.verbose && (dir -> held || dir -> out_off < dir -> out_len)) {
+    log_message("Dropping undeliverable data (%s)", dir -> direction);
+  }
+  relay_discard(dir);
+  dir -> src_closed = 1;
+  dir -> eof = 1;
+  dir -> src_want = 0;
+  dir -> dst_want = 0;
+}
+
+/*
+ * Relay both directions of a connection from the calling thread.
+ * Both sockets are switched to non-blocking mode and serviced with a single
+ * select() loop, so each SSL object is only ever touched by this thread.
+ * Answers to held chunks end the select() through a wakeup socket.
+ * Returns once both directions are done, or after 60 seconds of
+ * inactivity (non-verbose mode only). An opaque relay carries a
+ * passthrough connection (see relay_dir_set_opaque).
+ */
+void relay_bidirectional(socket_t client_fd, SSL * client_side_ssl,
+  socket_t server_fd, SSL * server_side_ssl,
+    const char * client_ip, int client_port,
+      const char * server_ip, int server_port,
+        const char * target_host, const client_hello_info_t * hello, int connection_id, int opaque) {
+  relay_dir_t * client_to_server = (relay_dir_t * ) malloc(sizeof(relay_dir_t));
+  relay_dir_t * server_to_client = (relay_dir_t * ) malloc(sizeof(relay_dir_t));
+  if (!client_to_server || !server_to_client) {
+    log_message("Memory allocation failed\n");
+    free(client_to_server);
+    free(server_to_client);
+    return;
+  }
+
+  relay_dir_init(client_to_server, client_fd, client_side_ssl, server_fd, server_side_ssl,
+    "Client->Server", client_ip, server_ip, server_port, connection_id);
+  relay_dir_init(server_to_client, server_fd, server_side_ssl, client_fd, client_side_ssl,
+    "Server->Client", server_ip, client_ip, client_port, connection_id);
+  relay_dir_pair(client_to_server, server_to_client);
+  relay_dir_set_target(client_to_server, target_host, server_port, client_to_server -> src_ip, client_side_ssl, hello);
+  relay_dir_set_target(server_to_client, target_host, server_port, client_to_server -> src_ip, client_side_ssl, hello);
+  if (opaque) {
+    relay_dir_set_opaque(client_to_server);
+    relay_dir_set_opaque(server_to_client);
+  }
+
+  socket_t wake_fd = INVALID_SOCKET;
+  if (!set_socket_nonblocking(client_fd, 1) || !set_socket_nonblocking(server_fd, 1)) {
+    log_message("Error: Failed to switch relay sockets to non-blocking mode");
+    goto done;
+  }
+
+  if (config.verbose) {
+    log_message("Starting single-thread relay: %s <-> %s:%d", client_ip, server_ip, server_port);
+  }
+
+  int activity_timeout = 0;
+  socket_t max_fd = client_fd > server_fd ? client_fd : server_fd;
+  if (!opaque) {
+    wake_fd = open_wakeup_socket();
+    if (wake_fd == INVALID_SOCKET) {
+      log_message("Warning: No relay wakeup socket, intercept responses apply within a second");
+    } else {
+      relay_dir_set_wakeup(client_to_server, signal_wakeup_socket, & wake_fd);
+      relay_dir_set_wakeup(server_to_client, signal_wakeup_socket, & wake_fd);
+      if (wake_fd > max_fd) {
+        max_fd = wake_fd;
+      }
+    }
+  }
+
+  while (1) {
+    relay_pump(client_to_server);
+    relay_pump(server_to_client);
+
+    if (client_to_server -> eof && server_to_client -> eof) {
+      break;
+    }
+
+    // Each socket carries the source side of one direction and the
+    // destination side of the other
+    int client_want = client_to_server -> src_want | server_to_client -> dst_want;
+    int server_want = client_to_server -> dst_want | server_to_client -> src_want;
+    int holding = client_to_server -> held || server_to_client -> held;
+
+    if (!client_want && !server_want) {
+      if (!holding) {
+        break; // Nothing left that could make progress
+      }
+      if (wake_fd == INVALID_SOCKET) {
+        SLEEP(1000); // Nothing to select() on until the hold timeout
+        continue;
+      }
+    }
+
+    fd_set readfds, writefds;
+    FD_ZERO( & readfds);
+    FD_ZERO( & writefds);
+    if (client_want & RELAY_WANT_READ) FD_SET(client_fd, & readfds);
+    if (client_want & RELAY_WANT_WRITE) FD_SET(client_fd, & writefds);
+    if (server_want & RELAY_WANT_READ) FD_SET(server_fd, & readfds);
+    if (server_want & RELAY_WANT_WRITE) FD_SET(server_fd, & writefds);
+    if (wake_fd != INVALID_SOCKET) FD_SET(wake_fd, & readfds);
+
+    // The timeout drives the idle check and the hold timeout
+    struct timeval tv;
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+
+    int ret = select((int)(max_fd + 1), & readfds, & writefds, NULL, & tv);
+    if (ret < 0) {
+      log_message("Error: select() failed in data relay");
+      break;
+    } else if (ret == 0) {
+      if (!holding) {
+        activity_timeout++;
+        if (!config.verbose && activity_timeout > 60) {
+          break;
+        }
+      }
+      continue;
+    }
+
+    if (wake_fd != INVALID_SOCKET && FD_ISSET(wake_fd, & readfds)) {
+      drain_wakeup_socket(wake_fd);
+    }
+    activity_timeout = 0;
+  }
+
+  set_socket_nonblocking(client_fd, 0);
+  set_socket_nonblocking(server_fd, 0);
+
+  done:
+    relay_dir_cleanup(client_to_server);
+  relay_dir_cleanup(server_to_client);
+  free(client_to_server);
+  free(server_to_client);
+  if (wake_fd != INVALID_SOCKET) {
+    CLOSE_SOCKET(wake_fd); // No chunk is registered any more to signal it
+  }
+}
@@ -8,6 +8,8 @@
 
 #include "../include/tls_proxy.h"
 
+#include "../include/log_writer.h"
+
 #ifndef INTERCEPT_WINDOWS
 #include <ifaddrs.h>
 
@@ -44,6 +46,21 @@ void init_config(void) {
 
   config.log_fp = NULL;
   config.verbose = 0;
+  config.engine = PROXY_ENGINE_THREADED;
+  config.reactor_threads = 0; /* 0 = one reactor per CPU */
+  config.key_pool_depth = KEY_POOL_DEFAULT_DEPTH;
+  config.leaf_key_algorithm = LEAF_KEY_ECDSA_P256;
+  config.event_queue_policy = EVENT_QUEUE_BLOCK;
+  config.event_queue_capacity = EVENT_QUEUE_DEFAULT_CAPACITY;
+  config.log_durability = LOG_DURABILITY_BATCHED;
+  config.log_flush_interval_ms = LOG_FLUSH_DEFAULT_INTERVAL_MS;
+  config.intercept_hold_budget = INTERCEPT_HOLD_DEFAULT_BUDGET;
+  config.http_message_mode = HTTP_MESSAGES_OFF;
+  config.http_message_max_body = HTTP_MESSAGE_DEFAULT_MAX_BODY;
+  config.ktls = 0;
+  config.dns_cache_ttl = DNS_CACHE_DEFAULT_TTL;
+  config.dns_negative_ttl = DNS_NEGATIVE_DEFAULT_TTL;
+  config.connect_timeout_ms = CONNECT_DEFAULT_TIMEOUT_MS;
 }
 
 /* Validate that the IP address exists on the system */
@@ -148,6 +165,9 @@ int open_log_file(void) {
   if (strlen(config.log_file) == 0) {
     return 1; // No log file specified, which is fine
   }
+  if (config.log_fp) {
+    return 1; // Already open
+  }
 
   // Try to open the log file
   config.log_fp = fopen(config.log_file, "a");
@@ -164,6 +184,11 @@ int open_log_file(void) {
 
   fflush(config.log_fp);
 
+  // Batch further writes on the log writer thread
+  if (!log_writer_start()) {
+    fprintf(stderr, "Warning: Failed to start log writer, writing log file synchronously\n");
+  }
+
   return 1;
 }
 
@@ -185,8 +210,7 @@ void log_message(const char * format, ...) {
 
   // Log to file if enabled
   if (config.log_fp) {
-    fprintf(config.log_fp, "[%s] %s\n", timestamp, message);
-    fflush(config.log_fp);
+    log_writer_printf("[%s] %s\n", timestamp, message);
   } // Print to console in verbose mode or send to callback
   if (config.verbose) {
     printf("[%s] %s\n", timestamp, message);
@@ -202,6 +226,9 @@ void log_message(const char * format, ...) {
 /* Close the log file */
 void close_log_file(void) {
   if (config.log_fp) {
+    // Write out everything still buffered first
+    log_writer_stop();
+
     time_t now = time(NULL);
     struct tm * tm_info = localtime( & now);
     char timestamp[26];
@@ -0,0 +1,176 @@
+/*
+ * TLS MITM Proxy - Work Queue Implementation
+ *
+ * Jobs wait in a FIFO list under the queue's lock. Idle workers sleep on
+ * the queue's event, which is set while jobs are queued or the queue is
+ * shutting down and reset by the worker that finds the list empty.
+ */
+
+#include "../include/work_queue.h"
+
+typedef struct work_item {
+  work_fn_t fn;
+  void * arg;
+  struct work_item * next;
+} work_item_t;
+
+struct work_queue {
+  mutex_t cs;
+  event_t ready;                // Set while jobs are queued or stopping
+  work_item_t * head;
+  work_item_t * tail;
+  int stopping;
+  THREAD_HANDLE threads[WORK_QUEUE_MAX_THREADS];
+  int thread_count;
+};
+
+static THREAD_RETURN_TYPE THREAD_CALL work_queue_worker(void * arg) {
+  work_queue_t * queue = (work_queue_t * ) arg;
+
+  while (1) {
+    LOCK_MUTEX(queue -> cs);
+    work_item_t * item = queue -> head;
+    if (item) {
+      queue -> head = item -> next;
+      if (!queue -> head) {
+        queue -> tail = NULL;
+      }
+    } else if (queue -> stopping) {
+      UNLOCK_MUTEX(queue -> cs);
+      break;
+    } else {
+      RESET_EVENT(queue -> ready); // Submitters set it again under the lock
+    }
+    UNLOCK_MUTEX(queue -> cs);
+
+    if (!item) {
+      WAIT_EVENT(queue -> ready, EVENT_WAIT_FOREVER);
+      continue;
+    }
+
+    item -> fn(item -> arg);
+    free(item);
+  }
+
+  THREAD_RETURN;
+}
+
+/* Start a queue with the given number of worker threads, NULL on failure */
+work_queue_t * work_queue_create(int threads) {
+  work_queue_t * queue = (work_queue_t * ) calloc(1, sizeof(work_queue_t));
+  if (!queue) {
+    return NULL;
+  }
+  queue -> ready = CREATE_EVENT();
+  if (!queue -> ready) {
+    free(queue);
+    return NULL;
+  }
+  INIT_MUTEX(queue -> cs);
+
+  if (threads > WORK_QUEUE_MAX_THREADS) {
+    threads = WORK_QUEUE_MAX_THREADS;
+  }
+  for (int i = 0; i < threads; i++) {
+    THREAD_HANDLE thread = INVALID_THREAD_ID;
+    if (CREATE_THREAD(thread, work_queue_worker, queue) != 0) {
+      log_message("WARNING: Failed to start worker thread");
+      break;
+    }
+    queue -> threads[queue -> thread_count++] = thread;
+  }
+
+  if (queue -> thread_count == 0) {
+    work_queue_destroy(queue);
+    return NULL;
+  }
+  return queue;
+}
+
+/* Queue fn(arg) to run on a worker. Returns 0 if it could not be queued. */
+int work_queue_submit(work_queue_t * queue, work_fn_t fn, void * arg) {
+  work_item_t * item = (work_item_t * ) malloc(sizeof(work_item_t));
+  if (!queue || !item) {
+    free(item);
+    return 0;
+  }
+  item -> fn = fn;
+  item -> arg = arg;
+  item -> next = NULL;
+
+  LOCK_MUTEX(queue -> cs);
+  if (queue -> stopping) {
+    UNLOCK_MUTEX(queue -> cs);
+    free(item);
+    return 0;
+  }
+  if (queue -> tail) {
+    queue -> tail -> next = item;
+  } else {
+    queue -> head = item;
+  }
+  queue -> tail = item;
+  SET_EVENT(queue -> ready);
+  UNLOCK_MUTEX(queue -> cs);
+  return 1;
+}
+
+/*
+ * Stop the workers and free the queue. Jobs already running finish first;
+ * jobs still queued are dropped without running, so their owner has to
+ * release whatever they refer to.
+ */
+void work_queue_destroy(work_queue_t * queue) {
+  if (!queue) {
+    return;
+  }
+
+  LOCK_MUTEX(queue -> cs);
+  queue -> stopping = 1;
+  while (queue -> head) {
+    work_item_t * next = queue -> head -> next;
+    free(queue -> head);
+    queue -> head = next;
+  }
+  queue -> tail = NULL;
+  SET_EVENT(queue -> ready);
+  UNLOCK_MUTEX(queue -> cs);
+
+  for (int i = 0; i < queue -> thread_count; i++) {
+    JOIN_THREAD(queue -> threads[i]);
+    #ifdef INTERCEPT_WINDOWS
+    CloseHandle(queue -> threads[i]);
+    #endif
+  }
+
+  CLOSE_EVENT(queue -> ready);
+  DESTROY_MUTEX(queue -> cs);
+  free(queue);
+}
+
+/* Add a waiter to a job's list; NULL is ignored */
+void work_waiter_add(work_waiter_t ** list, work_waiter_t * waiter) {
+  if (waiter) {
+    waiter -> next = * list;
+    * list = waiter;
+  }
+}
+
+/* Take a waiter off a job's list if it is still there, so it is not notified */
+void work_waiter_remove(work_waiter_t ** list, work_waiter_t * waiter) {
+  while ( * list && * list != waiter) {
+    list = & ( * list) -> next;
+  }
+  if ( * list) {
+    * list = waiter -> next;
+  }
+}
+
+/* Notify and empty a finished job's list */
+void work_waiter_notify_all(work_waiter_t ** list) {
+  while ( * list) {
+    work_waiter_t * waiter = * list;
+    * list = waiter -> next;
+    waiter -> notify(waiter -> arg);
+  }
+}
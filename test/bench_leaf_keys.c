@@ -0,0 +1,206 @@
+/*
+ * Leaf key algorithm benchmark
+ *
+ * Compares the leaf certificate key algorithms offered by
+ * set_leaf_key_algorithm(): how fast a key plus CA-signed certificate can be
+ * produced, and how many full TLS handshakes per second a server using that
+ * certificate completes. Handshakes run over in-memory BIO pairs so the
+ * numbers reflect CPU cost only.
+ *
+ * Build: gcc -O2 bench_leaf_keys.c -o bench_leaf_keys -lssl -lcrypto
+ * Usage: ./bench_leaf_keys [seconds-per-test]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/ec.h>
+#include <openssl/rsa.h>
+#include <openssl/x509v3.h>
+
+typedef struct {
+    const char* name;
+    int type;       /* EVP_PKEY_RSA or EVP_PKEY_EC */
+    int param;      /* RSA bits or curve NID */
+} algorithm_t;
+
+static const algorithm_t algorithms[] = {
+    { "RSA-2048",    EVP_PKEY_RSA, 2048 },
+    { "RSA-3072",    EVP_PKEY_RSA, 3072 },
+    { "ECDSA P-256", EVP_PKEY_EC,  NID_X9_62_prime256v1 },
+    { "ECDSA P-384", EVP_PKEY_EC,  NID_secp384r1 },
+};
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static EVP_PKEY* generate_key(const algorithm_t* alg) {
+    EVP_PKEY* key = NULL;
+    EVP_PKEY_CTX* ctx = EVP_PKEY_CTX_new_id(alg->type, NULL);
+    if (!ctx || EVP_PKEY_keygen_init(ctx) <= 0) {
+        EVP_PKEY_CTX_free(ctx);
+        return NULL;
+    }
+    if (alg->type == EVP_PKEY_RSA) {
+        EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, alg->param);
+    } else {
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, alg->param);
+        EVP_PKEY_CTX_set_ec_param_enc(ctx, OPENSSL_EC_NAMED_CURVE);
+    }
+    if (EVP_PKEY_keygen(ctx, &key) <= 0) {
+        key = NULL;
+    }
+    EVP_PKEY_CTX_free(ctx);
+    return key;
+}
+
+/* Same shape as generate_cert_for_host(): CN + SAN, signed by the CA with SHA-256 */
+static X509* issue_cert(const char* hostname, EVP_PKEY* key, X509* issuer, EVP_PKEY* issuer_key) {
+    X509* cert = X509_new();
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), rand());
+    X509_gmtime_adj(X509_get_notBefore(cert), 0);
+    X509_gmtime_adj(X509_get_notAfter(cert), 60 * 60 * 24 * 365);
+    X509_set_pubkey(cert, key);
+    X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC,
+                               (const unsigned char*)hostname, -1, -1, 0);
+    X509_set_issuer_name(cert, issuer ? X509_get_subject_name(issuer) : X509_get_subject_name(cert));
+
+    X509V3_CTX v3;
+    char san[300];
+    snprintf(san, sizeof(san), "DNS:%s", hostname);
+    X509V3_set_ctx(&v3, issuer ? issuer : cert, cert, NULL, NULL, 0);
+    X509_EXTENSION* ext = X509V3_EXT_conf_nid(NULL, &v3, NID_subject_alt_name, san);
+    if (ext) {
+        X509_add_ext(cert, ext, -1);
+        X509_EXTENSION_free(ext);
+    }
+
+    if (!X509_sign(cert, issuer_key, EVP_sha256())) {
+        X509_free(cert);
+        return NULL;
+    }
+    return cert;
+}
+
+/* Run one full handshake between a fresh client and server over a BIO pair */
+static int handshake_once(SSL_CTX* server_ctx, SSL_CTX* client_ctx) {
+    SSL* server = SSL_new(server_ctx);
+    SSL* client = SSL_new(client_ctx);
+    BIO* server_bio = NULL;
+    BIO* client_bio = NULL;
+    int ok = 0;
+
+    BIO_new_bio_pair(&server_bio, 0, &client_bio, 0);
+    SSL_set_bio(server, server_bio, server_bio);
+    SSL_set_bio(client, client_bio, client_bio);
+    SSL_set_accept_state(server);
+    SSL_set_connect_state(client);
+    SSL_set_tlsext_host_name(client, "bench.example");
+
+    for (int round = 0; round < 32; round++) {
+        int c = SSL_do_handshake(client);
+        int s = SSL_do_handshake(server);
+        if (c == 1 && s == 1) {
+            ok = 1;
+            break;
+        }
+        if ((c <= 0 && SSL_get_error(client, c) != SSL_ERROR_WANT_READ) ||
+            (s <= 0 && SSL_get_error(server, s) != SSL_ERROR_WANT_READ)) {
+            break;
+        }
+    }
+
+    SSL_free(client);
+    SSL_free(server);
+    return ok;
+}
+
+int main(int argc, char* argv[]) {
+    double seconds = argc > 1 ? atof(argv[1]) : 2.0;
+    if (seconds <= 0) {
+        seconds = 2.0;
+    }
+
+    /* RSA-2048 CA, like the proxy's generated myCA */
+    algorithm_t ca_alg = { "CA", EVP_PKEY_RSA, 2048 };
+    EVP_PKEY* ca_key = generate_key(&ca_alg);
+    X509* ca_cert = ca_key ? issue_cert("Bench CA", ca_key, NULL, ca_key) : NULL;
+    if (!ca_cert) {
+        fprintf(stderr, "Failed to create benchmark CA\n");
+        ERR_print_errors_fp(stderr);
+        return 1;
+    }
+
+    SSL_CTX* client_ctx = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_verify(client_ctx, SSL_VERIFY_NONE, NULL);
+    SSL_CTX_set_session_cache_mode(client_ctx, SSL_SESS_CACHE_OFF);
+
+    printf("%-12s %14s %14s %16s\n", "Algorithm", "key+cert ms", "keys+certs/s", "handshakes/s");
+    printf("%-12s %14s %14s %16s\n", "---------", "-----------", "------------", "------------");
+
+    for (size_t i = 0; i < sizeof(algorithms) / sizeof(algorithms[0]); i++) {
+        const algorithm_t* alg = &algorithms[i];
+
+        /* Key generation + certificate issuance (the cost the key pool hides) */
+        int issued = 0;
+        double start = now_seconds();
+        double elapsed = 0;
+        do {
+            EVP_PKEY* key = generate_key(alg);
+            X509* cert = key ? issue_cert("bench.example", key, ca_cert, ca_key) : NULL;
+            if (!cert) {
+                fprintf(stderr, "%s: certificate generation failed\n", alg->name);
+                ERR_print_errors_fp(stderr);
+                return 1;
+            }
+            X509_free(cert);
+            EVP_PKEY_free(key);
+            issued++;
+            elapsed = now_seconds() - start;
+        } while (elapsed < seconds);
+        double issue_rate = issued / elapsed;
+
+        /* Full handshakes with a server using this algorithm's certificate */
+        EVP_PKEY* key = generate_key(alg);
+        X509* cert = issue_cert("bench.example", key, ca_cert, ca_key);
+        SSL_CTX* server_ctx = SSL_CTX_new(TLS_server_method());
+        SSL_CTX_set_session_cache_mode(server_ctx, SSL_SESS_CACHE_OFF);
+        SSL_CTX_set_options(server_ctx, SSL_OP_NO_TICKET);
+        if (SSL_CTX_use_certificate(server_ctx, cert) != 1 ||
+            SSL_CTX_use_PrivateKey(server_ctx, key) != 1) {
+            fprintf(stderr, "%s: failed to configure server context\n", alg->name);
+            return 1;
+        }
+
+        int handshakes = 0;
+        start = now_seconds();
+        do {
+            if (!handshake_once(server_ctx, client_ctx)) {
+                fprintf(stderr, "%s: handshake failed\n", alg->name);
+                ERR_print_errors_fp(stderr);
+                return 1;
+            }
+            handshakes++;
+            elapsed = now_seconds() - start;
+        } while (elapsed < seconds);
+
+        printf("%-12s %14.2f %14.1f %16.1f\n", alg->name, 1000.0 / issue_rate, issue_rate, handshakes / elapsed);
+
+        SSL_CTX_free(server_ctx);
+        X509_free(cert);
+        EVP_PKEY_free(key);
+    }
+
+    SSL_CTX_free(client_ctx);
+    X509_free(ca_cert);
+    EVP_PKEY_free(ca_key);
+    return 0;
+}
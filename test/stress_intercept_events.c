@@ -0,0 +1,230 @@
+/*
+ * Intercept event stress test
+ *
+ * Exercises CREATE_EVENT/SET_EVENT/WAIT_EVENT from platform.h with a
+ * waiter racing its timeout against a signaller: hundreds of threads
+ * each hold a message and block on its event, responder threads answer
+ * them in random order under a shared lock, and a share of the messages
+ * is never answered so the timeout path runs too. Checks that:
+ *   - every answered waiter wakes with the action it was given,
+ *   - no waiter wakes before it was answered,
+ *   - unanswered waiters time out no earlier than the timeout and not
+ *     much later,
+ *   - a response racing the timeout is either applied or cleanly ignored
+ *     (run with a timeout of a few ms to provoke this).
+ *
+ * Build: gcc -O2 -I../include stress_intercept_events.c -o stress_intercept_events -lpthread
+ * Usage: ./stress_intercept_events [held-messages] [timeout-ms]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "platform.h"
+
+#define RESPONDER_THREADS 4
+#define UNANSWERED_EVERY 10     /* Every 10th message is left to time out */
+#define TIMEOUT_SLACK_MS 500    /* Allowed lateness of a timeout under load */
+
+typedef struct {
+    int id;
+    event_t event;
+    volatile int waiting;       /* Cleared by whoever decides the outcome, under g_lock */
+    volatile int action;
+    volatile int answered;
+    int registered;
+    int result;
+    int woke_early;
+    int got_action;
+    double waited_ms;
+} held_message_t;
+
+static mutex_t g_lock;
+static held_message_t* g_messages;
+static int g_count;
+static int g_timeout_ms;
+static volatile int g_registered;
+
+static double now_ms(void) {
+#ifdef INTERCEPT_WINDOWS
+    return (double)GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+#endif
+}
+
+/* Register, wait, resolve a timeout under the lock */
+static THREAD_RETURN_TYPE holder_thread(void* arg) {
+    held_message_t* m = (held_message_t*)arg;
+
+    m->event = CREATE_EVENT();
+    if (!m->event) {
+        fprintf(stderr, "CREATE_EVENT failed for message %d\n", m->id);
+        exit(1);
+    }
+    LOCK_MUTEX(g_lock);
+    m->waiting = 1;
+    m->registered = 1;
+    g_registered++;
+    UNLOCK_MUTEX(g_lock);
+
+    double start = now_ms();
+    m->result = (int)WAIT_EVENT(m->event, g_timeout_ms);
+    m->waited_ms = now_ms() - start;
+
+    LOCK_MUTEX(g_lock);
+    if (m->result == EVENT_WAIT_SIGNALED) {
+        m->woke_early = !m->answered;
+    } else if (m->waiting) {
+        m->waiting = 0;     /* Timed out: nobody may answer any more */
+        m->action = 0;
+    }
+    m->got_action = m->action;
+    UNLOCK_MUTEX(g_lock);
+
+    THREAD_RETURN;
+}
+
+/* Find a waiting message, answer it under the lock, signal */
+static THREAD_RETURN_TYPE responder_thread(void* arg) {
+    unsigned int seed = (unsigned int)(size_t)arg;
+
+    while (1) {
+        seed = seed * 1103515245u + 12345u;
+        int i = (int)((seed >> 8) % (unsigned int)g_count);
+        held_message_t* m = &g_messages[i];
+        if (m->id % UNANSWERED_EVERY == 0) {
+            continue;
+        }
+
+        LOCK_MUTEX(g_lock);
+        if (m->registered && m->waiting && !m->answered) {
+            m->action = 1 + (m->id % 2);    /* Drop or modify, anything but the timeout default */
+            m->answered = 1;
+            m->waiting = 0;
+            SET_EVENT(m->event);
+        }
+        UNLOCK_MUTEX(g_lock);
+
+        /* Stop once nothing answerable is left (answered, or already timed out) */
+        int remaining = 0;
+        LOCK_MUTEX(g_lock);
+        for (int k = 0; k < g_count && !remaining; k++) {
+            remaining = g_messages[k].id % UNANSWERED_EVERY != 0 && g_messages[k].waiting;
+        }
+        UNLOCK_MUTEX(g_lock);
+        if (!remaining) {
+            break;
+        }
+    }
+
+    THREAD_RETURN;
+}
+
+int main(int argc, char* argv[]) {
+    g_count = argc > 1 ? atoi(argv[1]) : 500;
+    g_timeout_ms = argc > 2 ? atoi(argv[2]) : 2000;
+    if (g_count <= 0 || g_timeout_ms <= 0) {
+        fprintf(stderr, "Usage: %s [held-messages] [timeout-ms]\n", argv[0]);
+        return 1;
+    }
+
+    INIT_MUTEX(g_lock);
+    g_messages = (held_message_t*)calloc((size_t)g_count, sizeof(held_message_t));
+    THREAD_HANDLE* holders = (THREAD_HANDLE*)calloc((size_t)g_count, sizeof(THREAD_HANDLE));
+    THREAD_HANDLE responders[RESPONDER_THREADS];
+    if (!g_messages || !holders) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    printf("Holding %d messages, %d responders, timeout %d ms\n", g_count, RESPONDER_THREADS, g_timeout_ms);
+
+    for (int i = 0; i < g_count; i++) {
+        g_messages[i].id = i;
+        if (CREATE_THREAD(holders[i], holder_thread, &g_messages[i]) != 0) {
+            fprintf(stderr, "Failed to start holder thread %d\n", i);
+            return 1;
+        }
+    }
+
+    /* Let every holder block before answering, so all messages are held at once */
+    while (1) {
+        LOCK_MUTEX(g_lock);
+        int registered = g_registered;
+        UNLOCK_MUTEX(g_lock);
+        if (registered == g_count) {
+            break;
+        }
+        SLEEP(1);
+    }
+
+    for (int i = 0; i < RESPONDER_THREADS; i++) {
+        CREATE_THREAD(responders[i], responder_thread, (void*)(size_t)(i * 7919 + 1));
+    }
+    for (int i = 0; i < RESPONDER_THREADS; i++) {
+        JOIN_THREAD(responders[i]);
+    }
+    for (int i = 0; i < g_count; i++) {
+        JOIN_THREAD(holders[i]);
+    }
+
+    int failures = 0;
+    int signaled = 0;
+    int timed_out = 0;
+    int late_answers = 0;
+    double max_answer_ms = 0;
+    double max_timeout_ms = 0;
+
+    for (int i = 0; i < g_count; i++) {
+        held_message_t* m = &g_messages[i];
+        int expect_answer = m->id % UNANSWERED_EVERY != 0;
+
+        if (m->result == EVENT_WAIT_SIGNALED) {
+            signaled++;
+            if (m->waited_ms > max_answer_ms) {
+                max_answer_ms = m->waited_ms;
+            }
+            if (m->woke_early || !expect_answer || m->got_action != 1 + (m->id % 2)) {
+                fprintf(stderr, "Message %d: bad wakeup (early=%d, action=%d)\n", m->id, m->woke_early, m->got_action);
+                failures++;
+            }
+        } else if (m->result == EVENT_WAIT_TIMEOUT) {
+            timed_out++;
+            if (m->waited_ms > max_timeout_ms) {
+                max_timeout_ms = m->waited_ms;
+            }
+            if (m->waited_ms < g_timeout_ms - 1 || m->waited_ms > g_timeout_ms + TIMEOUT_SLACK_MS) {
+                fprintf(stderr, "Message %d: timed out after %.1f ms\n", m->id, m->waited_ms);
+                failures++;
+            }
+            if (m->answered) {
+                /* Response won the race with the timeout: it must be applied in full */
+                late_answers++;
+                if (m->got_action != 1 + (m->id % 2)) {
+                    fprintf(stderr, "Message %d: late answer lost (action %d)\n", m->id, m->got_action);
+                    failures++;
+                }
+            } else if (m->got_action != 0) {
+                fprintf(stderr, "Message %d: timed out with action %d\n", m->id, m->got_action);
+                failures++;
+            }
+        } else {
+            fprintf(stderr, "Message %d: wait failed (%d)\n", m->id, m->result);
+            failures++;
+        }
+        CLOSE_EVENT(m->event);
+    }
+
+    printf("Signaled: %d (slowest answer %.1f ms)\n", signaled, max_answer_ms);
+    printf("Timed out: %d (%d unanswered by design, %d answered right at the timeout, slowest %.1f ms)\n",
+           timed_out, (g_count + UNANSWERED_EVERY - 1) / UNANSWERED_EVERY, late_answers, max_timeout_ms);
+    printf("%s\n", failures ? "FAILED" : "PASSED");
+
+    free(holders);
+    free(g_messages);
+    DESTROY_MUTEX(g_lock);
+    return failures ? 1 : 0;
+}
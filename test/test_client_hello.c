@@ -0,0 +1,334 @@
+/*
+ * ClientHello parser test
+ *
+ * Builds ClientHello records from the inputs of the published JA3 and JA4
+ * reference examples and checks client_hello_parse() against their
+ * published fingerprints:
+ *   - JA3 README: "769,47-53-5-10-49161-49162-49171-49172-50-56-19-4,0-10-11,23-24-25,0"
+ *     = ada70206e40642a3e4461f35503241d5
+ *   - JA4 README (Chrome): t13d1516h2_8daaf6152771_e5627efa2ab1, sent here
+ *     in Chrome's wire order with GREASE values, which both fingerprints
+ *     have to leave out
+ *
+ * Then checks truncated and oversized input: every prefix of a record
+ * (copied to a buffer of exactly that length, so a build with
+ * -fsanitize=address catches reads past the end) must be reported as
+ * incomplete, and records that are too long, not a ClientHello, continue
+ * in a second record or carry more list entries than client_hello_info_t
+ * holds must be rejected or flagged as truncated.
+ *
+ * Build: gcc -O2 -g -fsanitize=address -I../include test_client_hello.c ../src/client_hello.c -o test_client_hello -lcrypto
+ * Usage: ./test_client_hello
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "client_hello.h"
+
+typedef struct {
+    unsigned char data[CLIENT_HELLO_PEEK_SIZE + 1024];
+    int len;
+} builder_t;
+
+static int failures;
+
+static void check(int ok, const char* name, const char* what) {
+    if (!ok) {
+        printf("FAIL %s: %s\n", name, what);
+        failures++;
+    }
+}
+
+static void put_u8(builder_t* b, int value) {
+    b->data[b->len++] = (unsigned char)value;
+}
+
+static void put_u16(builder_t* b, int value) {
+    put_u8(b, value >> 8);
+    put_u8(b, value & 0xff);
+}
+
+static void put_bytes(builder_t* b, const void* data, int len) {
+    if (len == 0) {
+        return; /* data may be NULL, which memcpy() must not get even for no bytes */
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+/* Reserve a length field of size bytes; patch_length() fills it in later */
+static int open_length(builder_t* b, int size) {
+    int at = b->len;
+    b->len += size;
+    return at;
+}
+
+static void patch_length(builder_t* b, int at, int size) {
+    int value = b->len - at - size;
+    for (int i = size - 1; i >= 0; i--) {
+        b->data[at + i] = (unsigned char)(value & 0xff);
+        value >>= 8;
+    }
+}
+
+static void put_u16_list(builder_t* b, int length_size, const unsigned short* values, int count) {
+    int at = open_length(b, length_size);
+    for (int i = 0; i < count; i++) {
+        put_u16(b, values[i]);
+    }
+    patch_length(b, at, length_size);
+}
+
+/* Extension bodies */
+static void ext_server_name(builder_t* b, const char* host) {
+    put_u16(b, 0x0000);
+    int ext = open_length(b, 2);
+    int list = open_length(b, 2);
+    put_u8(b, 0);
+    put_u16(b, (int)strlen(host));
+    put_bytes(b, host, (int)strlen(host));
+    patch_length(b, list, 2);
+    patch_length(b, ext, 2);
+}
+
+static void ext_u16_list(builder_t* b, int type, int length_size, const unsigned short* values, int count) {
+    put_u16(b, type);
+    int ext = open_length(b, 2);
+    put_u16_list(b, length_size, values, count);
+    patch_length(b, ext, 2);
+}
+
+static void ext_alpn(builder_t* b, const char* const* protocols, int count) {
+    put_u16(b, 0x0010);
+    int ext = open_length(b, 2);
+    int list = open_length(b, 2);
+    for (int i = 0; i < count; i++) {
+        put_u8(b, (int)strlen(protocols[i]));
+        put_bytes(b, protocols[i], (int)strlen(protocols[i]));
+    }
+    patch_length(b, list, 2);
+    patch_length(b, ext, 2);
+}
+
+static void ext_raw(builder_t* b, int type, const void* body, int len) {
+    put_u16(b, type);
+    put_u16(b, len);
+    put_bytes(b, body, len);
+}
+
+/* Record and handshake headers up to the extensions; returns the extensions length field */
+static int begin_hello(builder_t* b, int version, const unsigned short* ciphers, int cipher_count, int* record, int* body) {
+    static const unsigned char random[32] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16,
+                                              17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32 };
+    b->len = 0;
+    put_u8(b, 0x16);
+    put_u16(b, 0x0301);
+    *record = open_length(b, 2);
+    put_u8(b, 0x01);
+    *body = open_length(b, 3);
+    put_u16(b, version);
+    put_bytes(b, random, sizeof(random));
+    put_u8(b, 32);
+    put_bytes(b, random, sizeof(random));
+    put_u16_list(b, 2, ciphers, cipher_count);
+    put_u8(b, 1);
+    put_u8(b, 0);
+    return open_length(b, 2);
+}
+
+static void end_hello(builder_t* b, int record, int body, int extensions) {
+    patch_length(b, extensions, 2);
+    patch_length(b, body, 3);
+    patch_length(b, record, 2);
+}
+
+/* The JA3 README example: TLS 1.0 with SNI, groups and point formats */
+static void build_ja3_example(builder_t* b) {
+    static const unsigned short ciphers[] = { 47, 53, 5, 10, 49161, 49162, 49171, 49172, 50, 56, 19, 4 };
+    static const unsigned short groups[] = { 23, 24, 25 };
+    static const unsigned char point_formats[] = { 1, 0 };
+    int record, body;
+
+    int extensions = begin_hello(b, 0x0301, ciphers, 12, &record, &body);
+    ext_server_name(b, "example.com");
+    ext_u16_list(b, 0x000a, 2, groups, 3);
+    ext_raw(b, 0x000b, point_formats, sizeof(point_formats));
+    end_hello(b, record, body, extensions);
+}
+
+/* The JA4 README Chrome example, with or without the GREASE values Chrome sends */
+static void build_ja4_example(builder_t* b, int grease) {
+    static const unsigned short ciphers[] = { 0x2a2a, 0x1301, 0x1302, 0x1303, 0xc02b, 0xc02f, 0xc02c, 0xc030,
+                                              0xcca9, 0xcca8, 0xc013, 0xc014, 0x009c, 0x009d, 0x002f, 0x0035 };
+    static const unsigned short groups[] = { 0x3a3a, 0x001d, 0x0017, 0x0018 };
+    static const unsigned short signature_algorithms[] = { 0x0403, 0x0804, 0x0401, 0x0503,
+                                                           0x0805, 0x0501, 0x0806, 0x0601 };
+    static const unsigned short versions[] = { 0x4a4a, 0x0304, 0x0303 };
+    static const char* const alpn[] = { "h2", "http/1.1" };
+    static const unsigned char point_formats[] = { 1, 0 };
+    static const unsigned char status_request[] = { 1, 0, 0, 0, 0 };
+    static const unsigned char psk_modes[] = { 1, 1 };
+    static const unsigned char compress_certificate[] = { 2, 0, 2 };
+    static const unsigned char alps[] = { 0, 3, 2, 'h', '2' };
+    static const unsigned char renegotiation_info[] = { 0 };
+    static const unsigned char key_share[] = { 0, 5, 0x3a, 0x3a, 0, 1, 0 };
+    static const unsigned char padding[16] = { 0 };
+    int g = grease ? 0 : 1;
+    int record, body;
+
+    int extensions = begin_hello(b, 0x0303, ciphers + g, 16 - g, &record, &body);
+    if (grease) {
+        ext_raw(b, 0x0a0a, NULL, 0);
+    }
+    ext_server_name(b, "www.example.com");
+    ext_raw(b, 0x0017, NULL, 0);
+    ext_raw(b, 0xff01, renegotiation_info, sizeof(renegotiation_info));
+    ext_u16_list(b, 0x000a, 2, groups + g, 4 - g);
+    ext_raw(b, 0x000b, point_formats, sizeof(point_formats));
+    ext_raw(b, 0x0023, NULL, 0);
+    ext_alpn(b, alpn, 2);
+    ext_raw(b, 0x0005, status_request, sizeof(status_request));
+    ext_u16_list(b, 0x000d, 2, signature_algorithms, 8);
+    ext_raw(b, 0x0012, NULL, 0);
+    ext_raw(b, 0x0033, key_share, sizeof(key_share));
+    ext_raw(b, 0x002d, psk_modes, sizeof(psk_modes));
+    ext_u16_list(b, 0x002b, 1, versions + g, 3 - g);
+    ext_raw(b, 0x001b, compress_certificate, sizeof(compress_certificate));
+    ext_raw(b, 0x4469, alps, sizeof(alps));
+    if (grease) {
+        ext_raw(b, 0x1a1a, padding, 1);
+    }
+    ext_raw(b, 0x0015, padding, sizeof(padding));
+    end_hello(b, record, body, extensions);
+}
+
+/* Parse a heap copy of exactly len bytes */
+static int parse_exact(const builder_t* b, int len, client_hello_info_t* hello) {
+    unsigned char* copy = (unsigned char*)malloc(len ? len : 1);
+    memcpy(copy, b->data, len);
+    int ret = client_hello_parse(copy, len, hello);
+    free(copy);
+    return ret;
+}
+
+static void test_published(void) {
+    builder_t b;
+    client_hello_info_t hello;
+    client_hello_info_t plain;
+
+    build_ja3_example(&b);
+    check(parse_exact(&b, b.len, &hello) == CLIENT_HELLO_OK, "JA3 example", "not parsed");
+    check(strcmp(hello.ja3, "ada70206e40642a3e4461f35503241d5") == 0, "JA3 example", "JA3 differs");
+    check(strcmp(hello.sni, "example.com") == 0, "JA3 example", "SNI");
+    check(hello.cipher_count == 12 && hello.extension_count == 3 && hello.group_count == 3 &&
+          hello.point_format_count == 1 && !hello.truncated, "JA3 example", "list counts");
+    check(strncmp(hello.ja4, "t10d1203", 8) == 0, "JA3 example", "JA4 prefix");
+
+    build_ja4_example(&b, 1);
+    check(parse_exact(&b, b.len, &hello) == CLIENT_HELLO_OK, "JA4 example", "not parsed");
+    check(strcmp(hello.ja4, "t13d1516h2_8daaf6152771_e5627efa2ab1") == 0, "JA4 example", "JA4 differs");
+    check(strcmp(hello.sni, "www.example.com") == 0, "JA4 example", "SNI");
+    check(strcmp(hello.alpn, "h2,http/1.1") == 0, "JA4 example", "ALPN");
+    check(hello.cipher_count == 16 && hello.extension_count == 18 && hello.version_count == 3,
+          "JA4 example", "GREASE values not kept in the lists");
+
+    build_ja4_example(&b, 0);
+    check(parse_exact(&b, b.len, &plain) == CLIENT_HELLO_OK, "JA4 example without GREASE", "not parsed");
+    check(strcmp(plain.ja4, hello.ja4) == 0, "JA4 example without GREASE", "JA4 depends on GREASE");
+    check(strcmp(plain.ja3, hello.ja3) == 0, "JA4 example without GREASE", "JA3 depends on GREASE");
+}
+
+static void test_truncated(void) {
+    builder_t b;
+    client_hello_info_t hello;
+
+    build_ja4_example(&b, 1);
+    for (int len = 0; len < b.len; len++) {
+        if (parse_exact(&b, len, &hello) != CLIENT_HELLO_INCOMPLETE) {
+            char what[64];
+            snprintf(what, sizeof(what), "prefix of %d bytes not incomplete", len);
+            check(0, "truncated record", what);
+            break;
+        }
+    }
+}
+
+static void test_oversized(void) {
+    builder_t b;
+    client_hello_info_t hello;
+    static const unsigned short one_cipher[] = { 0x1301 };
+    int record, body, extensions;
+
+    // Record length beyond what a ClientHello record may have
+    build_ja3_example(&b);
+    b.data[3] = (CLIENT_HELLO_MAX_RECORD + 1) >> 8;
+    b.data[4] = (CLIENT_HELLO_MAX_RECORD + 1) & 0xff;
+    check(parse_exact(&b, b.len, &hello) == CLIENT_HELLO_INVALID, "record too long", "accepted");
+
+    // Not a handshake record, not a ClientHello
+    build_ja3_example(&b);
+    b.data[0] = 0x17;
+    check(parse_exact(&b, b.len, &hello) == CLIENT_HELLO_INVALID, "application data record", "accepted");
+    check(parse_exact(&b, 1, &hello) == CLIENT_HELLO_INVALID, "application data first byte", "accepted");
+    build_ja3_example(&b);
+    b.data[5] = 0x02;
+    check(parse_exact(&b, b.len, &hello) == CLIENT_HELLO_INVALID, "ServerHello", "accepted");
+
+    // Extension running past the end of a complete record
+    build_ja3_example(&b);
+    b.data[b.len - 3] = 0x7f;
+    check(parse_exact(&b, b.len, &hello) == CLIENT_HELLO_INVALID, "extension past the record", "accepted");
+
+    // ClientHello continuing in a second record: parsed as far as the first goes
+    build_ja4_example(&b, 1);
+    int split = b.len - 40;
+    b.data[3] = (split - CLIENT_HELLO_RECORD_HEADER) >> 8;
+    b.data[4] = (split - CLIENT_HELLO_RECORD_HEADER) & 0xff;
+    check(parse_exact(&b, b.len, &hello) == CLIENT_HELLO_OK && hello.truncated &&
+          strcmp(hello.sni, "www.example.com") == 0, "ClientHello over two records", "not parsed as truncated");
+
+    // More ciphers and extensions than client_hello_info_t holds
+    unsigned short* ciphers = (unsigned short*)malloc(300 * sizeof(unsigned short));
+    for (int i = 0; i < 300; i++) {
+        ciphers[i] = (unsigned short)(0x0100 + i);
+    }
+    begin_hello(&b, 0x0303, ciphers, 300, &record, &body);
+    b.len -= 2; // No extensions
+    patch_length(&b, body, 3);
+    patch_length(&b, record, 2);
+    check(parse_exact(&b, b.len, &hello) == CLIENT_HELLO_OK && hello.truncated &&
+          hello.cipher_count == CLIENT_HELLO_MAX_CIPHERS, "300 ciphers", "not cut and flagged");
+    free(ciphers);
+
+    extensions = begin_hello(&b, 0x0303, one_cipher, 1, &record, &body);
+    for (int i = 0; i < CLIENT_HELLO_MAX_EXTENSIONS + 10; i++) {
+        ext_raw(&b, 0x1000 + i, NULL, 0);
+    }
+    end_hello(&b, record, body, extensions);
+    check(parse_exact(&b, b.len, &hello) == CLIENT_HELLO_OK && hello.truncated &&
+          hello.extension_count == CLIENT_HELLO_MAX_EXTENSIONS, "74 extensions", "not cut and flagged");
+
+    // Server name longer than client_hello_info_t.sni: left out
+    char long_name[400];
+    memset(long_name, 'a', sizeof(long_name) - 1);
+    long_name[sizeof(long_name) - 1] = '\0';
+    extensions = begin_hello(&b, 0x0303, one_cipher, 1, &record, &body);
+    ext_server_name(&b, long_name);
+    end_hello(&b, record, body, extensions);
+    check(parse_exact(&b, b.len, &hello) == CLIENT_HELLO_OK && hello.sni[0] == '\0' &&
+          hello.ja4[3] == 'i', "400-byte server name", "not left out");
+}
+
+int main(void) {
+    test_published();
+    test_truncated();
+    test_oversized();
+
+    if (failures) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("All ClientHello checks passed\n");
+    return 0;
+}
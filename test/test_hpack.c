@@ -0,0 +1,305 @@
+/*
+ * HPACK decoder test
+ *
+ * Runs the header block examples of RFC 7541 Appendix C through
+ * hpack_decode(): the single field representations of C.2, then the
+ * request (C.3, C.4) and response (C.5, C.6) sequences, each with and
+ * without Huffman coding, on one decoder per sequence so the dynamic table
+ * has to stay in step. Checks the decoded "name: value" lines, the header
+ * offsets and the dynamic table size after every block.
+ *
+ * Then feeds malformed input: every truncation of every example block
+ * (copied to a buffer of exactly that length, so a build with
+ * -fsanitize=address catches reads past the end), oversized integers,
+ * string lengths and table size updates, indexes past the tables and
+ * Huffman strings with bad padding or an EOS symbol.
+ *
+ * Build: gcc -O2 -g -fsanitize=address -I../include test_hpack.c ../src/hpack.c ../src/http_stream.c -o test_hpack
+ * Usage: ./test_hpack
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hpack.h"
+
+/* http_stream.c reads the body limit from the library configuration */
+proxy_config config;
+
+typedef struct {
+    const char* name;
+    const char* hex;            /* Header block, whitespace ignored */
+    const char* fields;         /* Expected "name: value" lines */
+    int table_size;             /* Dynamic table size after the block */
+} example_t;
+
+static const example_t c2[] = {
+    { "C.2.1 literal with indexing",
+      "400a 6375 7374 6f6d 2d6b 6579 0d63 7573 746f 6d2d 6865 6164 6572",
+      "custom-key: custom-header\r\n", 55 },
+    { "C.2.2 literal without indexing",
+      "040c 2f73 616d 706c 652f 7061 7468",
+      ":path: /sample/path\r\n", 0 },
+    { "C.2.3 literal never indexed",
+      "1008 7061 7373 776f 7264 0673 6563 7265 74",
+      "password: secret\r\n", 0 },
+    { "C.2.4 indexed",
+      "82",
+      ":method: GET\r\n", 0 },
+};
+
+static const example_t c3[] = {
+    { "C.3.1 first request",
+      "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+      ":method: GET\r\n:scheme: http\r\n:path: /\r\n:authority: www.example.com\r\n", 57 },
+    { "C.3.2 second request",
+      "8286 84be 5808 6e6f 2d63 6163 6865",
+      ":method: GET\r\n:scheme: http\r\n:path: /\r\n:authority: www.example.com\r\n"
+      "cache-control: no-cache\r\n", 110 },
+    { "C.3.3 third request",
+      "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65",
+      ":method: GET\r\n:scheme: https\r\n:path: /index.html\r\n:authority: www.example.com\r\n"
+      "custom-key: custom-value\r\n", 164 },
+};
+
+static const example_t c4[] = {
+    { "C.4.1 first request, Huffman",
+      "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff",
+      ":method: GET\r\n:scheme: http\r\n:path: /\r\n:authority: www.example.com\r\n", 57 },
+    { "C.4.2 second request, Huffman",
+      "8286 84be 5886 a8eb 1064 9cbf",
+      ":method: GET\r\n:scheme: http\r\n:path: /\r\n:authority: www.example.com\r\n"
+      "cache-control: no-cache\r\n", 110 },
+    { "C.4.3 third request, Huffman",
+      "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf",
+      ":method: GET\r\n:scheme: https\r\n:path: /index.html\r\n:authority: www.example.com\r\n"
+      "custom-key: custom-value\r\n", 164 },
+};
+
+#define C5_DATE1 "date: Mon, 21 Oct 2013 20:13:21 GMT\r\n"
+#define C5_DATE2 "date: Mon, 21 Oct 2013 20:13:22 GMT\r\n"
+#define C5_LOCATION "location: https://www.example.com\r\n"
+#define C5_COOKIE "set-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1\r\n"
+
+static const example_t c5[] = {
+    { "C.5.1 first response",
+      "4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133"
+      "2032 303a 3133 3a32 3120 474d 546e 1768 7474 7073 3a2f 2f77 7777 2e65 7861 6d70"
+      "6c65 2e63 6f6d",
+      ":status: 302\r\ncache-control: private\r\n" C5_DATE1 C5_LOCATION, 222 },
+    { "C.5.2 second response",
+      "4803 3330 37c1 c0bf",
+      ":status: 307\r\ncache-control: private\r\n" C5_DATE1 C5_LOCATION, 222 },
+    { "C.5.3 third response",
+      "88c1 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 2032 303a 3133 3a32 3220 474d"
+      "54c0 5a04 677a 6970 7738 666f 6f3d 4153 444a 4b48 514b 425a 584f 5157 454f 5049"
+      "5541 5851 5745 4f49 553b 206d 6178 2d61 6765 3d33 3630 303b 2076 6572 7369 6f6e"
+      "3d31",
+      ":status: 200\r\ncache-control: private\r\n" C5_DATE2 C5_LOCATION
+      "content-encoding: gzip\r\n" C5_COOKIE, 215 },
+};
+
+static const example_t c6[] = {
+    { "C.6.1 first response, Huffman",
+      "4882 6402 5885 aec3 771a 4b61 96d0 7abe 9410 54d4 44a8 2005 9504 0b81 66e0 82a6"
+      "2d1b ff6e 919d 29ad 1718 63c7 8f0b 97c8 e9ae 82ae 43d3",
+      ":status: 302\r\ncache-control: private\r\n" C5_DATE1 C5_LOCATION, 222 },
+    { "C.6.2 second response, Huffman",
+      "4883 640e ffc1 c0bf",
+      ":status: 307\r\ncache-control: private\r\n" C5_DATE1 C5_LOCATION, 222 },
+    { "C.6.3 third response, Huffman",
+      "88c1 6196 d07a be94 1054 d444 a820 0595 040b 8166 e084 a62d 1bff c05a 839b d9ab"
+      "77ad 94e7 821d d7f2 e6c7 b335 dfdf cd5b 3960 d5af 2708 7f36 72c1 ab27 0fb5 291f"
+      "9587 3160 65c0 03ed 4ee5 b106 3d50 07",
+      ":status: 200\r\ncache-control: private\r\n" C5_DATE2 C5_LOCATION
+      "content-encoding: gzip\r\n" C5_COOKIE, 215 },
+};
+
+/* Malformed blocks hpack_decode() has to reject on a fresh decoder */
+static const struct {
+    const char* name;
+    const char* hex;
+} malformed[] = {
+    { "index 0", "80" },
+    { "index past the static table, empty dynamic table", "be" },
+    { "index with a 5-byte continuation", "ff ff ff ff ff 0f" },
+    { "name index past the tables", "7f 20 01 61" },
+    { "string length past the block", "40 7f ff 0f 61" },
+    { "string length of 2^28", "00 7f ff ff ff 7f" },
+    { "missing value", "40 01 61" },
+    { "table size update above the limit", "3f e2 ff 3f" },
+    { "Huffman padding of 8 bits", "00 01 61 82 07 ff" },
+    { "Huffman padding with a zero bit", "00 01 61 81 02" },
+    { "Huffman EOS", "00 01 61 84 ff ff ff ff" },
+};
+
+static int failures;
+
+static int parse_hex(const char* hex, unsigned char* out, int max) {
+    int len = 0;
+    for (const char* p = hex; *p; p++) {
+        if (*p == ' ') {
+            continue;
+        }
+        unsigned int byte;
+        if (len == max || sscanf(p, "%2x", &byte) != 1) {
+            fprintf(stderr, "bad test vector: %s\n", hex);
+            exit(2);
+        }
+        out[len++] = (unsigned char)byte;
+        p++;
+    }
+    return len;
+}
+
+static void check(int ok, const char* name, const char* what) {
+    if (!ok) {
+        printf("FAIL %s: %s\n", name, what);
+        failures++;
+    }
+}
+
+/* Every header's offsets must point at its "name: value" line */
+static int headers_consistent(const http_message_t* message) {
+    int pos = 0;
+    for (int i = 0; i < message->info.header_count; i++) {
+        const http_header_field_t* h = &message->headers[i];
+        if (h->name_offset != pos || h->value_offset != h->name_offset + h->name_length + 2 ||
+            memcmp(message->data + h->value_offset - 2, ": ", 2) != 0 ||
+            memcmp(message->data + h->value_offset + h->value_length, "\r\n", 2) != 0) {
+            return 0;
+        }
+        pos = h->value_offset + h->value_length + 2;
+    }
+    return pos == message->len;
+}
+
+static int count_lines(const char* text) {
+    int lines = 0;
+    for (const char* p = strstr(text, "\r\n"); p; p = strstr(p + 2, "\r\n")) {
+        lines++;
+    }
+    return lines;
+}
+
+/* Decode the examples in order; each_fresh starts every block on its own decoder */
+static void run_examples(const example_t* examples, int count, int table_max, int each_fresh) {
+    hpack_decoder_t decoder;
+    hpack_decoder_init(&decoder);
+    decoder.max_size = table_max;
+
+    for (int i = 0; i < count; i++) {
+        const example_t* ex = &examples[i];
+        unsigned char block[512];
+        http_message_t message;
+        int len = parse_hex(ex->hex, block, sizeof(block));
+
+        if (each_fresh && i > 0) {
+            hpack_decoder_free(&decoder);
+            hpack_decoder_init(&decoder);
+            decoder.max_size = table_max;
+        }
+        memset(&message, 0, sizeof(message));
+        int ok = hpack_decode(&decoder, block, len, &message);
+        check(ok, ex->name, "rejected");
+        if (ok) {
+            int expected_len = (int)strlen(ex->fields);
+            check(message.len == expected_len && memcmp(message.data, ex->fields, expected_len) == 0,
+                  ex->name, "decoded fields differ");
+            check(message.info.header_count == count_lines(ex->fields), ex->name, "header count");
+            check(headers_consistent(&message), ex->name, "header offsets");
+            check(decoder.size == ex->table_size, ex->name, "dynamic table size");
+        }
+        free(message.data);
+        free(message.headers);
+    }
+    hpack_decoder_free(&decoder);
+}
+
+/* Decode every proper prefix of every block; the result may go either way, reads must stay inside */
+static void run_truncated(const example_t* examples, int count) {
+    for (int i = 0; i < count; i++) {
+        unsigned char block[512];
+        int len = parse_hex(examples[i].hex, block, sizeof(block));
+
+        for (int cut = 0; cut < len; cut++) {
+            hpack_decoder_t decoder;
+            http_message_t message;
+            unsigned char* copy = (unsigned char*)malloc(cut ? cut : 1);
+
+            memcpy(copy, block, cut);
+            hpack_decoder_init(&decoder);
+            memset(&message, 0, sizeof(message));
+            if (hpack_decode(&decoder, copy, cut, &message)) {
+                check(headers_consistent(&message), examples[i].name, "truncated block left bad offsets");
+            }
+            free(message.data);
+            free(message.headers);
+            hpack_decoder_free(&decoder);
+            free(copy);
+        }
+    }
+}
+
+static void run_malformed(void) {
+    for (size_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++) {
+        unsigned char block[64];
+        int len = parse_hex(malformed[i].hex, block, sizeof(block));
+        unsigned char* copy = (unsigned char*)malloc(len);
+        hpack_decoder_t decoder;
+        http_message_t message;
+
+        memcpy(copy, block, len);
+        hpack_decoder_init(&decoder);
+        memset(&message, 0, sizeof(message));
+        check(!hpack_decode(&decoder, copy, len, &message), malformed[i].name, "accepted");
+        free(message.data);
+        free(message.headers);
+        hpack_decoder_free(&decoder);
+        free(copy);
+    }
+}
+
+/* A field larger than the whole dynamic table empties it instead of failing */
+static void run_oversized_entry(void) {
+    unsigned char block[64];
+    int len = parse_hex(c2[0].hex, block, sizeof(block));
+    hpack_decoder_t decoder;
+    http_message_t message;
+
+    hpack_decoder_init(&decoder);
+    decoder.max_size = 54;
+    memset(&message, 0, sizeof(message));
+    check(hpack_decode(&decoder, block, len, &message), "entry larger than the table", "rejected");
+    check(decoder.count == 0 && decoder.size == 0, "entry larger than the table", "table not empty");
+    free(message.data);
+    free(message.headers);
+    hpack_decoder_free(&decoder);
+}
+
+#define COUNT(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+int main(void) {
+    config.http_message_max_body = HTTP_MESSAGE_DEFAULT_MAX_BODY;
+
+    run_examples(c2, COUNT(c2), HPACK_DEFAULT_TABLE_SIZE, 1);
+    run_examples(c3, COUNT(c3), HPACK_DEFAULT_TABLE_SIZE, 0);
+    run_examples(c4, COUNT(c4), HPACK_DEFAULT_TABLE_SIZE, 0);
+    run_examples(c5, COUNT(c5), 256, 0);
+    run_examples(c6, COUNT(c6), 256, 0);
+
+    run_truncated(c2, COUNT(c2));
+    run_truncated(c3, COUNT(c3));
+    run_truncated(c4, COUNT(c4));
+    run_truncated(c5, COUNT(c5));
+    run_truncated(c6, COUNT(c6));
+    run_malformed();
+    run_oversized_entry();
+
+    if (failures) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("All HPACK checks passed\n");
+    return 0;
+}
@@ -0,0 +1,334 @@
+/*
+ * HTTP/1.x stream parser test
+ *
+ * Feeds request and response streams through http_stream_feed() and checks
+ * the messages handed to the sink: Content-Length and chunked bodies (with
+ * chunk extensions and trailers), pipelined requests, responses without a
+ * body (HEAD, 1xx, 204, 304), a 101 protocol switch that stops both
+ * directions, and bodies delimited by the connection close. Every stream
+ * is fed in one piece, one byte at a time and in 7-byte pieces, and has to
+ * give the same messages each way.
+ *
+ * Then checks truncated and oversized input: streams that end inside a
+ * head, a body or a chunk, heads longer than HTTP_STREAM_MAX_HEAD, bodies
+ * beyond the configured limit, over-long chunk size lines, bad lengths and
+ * traffic that is not HTTP/1.x at all.
+ *
+ * Build: gcc -O2 -g -fsanitize=address -I../include test_http_stream.c ../src/http_stream.c -o test_http_stream
+ * Usage: ./test_http_stream
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "http_stream.h"
+
+/* http_stream.c reads the body limit from the library configuration */
+proxy_config config;
+
+#define MAX_MESSAGES 16
+
+typedef struct {
+    http_message_t* messages[MAX_MESSAGES];
+    int count;
+} collector_t;
+
+/* What a delivered message must look like; NULL strings are not checked */
+typedef struct {
+    int status_code;            /* 0 for a request */
+    const char* method;
+    const char* target;
+    const char* body;
+    int flags;
+} expected_t;
+
+static const int steps[] = { 0, 1, 7 };   /* Piece sizes, 0 = the whole stream at once */
+static int failures;
+
+static void check(int ok, const char* name, const char* what) {
+    if (!ok) {
+        printf("FAIL %s: %s\n", name, what);
+        failures++;
+    }
+}
+
+static void collect(void* context, http_message_t* message) {
+    collector_t* collector = (collector_t*)context;
+    if (collector->count == MAX_MESSAGES) {
+        http_message_free(message);
+        return;
+    }
+    collector->messages[collector->count++] = message;
+}
+
+static void collector_free(collector_t* collector) {
+    for (int i = 0; i < collector->count; i++) {
+        http_message_free(collector->messages[i]);
+    }
+    collector->count = 0;
+}
+
+/* Feed text in pieces of step bytes, each in its own exactly sized buffer; returns the first 0 result */
+static int feed(http_stream_t* stream, const char* text, int len, int step, collector_t* collector) {
+    for (int pos = 0; pos < len;) {
+        int n = (step == 0 || len - pos < step) ? len - pos : step;
+        unsigned char* piece = (unsigned char*)malloc(n);
+        memcpy(piece, text + pos, n);
+        int ok = http_stream_feed(stream, piece, n, NULL, 0, collect, collector);
+        free(piece);
+        if (!ok) {
+            return 0;
+        }
+        pos += n;
+    }
+    return 1;
+}
+
+static int text_equal(const http_message_t* message, int offset, int length, const char* text) {
+    return length == (int)strlen(text) && memcmp(message->data + offset, text, length) == 0;
+}
+
+static void check_messages(const char* name, int step, const collector_t* collector,
+                           const expected_t* expected, int count) {
+    char label[128];
+    snprintf(label, sizeof(label), "%s (pieces of %d)", name, step);
+
+    if (collector->count != count) {
+        char what[64];
+        snprintf(what, sizeof(what), "%d message(s) instead of %d", collector->count, count);
+        check(0, label, what);
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        const http_message_t* m = collector->messages[i];
+        const http_message_info_t* info = &m->info;
+        const expected_t* e = &expected[i];
+
+        check(info->is_request == (e->status_code == 0), label, "request or response");
+        check(info->status_code == e->status_code, label, "status code");
+        if (e->method) {
+            check(text_equal(m, info->method_offset, info->method_length, e->method), label, "method");
+            check(text_equal(m, info->target_offset, info->target_length, e->target), label, "target");
+        }
+        if (e->body) {
+            check(info->body_offset + info->body_length == m->len &&
+                  text_equal(m, info->body_offset, info->body_length, e->body), label, "body");
+        }
+        check(info->flags == e->flags, label, "flags");
+        check(info->headers == m->headers, label, "header offsets not published");
+    }
+}
+
+/* One direction on its own, finished with http_stream_finish() if finish is set */
+static void run_single(const char* name, const char* text, int len, int expect_ok, int finish,
+                       const expected_t* expected, int count) {
+    for (size_t s = 0; s < sizeof(steps) / sizeof(steps[0]); s++) {
+        http_stream_t stream;
+        collector_t collector;
+
+        memset(&stream, 0, sizeof(stream));
+        memset(&collector, 0, sizeof(collector));
+        int ok = feed(&stream, text, len, steps[s], &collector);
+        check(ok == expect_ok, name, expect_ok ? "stream rejected" : "stream accepted");
+        if (finish) {
+            http_stream_finish(&stream, collect, &collector);
+        }
+        check_messages(name, steps[s], &collector, expected, count);
+        collector_free(&collector);
+        http_stream_stop(&stream);
+    }
+}
+
+#define TEXT(s) s, (int)(sizeof(s) - 1)
+#define COUNT(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+static void test_framing(void) {
+    static const expected_t pipelined[] = {
+        { 0, "POST", "/form", "a=1&b=2", 0 },
+        { 0, "GET", "/next?x=1", "", 0 },
+    };
+    run_single("Content-Length and pipelining",
+               TEXT("POST /form HTTP/1.1\r\nHost: example.com\r\nContent-Length: 7\r\n\r\na=1&b=2"
+                    "GET /next?x=1 HTTP/1.1\r\nHost: example.com\r\n\r\n"),
+               1, 0, pipelined, COUNT(pipelined));
+
+    static const expected_t chunked[] = {
+        { 200, NULL, NULL, "hello world", HTTP_MESSAGE_CHUNKED },
+        { 200, NULL, NULL, "x", 0 },
+    };
+    run_single("chunked with extensions and trailers",
+               TEXT("HTTP/1.1 200 OK\r\nTransfer-Encoding: gzip, chunked\r\n\r\n"
+                    "5;name=value\r\nhello\r\n6\r\n world\r\n0\r\nX-Checksum: 1\r\nX-Other: 2\r\n\r\n"
+                    "HTTP/1.1 200 OK\r\nContent-Length: 1\r\n\r\nx"),
+               1, 0, chunked, COUNT(chunked));
+
+    static const expected_t no_body[] = {
+        { 100, NULL, NULL, "", 0 },
+        { 204, NULL, NULL, "", 0 },
+        { 304, NULL, NULL, "", 0 },
+        { 200, NULL, NULL, "abc", 0 },
+    };
+    run_single("1xx, 204 and 304",
+               TEXT("HTTP/1.1 100 Continue\r\n\r\n"
+                    "HTTP/1.1 204 No Content\r\nContent-Length: 10\r\n\r\n"
+                    "HTTP/1.1 304 Not Modified\r\nContent-Length: 50\r\n\r\n"
+                    "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\nabc"),
+               1, 0, no_body, COUNT(no_body));
+
+    static const expected_t until_close[] = {
+        { 200, NULL, NULL, "until the end", 0 },
+    };
+    run_single("body delimited by the close",
+               TEXT("HTTP/1.0 200 OK\r\nServer: test\r\n\r\nuntil the end"),
+               1, 1, until_close, COUNT(until_close));
+}
+
+/* Both directions of a connection: requests first, then responses */
+static void run_pair(const char* name, const char* requests, int requests_len,
+                     const char* responses, int responses_len, int expect_ok,
+                     const expected_t* expected, int count) {
+    for (size_t s = 0; s < sizeof(steps) / sizeof(steps[0]); s++) {
+        http_stream_t request_stream, response_stream;
+        collector_t sent, received;
+
+        memset(&request_stream, 0, sizeof(request_stream));
+        memset(&response_stream, 0, sizeof(response_stream));
+        memset(&sent, 0, sizeof(sent));
+        memset(&received, 0, sizeof(received));
+        http_stream_pair(&request_stream, &response_stream);
+
+        check(feed(&request_stream, requests, requests_len, steps[s], &sent), name, "requests rejected");
+        int ok = feed(&response_stream, responses, responses_len, steps[s], &received);
+        check(ok == expect_ok, name, expect_ok ? "responses rejected" : "responses accepted");
+        check_messages(name, steps[s], &received, expected, count);
+
+        if (!expect_ok) {
+            // A protocol switch stops the request side too
+            check(request_stream.state == HTTP_STREAM_OFF &&
+                  !feed(&request_stream, TEXT("GET / HTTP/1.1\r\n\r\n"), 0, &sent), name, "request side still parsing");
+        }
+        collector_free(&sent);
+        collector_free(&received);
+        http_stream_stop(&request_stream);
+        http_stream_stop(&response_stream);
+    }
+}
+
+static void test_paired(void) {
+    static const expected_t head[] = {
+        { 200, NULL, NULL, "", 0 },
+        { 200, NULL, NULL, "ok", 0 },
+    };
+    run_pair("HEAD response without a body",
+             TEXT("HEAD /file HTTP/1.1\r\nHost: a\r\n\r\nGET /file HTTP/1.1\r\nHost: a\r\n\r\n"),
+             TEXT("HTTP/1.1 200 OK\r\nContent-Length: 1000\r\n\r\n"
+                  "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok"),
+             1, head, COUNT(head));
+
+    static const expected_t informational_then_head[] = {
+        { 100, NULL, NULL, "", 0 },
+        { 200, NULL, NULL, "", 0 },
+    };
+    run_pair("1xx before a HEAD response",
+             TEXT("HEAD / HTTP/1.1\r\nExpect: 100-continue\r\n\r\n"),
+             TEXT("HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"),
+             1, informational_then_head, COUNT(informational_then_head));
+
+    static const expected_t upgrade[] = {
+        { 101, NULL, NULL, "", 0 },
+    };
+    run_pair("101 Switching Protocols",
+             TEXT("GET /chat HTTP/1.1\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n\r\n"),
+             TEXT("HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n\r\n\x81\x05hello"),
+             0, upgrade, COUNT(upgrade));
+}
+
+static void test_truncated(void) {
+    static const expected_t short_body[] = {
+        { 200, NULL, NULL, "abcd", HTTP_MESSAGE_INCOMPLETE },
+    };
+    run_single("end inside a Content-Length body",
+               TEXT("HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nabcd"),
+               1, 1, short_body, COUNT(short_body));
+
+    static const expected_t short_chunk[] = {
+        { 200, NULL, NULL, "hel", HTTP_MESSAGE_CHUNKED | HTTP_MESSAGE_INCOMPLETE },
+    };
+    run_single("end inside a chunk",
+               TEXT("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhel"),
+               1, 1, short_chunk, COUNT(short_chunk));
+
+    run_single("end inside a head",
+               TEXT("HTTP/1.1 200 OK\r\nContent-Length: 10\r\nX-Partial"),
+               1, 1, NULL, 0);
+    run_single("end inside a start line",
+               TEXT("GET /index.ht"),
+               1, 1, NULL, 0);
+}
+
+static void test_oversized(void) {
+    // Head longer than HTTP_STREAM_MAX_HEAD
+    int len = HTTP_STREAM_MAX_HEAD + 64;
+    char* head = (char*)malloc(len);
+    memcpy(head, "GET / HTTP/1.1\r\nX-Large: ", 25);
+    memset(head + 25, 'a', len - 25);
+    run_single("head over the limit", head, len, 0, 1, NULL, 0);
+    free(head);
+
+    // Body beyond the configured limit: the first bytes are kept and the rest counted
+    int saved = config.http_message_max_body;
+    config.http_message_max_body = 4;
+    static const expected_t limited[] = {
+        { 200, NULL, NULL, "0123", HTTP_MESSAGE_TRUNCATED },
+        { 200, NULL, NULL, "abcd", HTTP_MESSAGE_CHUNKED | HTTP_MESSAGE_TRUNCATED },
+    };
+    run_single("bodies over the limit",
+               TEXT("HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\n0123456789"
+                    "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nabc\r\n3\r\ndef\r\n0\r\n\r\n"),
+               1, 0, limited, COUNT(limited));
+    config.http_message_max_body = saved;
+
+    // Chunk size lines too long to keep, or with too many digits
+    static const expected_t bad_chunk[] = {
+        { 200, NULL, NULL, "", HTTP_MESSAGE_CHUNKED | HTTP_MESSAGE_INCOMPLETE },
+    };
+    char line[HTTP_STREAM_MAX_LINE + 128];
+    int used = snprintf(line, sizeof(line), "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n1;");
+    memset(line + used, 'e', HTTP_STREAM_MAX_LINE);
+    memcpy(line + used + HTTP_STREAM_MAX_LINE, "\r\nx\r\n0\r\n\r\n", 10);
+    run_single("chunk size line over the limit", line, used + HTTP_STREAM_MAX_LINE + 10, 0, 0,
+               bad_chunk, COUNT(bad_chunk));
+    run_single("chunk size of 13 hex digits",
+               TEXT("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n1000000000000\r\n"),
+               0, 0, bad_chunk, COUNT(bad_chunk));
+
+    // Unusable lengths: the parsed head is handed over as incomplete
+    static const expected_t bad_length[] = {
+        { 200, NULL, NULL, "", HTTP_MESSAGE_INCOMPLETE },
+    };
+    run_single("Content-Length not a number",
+               TEXT("HTTP/1.1 200 OK\r\nContent-Length: 12abc\r\n\r\n"), 0, 1, bad_length, COUNT(bad_length));
+    run_single("Content-Length of 16 digits",
+               TEXT("HTTP/1.1 200 OK\r\nContent-Length: 1000000000000000\r\n\r\n"), 0, 1,
+               bad_length, COUNT(bad_length));
+
+    // Start lines that cannot be HTTP/1.x
+    run_single("TLS record", TEXT("\x16\x03\x01\x02\x00\x01\x00\x01\xfc\x03\x03"), 0, 1, NULL, 0);
+    run_single("binary after a method", TEXT("GET \x01\x02\x03"), 0, 1, NULL, 0);
+}
+
+int main(void) {
+    config.http_message_max_body = HTTP_MESSAGE_DEFAULT_MAX_BODY;
+
+    test_framing();
+    test_paired();
+    test_truncated();
+    test_oversized();
+
+    if (failures) {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("All HTTP/1.x stream checks passed\n");
+    return 0;
+}